@@ -1,4 +1,5 @@
 #include "allocator.h"
+#include "heap_walk.h"
 
 #include <math.h>
 #include <malloc.h>
@@ -8,47 +9,33 @@
 #include <string.h>
 #include <limits.h>
 
-bool is_power_of_two(uintptr_t x)
+// Run attempt until it succeeds or the handler stops asking for a retry
+template <class Attempt>
+static void* oom_retry(OomHandler* handler, void* allocator, size_t size, size_t align, Attempt attempt)
 {
-    // check if x is only have one set bit, 
-    // if it is, then it must be power of two
-    return (x & (x - 1)) == 0;
-}
-
-uintptr_t align_forward(uintptr_t address, size_t align)
-{
-    assert(is_power_of_two(align));
-    // same as (address % align) when alignment is power of two
-    uintptr_t mod = address & (align - 1);
-    if (mod != 0)
-    {
-        address += (align - mod);
-    }
-    return address;
-}
-
-size_t get_padding_with_header(uintptr_t address, size_t header_size, size_t align)
-{
-    assert(is_power_of_two(align));
-
-    size_t padding = 0;
-    size_t mod = address & (align - 1);
-    if (mod != 0) {
-        padding += (align - mod);
-    }
-
-    if (padding < header_size) {
-        size_t remain = header_size - padding;
-        if ((remain & (align - 1)) == 0) {
-            padding += align * (remain / align);
+    for (int retries = 0;; retries++) {
+        void* ptr = attempt();
+        if (ptr != NULL || handler->func == NULL || retries == OOM_MAX_RETRIES) {
+            return ptr;
         }
-        else {
-            padding += align * ((remain / align) + 1);
+        void* fallback = NULL;
+        OomAction action = handler->func(allocator, size, align, handler->user_data, &fallback);
+        if (action == Oom_Action_Fallback) {
+            return fallback;
+        }
+        if (action != Oom_Action_Retry) {
+            return NULL;
         }
     }
+}
 
-    return padding;
+#if MEMORY_ALLOCATOR_STATS
+// bytes a large object takes: its header page and the data rounded up to pages
+static size_t large_object_footprint(size_t size)
+{
+    return align_forward(size, REGION_SMALL_PAGE_SIZE) + REGION_SMALL_PAGE_SIZE;
 }
+#endif
 
 // arena allocator
 void arena_init(ArenaAllocator* arena, void* buffer, size_t buffer_size)
@@ -56,25 +43,112 @@ void arena_init(ArenaAllocator* arena, void* buffer, size_t buffer_size)
     arena->buffer = (unsigned char*)buffer;
     arena->buffer_size = buffer_size;
     arena->offset = 0;
+    arena->region = NULL;
+    arena->large_threshold = 0;
+    arena->large_objects.head = NULL;
+    arena->large_objects.count = 0;
+    arena->oom_handler.func = NULL;
+    arena->oom_handler.user_data = NULL;
+    ALLOCATOR_STATS_INIT(&arena->stats);
 }
 
-void* arena_alloc(ArenaAllocator* arena, size_t size, size_t align)
+void arena_init_region(ArenaAllocator* arena, Region* region)
 {
-    assert(is_power_of_two(align));
+    arena_init(arena, region->base, region->size);
+    arena->region = region;
+}
+
+void arena_use_large_objects(ArenaAllocator* arena, size_t threshold)
+{
+    assert(threshold > 0);
+    arena->large_threshold = threshold;
+}
+
+void arena_set_oom_handler(ArenaAllocator* arena, OomHandlerFunc func, void* user_data)
+{
+    arena->oom_handler.func = func;
+    arena->oom_handler.user_data = user_data;
+}
+
+static bool arena_is_large(ArenaAllocator* arena, size_t size)
+{
+    return arena->large_threshold != 0 && size >= arena->large_threshold;
+}
+
+// large objects never live inside the buffer, so only pointers outside it walk the list
+static bool arena_owns_large(ArenaAllocator* arena, void* ptr)
+{
+    return arena->large_objects.head != NULL && (uintptr_t)ptr - (uintptr_t)arena->buffer >= arena->buffer_size &&
+        large_object_owns(&arena->large_objects, ptr);
+}
+
+static bool arena_commit(ArenaAllocator* arena, size_t end)
+{
+    if (arena->region == NULL || end <= arena->region->committed) {
+        return true;
+    }
+    return region_commit(arena->region, end);
+}
+
+static void* arena_alloc_once(ArenaAllocator* arena, size_t size, size_t align)
+{
+    ALLOCATOR_STATS_START(stats_start);
+
+    if (arena_is_large(arena, size)) {
+        void* ptr = try_large_object_alloc(&arena->large_objects, size, align);
+        if (ptr == NULL) {
+            ALLOCATOR_STATS_FAIL(&arena->stats, stats_start);
+            return NULL;
+        }
+        ALLOCATOR_STATS_ALLOC(&arena->stats, stats_start, size, large_object_footprint(size));
+        return ptr;
+    }
 
     uintptr_t next_address = 
         align_forward((uintptr_t)arena->buffer + arena->offset, align);
     size_t offset = next_address - (uintptr_t)arena->buffer;
 
     if (offset + size <= arena->buffer_size) {
+        if (!arena_commit(arena, offset + size)) {
+            ALLOCATOR_STATS_FAIL(&arena->stats, stats_start);
+            return NULL;
+        }
+        ALLOCATOR_STATS_ALLOC(&arena->stats, stats_start, size, offset + size - arena->offset);
         arena->offset = offset + size;
         void* ptr = (void*)&arena->buffer[offset];
         memset(ptr, 0, size);
         return ptr;
     }
 
-    fprintf(stderr, "[ERROR] arena doesn't have enough space for new allocation. " \
-        "Require size: %llu, arena available size: %llu\n", size, arena->buffer_size - arena->offset);
+    ALLOCATOR_STATS_FAIL(&arena->stats, stats_start);
+    return NULL;
+}
+
+void* try_arena_alloc_slow(ArenaAllocator* arena, size_t size, size_t align)
+{
+    assert(is_power_of_two(align));
+    return oom_retry(&arena->oom_handler, arena, size, align,
+        [=]() { return arena_alloc_once(arena, size, align); });
+}
+
+void* arena_alloc_slow(ArenaAllocator* arena, size_t size, size_t align)
+{
+    void* ptr = try_arena_alloc_slow(arena, size, align);
+    if (ptr != NULL) {
+        return ptr;
+    }
+
+    size_t offset = align_forward((uintptr_t)arena->buffer + arena->offset, align) - (uintptr_t)arena->buffer;
+    if (arena_is_large(arena, size)) {
+        fprintf(stderr, "[ERROR] arena failed to map a large object. Require size: %zu\n", size);
+    }
+    else if (offset + size <= arena->buffer_size) {
+        fprintf(stderr, "[ERROR] arena failed to commit memory up to offset %zu.\n", offset + size);
+    }
+    else {
+        fprintf(stderr, "[ERROR] arena doesn't have enough space for new allocation. " \
+            "Require size: %zu, arena available size: %zu\n", size, arena->buffer_size - arena->offset);
+    }
     return NULL;
 }
 
@@ -88,18 +162,52 @@ void* arena_resize(ArenaAllocator* arena, void* old_ptr, size_t old_size,
         return arena_alloc(arena, new_size, align);
     }
 
+    if (arena_owns_large(arena, old_ptr))
+    {
+#if MEMORY_ALLOCATOR_STATS
+        size_t old_footprint = large_object_footprint(large_object_size(old_ptr));
+        void* new_ptr = large_object_resize(&arena->large_objects, old_ptr, new_size);
+        if (new_ptr != NULL)
+        {
+            ALLOCATOR_STATS_ADJUST(&arena->stats, (int64_t)large_object_footprint(new_size) - (int64_t)old_footprint);
+        }
+        return new_ptr;
+#else
+        return large_object_resize(&arena->large_objects, old_ptr, new_size);
+#endif
+    }
+
     if (arena->buffer <= old_ptr && old_ptr < arena->buffer + arena->buffer_size)
     {
         size_t old_offset = (uintptr_t)old_ptr - (uintptr_t)arena->buffer;
-        if (old_offset + old_size == arena->offset)
+        if (old_offset + old_size == arena->offset && arena_is_large(arena, new_size))
+        {
+            // last allocation outgrowing the arena, give its space back and move it out
+            void* new_ptr = large_object_alloc(&arena->large_objects, new_size, align);
+            if (new_ptr == NULL)
+            {
+                return NULL;
+            }
+            memcpy(new_ptr, old_ptr, old_size);
+            ALLOCATOR_STATS_ADJUST(&arena->stats, (int64_t)old_offset - (int64_t)arena->offset
+                + (int64_t)large_object_footprint(new_size));
+            arena->offset = old_offset;
+            return new_ptr;
+        }
+        else if (old_offset + old_size == arena->offset)
         {
             if (old_offset + new_size > arena->buffer_size)
             {
                 fprintf(stderr, "[ERROR] arena doesn't have enough space for new allocation. " \
-                    "Require size: %llu, arena available size: %llu\n", new_size, arena->buffer_size - old_offset);
+                    "Require size: %zu, arena available size: %zu\n", new_size, arena->buffer_size - old_offset);
                 return NULL;
             }
 
+            if (!arena_commit(arena, old_offset + new_size)) {
+                fprintf(stderr, "[ERROR] arena failed to commit memory up to offset %zu.\n", old_offset + new_size);
+                return NULL;
+            }
+            ALLOCATOR_STATS_ADJUST(&arena->stats, (int64_t)new_size - (int64_t)old_size);
             arena->offset = old_offset + new_size;
             if (new_size > old_size)
             {
@@ -110,7 +218,10 @@ void* arena_resize(ArenaAllocator* arena, void* old_ptr, size_t old_size,
         else
         {
             void* new_ptr = arena_alloc(arena, new_size, align);
-            memset(new_ptr, 0, new_size);
+            if (new_ptr == NULL)
+            {
+                return NULL;
+            }
             size_t min_size = old_size < new_size ? old_size : new_size;
             memcpy(new_ptr, old_ptr, min_size);
             return new_ptr;
@@ -119,20 +230,31 @@ void* arena_resize(ArenaAllocator* arena, void* old_ptr, size_t old_size,
     else
     {
         //assert(0);
-        fprintf(stderr, "[ERROR] arena_resize failed. old_ptr(%#llX) not in arena scope[%#llX, %#llX).\n",
-            (uintptr_t)old_ptr, (uintptr_t)arena->buffer, (uintptr_t)arena->buffer + arena->buffer_size);
+        fprintf(stderr, "[ERROR] arena_resize failed. old_ptr(%p) not in arena scope[%p, %p).\n",
+            old_ptr, (void*)arena->buffer, (void*)(arena->buffer + arena->buffer_size));
         return NULL;
     }
 }
 
 void arena_free(ArenaAllocator* arena, void* ptr)
 {
-    // DO NOTHING
+    // DO NOTHING for arena space, large objects have their own mapping
+    if (arena_owns_large(arena, ptr))
+    {
+        ALLOCATOR_STATS_START(stats_start);
+        ALLOCATOR_STATS_FREE(&arena->stats, stats_start, large_object_footprint(large_object_size(ptr)));
+        large_object_free(&arena->large_objects, ptr);
+    }
 }
 
 void arena_free_all(ArenaAllocator* arena)
 {
+    ALLOCATOR_STATS_RELEASE_ALL(&arena->stats);
     arena->offset = 0;
+    if (arena->large_objects.head != NULL)
+    {
+        large_object_free_all(&arena->large_objects);
+    }
 }
 
 // Temporary arena allocator
@@ -146,6 +268,8 @@ TempArenaAllocator temp_arena_start(ArenaAllocator* arena)
 
 void temp_arena_end(TempArenaAllocator* temp_arena)
 {
+    ALLOCATOR_STATS_ADJUST(&temp_arena->arena->stats,
+        (int64_t)temp_arena->offset - (int64_t)temp_arena->arena->offset);
     temp_arena->arena->offset = temp_arena->offset;
 }
 
@@ -156,25 +280,65 @@ void stack_init(StackAllocator* stack, void* buffer, size_t buffer_size)
     stack->buffer_size = buffer_size;
     stack->offset = 0;
     stack->prev_offset = 0;
+    stack->large_threshold = 0;
+    stack->large_objects.head = NULL;
+    stack->large_objects.count = 0;
+    stack->oom_handler.func = NULL;
+    stack->oom_handler.user_data = NULL;
+    ALLOCATOR_STATS_INIT(&stack->stats);
+}
+
+void stack_use_large_objects(StackAllocator* stack, size_t threshold)
+{
+    assert(threshold > 0);
+    stack->large_threshold = threshold;
+}
+
+void stack_set_oom_handler(StackAllocator* stack, OomHandlerFunc func, void* user_data)
+{
+    stack->oom_handler.func = func;
+    stack->oom_handler.user_data = user_data;
+}
+
+static bool stack_is_large(StackAllocator* stack, size_t size)
+{
+    return stack->large_threshold != 0 && size >= stack->large_threshold;
+}
+
+static bool stack_owns_large(StackAllocator* stack, void* ptr)
+{
+    return stack->large_objects.head != NULL && (uintptr_t)ptr - (uintptr_t)stack->buffer >= stack->buffer_size &&
+        large_object_owns(&stack->large_objects, ptr);
 }
 
-void* stack_alloc(StackAllocator* stack, size_t size, size_t align)
+static void* stack_alloc_once(StackAllocator* stack, size_t size, size_t align)
 {
+    ALLOCATOR_STATS_START(stats_start);
+
+    if (stack_is_large(stack, size))
+    {
+        void* ptr = try_large_object_alloc(&stack->large_objects, size, align);
+        if (ptr == NULL)
+        {
+            ALLOCATOR_STATS_FAIL(&stack->stats, stats_start);
+            return NULL;
+        }
+        ALLOCATOR_STATS_ALLOC(&stack->stats, stats_start, size, large_object_footprint(size));
+        return ptr;
+    }
+
     uintptr_t start_address = (uintptr_t)stack->buffer + stack->offset;
     
-    size_t max_align = 1 << (8 * sizeof(StackAllocationHeader::padding) - 1);
-    if (align > max_align)
+    if (align > stack_max_align())
     {
-        align = max_align;
+        align = stack_max_align();
     }
 
     size_t padding = get_padding_with_header(start_address, sizeof(StackAllocationHeader), align);
     
     if (stack->offset + padding + size > stack->buffer_size)
     {
-        fprintf(stderr, "[ERROR] stack doesn't have enough space for new allocation. " \
-            "Require size: %lld, require padding: %lld, stack available size: %lld\n", 
-            size, padding, stack->buffer_size - stack->offset);
+        ALLOCATOR_STATS_FAIL(&stack->stats, stats_start);
         return NULL;
     }
 
@@ -183,13 +347,42 @@ void* stack_alloc(StackAllocator* stack, size_t size, size_t align)
     StackAllocationHeader* header = (StackAllocationHeader*)(ptr - sizeof(StackAllocationHeader));
     header->padding = padding;
     header->prev_offset = stack->prev_offset;
+    stack->buffer[stack->offset] = (uint8_t)padding;
 
     stack->prev_offset = stack->offset;
     stack->offset += (padding + size);
+    ALLOCATOR_STATS_ALLOC(&stack->stats, stats_start, size, padding + size);
 
     return memset((void*)ptr, 0, size);
 }
 
+void* try_stack_alloc_slow(StackAllocator* stack, size_t size, size_t align)
+{
+    return oom_retry(&stack->oom_handler, stack, size, align,
+        [=]() { return stack_alloc_once(stack, size, align); });
+}
+
+void* stack_alloc_slow(StackAllocator* stack, size_t size, size_t align)
+{
+    void* ptr = try_stack_alloc_slow(stack, size, align);
+    if (ptr != NULL)
+    {
+        return ptr;
+    }
+
+    if (stack_is_large(stack, size))
+    {
+        fprintf(stderr, "[ERROR] stack failed to map a large object. Require size: %zu\n", size);
+        return NULL;
+    }
+    size_t padding = get_padding_with_header((uintptr_t)stack->buffer + stack->offset, sizeof(StackAllocationHeader),
+        align > stack_max_align() ? stack_max_align() : align);
+    fprintf(stderr, "[ERROR] stack doesn't have enough space for new allocation. " \
+        "Require size: %zu, require padding: %zu, stack available size: %zu\n",
+        size, padding, stack->buffer_size - stack->offset);
+    return NULL;
+}
+
 void* stack_resize(StackAllocator* stack, void* old_ptr, size_t old_size, size_t new_size, size_t align)
 {
     size_t min_size = old_size < new_size ? old_size : new_size;
@@ -205,6 +398,21 @@ void* stack_resize(StackAllocator* stack, void* old_ptr, size_t old_size, size_t
         return NULL;
     }
 
+    if (stack_owns_large(stack, old_ptr))
+    {
+#if MEMORY_ALLOCATOR_STATS
+        size_t old_footprint = large_object_footprint(large_object_size(old_ptr));
+        void* new_ptr = large_object_resize(&stack->large_objects, old_ptr, new_size);
+        if (new_ptr != NULL)
+        {
+            ALLOCATOR_STATS_ADJUST(&stack->stats, (int64_t)large_object_footprint(new_size) - (int64_t)old_footprint);
+        }
+        return new_ptr;
+#else
+        return large_object_resize(&stack->large_objects, old_ptr, new_size);
+#endif
+    }
+
     if (old_ptr < stack->buffer || old_ptr >= stack->buffer + stack->buffer_size)
     {
         //assert(0);
@@ -219,13 +427,30 @@ void* stack_resize(StackAllocator* stack, void* old_ptr, size_t old_size, size_t
     }
 
     StackAllocationHeader* header = (StackAllocationHeader*)((uintptr_t)old_ptr - sizeof(StackAllocationHeader));
-    if ((uintptr_t)old_ptr + old_size != (uintptr_t)stack->buffer + stack->offset)
+    bool is_top = (uintptr_t)old_ptr + old_size == (uintptr_t)stack->buffer + stack->offset;
+    if (stack_is_large(stack, new_size))
+    {
+        void* new_ptr = large_object_alloc(&stack->large_objects, new_size, align);
+        if (new_ptr == NULL)
+        {
+            return NULL;
+        }
+        memcpy(new_ptr, old_ptr, min_size);
+        if (is_top)
+        {
+            stack_free(stack, old_ptr);
+        }
+        return new_ptr;
+    }
+
+    if (!is_top)
     {
         void* new_ptr = stack_alloc(stack, new_size, align);
         memcpy(new_ptr, old_ptr, min_size);
         return new_ptr;
     }
 
+    ALLOCATOR_STATS_ADJUST(&stack->stats, (int64_t)new_size - (int64_t)old_size);
     stack->offset = stack->offset - old_size + new_size;
     if (new_size > old_size)
     {
@@ -236,6 +461,15 @@ void* stack_resize(StackAllocator* stack, void* old_ptr, size_t old_size, size_t
 
 void stack_free(StackAllocator* stack, void* ptr)
 {
+    ALLOCATOR_STATS_START(stats_start);
+
+    if (stack_owns_large(stack, ptr))
+    {
+        ALLOCATOR_STATS_FREE(&stack->stats, stats_start, large_object_footprint(large_object_size(ptr)));
+        large_object_free(&stack->large_objects, ptr);
+        return;
+    }
+
     if (ptr < stack->buffer || ptr >= stack->buffer + stack->buffer_size)
     {
         //assert(0);
@@ -258,14 +492,37 @@ void stack_free(StackAllocator* stack, void* ptr)
         return;
     }
 
+    ALLOCATOR_STATS_FREE(&stack->stats, stats_start, stack->offset - stack->prev_offset);
     stack->offset = stack->prev_offset;
     stack->prev_offset = header->prev_offset;
 }
 
 void stack_free_all(StackAllocator* stack)
 {
+    ALLOCATOR_STATS_RELEASE_ALL(&stack->stats);
     stack->offset = 0;
     stack->prev_offset = 0;
+    if (stack->large_objects.head != NULL)
+    {
+        large_object_free_all(&stack->large_objects);
+    }
+}
+
+TempStackAllocator temp_stack_start(StackAllocator* stack)
+{
+    TempStackAllocator temp_stack = {};
+    temp_stack.stack = stack;
+    temp_stack.offset = stack->offset;
+    temp_stack.prev_offset = stack->prev_offset;
+    return temp_stack;
+}
+
+void temp_stack_end(TempStackAllocator* temp_stack)
+{
+    ALLOCATOR_STATS_ADJUST(&temp_stack->stack->stats,
+        (int64_t)temp_stack->offset - (int64_t)temp_stack->stack->offset);
+    temp_stack->stack->offset = temp_stack->offset;
+    temp_stack->stack->prev_offset = temp_stack->prev_offset;
 }
 
 void pool_init(PoolAllocator* pool, void* buffer, size_t buffer_size, size_t chunk_size, size_t align) 
@@ -281,26 +538,59 @@ void pool_init(PoolAllocator* pool, void* buffer, size_t buffer_size, size_t chu
     pool->buffer_size = buffer_size_align;
     pool->chunk_size = chunk_size_align;
     pool->head = NULL;
+    pool->oom_handler.func = NULL;
+    pool->oom_handler.user_data = NULL;
+    ALLOCATOR_STATS_INIT(&pool->stats);
 
     pool_free_all(pool);
 }
 
-void* pool_alloc(PoolAllocator* pool)
+void pool_set_oom_handler(PoolAllocator* pool, OomHandlerFunc func, void* user_data)
+{
+    pool->oom_handler.func = func;
+    pool->oom_handler.user_data = user_data;
+}
+
+static void* pool_alloc_once(PoolAllocator* pool)
 {
+    ALLOCATOR_STATS_START(stats_start);
     PoolListNode* node = pool->head;
     if (node == NULL)
     {
-        fprintf(stderr, "[ERROR] pool doesn't have enough space for new allocation.\n");
+        ALLOCATOR_STATS_FAIL(&pool->stats, stats_start);
         return NULL;
     }
 
     pool->head = node->next;
+    ALLOCATOR_STATS_ALLOC(&pool->stats, stats_start, pool->chunk_size, pool->chunk_size);
+    HEAP_PROFILE_ALLOC(node, pool->chunk_size);
 
     void* ptr = node;
     return memset(ptr, 0, pool->chunk_size);
 }
 
-void pool_free(PoolAllocator* pool, void* ptr)
+void* try_pool_alloc_slow(PoolAllocator* pool)
+{
+    // only an exhausted pool pays for the handler
+    if (pool->head != NULL || pool->oom_handler.func == NULL)
+    {
+        return pool_alloc_once(pool);
+    }
+    return oom_retry(&pool->oom_handler, pool, pool->chunk_size, 0,
+        [=]() { return pool_alloc_once(pool); });
+}
+
+void* pool_alloc_slow(PoolAllocator* pool)
+{
+    void* ptr = try_pool_alloc_slow(pool);
+    if (ptr == NULL)
+    {
+        fprintf(stderr, "[ERROR] pool doesn't have enough space for new allocation.\n");
+    }
+    return ptr;
+}
+
+void pool_free_slow(PoolAllocator* pool, void* ptr)
 {
     if (ptr == NULL)
     {
@@ -314,13 +604,17 @@ void pool_free(PoolAllocator* pool, void* ptr)
         return;
     }
 
+    ALLOCATOR_STATS_START(stats_start);
+    HEAP_PROFILE_FREE(ptr);
     PoolListNode* node = (PoolListNode*)ptr;
     node->next = pool->head;
     pool->head = node;
+    ALLOCATOR_STATS_FREE(&pool->stats, stats_start, pool->chunk_size);
 }
 
 void pool_free_all(PoolAllocator* pool)
 {
+    ALLOCATOR_STATS_RELEASE_ALL(&pool->stats);
     pool->head = NULL;
     size_t chunk_count = pool->buffer_size / pool->chunk_size;
     for (int i = 0; i < chunk_count; i++)
@@ -335,31 +629,50 @@ void pool_free_all(PoolAllocator* pool)
 // free list allocator
 void free_list_init(FreeListAllocator* free_list, void* buffer, size_t buffer_size, FreeListAllocationPolicy allocation_policy)
 {
-    assert(buffer_size >= sizeof(FreeListNode));
-    if (buffer_size < sizeof(FreeListNode))
+    // what is left once the start is aligned and the end trimmed
+    uintptr_t start = align_forward((uintptr_t)buffer, FREE_LIST_BLOCK_ALIGNMENT);
+    size_t skipped = start - (uintptr_t)buffer;
+    size_t usable_size = buffer_size > skipped ? (buffer_size - skipped) & ~(FREE_LIST_BLOCK_ALIGNMENT - 1) : 0;
+    assert(usable_size >= sizeof(FreeListNode));
+    if (usable_size < sizeof(FreeListNode))
     {
-        fprintf(stderr, "[ERROR] free_list_init failed. Buffer size=%lld is smaller then sizeof(FreeListNode)=%lld.\n",
-            buffer_size, sizeof(FreeListNode));
+        fprintf(stderr, "[ERROR] free_list_init failed. Buffer size=%zu leaves %zu aligned bytes, smaller then sizeof(FreeListNode)=%zu.\n",
+            buffer_size, usable_size, sizeof(FreeListNode));
         return;
     }
-    free_list->buffer = (unsigned char*)buffer;
-    free_list->buffer_size = buffer_size;
+    free_list->buffer = (unsigned char*)start;
+    free_list->buffer_size = usable_size;
     free_list->allocation_policy = allocation_policy;
+    free_list->oom_handler.func = NULL;
+    free_list->oom_handler.user_data = NULL;
+    ALLOCATOR_STATS_INIT(&free_list->stats);
     free_list_free_all(free_list);
 }
 
-void* free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align)
+void free_list_set_oom_handler(FreeListAllocator* free_list, OomHandlerFunc func, void* user_data)
 {
+    free_list->oom_handler.func = func;
+    free_list->oom_handler.user_data = user_data;
+}
+
+static void* free_list_alloc_once(FreeListAllocator* free_list, size_t size, size_t align)
+{
+    ALLOCATOR_STATS_START(stats_start);
     if ((free_list->buffer_size - free_list->buffer_used) < size
         || free_list->head == NULL)
     {
-        fprintf(stderr, "[ERROR] free_list_alloc failed. Allocator doesn't have enough memory for the allocation.\n");
+        ALLOCATOR_STATS_FAIL(&free_list->stats, stats_start);
         return NULL;
     }
 
+#if MEMORY_ALLOCATOR_STATS || MEMORY_ALLOCATOR_HEAP_PROFILE
+    const size_t requested_size = size;
+#endif
     if (size < sizeof(FreeListNode)) {
         size = sizeof(FreeListNode);
     }
+    // keeps every block start aligned
+    size = align_forward(size, FREE_LIST_BLOCK_ALIGNMENT);
 
     FreeListNode* prev_node = NULL;
     FreeListNode* found_node = NULL;
@@ -390,6 +703,7 @@ void* free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align)
     case Allocation_Policy_Best_Fit:
     {
         FreeListNode* node = free_list->head;
+        FreeListNode* node_prev = NULL;
         size_t minimum_diff_size = ~(size_t)0;
         while (node != NULL)
         {
@@ -401,8 +715,10 @@ void* free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align)
                 padding = padd;
                 minimum_diff_size = node->block_size - req_size;
                 found_node = node;
+                // remove_node needs the node in front of the best fit, not the last one visited
+                prev_node = node_prev;
             }
-            prev_node = node;
+            node_prev = node;
             node = node->next;
         }
         break;
@@ -415,7 +731,7 @@ void* free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align)
     }
 
     if (found_node == NULL) {
-        fprintf(stderr, "[ERROR] free_list_alloc failed. Allocator doesn't have suitable block for size=%lld.\n", size);
+        ALLOCATOR_STATS_FAIL(&free_list->stats, stats_start);
         return NULL;
     }
 
@@ -430,17 +746,49 @@ void* free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align)
     free_list_remove_node(free_list, prev_node, found_node);
 
     free_list->buffer_used += found_node->block_size;
+    ALLOCATOR_STATS_ALLOC(&free_list->stats, stats_start, requested_size, found_node->block_size);
 
     unsigned char* ptr = (unsigned char*)found_node + padding;
     FreeListAllocationHeader* header = 
         (FreeListAllocationHeader*)(ptr - sizeof(FreeListAllocationHeader));
     header->block_size = found_node->block_size;
     header->padding = padding;
+    if (padding != sizeof(FreeListAllocationHeader)) {
+        *(size_t*)found_node = padding;
+    }
+    HEAP_PROFILE_ALLOC(ptr, requested_size);
     return memset(ptr, 0, size);
 }
 
+void* try_free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align)
+{
+    return oom_retry(&free_list->oom_handler, free_list, size, align,
+        [=]() { return free_list_alloc_once(free_list, size, align); });
+}
+
+void* free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align)
+{
+    void* ptr = try_free_list_alloc(free_list, size, align);
+    if (ptr != NULL)
+    {
+        return ptr;
+    }
+
+    if ((free_list->buffer_size - free_list->buffer_used) < size || free_list->head == NULL)
+    {
+        fprintf(stderr, "[ERROR] free_list_alloc failed. Allocator doesn't have enough memory for the allocation.\n");
+    }
+    else
+    {
+        fprintf(stderr, "[ERROR] free_list_alloc failed. Allocator doesn't have suitable block for size=%zu.\n", size);
+    }
+    return NULL;
+}
+
 void free_list_free(FreeListAllocator* free_list, void* ptr)
 {
+    ALLOCATOR_STATS_START(stats_start);
+    HEAP_PROFILE_FREE(ptr);
     FreeListAllocationHeader* header = 
         (FreeListAllocationHeader*)((uintptr_t)ptr - sizeof(FreeListAllocationHeader));
 
@@ -462,6 +810,7 @@ void free_list_free(FreeListAllocator* free_list, void* ptr)
 
     free_list_insert_node(free_list, prev_node, new_node);
     free_list->buffer_used -= new_node->block_size;
+    ALLOCATOR_STATS_FREE(&free_list->stats, stats_start, block_size);
     free_list_coalescence_node(prev_node, new_node);
 }
 
@@ -508,6 +857,7 @@ void free_list_coalescence_node(FreeListNode* prev_node, FreeListNode* node)
 
 void free_list_free_all(FreeListAllocator* free_list)
 {
+    ALLOCATOR_STATS_RELEASE_ALL(&free_list->stats);
     free_list->buffer_used = 0;
     FreeListNode* node = (FreeListNode*)free_list->buffer;
     node->block_size = free_list->buffer_size;
@@ -516,17 +866,20 @@ void free_list_free_all(FreeListAllocator* free_list)
 }
 
 // buddy
-// 0b00 Free  0b01 Split  0b10 Alloc
+// 0b00 Free  0b01 Split  0b10 Alloc  0b11 Tail (allocated, continues the span on its left)
 #define BUDDY_BIT 2
 #define BUDDY_SLOT(i) ((i) / 4)
 #define BUDDY_MASK(i) ((1 << (((i) * BUDDY_BIT) % 8)) | (1 << (((i) * BUDDY_BIT) % 8 + 1)))
 #define BUDDY_INDEX(arr, i) ((arr)[BUDDY_SLOT(i)] & BUDDY_MASK(i))
+#define BUDDY_STATE(arr, i) (BUDDY_INDEX(arr, i) >> (((i) * BUDDY_BIT) % 8))
 #define BUDDY_SET_FREE(arr, i) ((arr)[BUDDY_SLOT(i)] &= ~BUDDY_MASK(i))
 #define BUDDY_SET_SPLIT(arr, i) ((arr)[BUDDY_SLOT(i)] |= (1 << (((i) * BUDDY_BIT) % 8)))
 #define BUDDY_SET_ALLOC(arr, i) ((arr)[BUDDY_SLOT(i)] |= (1 << (((i) * BUDDY_BIT) % 8 + 1)))
-#define BUDDY_IS_FREE(arr, i) ((BUDDY_INDEX(arr, i) & BUDDY_MASK(i)) == 0)
-#define BUDDY_IS_SPLIT(arr, i) ((BUDDY_INDEX(arr, i) & (1 << (((i) * BUDDY_BIT) % 8))) != 0)
-#define BUDDY_IS_ALLOC(arr, i) ((BUDDY_INDEX(arr, i) & (1 << (((i) * BUDDY_BIT) % 8 + 1))) != 0)
+#define BUDDY_SET_TAIL(arr, i) ((arr)[BUDDY_SLOT(i)] |= BUDDY_MASK(i))
+#define BUDDY_IS_FREE(arr, i) (BUDDY_STATE(arr, i) == 0)
+#define BUDDY_IS_SPLIT(arr, i) (BUDDY_STATE(arr, i) == 1)
+#define BUDDY_IS_ALLOC(arr, i) (BUDDY_STATE(arr, i) == 2)
+#define BUDDY_IS_TAIL(arr, i) (BUDDY_STATE(arr, i) == 3)
 
 void buddy_init(BuddyAllocator* allocator, void* buffer, size_t size, size_t align)
 {
@@ -555,38 +908,98 @@ void buddy_init(BuddyAllocator* allocator, void* buffer, size_t size, size_t ali
     allocator->buffer = (unsigned char*)buffer;
     allocator->tree_height = tree_height;
     allocator->alignment = align;
+    allocator->usable_size = size;
+    allocator->tree_in_buffer = false;
+    allocator->oom_handler.func = NULL;
+    allocator->oom_handler.user_data = NULL;
+    ALLOCATOR_STATS_INIT(&allocator->stats);
 }
 
-void* buddy_alloc(BuddyAllocator* allocator, size_t size)
+// Mark every block at or after `begin` as allocated, splitting the blocks that straddle it.
+static void buddy_reserve_tail(BuddyAllocator* allocator, size_t index, size_t offset, size_t block_size, size_t begin)
 {
-    size_t require_size = align_forward(size, allocator->alignment);
+    if (offset >= begin) {
+        BUDDY_SET_ALLOC(allocator->tree, index);
+        return;
+    }
+    if (offset + block_size <= begin) {
+        return;
+    }
+    BUDDY_SET_SPLIT(allocator->tree, index);
+    size_t half = block_size >> 1;
+    buddy_reserve_tail(allocator, index * 2 + 1, offset, half, begin);
+    buddy_reserve_tail(allocator, index * 2 + 2, offset + half, half, begin);
+}
 
-    size_t queue[1024];
-    int head = 0, tail = 0;
+void buddy_init_region(BuddyAllocator* allocator, void* buffer, size_t size, size_t align)
+{
+    assert(buffer != NULL);
+    assert(is_power_of_two(align));
+
+    uintptr_t start = align_forward((uintptr_t)buffer, align);
+    assert(start - (uintptr_t)buffer < size);
+    size_t available = size - (start - (uintptr_t)buffer);
+
+    size_t leaf_count = 2;
+    while (leaf_count * align < available) {
+        leaf_count <<= 1;
+    }
+
+    size_t tree_height = 0;
+    for (size_t i = leaf_count; i > 1; i >>= 1) {
+        tree_height++;
+    }
+
+    size_t node_count = 2 * leaf_count - 1;
+    size_t tree_size = (node_count * BUDDY_BIT) / CHAR_BIT + 1;
+    assert(tree_size < available);
+
+    size_t usable_size = ((available - tree_size) / align) * align;
+    assert(usable_size >= align);
+
+    allocator->tree = (unsigned char*)start + available - tree_size;
+    allocator->buffer = (unsigned char*)start;
+    allocator->tree_height = tree_height;
+    allocator->alignment = align;
+    allocator->usable_size = usable_size;
+    allocator->tree_in_buffer = true;
+    allocator->oom_handler.func = NULL;
+    allocator->oom_handler.user_data = NULL;
+    ALLOCATOR_STATS_INIT(&allocator->stats);
+
+    buddy_free_all(allocator);
+}
+
+// Find and mark the smallest buddy that fits size. Doesn't touch the memory.
+static void* buddy_alloc_block(BuddyAllocator* allocator, size_t size, size_t* block_size_out)
+{
+    size_t require_size = align_forward(size, allocator->alignment);
 
     const size_t buffer_size = POW_OF_2(allocator->tree_height) * allocator->alignment;
 
+    // no block can be tighter than the smallest power of two that fits
+    size_t best_size = allocator->alignment;
+    while (best_size < require_size) {
+        best_size <<= 1;
+    }
+
     bool found = false;
     size_t buddy_index = 0;
-    size_t buddy_size = ~0;
+    size_t buddy_size = ~(size_t)0;
     size_t buddy_height = 0;
-    // enqueue
-    queue[tail] = 0; 
-    tail = (tail + 1) % 1024;
-    assert(head != tail);
-    while (head != tail) {
-        // dequeue
-        size_t index = queue[head];
-        head = (head + 1) % 1024;
-
-        size_t block_size = buffer_size;
-        size_t height = 0;
-        size_t i = index + 1;
-        while (i > 1) {
-            block_size >>= 1;
-            i >>= 1;
-            height++;
-        }
+
+    // depth first, left child first, so the leftmost of the smallest blocks wins.
+    // A pending right sibling per level is all the stack ever holds.
+    struct { size_t index; size_t height; } stack[2 * 64];
+    int top = 0;
+    stack[top].index = 0;
+    stack[top].height = 0;
+    top++;
+    while (top > 0) {
+        top--;
+        size_t index = stack[top].index;
+        size_t height = stack[top].height;
+        size_t block_size = buffer_size >> height;
 
         if (block_size < require_size) continue;
 
@@ -595,20 +1008,17 @@ void* buddy_alloc(BuddyAllocator* allocator, size_t size)
             buddy_index = index;
             buddy_size = block_size;
             buddy_height = height;
+            if (block_size == best_size) break;
         }
-        else if (BUDDY_IS_SPLIT(allocator->tree, index)) {
-            size_t left = index * 2 + 1;
-            size_t right = index * 2 + 2;
-            
-            // enqueue
-            queue[tail] = left; 
-            tail = (tail + 1) % 1024;
-            assert(head != tail);
-            
-            // enqueue
-            queue[tail] = right; 
-            tail = (tail + 1) % 1024;
-            assert(head != tail);
+        else if (BUDDY_IS_SPLIT(allocator->tree, index)
+            && (block_size >> 1) >= require_size && (block_size >> 1) < buddy_size) {
+            assert(top + 2 <= (int)(sizeof(stack) / sizeof(stack[0])));
+            stack[top].index = index * 2 + 2;
+            stack[top].height = height + 1;
+            top++;
+            stack[top].index = index * 2 + 1;
+            stack[top].height = height + 1;
+            top++;
         }
     }
 
@@ -621,39 +1031,295 @@ void* buddy_alloc(BuddyAllocator* allocator, size_t size)
         }
         BUDDY_SET_ALLOC(allocator->tree, buddy_index);
         size_t offset = buddy_size * (buddy_index + 1 - POW_OF_2(buddy_height));
-        void* ptr = &allocator->buffer[offset];
-        return memset(ptr, 0, buddy_size);
+        *block_size_out = buddy_size;
+        return &allocator->buffer[offset];
     }
 
-    fprintf(stderr, "[ERROR] buddy_allocator_alloc failed. Allocator doesn't have suitable buddy for size=%lld.", size);
     return NULL;
 }
 
-void buddy_free(BuddyAllocator* allocator, void* ptr)
+void buddy_set_oom_handler(BuddyAllocator* allocator, OomHandlerFunc func, void* user_data)
+{
+    allocator->oom_handler.func = func;
+    allocator->oom_handler.user_data = user_data;
+}
+
+static void* buddy_alloc_once(BuddyAllocator* allocator, size_t size)
+{
+    ALLOCATOR_STATS_START(stats_start);
+    size_t block_size = 0;
+    void* ptr = buddy_alloc_block(allocator, size, &block_size);
+    if (ptr != NULL) {
+        ALLOCATOR_STATS_ALLOC(&allocator->stats, stats_start, size, block_size);
+        HEAP_PROFILE_ALLOC(ptr, size);
+        return memset(ptr, 0, block_size);
+    }
+
+    ALLOCATOR_STATS_FAIL(&allocator->stats, stats_start);
+    return NULL;
+}
+
+void* try_buddy_alloc(BuddyAllocator* allocator, size_t size)
+{
+    return oom_retry(&allocator->oom_handler, allocator, size, allocator->alignment,
+        [=]() { return buddy_alloc_once(allocator, size); });
+}
+
+void* buddy_alloc(BuddyAllocator* allocator, size_t size)
+{
+    void* ptr = try_buddy_alloc(allocator, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "[ERROR] buddy_alloc failed. Allocator doesn't have suitable buddy for size=%zu.\n", size);
+    }
+    return ptr;
+}
+
+// Find the node in `state` whose block starts at offset.
+static bool buddy_find_node(BuddyAllocator* allocator, size_t offset, size_t state, size_t* index_out, size_t* height_out)
 {
-    size_t offset = (uintptr_t)ptr - (uintptr_t)allocator->buffer;
     size_t index =
         POW_OF_2(allocator->tree_height) - 1 + (offset / allocator->alignment);
+    size_t height = allocator->tree_height;
 
-    bool free = false;
     while (index != 0) {
-        if (BUDDY_IS_ALLOC(allocator->tree, index)) {
-            BUDDY_SET_FREE(allocator->tree, index);
-            free = true;
-            break;
+        if (BUDDY_STATE(allocator->tree, index) == state) {
+            *index_out = index;
+            *height_out = height;
+            return true;
         }
         if (index % 2 == 0) break;
         index = (index - 1) / 2;
+        height--;
+    }
+    if (offset == 0 && BUDDY_STATE(allocator->tree, 0) == state) {
+        *index_out = 0;
+        *height_out = 0;
+        return true;
+    }
+    return false;
+}
+
+static bool buddy_find_alloc(BuddyAllocator* allocator, void* ptr, size_t* index_out, size_t* height_out)
+{
+    size_t offset = (uintptr_t)ptr - (uintptr_t)allocator->buffer;
+    return buddy_find_node(allocator, offset, 2, index_out, height_out);
+}
+
+// Merge a freed node with its free buddies on the way up. Only the freed
+// node's path can change, so there is no need to walk the whole tree.
+static void buddy_merge_up(BuddyAllocator* allocator, size_t index)
+{
+    while (index != 0) {
+        size_t buddy = index % 2 == 1 ? index + 1 : index - 1;
+        size_t parent = (index - 1) / 2;
+        if (!BUDDY_IS_FREE(allocator->tree, index) || !BUDDY_IS_FREE(allocator->tree, buddy)
+            || !BUDDY_IS_SPLIT(allocator->tree, parent)) {
+            break;
+        }
+        BUDDY_SET_FREE(allocator->tree, parent);
+        index = parent;
+    }
+}
+
+// Bytes covered by the allocation whose head block is at (offset, block_size),
+// including the tail blocks left by buddy_alloc_exact.
+static size_t buddy_span_size(BuddyAllocator* allocator, size_t offset, size_t block_size, bool release)
+{
+    const size_t buffer_size = POW_OF_2(allocator->tree_height) * allocator->alignment;
+    size_t end = offset + block_size;
+    size_t index = 0, height = 0;
+    while (end < buffer_size && buddy_find_node(allocator, end, 3, &index, &height)) {
+        if (release) {
+            BUDDY_SET_FREE(allocator->tree, index);
+            buddy_merge_up(allocator, index);
+        }
+        end += POW_OF_2(allocator->tree_height - height) * allocator->alignment;
+    }
+    return end - offset;
+}
+
+// Mark the first `used` bytes of a free node as one allocation: a head block
+// followed by tail blocks, the rest of the node stays free.
+static void buddy_mark_span(BuddyAllocator* allocator, size_t index, size_t block_size, size_t used, bool head)
+{
+    if (used == block_size) {
+        if (head) {
+            BUDDY_SET_ALLOC(allocator->tree, index);
+        }
+        else {
+            BUDDY_SET_TAIL(allocator->tree, index);
+        }
+        return;
+    }
+    BUDDY_SET_SPLIT(allocator->tree, index);
+    size_t half = block_size >> 1;
+    if (used <= half) {
+        buddy_mark_span(allocator, index * 2 + 1, half, used, head);
+        return;
+    }
+    buddy_mark_span(allocator, index * 2 + 1, half, half, head);
+    buddy_mark_span(allocator, index * 2 + 2, half, used - half, false);
+}
+
+void* buddy_alloc_exact(BuddyAllocator* allocator, size_t size)
+{
+    ALLOCATOR_STATS_START(stats_start);
+    size_t require_size = align_forward(size, allocator->alignment);
+    size_t block_size = 0;
+    void* ptr = buddy_alloc_block(allocator, require_size, &block_size);
+    if (ptr == NULL) {
+        ALLOCATOR_STATS_FAIL(&allocator->stats, stats_start);
+        fprintf(stderr, "[ERROR] buddy_alloc_exact failed. Allocator doesn't have suitable buddy for size=%zu.\n", size);
+        return NULL;
+    }
+
+    if (require_size < block_size) {
+        size_t index = 0, height = 0;
+        buddy_find_alloc(allocator, ptr, &index, &height);
+        BUDDY_SET_FREE(allocator->tree, index);
+        buddy_mark_span(allocator, index, block_size, require_size, true);
+    }
+    ALLOCATOR_STATS_ALLOC(&allocator->stats, stats_start, size, require_size);
+    HEAP_PROFILE_ALLOC(ptr, size);
+    return memset(ptr, 0, require_size);
+}
+
+void buddy_free(BuddyAllocator* allocator, void* ptr)
+{
+    buddy_free_batch(allocator, &ptr, 1);
+}
+
+size_t buddy_alloc_batch(BuddyAllocator* allocator, size_t size, void** blocks, size_t count)
+{
+    size_t block_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        ALLOCATOR_STATS_START(stats_start);
+        blocks[i] = buddy_alloc_block(allocator, size, &block_size);
+        if (blocks[i] == NULL) {
+            ALLOCATOR_STATS_FAIL(&allocator->stats, stats_start);
+            return i;
+        }
+        ALLOCATOR_STATS_ALLOC(&allocator->stats, stats_start, size, block_size);
+        HEAP_PROFILE_ALLOC(blocks[i], size);
+    }
+    return count;
+}
+
+void buddy_free_batch(BuddyAllocator* allocator, void** blocks, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        ALLOCATOR_STATS_START(stats_start);
+        size_t index = 0, height = 0;
+        bool found = buddy_find_alloc(allocator, blocks[i], &index, &height);
+        assert(found);
+        if (!found) {
+            continue;
+        }
+        HEAP_PROFILE_FREE(blocks[i]);
+        BUDDY_SET_FREE(allocator->tree, index);
+
+        size_t block_size = POW_OF_2(allocator->tree_height - height) * allocator->alignment;
+        size_t offset = (uintptr_t)blocks[i] - (uintptr_t)allocator->buffer;
+        // releases the tail blocks of the span as well
+#if MEMORY_ALLOCATOR_STATS
+        size_t span_size = buddy_span_size(allocator, offset, block_size, true);
+#else
+        buddy_span_size(allocator, offset, block_size, true);
+#endif
+        buddy_merge_up(allocator, index);
+        ALLOCATOR_STATS_FREE(&allocator->stats, stats_start, span_size);
+    }
+}
+
+void* buddy_resize(BuddyAllocator* allocator, void* ptr, size_t new_size)
+{
+    if (ptr == NULL) {
+        return buddy_alloc(allocator, new_size);
+    }
+
+    if (new_size == 0) {
+        buddy_free(allocator, ptr);
+        return NULL;
+    }
+
+    ALLOCATOR_STATS_START(stats_start);
+    size_t index = 0, height = 0;
+    if (!buddy_find_alloc(allocator, ptr, &index, &height)) {
+        fprintf(stderr, "[ERROR] buddy_resize failed. ptr is not an allocated buddy.\n");
+        return NULL;
+    }
+
+    size_t block_size = POW_OF_2(allocator->tree_height - height) * allocator->alignment;
+    size_t require_size = align_forward(new_size, allocator->alignment);
+
+    // spans from buddy_alloc_exact are not a single buddy, always move them
+    size_t offset = (uintptr_t)ptr - (uintptr_t)allocator->buffer;
+    size_t span_size = buddy_span_size(allocator, offset, block_size, false);
+    if (span_size != block_size) {
+        size_t new_block_size = 0;
+        unsigned char* new_ptr = (unsigned char*)buddy_alloc_block(allocator, require_size, &new_block_size);
+        if (new_ptr == NULL) {
+            ALLOCATOR_STATS_FAIL(&allocator->stats, stats_start);
+            fprintf(stderr, "[ERROR] buddy_resize failed. Allocator doesn't have suitable buddy for size=%zu.\n", new_size);
+            return NULL;
+        }
+        size_t copy_size = span_size < new_block_size ? span_size : new_block_size;
+        memcpy(new_ptr, ptr, copy_size);
+        memset(new_ptr + copy_size, 0, new_block_size - copy_size);
+        buddy_free(allocator, ptr);
+        ALLOCATOR_STATS_ALLOC(&allocator->stats, stats_start, new_size, new_block_size);
+        HEAP_PROFILE_ALLOC(new_ptr, new_size);
+        return new_ptr;
+    }
+
+    if (require_size <= block_size) {
+        // shrink, keep the left half and release the right one at every level
+        while (require_size <= (block_size >> 1)) {
+            BUDDY_SET_FREE(allocator->tree, index);
+            BUDDY_SET_SPLIT(allocator->tree, index);
+            index = index * 2 + 1;
+            BUDDY_SET_ALLOC(allocator->tree, index);
+            block_size >>= 1;
+            ALLOCATOR_STATS_ADJUST(&allocator->stats, -(int64_t)block_size);
+        }
+        return ptr;
+    }
+
+    // grow in place, only possible while we are a left child with a free buddy
+    size_t target = index;
+    size_t target_size = block_size;
+    while (target_size < require_size) {
+        if (target == 0 || target % 2 == 0 || !BUDDY_IS_FREE(allocator->tree, target + 1)) {
+            break;
+        }
+        target = (target - 1) / 2;
+        target_size <<= 1;
     }
-    if (!free && offset == 0) {
-        if (BUDDY_IS_ALLOC(allocator->tree, 0)) {
-            BUDDY_SET_FREE(allocator->tree, 0);
-            free = true;
+
+    if (target_size >= require_size) {
+        for (size_t i = index; i != target; i = (i - 1) / 2) {
+            BUDDY_SET_FREE(allocator->tree, i);
         }
+        BUDDY_SET_FREE(allocator->tree, target);
+        BUDDY_SET_ALLOC(allocator->tree, target);
+        memset((unsigned char*)ptr + block_size, 0, target_size - block_size);
+        ALLOCATOR_STATS_ADJUST(&allocator->stats, (int64_t)(target_size - block_size));
+        return ptr;
     }
-    assert(free);
 
-    buddy_coalescence(allocator);
+    size_t new_block_size = 0;
+    unsigned char* new_ptr = (unsigned char*)buddy_alloc_block(allocator, require_size, &new_block_size);
+    if (new_ptr == NULL) {
+        ALLOCATOR_STATS_FAIL(&allocator->stats, stats_start);
+        fprintf(stderr, "[ERROR] buddy_resize failed. Allocator doesn't have suitable buddy for size=%zu.\n", new_size);
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, block_size);
+    memset(new_ptr + block_size, 0, new_block_size - block_size);
+    buddy_free(allocator, ptr);
+    ALLOCATOR_STATS_ALLOC(&allocator->stats, stats_start, new_size, new_block_size);
+    HEAP_PROFILE_ALLOC(new_ptr, new_size);
+    return new_ptr;
 }
 
 void buddy_coalescence(BuddyAllocator* allocator)
@@ -680,18 +1346,33 @@ void buddy_coalescence(BuddyAllocator* allocator)
     }
 }
 
+size_t buddy_tree_size(BuddyAllocator* allocator)
+{
+    return ((POW_OF_2(allocator->tree_height + 1) - 1) * BUDDY_BIT) / CHAR_BIT + 1;
+}
+
 void buddy_free_all(BuddyAllocator* allocator)
 {
-    size_t tree_size = ((POW_OF_2(allocator->tree_height + 1) - 1) * BUDDY_BIT) / CHAR_BIT + 1;
-    memset(allocator->tree, 0, tree_size);
+    ALLOCATOR_STATS_RELEASE_ALL(&allocator->stats);
+    memset(allocator->tree, 0, buddy_tree_size(allocator));
+
+    const size_t buffer_size = POW_OF_2(allocator->tree_height) * allocator->alignment;
+    if (allocator->usable_size < buffer_size) {
+        buddy_reserve_tail(allocator, 0, 0, buffer_size, allocator->usable_size);
+    }
 }
 
 void buddy_destory(BuddyAllocator* allocator)
 {
+    if (!allocator->tree_in_buffer) {
+        free(allocator->tree);
+    }
+    allocator->tree = NULL;
     allocator->buffer = NULL;
     allocator->alignment = 0;
     allocator->tree_height = 0;
-    free(allocator->tree);
+    allocator->usable_size = 0;
+    allocator->tree_in_buffer = false;
 }
 
 void buddy_debug_print(BuddyAllocator* allocator)
@@ -720,6 +1401,12 @@ void buddy_debug_print(BuddyAllocator* allocator)
                     fprintf(stdout, " ");
                 }
             }
+            else if (BUDDY_IS_TAIL(allocator->tree, i)) {
+                fprintf(stdout, "3");
+                for (size_t j = 0; j < indent; j++) {
+                    fprintf(stdout, " ");
+                }
+            }
         }
         height--;
         indent = indent * 2 + 1;
@@ -734,5 +1421,48 @@ void buddy_debug_print(BuddyAllocator* allocator)
     else if (BUDDY_IS_ALLOC(allocator->tree, 0)) {
         fprintf(stdout, "2");
     }
+    else if (BUDDY_IS_TAIL(allocator->tree, 0)) {
+        fprintf(stdout, "3");
+    }
     fprintf(stdout, "\n");
 }
+
+// in address order, exact spans are reported at their head with the tails folded in
+static bool buddy_walk_node(BuddyAllocator* allocator, size_t index, size_t offset, size_t block_size,
+    HeapWalkFunc func, void* user_data)
+{
+    HeapBlock block;
+    block.offset = offset;
+    block.size = block_size;
+    block.padding = 0;
+    block.data = NULL;
+    block.large = false;
+    switch (BUDDY_STATE(allocator->tree, index)) {
+    case 0:
+        block.state = Heap_Block_Free;
+        return func(&block, user_data);
+    case 1:
+    {
+        size_t half = block_size >> 1;
+        return buddy_walk_node(allocator, index * 2 + 1, offset, half, func, user_data) &&
+            buddy_walk_node(allocator, index * 2 + 2, offset + half, half, func, user_data);
+    }
+    case 2:
+        if (offset >= allocator->usable_size) {
+            block.state = Heap_Block_Reserved;
+        } else {
+            block.state = Heap_Block_Used;
+            block.size = buddy_span_size(allocator, offset, block_size, false);
+            block.data = allocator->buffer + offset;
+        }
+        return func(&block, user_data);
+    default:
+        return true;
+    }
+}
+
+bool buddy_walk(BuddyAllocator* allocator, HeapWalkFunc func, void* user_data)
+{
+    const size_t buffer_size = POW_OF_2(allocator->tree_height) * allocator->alignment;
+    return buddy_walk_node(allocator, 0, 0, buffer_size, func, user_data);
+}
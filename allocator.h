@@ -1,17 +1,110 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "allocator_stats.h"
+#include "heap_profile.h"
+#include "large_object.h"
+#include "region.h"
 
 #define DEFAULT_ALIGNMENT 8
 
-#define POW_OF_2(x) (1 << (x))
+#define POW_OF_2(x) ((size_t)1 << (x))
+
+// The bump and free-list pops of the arena, stack and pool are inline below
+// and fall back to the out of line _slow functions for everything else: large
+// objects, commits, the OOM handler and the error report. With
+// MEMORY_ALLOCATOR_STATS every call takes the out of line path, so the counters
+// see all of them.
+#if MEMORY_ALLOCATOR_STATS
+#define ALLOCATOR_FAST_PATHS 0
+#else
+#define ALLOCATOR_FAST_PATHS 1
+#endif
+
+#if defined(_MSC_VER)
+#define ALLOCATOR_NOINLINE __declspec(noinline)
+#else
+#define ALLOCATOR_NOINLINE __attribute__((noinline))
+#endif
+
+inline bool is_power_of_two(uintptr_t x)
+{
+    // check if x is only have one set bit, 
+    // if it is, then it must be power of two
+    return (x & (x - 1)) == 0;
+}
+
+inline uintptr_t align_forward(uintptr_t address, size_t align)
+{
+    assert(is_power_of_two(align));
+    // same as (address % align) when alignment is power of two
+    uintptr_t mod = address & (align - 1);
+    if (mod != 0)
+    {
+        address += (align - mod);
+    }
+    return address;
+}
+
+inline size_t get_padding_with_header(uintptr_t address, size_t header_size, size_t align)
+{
+    assert(is_power_of_two(align));
+
+    size_t padding = 0;
+    size_t mod = address & (align - 1);
+    if (mod != 0) {
+        padding += (align - mod);
+    }
+
+    if (padding < header_size) {
+        size_t remain = header_size - padding;
+        if ((remain & (align - 1)) == 0) {
+            padding += align * (remain / align);
+        }
+        else {
+            padding += align * ((remain / align) + 1);
+        }
+    }
+
+    return padding;
+}
+
+////////////////////////////////
+// out of memory
+//
+// Every allocator can carry a handler that runs when a request can't be
+// served, before NULL is returned. It can make room (grow the heap, evict) and
+// ask for another attempt, or hand out a block from somewhere else, which the
+// caller then frees wherever the handler got it from. `align` is 0 for the pool,
+// whose chunks have a fixed alignment.
+//
+// The try_ functions fail without printing anything, the plain ones report
+// the failure on stderr after the handler gave up.
+
+enum OomAction
+{
+    Oom_Action_Fail,
+    // the handler made room, try again
+    Oom_Action_Retry,
+    // return *fallback instead
+    Oom_Action_Fallback,
+};
 
-bool is_power_of_two(uintptr_t x);
+typedef OomAction (*OomHandlerFunc)(void* allocator, size_t size, size_t align, void* user_data, void** fallback);
 
-uintptr_t align_forward(uintptr_t address, size_t align);
+struct OomHandler
+{
+    OomHandlerFunc func;
+    void* user_data;
+};
 
-size_t get_padding_with_header(uintptr_t address, size_t header_size, size_t align);
+// retries per request, a handler that keeps asking without making room fails
+#define OOM_MAX_RETRIES 16
 
 ////////////////////////////////
 // arena/linear allocator
@@ -20,10 +113,60 @@ struct ArenaAllocator
     unsigned char* buffer;
     size_t buffer_size;
     size_t offset;
+    // set by arena_init_region, memory is committed on demand in region->page_size steps
+    Region* region;
+    // 0 unless arena_use_large_objects was called
+    size_t large_threshold;
+    LargeObjectList large_objects;
+    OomHandler oom_handler;
+    // counters, only with MEMORY_ALLOCATOR_STATS (allocator_stats.h)
+    ALLOCATOR_STATS_FIELD
 };
 
 void arena_init(ArenaAllocator* arena, void* buffer, size_t buffer_size);
-void* arena_alloc(ArenaAllocator* arena, size_t size, size_t align = DEFAULT_ALIGNMENT);
+void arena_init_region(ArenaAllocator* arena, Region* region);
+// Requests of at least `threshold` bytes get their own mapping instead of arena
+// space and are resized with mremap. They are released by arena_free and
+// arena_free_all, temp_arena_end leaves them alone.
+void arena_use_large_objects(ArenaAllocator* arena, size_t threshold = LARGE_OBJECT_THRESHOLD);
+void arena_set_oom_handler(ArenaAllocator* arena, OomHandlerFunc func, void* user_data);
+ALLOCATOR_NOINLINE void* arena_alloc_slow(ArenaAllocator* arena, size_t size, size_t align);
+ALLOCATOR_NOINLINE void* try_arena_alloc_slow(ArenaAllocator* arena, size_t size, size_t align);
+
+// NULL when the request needs the slow path. The block is not zeroed, for
+// callers that write every byte themselves.
+inline void* arena_bump_fast(ArenaAllocator* arena, size_t size, size_t align)
+{
+#if ALLOCATOR_FAST_PATHS
+    size_t offset = align_forward((uintptr_t)arena->buffer + arena->offset, align) - (uintptr_t)arena->buffer;
+    size_t limit = arena->region != NULL ? arena->region->committed : arena->buffer_size;
+    if ((arena->large_threshold == 0 || size < arena->large_threshold) && offset + size <= limit) {
+        arena->offset = offset + size;
+        return &arena->buffer[offset];
+    }
+#endif
+    return NULL;
+}
+
+// NULL when the request needs the slow path
+inline void* arena_alloc_fast(ArenaAllocator* arena, size_t size, size_t align)
+{
+    void* ptr = arena_bump_fast(arena, size, align);
+    return ptr != NULL ? memset(ptr, 0, size) : NULL;
+}
+
+inline void* arena_alloc(ArenaAllocator* arena, size_t size, size_t align = DEFAULT_ALIGNMENT)
+{
+    void* ptr = arena_alloc_fast(arena, size, align);
+    return ptr != NULL ? ptr : arena_alloc_slow(arena, size, align);
+}
+
+inline void* try_arena_alloc(ArenaAllocator* arena, size_t size, size_t align = DEFAULT_ALIGNMENT)
+{
+    void* ptr = arena_alloc_fast(arena, size, align);
+    return ptr != NULL ? ptr : try_arena_alloc_slow(arena, size, align);
+}
+
 void* arena_resize(ArenaAllocator* arena, void* old_memory, size_t old_size, 
     size_t new_size, size_t align = DEFAULT_ALIGNMENT);
 void arena_free(ArenaAllocator* arena, void* ptr);
@@ -46,21 +189,93 @@ struct StackAllocator
     size_t buffer_size;
     size_t offset;
     size_t prev_offset;
+    // 0 unless stack_use_large_objects was called
+    size_t large_threshold;
+    LargeObjectList large_objects;
+    OomHandler oom_handler;
+    ALLOCATOR_STATS_FIELD
 };
 
+// padding comes first: the first byte of every block holds the padding, either
+// as a copy in front of the header or as the header's own field, so a heap walk
+// can step from a block's start to its header
 struct StackAllocationHeader
 {
-    size_t prev_offset;
     uint8_t padding;
+    size_t prev_offset;
 };
 
 void stack_init(StackAllocator* stack, void* buffer, size_t buffer_size);
-void* stack_alloc(StackAllocator* stack, size_t size, size_t align = DEFAULT_ALIGNMENT);
+// Same as arena_use_large_objects, large blocks can be freed in any order.
+void stack_use_large_objects(StackAllocator* stack, size_t threshold = LARGE_OBJECT_THRESHOLD);
+void stack_set_oom_handler(StackAllocator* stack, OomHandlerFunc func, void* user_data);
+ALLOCATOR_NOINLINE void* stack_alloc_slow(StackAllocator* stack, size_t size, size_t align);
+ALLOCATOR_NOINLINE void* try_stack_alloc_slow(StackAllocator* stack, size_t size, size_t align);
+
+// largest alignment the padding byte of the header can express
+inline size_t stack_max_align()
+{
+    return (size_t)1 << (8 * sizeof(StackAllocationHeader::padding) - 1);
+}
+
+// NULL when the request needs the slow path. Not zeroed, like arena_bump_fast.
+inline void* stack_push_fast(StackAllocator* stack, size_t size, size_t align)
+{
+#if ALLOCATOR_FAST_PATHS
+    if ((stack->large_threshold == 0 || size < stack->large_threshold) && align <= stack_max_align()) {
+        size_t padding = get_padding_with_header((uintptr_t)stack->buffer + stack->offset,
+            sizeof(StackAllocationHeader), align);
+        if (stack->offset + padding + size <= stack->buffer_size) {
+            unsigned char* ptr = &stack->buffer[stack->offset + padding];
+            StackAllocationHeader* header = (StackAllocationHeader*)(ptr - sizeof(StackAllocationHeader));
+            header->padding = padding;
+            header->prev_offset = stack->prev_offset;
+            stack->buffer[stack->offset] = (uint8_t)padding;
+            stack->prev_offset = stack->offset;
+            stack->offset += padding + size;
+            return ptr;
+        }
+    }
+#endif
+    return NULL;
+}
+
+// NULL when the request needs the slow path
+inline void* stack_alloc_fast(StackAllocator* stack, size_t size, size_t align)
+{
+    void* ptr = stack_push_fast(stack, size, align);
+    return ptr != NULL ? memset(ptr, 0, size) : NULL;
+}
+
+inline void* stack_alloc(StackAllocator* stack, size_t size, size_t align = DEFAULT_ALIGNMENT)
+{
+    void* ptr = stack_alloc_fast(stack, size, align);
+    return ptr != NULL ? ptr : stack_alloc_slow(stack, size, align);
+}
+
+inline void* try_stack_alloc(StackAllocator* stack, size_t size, size_t align = DEFAULT_ALIGNMENT)
+{
+    void* ptr = stack_alloc_fast(stack, size, align);
+    return ptr != NULL ? ptr : try_stack_alloc_slow(stack, size, align);
+}
+
 void* stack_resize(StackAllocator* stack, void* old_ptr, size_t old_size, 
     size_t new_size, size_t align = DEFAULT_ALIGNMENT);
 void stack_free(StackAllocator* stack, void* ptr);
 void stack_free_all(StackAllocator* stack);
 
+// Rewind point, like TempArenaAllocator. temp_stack_end frees everything
+// allocated since the start in one step, large objects are left alone.
+struct TempStackAllocator
+{
+    StackAllocator* stack;
+    size_t offset;
+    size_t prev_offset;
+};
+
+TempStackAllocator temp_stack_start(StackAllocator* stack);
+void temp_stack_end(TempStackAllocator* temp_stack);
+
 ////////////////////////////////
 // pool allocator
 struct PoolListNode
@@ -74,12 +289,58 @@ struct PoolAllocator
     size_t buffer_size;
     size_t chunk_size;
     PoolListNode* head;
+    OomHandler oom_handler;
+    ALLOCATOR_STATS_FIELD
 };
 
 void pool_init(PoolAllocator* pool, void* buffer, size_t buffer_size, 
     size_t chunk_size, size_t align = DEFAULT_ALIGNMENT);
-void* pool_alloc(PoolAllocator* pool);
-void pool_free(PoolAllocator* pool, void* ptr);
+void pool_set_oom_handler(PoolAllocator* pool, OomHandlerFunc func, void* user_data);
+ALLOCATOR_NOINLINE void* pool_alloc_slow(PoolAllocator* pool);
+ALLOCATOR_NOINLINE void* try_pool_alloc_slow(PoolAllocator* pool);
+ALLOCATOR_NOINLINE void pool_free_slow(PoolAllocator* pool, void* ptr);
+
+// NULL when the pool is empty
+inline void* pool_alloc_fast(PoolAllocator* pool)
+{
+#if ALLOCATOR_FAST_PATHS
+    PoolListNode* node = pool->head;
+    if (node != NULL) {
+        pool->head = node->next;
+        HEAP_PROFILE_ALLOC(node, pool->chunk_size);
+        return memset(node, 0, pool->chunk_size);
+    }
+#endif
+    return NULL;
+}
+
+inline void* pool_alloc(PoolAllocator* pool)
+{
+    void* ptr = pool_alloc_fast(pool);
+    return ptr != NULL ? ptr : pool_alloc_slow(pool);
+}
+
+inline void* try_pool_alloc(PoolAllocator* pool)
+{
+    void* ptr = pool_alloc_fast(pool);
+    return ptr != NULL ? ptr : try_pool_alloc_slow(pool);
+}
+
+inline void pool_free(PoolAllocator* pool, void* ptr)
+{
+#if ALLOCATOR_FAST_PATHS
+    if ((unsigned char*)ptr >= pool->buffer && (unsigned char*)ptr < pool->buffer + pool->buffer_size) {
+        HEAP_PROFILE_FREE(ptr);
+        PoolListNode* node = (PoolListNode*)ptr;
+        node->next = pool->head;
+        pool->head = node;
+        return;
+    }
+#endif
+    // NULL, a pointer from elsewhere, or a stats build
+    pool_free_slow(pool, ptr);
+}
+
 void pool_free_all(PoolAllocator* pool);
 
 ////////////////////////////////
@@ -90,6 +351,12 @@ enum FreeListAllocationPolicy
     Allocation_Policy_Best_Fit,
 };
 
+// Blocks start FREE_LIST_BLOCK_ALIGNMENT aligned, so the padding in front of
+// the header is 0 or a multiple of it. When it isn't 0 the allocator copies
+// `padding` into the block's first word; either way a heap walk finds the
+// padding at the block start.
+#define FREE_LIST_BLOCK_ALIGNMENT sizeof(size_t)
+
 struct FreeListAllocationHeader
 {
     size_t padding;
@@ -109,10 +376,14 @@ struct FreeListAllocator
     size_t buffer_used;
     FreeListNode* head;
     FreeListAllocationPolicy allocation_policy;
+    OomHandler oom_handler;
+    ALLOCATOR_STATS_FIELD
 };
 
 void free_list_init(FreeListAllocator* free_list, void* buffer, size_t buffer_size, FreeListAllocationPolicy allocation_policy);
+void free_list_set_oom_handler(FreeListAllocator* free_list, OomHandlerFunc func, void* user_data);
 void* free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align = DEFAULT_ALIGNMENT);
+void* try_free_list_alloc(FreeListAllocator* free_list, size_t size, size_t align = DEFAULT_ALIGNMENT);
 void free_list_free(FreeListAllocator* free_list, void* ptr);
 void free_list_insert_node(FreeListAllocator* free_list, FreeListNode* prev_node, FreeListNode* node);
 void free_list_remove_node(FreeListAllocator* free_list, FreeListNode* prev_node, FreeListNode* node);
@@ -127,13 +398,39 @@ struct BuddyAllocator
     unsigned char* buffer;
     size_t tree_height;
     size_t alignment;
+    // bytes from buffer that can be handed out, everything after it is reserved
+    size_t usable_size;
+    // tree lives inside the managed buffer (buddy_init_region), not malloc'd
+    bool tree_in_buffer;
+    OomHandler oom_handler;
+    ALLOCATOR_STATS_FIELD
 };
 
 void buddy_init(BuddyAllocator* allocator, void* buffer, size_t size, size_t align=DEFAULT_ALIGNMENT);
+// Manage a buffer of any size and alignment without malloc. The tree is stored
+// at the end of the buffer, the heap is rounded up to the next power of two and
+// the part past the usable bytes (tree + virtual tail) is marked as allocated.
+void buddy_init_region(BuddyAllocator* allocator, void* buffer, size_t size, size_t align=DEFAULT_ALIGNMENT);
+void buddy_set_oom_handler(BuddyAllocator* allocator, OomHandlerFunc func, void* user_data);
 void* buddy_alloc(BuddyAllocator* allocator, size_t size);
+void* try_buddy_alloc(BuddyAllocator* allocator, size_t size);
+// Allocate exactly the leaf-aligned span: the covering buddy is split and the
+// trailing sub-buddies that aren't needed stay free. buddy_free releases the whole span.
+void* buddy_alloc_exact(BuddyAllocator* allocator, size_t size);
 void buddy_free(BuddyAllocator* allocator, void* ptr);
+// Batch versions for callers that amortize one lock over many blocks. Blocks
+// from buddy_alloc_batch are not zeroed.
+size_t buddy_alloc_batch(BuddyAllocator* allocator, size_t size, void** blocks, size_t count);
+void buddy_free_batch(BuddyAllocator* allocator, void** blocks, size_t count);
+// Shrink or grow in place by splitting/merging buddies, copies only when the
+// block can't be merged with its right-hand buddies up to the new size.
+void* buddy_resize(BuddyAllocator* allocator, void* ptr, size_t new_size);
+// Merge every split node whose halves are both free. Frees already merge along
+// the freed block's path, so this is only a full-tree consistency pass.
 void buddy_coalescence(BuddyAllocator* allocator);
 void buddy_free_all(BuddyAllocator* allocator);
+// bytes used by the state tree
+size_t buddy_tree_size(BuddyAllocator* allocator);
 void buddy_destory(BuddyAllocator* allocator);
 void buddy_debug_print(BuddyAllocator* allocator);
 
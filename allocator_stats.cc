@@ -0,0 +1,95 @@
+#include "allocator_stats.h"
+
+#if MEMORY_ALLOCATOR_STATS
+
+#include <stdio.h>
+#include <string.h>
+
+void allocator_stats_init(AllocatorStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void allocator_stats_refresh_peak(AllocatorStats* stats, AllocatorStatsShard* shard, int64_t live)
+{
+    __atomic_store_n(&shard->peak_check, live + live / 64, __ATOMIC_RELAXED);
+
+    int64_t total = 0;
+    for (size_t i = 0; i < ALLOCATOR_STATS_SHARDS; i++) {
+        total += __atomic_load_n(&stats->shards[i].live_bytes, __ATOMIC_RELAXED);
+    }
+    int64_t peak = __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED);
+    while (total > peak &&
+        !__atomic_compare_exchange_n(&stats->peak_bytes, &peak, total, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void allocator_stats_release_all(AllocatorStats* stats)
+{
+    for (size_t i = 0; i < ALLOCATOR_STATS_SHARDS; i++) {
+        __atomic_store_n(&stats->shards[i].live_bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->shards[i].peak_check, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void allocator_stats_read(const AllocatorStats* stats, AllocatorStatsSnapshot* snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (size_t i = 0; i < ALLOCATOR_STATS_SHARDS; i++) {
+        const AllocatorStatsShard* shard = &stats->shards[i];
+        snapshot->alloc_count += __atomic_load_n(&shard->alloc_count, __ATOMIC_RELAXED);
+        snapshot->free_count += __atomic_load_n(&shard->free_count, __ATOMIC_RELAXED);
+        snapshot->failed_count += __atomic_load_n(&shard->failed_count, __ATOMIC_RELAXED);
+        snapshot->requested_bytes += __atomic_load_n(&shard->requested_bytes, __ATOMIC_RELAXED);
+        snapshot->overhead_bytes += __atomic_load_n(&shard->overhead_bytes, __ATOMIC_RELAXED);
+        snapshot->live_bytes += __atomic_load_n(&shard->live_bytes, __ATOMIC_RELAXED);
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+        for (size_t b = 0; b < ALLOCATOR_STATS_LATENCY_BUCKETS; b++) {
+            snapshot->alloc_latency[b] += __atomic_load_n(&shard->alloc_latency[b], __ATOMIC_RELAXED);
+            snapshot->free_latency[b] += __atomic_load_n(&shard->free_latency[b], __ATOMIC_RELAXED);
+        }
+#endif
+    }
+    snapshot->peak_bytes = __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED);
+    if (snapshot->live_bytes > snapshot->peak_bytes) {
+        snapshot->peak_bytes = snapshot->live_bytes;
+    }
+}
+
+uint64_t allocator_stats_percentile(const uint64_t* histogram, double fraction)
+{
+    uint64_t total = 0;
+    for (size_t b = 0; b < ALLOCATOR_STATS_LATENCY_BUCKETS; b++) {
+        total += histogram[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * (double)total);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < ALLOCATOR_STATS_LATENCY_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen > rank) {
+            // upper edge of the bucket
+            return b == 0 ? 0 : (uint64_t)1 << b;
+        }
+    }
+    return (uint64_t)1 << (ALLOCATOR_STATS_LATENCY_BUCKETS - 1);
+}
+
+void allocator_stats_print(const char* name, const AllocatorStatsSnapshot* snapshot)
+{
+    fprintf(stdout, "%s: allocs %llu, frees %llu, failed %llu, live %lld B, peak %lld B, requested %llu B, overhead %llu B\n",
+        name, (unsigned long long)snapshot->alloc_count, (unsigned long long)snapshot->free_count,
+        (unsigned long long)snapshot->failed_count, (long long)snapshot->live_bytes, (long long)snapshot->peak_bytes,
+        (unsigned long long)snapshot->requested_bytes, (unsigned long long)snapshot->overhead_bytes);
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+    fprintf(stdout, "%s: alloc p50 < %llu p99 < %llu cycles, free p50 < %llu p99 < %llu cycles\n", name,
+        (unsigned long long)allocator_stats_percentile(snapshot->alloc_latency, 0.5),
+        (unsigned long long)allocator_stats_percentile(snapshot->alloc_latency, 0.99),
+        (unsigned long long)allocator_stats_percentile(snapshot->free_latency, 0.5),
+        (unsigned long long)allocator_stats_percentile(snapshot->free_latency, 0.99));
+#endif
+}
+
+#endif
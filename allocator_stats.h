@@ -0,0 +1,212 @@
+#ifndef ALLOCATOR_STATS_H
+#define ALLOCATOR_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// allocator statistics
+//
+// Build with -DMEMORY_ALLOCATOR_STATS=1 (cmake -DMEMORY_ALLOCATOR_STATS=ON) and
+// every allocator in allocator.h and static_buddy.h gets a `stats` member
+// counting allocations, frees, failures, live and peak bytes, and the bytes
+// spent on padding, headers and rounding. MEMORY_ALLOCATOR_STATS_LATENCY=1 adds
+// log2 histograms of alloc and free latency in cycles.
+//
+// Without the toggle the member and every hook expand to nothing.
+//
+// Counters are split into cache-line shards, one per thread (threads beyond
+// ALLOCATOR_STATS_SHARDS share), and are only summed when read. The peak is
+// refreshed whenever a shard's live bytes grow by 1/64, so it may run up to
+// 1/64 below the true peak.
+
+#ifndef MEMORY_ALLOCATOR_STATS
+#define MEMORY_ALLOCATOR_STATS 0
+#endif
+
+#ifndef MEMORY_ALLOCATOR_STATS_LATENCY
+#define MEMORY_ALLOCATOR_STATS_LATENCY 0
+#endif
+
+#if MEMORY_ALLOCATOR_STATS
+
+#include <atomic>
+
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+#endif
+
+#ifndef ALLOCATOR_STATS_SHARDS
+#define ALLOCATOR_STATS_SHARDS 8
+#endif
+
+// bucket i counts ops that took [2^(i-1), 2^i) cycles, the last one everything above
+#define ALLOCATOR_STATS_LATENCY_BUCKETS 32
+
+struct alignas(64) AllocatorStatsShard
+{
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t failed_count;
+    uint64_t requested_bytes;
+    uint64_t overhead_bytes;
+    // may go negative when another thread's shard did the allocation
+    int64_t live_bytes;
+    // live_bytes that triggers the next peak refresh
+    int64_t peak_check;
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+    uint64_t alloc_latency[ALLOCATOR_STATS_LATENCY_BUCKETS];
+    uint64_t free_latency[ALLOCATOR_STATS_LATENCY_BUCKETS];
+#endif
+};
+
+struct AllocatorStats
+{
+    AllocatorStatsShard shards[ALLOCATOR_STATS_SHARDS];
+    int64_t peak_bytes;
+};
+
+struct AllocatorStatsSnapshot
+{
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t failed_count;
+    // bytes asked for by callers, summed over all allocations
+    uint64_t requested_bytes;
+    // bytes consumed beyond what was asked for, summed over all allocations
+    uint64_t overhead_bytes;
+    // bytes held by live blocks, overhead included
+    int64_t live_bytes;
+    int64_t peak_bytes;
+    uint64_t alloc_latency[ALLOCATOR_STATS_LATENCY_BUCKETS];
+    uint64_t free_latency[ALLOCATOR_STATS_LATENCY_BUCKETS];
+};
+
+void allocator_stats_init(AllocatorStats* stats);
+void allocator_stats_read(const AllocatorStats* stats, AllocatorStatsSnapshot* snapshot);
+void allocator_stats_print(const char* name, const AllocatorStatsSnapshot* snapshot);
+// cycles below which `fraction` of the ops in a histogram finished
+uint64_t allocator_stats_percentile(const uint64_t* histogram, double fraction);
+// slow path of the alloc hook, sums the shards into peak_bytes
+void allocator_stats_refresh_peak(AllocatorStats* stats, AllocatorStatsShard* shard, int64_t live);
+
+inline void allocator_stats_add(uint64_t* counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+inline int64_t allocator_stats_add_live(int64_t* counter, int64_t value)
+{
+    return __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+inline AllocatorStatsShard* allocator_stats_shard(AllocatorStats* stats)
+{
+    static std::atomic<uint32_t> next_thread(0);
+    static thread_local uint32_t thread_index = 0;
+    if (thread_index == 0) {
+        thread_index = next_thread.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    return &stats->shards[(thread_index - 1) % ALLOCATOR_STATS_SHARDS];
+}
+
+inline uint64_t allocator_stats_start()
+{
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+#else
+    return 0;
+#endif
+}
+
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+inline void allocator_stats_latency(uint64_t* histogram, uint64_t start)
+{
+    uint64_t ticks = allocator_stats_start() - start;
+    size_t bucket = 0;
+    while (ticks != 0 && bucket < ALLOCATOR_STATS_LATENCY_BUCKETS - 1) {
+        ticks >>= 1;
+        bucket++;
+    }
+    allocator_stats_add(&histogram[bucket], 1);
+}
+#endif
+
+inline void allocator_stats_alloc(AllocatorStats* stats, uint64_t start, size_t requested, size_t consumed)
+{
+    AllocatorStatsShard* shard = allocator_stats_shard(stats);
+    allocator_stats_add(&shard->alloc_count, 1);
+    allocator_stats_add(&shard->requested_bytes, requested);
+    allocator_stats_add(&shard->overhead_bytes, consumed > requested ? consumed - requested : 0);
+    int64_t live = allocator_stats_add_live(&shard->live_bytes, (int64_t)consumed);
+    if (live > __atomic_load_n(&shard->peak_check, __ATOMIC_RELAXED)) {
+        allocator_stats_refresh_peak(stats, shard, live);
+    }
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+    allocator_stats_latency(shard->alloc_latency, start);
+#endif
+}
+
+inline void allocator_stats_free(AllocatorStats* stats, uint64_t start, size_t consumed)
+{
+    AllocatorStatsShard* shard = allocator_stats_shard(stats);
+    allocator_stats_add(&shard->free_count, 1);
+    allocator_stats_add_live(&shard->live_bytes, -(int64_t)consumed);
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+    allocator_stats_latency(shard->free_latency, start);
+#endif
+}
+
+inline void allocator_stats_fail(AllocatorStats* stats, uint64_t start)
+{
+    AllocatorStatsShard* shard = allocator_stats_shard(stats);
+    allocator_stats_add(&shard->failed_count, 1);
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+    allocator_stats_latency(shard->alloc_latency, start);
+#endif
+}
+
+// a block grew or shrank in place, or a rewind gave bytes back
+inline void allocator_stats_adjust(AllocatorStats* stats, int64_t delta)
+{
+    AllocatorStatsShard* shard = allocator_stats_shard(stats);
+    int64_t live = allocator_stats_add_live(&shard->live_bytes, delta);
+    if (delta > 0 && live > __atomic_load_n(&shard->peak_check, __ATOMIC_RELAXED)) {
+        allocator_stats_refresh_peak(stats, shard, live);
+    }
+}
+
+// free_all: nothing is live any more, the counters stay
+void allocator_stats_release_all(AllocatorStats* stats);
+
+#define ALLOCATOR_STATS_FIELD AllocatorStats stats;
+#define ALLOCATOR_STATS_INIT(stats) allocator_stats_init(stats)
+#define ALLOCATOR_STATS_START(name) const uint64_t name = allocator_stats_start()
+#define ALLOCATOR_STATS_ALLOC(stats, start, requested, consumed) allocator_stats_alloc(stats, start, requested, consumed)
+#define ALLOCATOR_STATS_FREE(stats, start, consumed) allocator_stats_free(stats, start, consumed)
+#define ALLOCATOR_STATS_FAIL(stats, start) allocator_stats_fail(stats, start)
+#define ALLOCATOR_STATS_ADJUST(stats, delta) allocator_stats_adjust(stats, delta)
+#define ALLOCATOR_STATS_RELEASE_ALL(stats) allocator_stats_release_all(stats)
+
+#else
+
+#define ALLOCATOR_STATS_FIELD
+#define ALLOCATOR_STATS_INIT(stats) ((void)0)
+#define ALLOCATOR_STATS_START(name) ((void)0)
+#define ALLOCATOR_STATS_ALLOC(stats, start, requested, consumed) ((void)0)
+#define ALLOCATOR_STATS_FREE(stats, start, consumed) ((void)0)
+#define ALLOCATOR_STATS_FAIL(stats, start) ((void)0)
+#define ALLOCATOR_STATS_ADJUST(stats, delta) ((void)0)
+#define ALLOCATOR_STATS_RELEASE_ALL(stats) ((void)0)
+
+#endif
+
+#endif
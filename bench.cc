@@ -0,0 +1,1354 @@
+#include "allocator.h"
+#include "static_buddy.h"
+#include "buddy_pcp.h"
+#include "region.h"
+#include "warmup.h"
+#include "large_object.h"
+#include "pmr_allocator.h"
+#include "thread_heap.h"
+#include "shm_allocator.h"
+#include "epoch.h"
+#include "coroutine.h"
+
+#include "bench.h"
+#include "heap_profile.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static uint64_t bench_rng_state = 0x9E3779B97F4A7C15ull;
+
+uint64_t bench_rand()
+{
+    // xorshift64*
+    bench_rng_state ^= bench_rng_state >> 12;
+    bench_rng_state ^= bench_rng_state << 25;
+    bench_rng_state ^= bench_rng_state >> 27;
+    return bench_rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+void bench_seed(uint64_t seed)
+{
+    bench_rng_state = seed != 0 ? seed : 0x9E3779B97F4A7C15ull;
+}
+
+volatile uint64_t bench_sink;
+
+double bench_now_ns()
+{
+    using namespace std::chrono;
+    return (double)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t bench_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)bench_now_ns();
+#endif
+}
+
+double bench_ticks_per_ns()
+{
+    static double ticks_per_ns = 0;
+    if (ticks_per_ns == 0) {
+        double start_ns = bench_now_ns();
+        uint64_t start_ticks = bench_ticks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ticks_per_ns = (double)(bench_ticks() - start_ticks) / (bench_now_ns() - start_ns);
+    }
+    return ticks_per_ns;
+}
+
+void bench_latency_init(BenchLatency* latency, size_t capacity)
+{
+    latency->samples = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    latency->count = 0;
+    latency->capacity = latency->samples != NULL ? capacity : 0;
+}
+
+void bench_latency_destroy(BenchLatency* latency)
+{
+    free(latency->samples);
+    memset(latency, 0, sizeof(*latency));
+}
+
+void bench_latency_merge(BenchLatency* into, const BenchLatency* from)
+{
+    for (size_t i = 0; i < from->count; i++) {
+        bench_latency_add(into, from->samples[i]);
+    }
+}
+
+static std::vector<BenchResult> bench_results;
+
+static double bench_percentile(const BenchLatency* latency, double percentile)
+{
+    size_t index = (size_t)(percentile * (double)(latency->count - 1));
+    return (double)latency->samples[index] / bench_ticks_per_ns();
+}
+
+BenchResult* bench_record(const char* name, size_t ops, double elapsed_ns, BenchLatency* latency, size_t failures)
+{
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    result.ops = ops;
+    result.elapsed_ns = elapsed_ns;
+    result.failures = failures;
+    if (latency != NULL && latency->count != 0) {
+        std::sort(latency->samples, latency->samples + latency->count);
+        result.has_latency = true;
+        result.p50 = bench_percentile(latency, 0.50);
+        result.p90 = bench_percentile(latency, 0.90);
+        result.p99 = bench_percentile(latency, 0.99);
+        result.p999 = bench_percentile(latency, 0.999);
+        result.max = bench_percentile(latency, 1.0);
+    }
+
+    fprintf(stderr, "%-40s %12zu ops %10.2f ns/op", name, ops, ops != 0 ? elapsed_ns / (double)ops : 0.0);
+    if (result.has_latency) {
+        fprintf(stderr, "  p50 %.0f p99 %.0f p99.9 %.0f ns", result.p50, result.p99, result.p999);
+    }
+    if (failures != 0) {
+        fprintf(stderr, "  %zu failed", failures);
+    }
+    fprintf(stderr, "\n");
+
+    bench_results.push_back(result);
+    return &bench_results.back();
+}
+
+void bench_print(const char* name, size_t ops, double elapsed_ns)
+{
+    bench_record(name, ops, elapsed_ns, NULL);
+}
+
+void bench_metric(BenchResult* result, const char* key, double value)
+{
+    assert(result->metric_count < BENCH_MAX_METRICS);
+    result->metrics[result->metric_count].key = key;
+    result->metrics[result->metric_count].value = value;
+    result->metric_count++;
+    fprintf(stderr, "%-40s %s = %.2f\n", "", key, value);
+}
+
+static void bench_write_json(FILE* file)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"timestamp\": %lld,\n", (long long)time(NULL));
+    fprintf(file, "  \"hardware_concurrency\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(file, "  \"ticks_per_ns\": %.4f,\n", bench_ticks_per_ns());
+#if defined(NDEBUG)
+    fprintf(file, "  \"asserts\": false,\n");
+#else
+    fprintf(file, "  \"asserts\": true,\n");
+#endif
+    fprintf(file, "  \"results\": [");
+    for (size_t i = 0; i < bench_results.size(); i++) {
+        const BenchResult* result = &bench_results[i];
+        double ns_per_op = result->ops != 0 ? result->elapsed_ns / (double)result->ops : 0.0;
+        double ops_per_sec = result->elapsed_ns > 0 ? (double)result->ops * 1e9 / result->elapsed_ns : 0.0;
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"ops\": %zu, \"elapsed_ns\": %.0f, \"ns_per_op\": %.3f, \"ops_per_sec\": %.0f, \"failures\": %zu",
+            i == 0 ? "" : ",", result->name, result->ops, result->elapsed_ns, ns_per_op, ops_per_sec, result->failures);
+        if (result->has_latency) {
+            fprintf(file, ", \"latency_ns\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+                result->p50, result->p90, result->p99, result->p999, result->max);
+        }
+        if (result->metric_count != 0) {
+            fprintf(file, ", \"metrics\": {");
+            for (size_t m = 0; m < result->metric_count; m++) {
+                fprintf(file, "%s\"%s\": %.4f", m == 0 ? "" : ", ", result->metrics[m].key, result->metrics[m].value);
+            }
+            fprintf(file, "}");
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+////////////////////////////////
+// Buddy<HeapSize, MinBlock> vs runtime BuddyAllocator
+//
+// Random alloc/free churn with a bounded live set. The op sequence is generated
+// up front so both allocators see exactly the same requests.
+static const size_t BUDDY_BENCH_HEAP = 16 * 1024;
+static const size_t BUDDY_BENCH_MIN_BLOCK = 64;
+static const size_t BUDDY_BENCH_LIVE = 16;
+static const size_t BUDDY_BENCH_OPS = 200000;
+
+struct BuddyBenchOp
+{
+    size_t size; // 0 means free the block in `slot`
+    size_t slot;
+};
+
+static BuddyBenchOp* buddy_bench_ops()
+{
+    BuddyBenchOp* ops = (BuddyBenchOp*)malloc(BUDDY_BENCH_OPS * sizeof(BuddyBenchOp));
+    bool live[BUDDY_BENCH_LIVE] = { 0 };
+    for (size_t i = 0; i < BUDDY_BENCH_OPS; i++) {
+        size_t slot = bench_rand() % BUDDY_BENCH_LIVE;
+        ops[i].slot = slot;
+        if (live[slot]) {
+            ops[i].size = 0;
+            live[slot] = false;
+        }
+        else {
+            ops[i].size = BUDDY_BENCH_MIN_BLOCK << (bench_rand() % 4);
+            live[slot] = true;
+        }
+    }
+    return ops;
+}
+
+static void buddy_bench()
+{
+    BuddyBenchOp* ops = buddy_bench_ops();
+    void* live[BUDDY_BENCH_LIVE] = { 0 };
+    void* buf = malloc(2 * BUDDY_BENCH_HEAP);
+    void* heap = (void*)align_forward((uintptr_t)buf, BUDDY_BENCH_HEAP);
+
+    {
+        BuddyAllocator buddy = { 0 };
+        buddy_init(&buddy, heap, BUDDY_BENCH_HEAP, BUDDY_BENCH_MIN_BLOCK);
+        double start = bench_now_ns();
+        for (size_t i = 0; i < BUDDY_BENCH_OPS; i++) {
+            if (ops[i].size != 0) {
+                live[ops[i].slot] = buddy_alloc(&buddy, ops[i].size);
+            }
+            else if (live[ops[i].slot] != NULL) {
+                buddy_free(&buddy, live[ops[i].slot]);
+                live[ops[i].slot] = NULL;
+            }
+        }
+        bench_print("buddy runtime (BuddyAllocator)", BUDDY_BENCH_OPS, bench_now_ns() - start);
+        buddy_destory(&buddy);
+    }
+
+    for (size_t i = 0; i < BUDDY_BENCH_LIVE; i++) {
+        live[i] = NULL;
+    }
+
+    {
+        typedef Buddy<BUDDY_BENCH_HEAP, BUDDY_BENCH_MIN_BLOCK> BenchBuddy;
+        BenchBuddy* buddy = (BenchBuddy*)malloc(sizeof(BenchBuddy));
+        buddy->init(heap);
+        double start = bench_now_ns();
+        for (size_t i = 0; i < BUDDY_BENCH_OPS; i++) {
+            if (ops[i].size != 0) {
+                live[ops[i].slot] = buddy->alloc(ops[i].size);
+            }
+            else if (live[ops[i].slot] != NULL) {
+                buddy->free(live[ops[i].slot]);
+                live[ops[i].slot] = NULL;
+            }
+        }
+        bench_print("buddy compile-time (Buddy<16K, 64>)", BUDDY_BENCH_OPS, bench_now_ns() - start);
+        free(buddy);
+    }
+
+    free(buf);
+    free(ops);
+}
+
+////////////////////////////////
+// buddy_alloc vs buddy_alloc_exact internal fragmentation
+//
+// Fill the heap with mixed sizes until the first failure and compare how many
+// bytes the blocks actually consume against what was requested.
+static const size_t BUDDY_FRAG_HEAP = 512 * 1024;
+static const size_t BUDDY_FRAG_LEAF = 1024;
+static const size_t BUDDY_FRAG_MAX_REQUEST = 48 * 1024;
+static const size_t BUDDY_FRAG_ROUNDS = 8;
+static const size_t BUDDY_FRAG_MAX_ALLOCS = BUDDY_FRAG_HEAP / BUDDY_FRAG_LEAF;
+
+static size_t buddy_frag_block_size(size_t size, bool exact)
+{
+    size_t leaf_size = align_forward(size, BUDDY_FRAG_LEAF);
+    if (exact) {
+        return leaf_size;
+    }
+    size_t block_size = BUDDY_FRAG_LEAF;
+    while (block_size < leaf_size) {
+        block_size <<= 1;
+    }
+    return block_size;
+}
+
+static void buddy_fragmentation_bench()
+{
+    size_t* sizes = (size_t*)malloc(BUDDY_FRAG_ROUNDS * BUDDY_FRAG_MAX_ALLOCS * sizeof(size_t));
+    for (size_t i = 0; i < BUDDY_FRAG_ROUNDS * BUDDY_FRAG_MAX_ALLOCS; i++) {
+        sizes[i] = 1 + bench_rand() % BUDDY_FRAG_MAX_REQUEST;
+    }
+
+    void* heap = malloc(BUDDY_FRAG_HEAP);
+
+    for (int exact = 0; exact < 2; exact++) {
+        BuddyAllocator buddy = { 0 };
+        buddy_init(&buddy, heap, BUDDY_FRAG_HEAP, BUDDY_FRAG_LEAF);
+
+        size_t alloc_count = 0;
+        size_t requested = 0;
+        size_t consumed = 0;
+        for (size_t round = 0; round < BUDDY_FRAG_ROUNDS; round++) {
+            const size_t* round_sizes = &sizes[round * BUDDY_FRAG_MAX_ALLOCS];
+            for (size_t i = 0; i < BUDDY_FRAG_MAX_ALLOCS; i++) {
+                void* ptr = exact ? buddy_alloc_exact(&buddy, round_sizes[i]) : buddy_alloc(&buddy, round_sizes[i]);
+                if (ptr == NULL) {
+                    break;
+                }
+                alloc_count++;
+                requested += round_sizes[i];
+                consumed += buddy_frag_block_size(round_sizes[i], exact != 0);
+            }
+            buddy_free_all(&buddy);
+        }
+
+        BenchResult* result = bench_record(exact ? "buddy_alloc_exact fill" : "buddy_alloc fill", alloc_count, 0, NULL);
+        bench_metric(result, "requested_kib", (double)requested / 1024);
+        bench_metric(result, "consumed_kib", (double)consumed / 1024);
+        bench_metric(result, "internal_waste_pct", 100.0 * (double)(consumed - requested) / (double)consumed);
+        buddy_destory(&buddy);
+    }
+
+    free(heap);
+    free(sizes);
+}
+
+////////////////////////////////
+// shared buddy scaling, one lock per op vs per-thread page caches
+static const size_t BUDDY_PCP_BENCH_HEAP = 256 * 1024;
+static const size_t BUDDY_PCP_BENCH_LEAF = 64;
+static const size_t BUDDY_PCP_BENCH_OPS = 20000;
+static const size_t BUDDY_PCP_BENCH_LIVE = 16;
+
+static void buddy_pcp_bench_thread(BuddySharedAllocator* shared, bool use_pcp, uint64_t seed)
+{
+    BuddyPageCache pcp;
+    buddy_pcp_init(&pcp, shared, 16, 64);
+
+    void* live[BUDDY_PCP_BENCH_LIVE] = { 0 };
+    size_t live_size[BUDDY_PCP_BENCH_LIVE] = { 0 };
+    uint64_t state = seed;
+    for (size_t i = 0; i < BUDDY_PCP_BENCH_OPS; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        size_t slot = (state >> 33) % BUDDY_PCP_BENCH_LIVE;
+        if (live[slot] != NULL) {
+            if (use_pcp) {
+                buddy_pcp_free(&pcp, live[slot], live_size[slot]);
+            }
+            else {
+                buddy_shared_free(shared, live[slot]);
+            }
+            live[slot] = NULL;
+        }
+        else {
+            size_t size = BUDDY_PCP_BENCH_LEAF << ((state >> 40) % 3);
+            live[slot] = use_pcp ? buddy_pcp_alloc(&pcp, size) : buddy_shared_alloc(shared, size);
+            live_size[slot] = size;
+        }
+    }
+
+    for (size_t slot = 0; slot < BUDDY_PCP_BENCH_LIVE; slot++) {
+        if (live[slot] == NULL) {
+            continue;
+        }
+        if (use_pcp) {
+            buddy_pcp_free(&pcp, live[slot], live_size[slot]);
+        }
+        else {
+            buddy_shared_free(shared, live[slot]);
+        }
+    }
+    buddy_pcp_drain(&pcp);
+}
+
+static void buddy_pcp_bench()
+{
+    void* raw = malloc(2 * BUDDY_PCP_BENCH_HEAP);
+    void* heap = (void*)align_forward((uintptr_t)raw, BUDDY_PCP_BENCH_HEAP);
+
+    for (int use_pcp = 0; use_pcp < 2; use_pcp++) {
+        for (size_t thread_count = 1; thread_count <= 8; thread_count *= 2) {
+            BuddySharedAllocator* shared = new BuddySharedAllocator();
+            buddy_shared_init(shared, heap, BUDDY_PCP_BENCH_HEAP, BUDDY_PCP_BENCH_LEAF);
+
+            double start = bench_now_ns();
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < thread_count; t++) {
+                threads.emplace_back(buddy_pcp_bench_thread, shared, use_pcp != 0, 0x1234 + t);
+            }
+            for (size_t t = 0; t < thread_count; t++) {
+                threads[t].join();
+            }
+            double elapsed = bench_now_ns() - start;
+
+            char name[64];
+            snprintf(name, sizeof(name), "buddy %s, %zu threads", use_pcp ? "per-thread cache" : "locked", thread_count);
+            bench_print(name, BUDDY_PCP_BENCH_OPS * thread_count, elapsed);
+
+            buddy_shared_destory(shared);
+            delete shared;
+        }
+    }
+
+    free(raw);
+}
+
+////////////////////////////////
+// dTLB sensitivity, random reads over buddy blocks on 4 KiB vs huge pages
+static const size_t TLB_BENCH_HEAP = 512 * 1024 * 1024;
+static const size_t TLB_BENCH_BLOCK = 16 * 1024;
+static const size_t TLB_BENCH_BLOCKS = 16 * 1024;
+static const size_t TLB_BENCH_READS = 20 * 1000 * 1000;
+
+static const char* region_backing_name(RegionBacking backing)
+{
+    switch (backing) {
+    case Region_Backing_Small_Pages: return "4 KiB pages";
+    case Region_Backing_Hugetlb: return "hugetlb 2 MiB pages";
+    case Region_Backing_Transparent_Huge_Pages: return "THP 2 MiB pages";
+    }
+    return "unknown";
+}
+
+static void tlb_bench()
+{
+    uint32_t* reads = (uint32_t*)malloc(TLB_BENCH_READS * sizeof(uint32_t));
+    for (size_t i = 0; i < TLB_BENCH_READS; i++) {
+        reads[i] = (uint32_t)bench_rand();
+    }
+    void** blocks = (void**)malloc(TLB_BENCH_BLOCKS * sizeof(void*));
+
+    for (int huge = 0; huge < 2; huge++) {
+        Region region;
+        if (!region_map(&region, TLB_BENCH_HEAP, huge ? Region_Flag_Huge_Pages : Region_Flag_None)) {
+            continue;
+        }
+
+        // same leaf size for both, only the backing pages differ
+        BuddyAllocator buddy = { 0 };
+        buddy_init(&buddy, region.base, region.size, REGION_SMALL_PAGE_SIZE);
+        for (size_t i = 0; i < TLB_BENCH_BLOCKS; i++) {
+            blocks[i] = buddy_alloc(&buddy, TLB_BENCH_BLOCK);
+        }
+
+        uint64_t sum = 0;
+        double start = bench_now_ns();
+        for (size_t i = 0; i < TLB_BENCH_READS; i++) {
+            uint32_t r = reads[i];
+            const uint64_t* block = (const uint64_t*)blocks[r % TLB_BENCH_BLOCKS];
+            sum += block[(r >> 16) % (TLB_BENCH_BLOCK / sizeof(uint64_t))];
+        }
+        bench_sink = sum;
+        double elapsed = bench_now_ns() - start;
+
+        char name[64];
+        snprintf(name, sizeof(name), "random read, %s", region_backing_name(region.backing));
+        bench_print(name, TLB_BENCH_READS, elapsed);
+
+        buddy_destory(&buddy);
+        region_unmap(&region);
+    }
+
+    free(blocks);
+    free(reads);
+}
+
+////////////////////////////////
+// first-touch cost of arena allocations, cold vs pre-faulted
+static const size_t WARMUP_BENCH_ARENA = 256 * 1024 * 1024;
+static const size_t WARMUP_BENCH_ALLOC = 4096;
+
+static void warmup_bench()
+{
+    for (int warm = 0; warm < 2; warm++) {
+        Region region;
+        if (!region_map(&region, WARMUP_BENCH_ARENA)) {
+            continue;
+        }
+        ArenaAllocator arena = { 0 };
+        arena_init_region(&arena, &region);
+
+        if (warm) {
+            WarmupResult result;
+            arena_warmup(&arena, NULL, &result);
+            // ops are pages here, populated is 1 for MADV_POPULATE_WRITE and 0 for the touch loop
+            BenchResult* warmup = bench_record("arena warm-up", result.pages, (double)result.elapsed_ns, NULL);
+            bench_metric(warmup, "populated", result.populated ? 1 : 0);
+            bench_metric(warmup, "threads", (double)result.thread_count);
+        }
+
+        size_t count = WARMUP_BENCH_ARENA / WARMUP_BENCH_ALLOC;
+        double start = bench_now_ns();
+        for (size_t i = 0; i < count; i++) {
+            arena_alloc(&arena, WARMUP_BENCH_ALLOC);
+        }
+        bench_print(warm ? "arena 4 KiB alloc, pre-faulted" : "arena 4 KiB alloc, cold", count, bench_now_ns() - start);
+
+        region_unmap(&region);
+    }
+}
+
+////////////////////////////////
+// growing one buffer 1 MiB -> 4 GiB by doubling, mremap vs allocate + memcpy
+//
+// Only the resizes are timed. The buffer is filled after each step up to
+// LARGE_BENCH_FILL so the copies have real pages to move; the copying baseline
+// stops there too, old + new copy of a 4 GiB buffer doesn't fit in memory.
+static const size_t LARGE_BENCH_START = 1024 * 1024;
+static const size_t LARGE_BENCH_END = (size_t)4 * 1024 * 1024 * 1024;
+static const size_t LARGE_BENCH_FILL = 1024 * 1024 * 1024;
+
+static void large_bench_fill(unsigned char* ptr, size_t begin, size_t end)
+{
+    if (end > LARGE_BENCH_FILL) {
+        end = LARGE_BENCH_FILL;
+    }
+    if (begin < end) {
+        memset(ptr + begin, 0x5A, end - begin);
+    }
+}
+
+static void large_object_bench()
+{
+    // mremap
+    LargeObjectList list = { 0 };
+    size_t size = LARGE_BENCH_START;
+    unsigned char* ptr = (unsigned char*)large_object_alloc(&list, size);
+    large_bench_fill(ptr, 0, size);
+    double filled_ns = 0;
+    double total_ns = 0;
+    size_t steps = 0;
+    size_t filled_steps = 0;
+    while (ptr != NULL && size < LARGE_BENCH_END) {
+        double start = bench_now_ns();
+        ptr = (unsigned char*)large_object_resize(&list, ptr, size * 2);
+        double elapsed = bench_now_ns() - start;
+        total_ns += elapsed;
+        steps++;
+        if (size * 2 <= LARGE_BENCH_FILL) {
+            filled_ns += elapsed;
+            filled_steps++;
+        }
+        if (ptr != NULL) {
+            large_bench_fill(ptr, size, size * 2);
+            size *= 2;
+        }
+    }
+    if (ptr != NULL) {
+        bench_sink = ptr[LARGE_BENCH_START - 1];
+    }
+    large_object_free_all(&list);
+    bench_print("large object grow to 1 GiB, mremap", filled_steps, filled_ns);
+    bench_print("large object grow to 4 GiB, mremap", steps, total_ns);
+
+    // copy into a fresh block, what arena_resize/stack_resize did
+    size = LARGE_BENCH_START;
+    ptr = (unsigned char*)malloc(size);
+    large_bench_fill(ptr, 0, size);
+    total_ns = 0;
+    steps = 0;
+    while (ptr != NULL && size < LARGE_BENCH_FILL) {
+        double start = bench_now_ns();
+        unsigned char* new_ptr = (unsigned char*)malloc(size * 2);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, size);
+        }
+        free(ptr);
+        total_ns += bench_now_ns() - start;
+        steps++;
+        ptr = new_ptr;
+        if (ptr != NULL) {
+            large_bench_fill(ptr, size, size * 2);
+            size *= 2;
+        }
+    }
+    if (ptr != NULL) {
+        bench_sink = ptr[LARGE_BENCH_START - 1];
+    }
+    free(ptr);
+    bench_print("large object grow to 1 GiB, memcpy", steps, total_ns);
+}
+
+////////////////////////////////
+// pmr containers on a request-scoped arena vs the default resource
+//
+// Each "request" builds a vector and an unordered_map and drops them, the arena
+// is reset in between.
+static const size_t PMR_BENCH_REQUESTS = 2000;
+static const size_t PMR_BENCH_ITEMS = 1000;
+static const size_t PMR_BENCH_ARENA = 1024 * 1024;
+
+static void pmr_bench_request(std::pmr::memory_resource* resource)
+{
+    std::pmr::vector<uint64_t> vec(resource);
+    std::pmr::unordered_map<uint64_t, uint64_t> map(resource);
+    for (size_t i = 0; i < PMR_BENCH_ITEMS; i++) {
+        vec.push_back(i);
+        map[i * 7] = i;
+    }
+    bench_sink = vec.back() + map.size();
+}
+
+static void pmr_bench()
+{
+    double start = bench_now_ns();
+    for (size_t r = 0; r < PMR_BENCH_REQUESTS; r++) {
+        pmr_bench_request(std::pmr::get_default_resource());
+    }
+    bench_print("pmr request, default resource", PMR_BENCH_REQUESTS, bench_now_ns() - start);
+
+    void* buf = malloc(PMR_BENCH_ARENA);
+    ArenaAllocator arena;
+    arena_init(&arena, buf, PMR_BENCH_ARENA);
+    ArenaResource resource(&arena);
+    start = bench_now_ns();
+    for (size_t r = 0; r < PMR_BENCH_REQUESTS; r++) {
+        pmr_bench_request(&resource);
+        arena_free_all(&arena);
+    }
+    bench_print("pmr request, ArenaResource", PMR_BENCH_REQUESTS, bench_now_ns() - start);
+    free(buf);
+}
+
+////////////////////////////////
+// inline fast paths vs the out of line call
+//
+// The same operations through the inline header functions and through the
+// _slow functions, which do the full work behind one call into allocator.cc.
+static const size_t INLINE_BENCH_OPS = 20 * 1000 * 1000;
+static const size_t INLINE_BENCH_ARENA = 1024 * 1024;
+static const size_t INLINE_BENCH_OBJECT_SIZE = 16;
+
+template <bool Inline>
+static double inline_bench_arena()
+{
+    void* buf = malloc(INLINE_BENCH_ARENA);
+    ArenaAllocator arena;
+    arena_init(&arena, buf, INLINE_BENCH_ARENA);
+    const size_t per_reset = INLINE_BENCH_ARENA / INLINE_BENCH_OBJECT_SIZE;
+    uint64_t sum = 0;
+    double start = bench_now_ns();
+    for (size_t i = 0; i < INLINE_BENCH_OPS; i += per_reset) {
+        for (size_t j = 0; j < per_reset; j++) {
+            uint64_t* object = (uint64_t*)(Inline ? arena_alloc(&arena, INLINE_BENCH_OBJECT_SIZE) :
+                arena_alloc_slow(&arena, INLINE_BENCH_OBJECT_SIZE, DEFAULT_ALIGNMENT));
+            object[0] = j;
+            sum += object[1];
+        }
+        arena_free_all(&arena);
+    }
+    double elapsed = bench_now_ns() - start;
+    bench_sink = sum;
+    free(buf);
+    return elapsed;
+}
+
+template <bool Inline>
+static double inline_bench_stack()
+{
+    void* buf = malloc(INLINE_BENCH_ARENA);
+    StackAllocator stack;
+    stack_init(&stack, buf, INLINE_BENCH_ARENA);
+    // a frame of 64 objects, then unwind
+    const size_t frame = 64;
+    uint64_t sum = 0;
+    double start = bench_now_ns();
+    for (size_t i = 0; i < INLINE_BENCH_OPS; i += frame) {
+        for (size_t j = 0; j < frame; j++) {
+            uint64_t* object = (uint64_t*)(Inline ? stack_alloc(&stack, INLINE_BENCH_OBJECT_SIZE) :
+                stack_alloc_slow(&stack, INLINE_BENCH_OBJECT_SIZE, DEFAULT_ALIGNMENT));
+            object[0] = j;
+            sum += object[1];
+        }
+        stack_free_all(&stack);
+    }
+    double elapsed = bench_now_ns() - start;
+    bench_sink = sum;
+    free(buf);
+    return elapsed;
+}
+
+template <bool Inline>
+static double inline_bench_pool()
+{
+    const size_t live = 64;
+    size_t pool_size = live * INLINE_BENCH_OBJECT_SIZE;
+    void* buf = malloc(pool_size);
+    PoolAllocator pool;
+    pool_init(&pool, buf, pool_size, INLINE_BENCH_OBJECT_SIZE);
+    uint64_t* objects[live];
+    uint64_t sum = 0;
+    double start = bench_now_ns();
+    // alloc + free is one op
+    for (size_t i = 0; i < INLINE_BENCH_OPS; i += live) {
+        for (size_t j = 0; j < live; j++) {
+            objects[j] = (uint64_t*)(Inline ? pool_alloc(&pool) : pool_alloc_slow(&pool));
+            objects[j][0] = j;
+        }
+        for (size_t j = 0; j < live; j++) {
+            sum += objects[j][1];
+            if (Inline) {
+                pool_free(&pool, objects[j]);
+            }
+            else {
+                pool_free_slow(&pool, objects[j]);
+            }
+        }
+    }
+    double elapsed = bench_now_ns() - start;
+    bench_sink = sum;
+    free(buf);
+    return elapsed;
+}
+
+static void inline_bench_report(const char* name, double inline_ns, double call_ns)
+{
+    char label[96];
+    snprintf(label, sizeof(label), "%s, out of line", name);
+    bench_print(label, INLINE_BENCH_OPS, call_ns);
+    snprintf(label, sizeof(label), "%s, inline", name);
+    BenchResult* result = bench_record(label, INLINE_BENCH_OPS, inline_ns, NULL);
+    bench_metric(result, "speedup", call_ns / inline_ns);
+}
+
+static void inline_bench()
+{
+#if !ALLOCATOR_FAST_PATHS
+    fprintf(stderr, "inline fast paths are off in stats builds, both columns take the same path\n");
+#endif
+    inline_bench_report("arena bump 16 B", inline_bench_arena<true>(), inline_bench_arena<false>());
+    inline_bench_report("stack push 16 B", inline_bench_stack<true>(), inline_bench_stack<false>());
+    inline_bench_report("pool alloc+free 16 B", inline_bench_pool<true>(), inline_bench_pool<false>());
+}
+
+////////////////////////////////
+// producer/consumer: one thread allocates, another frees
+//
+// Blocks travel through a single-producer single-consumer ring. Compared:
+// malloc/free, a PoolAllocator behind a mutex (the only way the existing
+// allocators can take cross-thread frees) and thread heaps with remote frees.
+static const size_t PC_BENCH_OBJECTS = 2 * 1000 * 1000;
+static const size_t PC_BENCH_OBJECT_SIZE = 64;
+static const size_t PC_BENCH_RING = 4096;
+
+struct PcBenchRing
+{
+    void* slots[PC_BENCH_RING];
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+static void pc_bench_push(PcBenchRing* ring, void* ptr)
+{
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    while (tail - ring->head.load(std::memory_order_acquire) == PC_BENCH_RING) {
+        std::this_thread::yield();
+    }
+    ring->slots[tail % PC_BENCH_RING] = ptr;
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+static void* pc_bench_pop(PcBenchRing* ring)
+{
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    while (ring->tail.load(std::memory_order_acquire) == head) {
+        std::this_thread::yield();
+    }
+    void* ptr = ring->slots[head % PC_BENCH_RING];
+    ring->head.store(head + 1, std::memory_order_release);
+    return ptr;
+}
+
+template <class Alloc, class Free>
+static double pc_bench_run(Alloc alloc, Free release)
+{
+    PcBenchRing* ring = new PcBenchRing();
+    double start = bench_now_ns();
+    std::thread consumer([ring, &release]() {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < PC_BENCH_OBJECTS; i++) {
+            uint64_t* object = (uint64_t*)pc_bench_pop(ring);
+            sum += object[0];
+            release(object);
+        }
+        bench_sink = sum;
+    });
+    for (size_t i = 0; i < PC_BENCH_OBJECTS; i++) {
+        uint64_t* object = (uint64_t*)alloc();
+        object[0] = i;
+        pc_bench_push(ring, object);
+    }
+    consumer.join();
+    double elapsed = bench_now_ns() - start;
+    delete ring;
+    return elapsed;
+}
+
+static void producer_consumer_bench()
+{
+    double elapsed = pc_bench_run(
+        []() { return malloc(PC_BENCH_OBJECT_SIZE); },
+        [](void* ptr) { free(ptr); });
+    bench_print("producer/consumer, malloc", PC_BENCH_OBJECTS, elapsed);
+
+    // the ring plus the consumer's lag never hold more than this many objects
+    size_t pool_size = 2 * PC_BENCH_RING * PC_BENCH_OBJECT_SIZE + 64 * 1024;
+    void* buf = malloc(pool_size);
+    PoolAllocator pool;
+    pool_init(&pool, buf, pool_size, PC_BENCH_OBJECT_SIZE);
+    std::mutex lock;
+    elapsed = pc_bench_run(
+        [&pool, &lock]() { std::lock_guard<std::mutex> guard(lock); return pool_alloc(&pool); },
+        [&pool, &lock](void* ptr) { std::lock_guard<std::mutex> guard(lock); pool_free(&pool, ptr); });
+    bench_print("producer/consumer, locked pool", PC_BENCH_OBJECTS, elapsed);
+    free(buf);
+
+    elapsed = pc_bench_run(
+        []() { return thread_heap_alloc(thread_heap_local(), PC_BENCH_OBJECT_SIZE); },
+        [](void* ptr) { thread_heap_free(thread_heap_local(), ptr); });
+    bench_print("producer/consumer, thread heap", PC_BENCH_OBJECTS, elapsed);
+}
+
+////////////////////////////////
+// read-heavy map: epoch reclamation vs atomic reference counts
+//
+// A fixed table of slots, each pointing at a pool node. Lookups read a node,
+// updates publish a new node and unlink the old one. Under epochs a lookup
+// only writes its own epoch word. The reference-counted version keeps a
+// split count in the slot word (pointer in the low 48 bits, readers in flight
+// plus one above it) and a count in the node for readers that finish after
+// the node was replaced, so every lookup does two CAS on the slot's line.
+// Both take nodes from the same per-thread pool caches.
+static const size_t EPOCH_BENCH_SLOTS = 1024;
+static const size_t EPOCH_BENCH_OPS = 1000 * 1000;
+static const uint64_t EPOCH_BENCH_PTR_MASK = (1ull << 48) - 1;
+static const uint64_t EPOCH_BENCH_READER = 1ull << 48;
+
+struct EpochBenchNode
+{
+    uint64_t key;
+    uint64_t value;
+    std::atomic<int64_t> readers;
+};
+
+static EpochBenchNode* epoch_bench_node(uint64_t word)
+{
+    return (EpochBenchNode*)(uintptr_t)(word & EPOCH_BENCH_PTR_MASK);
+}
+
+static uint64_t epoch_bench_rc_lookup(std::atomic<uint64_t>* slot, EpochThread* thread)
+{
+    uint64_t word = slot->load(std::memory_order_relaxed);
+    while (!slot->compare_exchange_weak(word, word + EPOCH_BENCH_READER, std::memory_order_acquire)) {
+    }
+    EpochBenchNode* node = epoch_bench_node(word);
+    uint64_t value = node->value;
+
+    word += EPOCH_BENCH_READER;
+    for (;;) {
+        if (epoch_bench_node(word) != node) {
+            // replaced meanwhile, the writer moved our count into the node
+            if (node->readers.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                epoch_free(thread, node);
+            }
+            break;
+        }
+        if (slot->compare_exchange_weak(word, word - EPOCH_BENCH_READER, std::memory_order_release)) {
+            break;
+        }
+    }
+    return value;
+}
+
+static void epoch_bench_rc_update(std::atomic<uint64_t>* slot, EpochThread* thread, uint64_t key, uint64_t value)
+{
+    EpochBenchNode* node = (EpochBenchNode*)epoch_alloc(thread);
+    assert(((uintptr_t)node & ~EPOCH_BENCH_PTR_MASK) == 0);
+    node->key = key;
+    node->value = value;
+    uint64_t old = slot->exchange((uint64_t)(uintptr_t)node | EPOCH_BENCH_READER, std::memory_order_acq_rel);
+    EpochBenchNode* old_node = epoch_bench_node(old);
+    // readers still in flight, minus the slot's own reference
+    int64_t in_flight = (int64_t)(old >> 48) - 1;
+    if (old_node->readers.fetch_add(in_flight, std::memory_order_acq_rel) == -in_flight) {
+        epoch_free(thread, old_node);
+    }
+}
+
+static uint64_t epoch_bench_ebr_lookup(std::atomic<uint64_t>* slot, EpochThread* thread)
+{
+    EpochGuard guard(thread);
+    return epoch_bench_node(slot->load(std::memory_order_acquire))->value;
+}
+
+static void epoch_bench_ebr_update(std::atomic<uint64_t>* slot, EpochThread* thread, uint64_t key, uint64_t value)
+{
+    EpochBenchNode* node = (EpochBenchNode*)epoch_alloc(thread);
+    node->key = key;
+    node->value = value;
+    EpochGuard guard(thread);
+    uint64_t old = slot->exchange((uint64_t)(uintptr_t)node | EPOCH_BENCH_READER, std::memory_order_acq_rel);
+    epoch_retire(thread, epoch_bench_node(old));
+}
+
+template <bool Epoch>
+static double epoch_bench_run(int thread_count, size_t write_every)
+{
+    size_t pool_size = 64 * 1024 * sizeof(EpochBenchNode);
+    void* buf = malloc(pool_size);
+    EpochPool* domain = new EpochPool();
+    epoch_pool_init(domain, buf, pool_size, sizeof(EpochBenchNode));
+    std::atomic<uint64_t>* slots = new std::atomic<uint64_t>[EPOCH_BENCH_SLOTS];
+    EpochThread* setup = new EpochThread();
+    epoch_thread_register(setup, domain, 32, 128);
+    for (size_t i = 0; i < EPOCH_BENCH_SLOTS; i++) {
+        EpochBenchNode* node = (EpochBenchNode*)epoch_alloc(setup);
+        node->key = i;
+        node->value = i;
+        slots[i].store((uint64_t)(uintptr_t)node | EPOCH_BENCH_READER);
+    }
+
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&, t]() {
+            EpochThread* thread = new EpochThread();
+            epoch_thread_register(thread, domain, 32, 128);
+            uint64_t state = 0x9E3779B97F4A7C15ull * (uint64_t)(t + 1);
+            uint64_t sum = 0;
+            ready.fetch_add(1);
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            for (size_t i = 0; i < EPOCH_BENCH_OPS; i++) {
+                state ^= state >> 12;
+                state ^= state << 25;
+                state ^= state >> 27;
+                uint64_t key = (state * 0x2545F4914F6CDD1Dull) % EPOCH_BENCH_SLOTS;
+                if (i % write_every == 0) {
+                    Epoch ? epoch_bench_ebr_update(&slots[key], thread, key, i) :
+                        epoch_bench_rc_update(&slots[key], thread, key, i);
+                } else {
+                    sum += Epoch ? epoch_bench_ebr_lookup(&slots[key], thread) :
+                        epoch_bench_rc_lookup(&slots[key], thread);
+                }
+            }
+            bench_sink = sum;
+            epoch_thread_unregister(thread);
+            delete thread;
+        });
+    }
+    while (ready.load() != thread_count) {
+        std::this_thread::yield();
+    }
+    double start = bench_now_ns();
+    go.store(true, std::memory_order_release);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double elapsed = bench_now_ns() - start;
+
+    for (size_t i = 0; i < EPOCH_BENCH_SLOTS; i++) {
+        epoch_free(setup, epoch_bench_node(slots[i].load()));
+    }
+    epoch_thread_unregister(setup);
+    delete setup;
+    delete[] slots;
+    delete domain;
+    free(buf);
+    return elapsed;
+}
+
+static void epoch_bench()
+{
+    static const int thread_counts[] = { 1, 2, 4 };
+    // one update in 20 and in 1000 operations
+    static const size_t write_every[] = { 20, 1000 };
+    for (size_t writes : write_every) {
+        for (int thread_count : thread_counts) {
+            size_t ops = EPOCH_BENCH_OPS * (size_t)thread_count;
+            char name[96];
+            double refcount = epoch_bench_run<false>(thread_count, writes);
+            snprintf(name, sizeof(name), "map 1/%zu writes, %d threads, refcount", writes, thread_count);
+            bench_print(name, ops, refcount);
+            double epoch = epoch_bench_run<true>(thread_count, writes);
+            snprintf(name, sizeof(name), "map 1/%zu writes, %d threads, epoch", writes, thread_count);
+            BenchResult* result = bench_record(name, ops, epoch, NULL);
+            bench_metric(result, "speedup", refcount / epoch);
+        }
+    }
+}
+
+#if MEMORY_ALLOCATOR_COROUTINES
+////////////////////////////////
+// coroutine frames: deep await chains
+//
+// Each request awaits a chain of CoroTask frames DEPTH deep, the leaf does a
+// little work. Default frames come from global operator new, the others from
+// a per-request StackAllocator or TempArenaAllocator scope that is rewound
+// when the request ends.
+static const size_t CORO_BENCH_FRAMES = 4 * 1000 * 1000;
+
+enum CoroBenchMode
+{
+    Coro_Bench_Default,
+    Coro_Bench_Stack,
+    Coro_Bench_Arena,
+};
+
+static CoroTask<uint64_t> coro_bench_default(int depth, uint64_t key)
+{
+    if (depth == 0) {
+        co_return key * 0x9E3779B97F4A7C15ull;
+    }
+    uint64_t below = co_await coro_bench_default(depth - 1, key);
+    co_return below + (uint64_t)depth;
+}
+
+static CoroTask<uint64_t> coro_bench_frames(CoroFrameAllocator& frames, int depth, uint64_t key)
+{
+    if (depth == 0) {
+        co_return key * 0x9E3779B97F4A7C15ull;
+    }
+    uint64_t below = co_await coro_bench_frames(frames, depth - 1, key);
+    co_return below + (uint64_t)depth;
+}
+
+static double coro_bench_run(CoroBenchMode mode, int depth)
+{
+    const size_t buf_size = 1024 * 1024;
+    void* buf = malloc(buf_size);
+    StackAllocator stack;
+    stack_init(&stack, buf, buf_size);
+    ArenaAllocator arena;
+    arena_init(&arena, buf, buf_size);
+
+    size_t requests = CORO_BENCH_FRAMES / (size_t)(depth + 1);
+    uint64_t sum = 0;
+    double start = bench_now_ns();
+    for (size_t i = 0; i < requests; i++) {
+        if (mode == Coro_Bench_Default) {
+            sum += coro_run(coro_bench_default(depth, i));
+            continue;
+        }
+        CoroFrameAllocator frames;
+        if (mode == Coro_Bench_Stack) {
+            coro_frames_begin_stack(&frames, &stack);
+        } else {
+            coro_frames_begin_arena(&frames, &arena);
+        }
+        sum += coro_run(coro_bench_frames(frames, depth, i));
+        coro_frames_end(&frames);
+    }
+    double elapsed = bench_now_ns() - start;
+    bench_sink = sum;
+    free(buf);
+    return elapsed;
+}
+
+static void coroutine_bench()
+{
+    static const int depths[] = { 4, 32, 256 };
+    static const char* mode_names[] = { "operator new", "stack", "arena scope" };
+    for (int depth : depths) {
+        size_t frames = CORO_BENCH_FRAMES / (size_t)(depth + 1) * (size_t)(depth + 1);
+        double baseline = 0.0;
+        for (int mode = Coro_Bench_Default; mode <= Coro_Bench_Arena; mode++) {
+            double elapsed = coro_bench_run((CoroBenchMode)mode, depth);
+            char name[96];
+            snprintf(name, sizeof(name), "await chain depth %d, %s", depth, mode_names[mode]);
+            BenchResult* result = bench_record(name, frames, elapsed, NULL);
+            if (mode == Coro_Bench_Default) {
+                baseline = elapsed;
+            } else {
+                bench_metric(result, "speedup", baseline / elapsed);
+            }
+        }
+    }
+}
+#endif
+
+#if defined(__linux__)
+////////////////////////////////
+// cross-process messages: shared memory vs socket copy
+//
+// A forked consumer takes messages from the producer over a socketpair. With
+// the shared pool or free list only the 8-byte offset crosses the socket, the
+// consumer reads the message in place and frees it from its own mapping. The
+// baseline writes the whole message through the socket. Both consumers read
+// every cache line of every message.
+static const size_t SHM_BENCH_BYTES = (size_t)256 * 1024 * 1024;
+static const size_t SHM_BENCH_IN_FLIGHT = 32;
+
+enum ShmBenchMode
+{
+    Shm_Bench_Socket,
+    Shm_Bench_Pool,
+    Shm_Bench_Free_List,
+};
+
+static bool shm_bench_transfer(int fd, void* data, size_t size, bool send)
+{
+    unsigned char* bytes = (unsigned char*)data;
+    while (size > 0) {
+        ssize_t done = send ? write(fd, bytes, size) : read(fd, bytes, size);
+        if (done <= 0) {
+            if (done < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += done;
+        size -= (size_t)done;
+    }
+    return true;
+}
+
+static uint64_t shm_bench_touch(const unsigned char* message, size_t size)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size; i += 64) {
+        sum += message[i];
+    }
+    return sum;
+}
+
+static void shm_bench_consume(ShmBenchMode mode, const char* name, int fd, size_t size, size_t count)
+{
+    ShmPoolAllocator pool;
+    ShmFreeListAllocator free_list;
+    unsigned char* buffer = NULL;
+    if ((mode == Shm_Bench_Pool && !shm_pool_attach(&pool, name)) ||
+        (mode == Shm_Bench_Free_List && !shm_free_list_attach(&free_list, name))) {
+        _exit(1);
+    }
+    if (mode == Shm_Bench_Socket) {
+        buffer = (unsigned char*)malloc(size);
+    }
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (mode == Shm_Bench_Socket) {
+            if (!shm_bench_transfer(fd, buffer, size, false)) {
+                _exit(2);
+            }
+            sum += shm_bench_touch(buffer, size);
+            continue;
+        }
+        uint64_t offset;
+        if (!shm_bench_transfer(fd, &offset, sizeof(offset), false)) {
+            _exit(2);
+        }
+        if (mode == Shm_Bench_Pool) {
+            unsigned char* message = (unsigned char*)shm_pointer(&pool.segment, offset);
+            sum += shm_bench_touch(message, size);
+            shm_pool_free(&pool, message);
+        } else {
+            unsigned char* message = (unsigned char*)shm_pointer(&free_list.segment, offset);
+            sum += shm_bench_touch(message, size);
+            shm_free_list_free(&free_list, message);
+        }
+    }
+    bench_sink = sum;
+    _exit(0);
+}
+
+static double shm_bench_run(ShmBenchMode mode, size_t size, size_t count)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/memory_allocator_bench_%d", (int)getpid());
+    ShmPoolAllocator pool;
+    ShmFreeListAllocator free_list;
+    // the allocator's capacity bounds the messages in flight
+    if ((mode == Shm_Bench_Pool && !shm_pool_create(&pool, name, SHM_BENCH_IN_FLIGHT * size, size, 64)) ||
+        (mode == Shm_Bench_Free_List && !shm_free_list_create(&free_list, name,
+            SHM_BENCH_IN_FLIGHT * (size + 64), Allocation_Policy_First_Fit))) {
+        return 0.0;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, "[ERROR] shm bench failed. Can't create a socketpair.\n");
+        return 0.0;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        shm_bench_consume(mode, name, fds[1], size, count);
+    }
+    close(fds[1]);
+
+    unsigned char* buffer = mode == Shm_Bench_Socket ? (unsigned char*)malloc(size) : NULL;
+    double start = bench_now_ns();
+    for (size_t i = 0; i < count; i++) {
+        if (mode == Shm_Bench_Socket) {
+            memset(buffer, (int)i, size);
+            shm_bench_transfer(fds[0], buffer, size, true);
+            continue;
+        }
+        unsigned char* message = NULL;
+        while (message == NULL) {
+            message = (unsigned char*)(mode == Shm_Bench_Pool ? try_shm_pool_alloc(&pool) :
+                try_shm_free_list_alloc(&free_list, size, 64));
+            if (message == NULL) {
+                // wait for the consumer to free one
+                sched_yield();
+            }
+        }
+        memset(message, (int)i, size);
+        uint64_t offset = shm_offset(mode == Shm_Bench_Pool ? &pool.segment : &free_list.segment, message);
+        shm_bench_transfer(fds[0], &offset, sizeof(offset), true);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    double elapsed = bench_now_ns() - start;
+    close(fds[0]);
+    free(buffer);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "[ERROR] shm bench consumer failed.\n");
+    }
+
+    if (mode == Shm_Bench_Pool) {
+        shm_pool_detach(&pool);
+    } else if (mode == Shm_Bench_Free_List) {
+        shm_free_list_detach(&free_list);
+    }
+    return elapsed;
+}
+
+static void shm_bench()
+{
+    static const size_t sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+    static const char* mode_names[] = { "socket copy", "shm pool", "shm free list" };
+    for (size_t size : sizes) {
+        size_t count = SHM_BENCH_BYTES / size;
+        for (int mode = Shm_Bench_Socket; mode <= Shm_Bench_Free_List; mode++) {
+            double elapsed = shm_bench_run((ShmBenchMode)mode, size, count);
+            char name[96];
+            snprintf(name, sizeof(name), "messages %zu KiB, %s", size / 1024, mode_names[mode]);
+            BenchResult* result = bench_record(name, count, elapsed, NULL);
+            bench_metric(result, "mb_per_s", (double)(count * size) / (1024.0 * 1024.0) / (elapsed / 1e9));
+        }
+    }
+}
+#endif
+
+struct BenchGroup
+{
+    const char* name;
+    void (*run)();
+};
+
+static const BenchGroup bench_groups[] = {
+    { "suite/lifo", bench_suite_lifo },
+    { "suite/fifo", bench_suite_fifo },
+    { "suite/random-free", bench_suite_random_free },
+    { "suite/size-mixed", bench_suite_size_mixed },
+    { "suite/larson", bench_suite_larson },
+    { "suite/fragmentation", bench_suite_fragmentation },
+    { "buddy", buddy_bench },
+    { "buddy-fragmentation", buddy_fragmentation_bench },
+    { "buddy-pcp", buddy_pcp_bench },
+    { "tlb", tlb_bench },
+    { "warmup", warmup_bench },
+    { "large-object", large_object_bench },
+    { "pmr", pmr_bench },
+    { "inline", inline_bench },
+    { "producer-consumer", producer_consumer_bench },
+    { "epoch", epoch_bench },
+#if MEMORY_ALLOCATOR_COROUTINES
+    { "coroutine", coroutine_bench },
+#endif
+#if defined(__linux__)
+    { "shm", shm_bench },
+#endif
+};
+
+static void bench_usage()
+{
+    fprintf(stderr, "usage: memory_allocator_bench [--json FILE] [--list] [--heap-profile RATE] [GROUP...]\n"
+        "  GROUP selects groups whose name starts with it, e.g. suite\n"
+        "  --heap-profile samples every RATE bytes on average, needs MEMORY_ALLOCATOR_HEAP_PROFILE\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* json_path = NULL;
+    std::vector<const char*> filters;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        }
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+        else if (strcmp(argv[i], "--heap-profile") == 0 && i + 1 < argc) {
+            // measures the allocators with sampling on
+            heap_profile_start((size_t)strtoull(argv[++i], NULL, 10));
+        }
+#endif
+        else if (strcmp(argv[i], "--list") == 0) {
+            for (const BenchGroup& group : bench_groups) {
+                fprintf(stdout, "%s\n", group.name);
+            }
+            return 0;
+        }
+        else if (argv[i][0] == '-') {
+            bench_usage();
+            return 1;
+        }
+        else {
+            filters.push_back(argv[i]);
+        }
+    }
+
+    bench_ticks_per_ns();
+    for (const BenchGroup& group : bench_groups) {
+        bool selected = filters.empty();
+        for (const char* filter : filters) {
+            selected = selected || strncmp(group.name, filter, strlen(filter)) == 0;
+        }
+        if (selected) {
+            fprintf(stderr, "== %s\n", group.name);
+            group.run();
+        }
+    }
+
+    FILE* file = json_path != NULL ? fopen(json_path, "w") : stdout;
+    if (file == NULL) {
+        fprintf(stderr, "[ERROR] can't open %s for writing.\n", json_path);
+        return 1;
+    }
+    bench_write_json(file);
+    if (file != stdout) {
+        fclose(file);
+    }
+    return 0;
+}
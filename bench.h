@@ -0,0 +1,85 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// benchmark harness
+//
+// Every benchmark reports through bench_print/bench_record. A readable line
+// goes to stderr as it runs. All results are written as one JSON document at
+// the end, to stdout or to --json FILE. Configure with
+// -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+
+uint64_t bench_rand();
+void bench_seed(uint64_t seed);
+double bench_now_ns();
+
+// cycle counter (rdtsc on x86, steady_clock ns elsewhere)
+uint64_t bench_ticks();
+double bench_ticks_per_ns();
+
+// results written here can't be optimized away
+extern volatile uint64_t bench_sink;
+
+// per-op latency samples in ticks
+struct BenchLatency
+{
+    uint32_t* samples;
+    size_t count;
+    size_t capacity;
+};
+
+void bench_latency_init(BenchLatency* latency, size_t capacity);
+void bench_latency_destroy(BenchLatency* latency);
+// tick delta of one op; samples past capacity are dropped
+inline void bench_latency_add(BenchLatency* latency, uint64_t ticks)
+{
+    if (latency->count < latency->capacity) {
+        latency->samples[latency->count++] = ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks;
+    }
+}
+void bench_latency_merge(BenchLatency* into, const BenchLatency* from);
+
+#define BENCH_MAX_METRICS 8
+
+struct BenchMetric
+{
+    const char* key;
+    double value;
+};
+
+struct BenchResult
+{
+    char name[96];
+    size_t ops;
+    double elapsed_ns;
+    size_t failures;
+    // latency in ns, filled when a BenchLatency was passed
+    bool has_latency;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    double max;
+    BenchMetric metrics[BENCH_MAX_METRICS];
+    size_t metric_count;
+};
+
+// throughput only
+void bench_print(const char* name, size_t ops, double elapsed_ns);
+// latency may be NULL, returns the result so metrics can be attached
+BenchResult* bench_record(const char* name, size_t ops, double elapsed_ns, BenchLatency* latency, size_t failures = 0);
+// key must be a string literal
+void bench_metric(BenchResult* result, const char* key, double value);
+
+// the standard workloads of bench_suite.cc, one group per workload
+void bench_suite_lifo();
+void bench_suite_fifo();
+void bench_suite_random_free();
+void bench_suite_size_mixed();
+void bench_suite_larson();
+void bench_suite_fragmentation();
+
+#endif
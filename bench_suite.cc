@@ -0,0 +1,543 @@
+#include "bench.h"
+#include "allocator.h"
+#include "static_buddy.h"
+#include "buddy_pcp.h"
+#include "region.h"
+#include "thread_heap.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+////////////////////////////////
+// standard workloads
+//
+// Every allocator runs the same seeded op sequence of each workload behind one
+// function-pointer interface, so the call overhead is the same for all. Each
+// alloc and free is timed with bench_ticks for the latency percentiles, the
+// ns/op figure includes that timing.
+
+#define BENCH_SUITE_OPS (1000 * 1000)
+#define BENCH_SUITE_BATCH 1000
+#define BENCH_SUITE_LIVE 4096
+#define BENCH_SUITE_SMALL 64
+#define BENCH_SUITE_HEAP ((size_t)16 * 1024 * 1024)
+#define BENCH_SUITE_SEED 0xB5AD4ECEDA1CE2A9ull
+
+enum BenchAllocatorFlags
+{
+    // free is a no-op, memory comes back with reset after each batch
+    Bench_Flag_No_Free = 1 << 0,
+    // frees must come in reverse order
+    Bench_Flag_Lifo_Only = 1 << 1,
+    // only BENCH_SUITE_SMALL byte blocks
+    Bench_Flag_Fixed_Size = 1 << 2,
+    // alloc and free may be called from any thread
+    Bench_Flag_Thread_Safe = 1 << 3,
+    // a fixed heap of BENCH_SUITE_HEAP bytes, used by the fragmentation stress
+    Bench_Flag_Bounded = 1 << 4,
+};
+
+struct BenchAllocator
+{
+    const char* name;
+    unsigned flags;
+    bool (*init)();
+    void (*destroy)();
+    void* (*alloc)(size_t size);
+    void (*free)(void* ptr, size_t size);
+    // may be NULL
+    void (*reset)();
+};
+
+////////////////////////////////
+// adapters
+
+static Region bench_region;
+
+static bool bench_map_heap()
+{
+    return region_map(&bench_region, BENCH_SUITE_HEAP);
+}
+
+static void bench_unmap_heap()
+{
+    region_unmap(&bench_region);
+}
+
+// glibc
+static bool bench_malloc_init() { return true; }
+static void bench_malloc_destroy() {}
+static void* bench_malloc_alloc(size_t size) { return malloc(size); }
+static void bench_malloc_free(void* ptr, size_t size) { free(ptr); }
+
+// arena
+static ArenaAllocator bench_arena;
+static bool bench_arena_init()
+{
+    if (!bench_map_heap()) {
+        return false;
+    }
+    arena_init(&bench_arena, bench_region.base, bench_region.size);
+    return true;
+}
+static void* bench_arena_alloc(size_t size) { return arena_alloc(&bench_arena, size); }
+static void bench_arena_free(void* ptr, size_t size) { arena_free(&bench_arena, ptr); }
+static void bench_arena_reset() { arena_free_all(&bench_arena); }
+
+// stack
+static StackAllocator bench_stack;
+static bool bench_stack_init()
+{
+    if (!bench_map_heap()) {
+        return false;
+    }
+    stack_init(&bench_stack, bench_region.base, bench_region.size);
+    return true;
+}
+static void* bench_stack_alloc(size_t size) { return stack_alloc(&bench_stack, size); }
+static void bench_stack_free(void* ptr, size_t size) { stack_free(&bench_stack, ptr); }
+static void bench_stack_reset() { stack_free_all(&bench_stack); }
+
+// pool
+static PoolAllocator bench_pool;
+static bool bench_pool_init()
+{
+    if (!bench_map_heap()) {
+        return false;
+    }
+    pool_init(&bench_pool, bench_region.base, bench_region.size, BENCH_SUITE_SMALL);
+    return true;
+}
+static void* bench_pool_alloc(size_t size) { return pool_alloc(&bench_pool); }
+static void bench_pool_free(void* ptr, size_t size) { pool_free(&bench_pool, ptr); }
+
+// free list
+static FreeListAllocator bench_free_list;
+static bool bench_free_list_init()
+{
+    if (!bench_map_heap()) {
+        return false;
+    }
+    free_list_init(&bench_free_list, bench_region.base, bench_region.size, Allocation_Policy_First_Fit);
+    return true;
+}
+static void* bench_free_list_alloc(size_t size) { return free_list_alloc(&bench_free_list, size); }
+static void bench_free_list_free(void* ptr, size_t size) { free_list_free(&bench_free_list, ptr); }
+
+// buddy
+static BuddyAllocator bench_buddy;
+static bool bench_buddy_init()
+{
+    if (!bench_map_heap()) {
+        return false;
+    }
+    memset(&bench_buddy, 0, sizeof(bench_buddy));
+    buddy_init(&bench_buddy, bench_region.base, bench_region.size, 64);
+    return true;
+}
+static void bench_buddy_destroy()
+{
+    buddy_destory(&bench_buddy);
+    bench_unmap_heap();
+}
+static void* bench_buddy_alloc(size_t size) { return buddy_alloc(&bench_buddy, size); }
+static void* bench_buddy_alloc_exact(size_t size) { return buddy_alloc_exact(&bench_buddy, size); }
+static void bench_buddy_free(void* ptr, size_t size) { buddy_free(&bench_buddy, ptr); }
+
+// compile-time buddy
+typedef Buddy<BENCH_SUITE_HEAP, 64> BenchStaticBuddy;
+static BenchStaticBuddy* bench_static_buddy;
+static bool bench_static_buddy_init()
+{
+    if (!bench_map_heap()) {
+        return false;
+    }
+    bench_static_buddy = (BenchStaticBuddy*)malloc(sizeof(BenchStaticBuddy));
+    bench_static_buddy->init(bench_region.base);
+    return true;
+}
+static void bench_static_buddy_destroy()
+{
+    free(bench_static_buddy);
+    bench_unmap_heap();
+}
+static void* bench_static_buddy_alloc(size_t size) { return bench_static_buddy->alloc(size); }
+static void bench_static_buddy_free(void* ptr, size_t size) { bench_static_buddy->free(ptr); }
+
+// buddy behind a lock
+static BuddySharedAllocator* bench_shared_buddy;
+static bool bench_shared_buddy_init()
+{
+    if (!bench_map_heap()) {
+        return false;
+    }
+    bench_shared_buddy = new BuddySharedAllocator();
+    buddy_shared_init(bench_shared_buddy, bench_region.base, bench_region.size, 64);
+    return true;
+}
+static void bench_shared_buddy_destroy()
+{
+    buddy_shared_destory(bench_shared_buddy);
+    delete bench_shared_buddy;
+    bench_unmap_heap();
+}
+static void* bench_shared_buddy_alloc(size_t size) { return buddy_shared_alloc(bench_shared_buddy, size); }
+static void bench_shared_buddy_free(void* ptr, size_t size) { buddy_shared_free(bench_shared_buddy, ptr); }
+
+// thread heaps
+static bool bench_thread_heap_init() { return thread_heap_local() != NULL; }
+static void bench_thread_heap_destroy() { thread_heap_collect(thread_heap_local()); }
+static void* bench_thread_heap_alloc(size_t size) { return thread_heap_alloc(thread_heap_local(), size); }
+static void bench_thread_heap_free(void* ptr, size_t size) { thread_heap_free(thread_heap_local(), ptr); }
+
+static const BenchAllocator bench_allocators[] = {
+    { "malloc", Bench_Flag_Thread_Safe, bench_malloc_init, bench_malloc_destroy, bench_malloc_alloc, bench_malloc_free, NULL },
+    { "arena", Bench_Flag_No_Free, bench_arena_init, bench_unmap_heap, bench_arena_alloc, bench_arena_free, bench_arena_reset },
+    { "stack", Bench_Flag_Lifo_Only, bench_stack_init, bench_unmap_heap, bench_stack_alloc, bench_stack_free, bench_stack_reset },
+    { "pool", Bench_Flag_Fixed_Size, bench_pool_init, bench_unmap_heap, bench_pool_alloc, bench_pool_free, NULL },
+    { "free_list", Bench_Flag_Bounded, bench_free_list_init, bench_unmap_heap, bench_free_list_alloc, bench_free_list_free, NULL },
+    { "buddy", Bench_Flag_Bounded, bench_buddy_init, bench_buddy_destroy, bench_buddy_alloc, bench_buddy_free, NULL },
+    { "buddy_exact", Bench_Flag_Bounded, bench_buddy_init, bench_buddy_destroy, bench_buddy_alloc_exact, bench_buddy_free, NULL },
+    { "static_buddy", Bench_Flag_Bounded, bench_static_buddy_init, bench_static_buddy_destroy, bench_static_buddy_alloc, bench_static_buddy_free, NULL },
+    { "shared_buddy", Bench_Flag_Thread_Safe, bench_shared_buddy_init, bench_shared_buddy_destroy, bench_shared_buddy_alloc, bench_shared_buddy_free, NULL },
+    { "thread_heap", Bench_Flag_Thread_Safe, bench_thread_heap_init, bench_thread_heap_destroy, bench_thread_heap_alloc, bench_thread_heap_free, NULL },
+};
+
+////////////////////////////////
+// helpers
+
+static void* bench_timed_alloc(const BenchAllocator* allocator, size_t size, BenchLatency* latency, size_t* failures)
+{
+    uint64_t start = bench_ticks();
+    void* ptr = allocator->alloc(size);
+    bench_latency_add(latency, bench_ticks() - start);
+    if (ptr == NULL) {
+        (*failures)++;
+    }
+    else {
+        *(volatile unsigned char*)ptr = 1;
+    }
+    return ptr;
+}
+
+static void bench_timed_free(const BenchAllocator* allocator, void* ptr, size_t size, BenchLatency* latency)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    uint64_t start = bench_ticks();
+    allocator->free(ptr, size);
+    bench_latency_add(latency, bench_ticks() - start);
+}
+
+static void bench_suite_report(const char* workload, const BenchAllocator* allocator, size_t ops, double elapsed_ns,
+    BenchLatency* latency, size_t failures)
+{
+    char name[96];
+    snprintf(name, sizeof(name), "suite/%s/%s", workload, allocator->name);
+    bench_record(name, ops, elapsed_ns, latency, failures);
+}
+
+// 16 B .. 8 KiB, skewed towards small sizes
+static size_t bench_mixed_size()
+{
+    size_t shift = bench_rand() % 10;
+    return 16 + bench_rand() % ((size_t)16 << shift);
+}
+
+typedef void (*BenchWorkload)(const BenchAllocator* allocator, const char* workload);
+
+static void bench_suite_run(const char* workload, unsigned exclude, BenchWorkload run)
+{
+    for (const BenchAllocator& allocator : bench_allocators) {
+        if (allocator.flags & exclude) {
+            continue;
+        }
+        if (!allocator.init()) {
+            fprintf(stderr, "[ERROR] %s: can't set up %s.\n", workload, allocator.name);
+            continue;
+        }
+        bench_seed(BENCH_SUITE_SEED);
+        run(&allocator, workload);
+        allocator.destroy();
+    }
+}
+
+////////////////////////////////
+// LIFO and FIFO: batches of small blocks freed in reverse or allocation order
+
+static void bench_batch_workload(const BenchAllocator* allocator, const char* workload, bool lifo)
+{
+    void* blocks[BENCH_SUITE_BATCH];
+    BenchLatency latency;
+    bench_latency_init(&latency, BENCH_SUITE_OPS);
+    size_t failures = 0;
+    size_t ops = 0;
+
+    double start = bench_now_ns();
+    while (ops < BENCH_SUITE_OPS) {
+        for (size_t i = 0; i < BENCH_SUITE_BATCH; i++) {
+            blocks[i] = bench_timed_alloc(allocator, BENCH_SUITE_SMALL, &latency, &failures);
+        }
+        for (size_t i = 0; i < BENCH_SUITE_BATCH; i++) {
+            size_t index = lifo ? BENCH_SUITE_BATCH - 1 - i : i;
+            bench_timed_free(allocator, blocks[index], BENCH_SUITE_SMALL, &latency);
+        }
+        if (allocator->reset != NULL) {
+            allocator->reset();
+        }
+        ops += 2 * BENCH_SUITE_BATCH;
+    }
+    double elapsed = bench_now_ns() - start;
+
+    bench_suite_report(workload, allocator, ops, elapsed, &latency, failures);
+    bench_latency_destroy(&latency);
+}
+
+static void bench_lifo(const BenchAllocator* allocator, const char* workload)
+{
+    bench_batch_workload(allocator, workload, true);
+}
+
+static void bench_fifo(const BenchAllocator* allocator, const char* workload)
+{
+    bench_batch_workload(allocator, workload, false);
+}
+
+void bench_suite_lifo()
+{
+    bench_suite_run("lifo", 0, bench_lifo);
+}
+
+void bench_suite_fifo()
+{
+    bench_suite_run("fifo", Bench_Flag_Lifo_Only, bench_fifo);
+}
+
+////////////////////////////////
+// random-free and size-mixed: a live set where each op frees or fills a random slot
+
+static void bench_slot_workload(const BenchAllocator* allocator, const char* workload, bool mixed)
+{
+    void** live = (void**)calloc(BENCH_SUITE_LIVE, sizeof(void*));
+    size_t* live_size = (size_t*)calloc(BENCH_SUITE_LIVE, sizeof(size_t));
+    BenchLatency latency;
+    bench_latency_init(&latency, BENCH_SUITE_OPS);
+    size_t failures = 0;
+
+    double start = bench_now_ns();
+    for (size_t i = 0; i < BENCH_SUITE_OPS; i++) {
+        size_t slot = bench_rand() % BENCH_SUITE_LIVE;
+        if (live[slot] != NULL) {
+            bench_timed_free(allocator, live[slot], live_size[slot], &latency);
+            live[slot] = NULL;
+        }
+        else {
+            live_size[slot] = mixed ? bench_mixed_size() : BENCH_SUITE_SMALL;
+            live[slot] = bench_timed_alloc(allocator, live_size[slot], &latency, &failures);
+        }
+    }
+    double elapsed = bench_now_ns() - start;
+
+    for (size_t slot = 0; slot < BENCH_SUITE_LIVE; slot++) {
+        if (live[slot] != NULL) {
+            allocator->free(live[slot], live_size[slot]);
+        }
+    }
+    bench_suite_report(workload, allocator, BENCH_SUITE_OPS, elapsed, &latency, failures);
+    bench_latency_destroy(&latency);
+    free(live_size);
+    free(live);
+}
+
+static void bench_random_free(const BenchAllocator* allocator, const char* workload)
+{
+    bench_slot_workload(allocator, workload, false);
+}
+
+static void bench_size_mixed(const BenchAllocator* allocator, const char* workload)
+{
+    bench_slot_workload(allocator, workload, true);
+}
+
+void bench_suite_random_free()
+{
+    bench_suite_run("random-free", Bench_Flag_No_Free | Bench_Flag_Lifo_Only, bench_random_free);
+}
+
+void bench_suite_size_mixed()
+{
+    bench_suite_run("size-mixed", Bench_Flag_No_Free | Bench_Flag_Lifo_Only | Bench_Flag_Fixed_Size, bench_size_mixed);
+}
+
+////////////////////////////////
+// larson: threads replace random blocks in their slot arrays, and between
+// rounds every array moves on to the next thread, so most frees are remote
+
+#define BENCH_LARSON_THREADS 4
+#define BENCH_LARSON_ROUNDS 10
+#define BENCH_LARSON_SLOTS 1024
+
+struct BenchLarsonSlots
+{
+    void* blocks[BENCH_LARSON_SLOTS];
+    size_t sizes[BENCH_LARSON_SLOTS];
+};
+
+static void bench_larson_thread(const BenchAllocator* allocator, BenchLarsonSlots* slots, size_t ops,
+    uint64_t seed, BenchLatency* latency, size_t* failures)
+{
+    uint64_t state = seed;
+    for (size_t i = 0; i < ops; i += 2) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        size_t slot = (state >> 33) % BENCH_LARSON_SLOTS;
+        bench_timed_free(allocator, slots->blocks[slot], slots->sizes[slot], latency);
+        slots->sizes[slot] = 16 + (state >> 45) % 497;
+        slots->blocks[slot] = bench_timed_alloc(allocator, slots->sizes[slot], latency, failures);
+    }
+}
+
+static void bench_larson(const BenchAllocator* allocator, const char* workload)
+{
+    BenchLarsonSlots* slots = (BenchLarsonSlots*)calloc(BENCH_LARSON_THREADS, sizeof(BenchLarsonSlots));
+    BenchLatency latency[BENCH_LARSON_THREADS];
+    size_t failures[BENCH_LARSON_THREADS] = { 0 };
+    const size_t ops_per_thread = BENCH_SUITE_OPS / BENCH_LARSON_THREADS / BENCH_LARSON_ROUNDS;
+    for (size_t t = 0; t < BENCH_LARSON_THREADS; t++) {
+        bench_latency_init(&latency[t], ops_per_thread * BENCH_LARSON_ROUNDS);
+    }
+
+    double start = bench_now_ns();
+    for (size_t round = 0; round < BENCH_LARSON_ROUNDS; round++) {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < BENCH_LARSON_THREADS; t++) {
+            BenchLarsonSlots* thread_slots = &slots[(t + round) % BENCH_LARSON_THREADS];
+            threads.emplace_back(bench_larson_thread, allocator, thread_slots, ops_per_thread,
+                BENCH_SUITE_SEED + round * BENCH_LARSON_THREADS + t, &latency[t], &failures[t]);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+    double elapsed = bench_now_ns() - start;
+
+    size_t total_failures = 0;
+    for (size_t t = 1; t < BENCH_LARSON_THREADS; t++) {
+        bench_latency_merge(&latency[0], &latency[t]);
+        total_failures += failures[t];
+    }
+    total_failures += failures[0];
+    for (size_t t = 0; t < BENCH_LARSON_THREADS; t++) {
+        for (size_t slot = 0; slot < BENCH_LARSON_SLOTS; slot++) {
+            if (slots[t].blocks[slot] != NULL) {
+                allocator->free(slots[t].blocks[slot], slots[t].sizes[slot]);
+            }
+        }
+    }
+
+    bench_suite_report(workload, allocator, ops_per_thread * BENCH_LARSON_THREADS * BENCH_LARSON_ROUNDS,
+        elapsed, &latency[0], total_failures);
+    for (size_t t = 0; t < BENCH_LARSON_THREADS; t++) {
+        bench_latency_destroy(&latency[t]);
+    }
+    free(slots);
+}
+
+void bench_suite_larson()
+{
+    for (const BenchAllocator& allocator : bench_allocators) {
+        if (!(allocator.flags & Bench_Flag_Thread_Safe)) {
+            continue;
+        }
+        if (!allocator.init()) {
+            continue;
+        }
+        bench_larson(&allocator, "larson");
+        allocator.destroy();
+    }
+}
+
+////////////////////////////////
+// fragmentation stress on the fixed-size heaps
+//
+// Fill with mixed sizes until the first failure, free a random half, then
+// count how much of the freed space comes back as 16 KiB blocks.
+
+#define BENCH_FRAG_LARGE (16 * 1024)
+#define BENCH_FRAG_MAX_BLOCKS (BENCH_SUITE_HEAP / 16)
+
+static void bench_fragmentation(const BenchAllocator* allocator, const char* workload)
+{
+    void** blocks = (void**)malloc(BENCH_FRAG_MAX_BLOCKS * sizeof(void*));
+    size_t* sizes = (size_t*)malloc(BENCH_FRAG_MAX_BLOCKS * sizeof(size_t));
+    BenchLatency latency;
+    bench_latency_init(&latency, 2 * BENCH_FRAG_MAX_BLOCKS);
+    size_t failures = 0;
+    size_t ops = 0;
+
+    double start = bench_now_ns();
+    size_t count = 0;
+    size_t filled = 0;
+    while (count < BENCH_FRAG_MAX_BLOCKS) {
+        size_t size = bench_mixed_size();
+        void* ptr = allocator->alloc(size);
+        ops++;
+        if (ptr == NULL) {
+            break;
+        }
+        blocks[count] = ptr;
+        sizes[count] = size;
+        filled += size;
+        count++;
+    }
+
+    size_t released = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (bench_rand() & 1) {
+            bench_timed_free(allocator, blocks[i], sizes[i], &latency);
+            released += sizes[i];
+            ops++;
+        }
+    }
+
+    size_t recovered = 0;
+    for (;;) {
+        void* ptr = bench_timed_alloc(allocator, BENCH_FRAG_LARGE, &latency, &failures);
+        ops++;
+        if (ptr == NULL) {
+            break;
+        }
+        recovered += BENCH_FRAG_LARGE;
+    }
+    double elapsed = bench_now_ns() - start;
+
+    char name[96];
+    snprintf(name, sizeof(name), "suite/%s/%s", workload, allocator->name);
+    // the single failure that ends the last phase is expected
+    BenchResult* result = bench_record(name, ops, elapsed, &latency, failures - 1);
+    bench_metric(result, "fill_utilization_pct", 100.0 * (double)filled / (double)BENCH_SUITE_HEAP);
+    bench_metric(result, "released_kib", (double)released / 1024);
+    bench_metric(result, "recovered_pct", released != 0 ? 100.0 * (double)recovered / (double)released : 0.0);
+
+    bench_latency_destroy(&latency);
+    free(sizes);
+    free(blocks);
+}
+
+void bench_suite_fragmentation()
+{
+    for (const BenchAllocator& allocator : bench_allocators) {
+        if (!(allocator.flags & Bench_Flag_Bounded)) {
+            continue;
+        }
+        if (!allocator.init()) {
+            continue;
+        }
+        bench_seed(BENCH_SUITE_SEED);
+        bench_fragmentation(&allocator, "fragmentation");
+        allocator.destroy();
+    }
+}
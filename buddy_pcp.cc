@@ -0,0 +1,144 @@
+#include "buddy_pcp.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+void buddy_shared_init(BuddySharedAllocator* shared, void* buffer, size_t size, size_t align)
+{
+    buddy_init(&shared->buddy, buffer, size, align);
+}
+
+void* buddy_shared_alloc(BuddySharedAllocator* shared, size_t size)
+{
+    std::lock_guard<std::mutex> guard(shared->lock);
+    return buddy_alloc(&shared->buddy, size);
+}
+
+void buddy_shared_free(BuddySharedAllocator* shared, void* ptr)
+{
+    std::lock_guard<std::mutex> guard(shared->lock);
+    buddy_free(&shared->buddy, ptr);
+}
+
+void buddy_shared_destory(BuddySharedAllocator* shared)
+{
+    buddy_destory(&shared->buddy);
+}
+
+void buddy_pcp_init(BuddyPageCache* pcp, BuddySharedAllocator* shared, size_t low, size_t high)
+{
+    assert(low > 0);
+    assert(low < high);
+    assert(high <= BUDDY_PCP_MAX_HIGH);
+    assert(shared->buddy.alignment >= sizeof(PoolListNode));
+
+    pcp->shared = shared;
+    pcp->low = low;
+    pcp->high = high;
+    for (int i = 0; i < BUDDY_PCP_ORDERS; i++) {
+        pcp->lists[i].head = NULL;
+        pcp->lists[i].count = 0;
+    }
+}
+
+// cache order of a request, BUDDY_PCP_ORDERS if it isn't cached
+static size_t buddy_pcp_order(BuddyPageCache* pcp, size_t size)
+{
+    const size_t alignment = pcp->shared->buddy.alignment;
+    size_t order = 0;
+    size_t block_size = alignment;
+    while (block_size < size && order < BUDDY_PCP_ORDERS) {
+        block_size <<= 1;
+        order++;
+    }
+    return order;
+}
+
+static void buddy_pcp_push(BuddyPageCacheList* list, void* ptr)
+{
+    PoolListNode* node = (PoolListNode*)ptr;
+    node->next = list->head;
+    list->head = node;
+    list->count++;
+}
+
+static void* buddy_pcp_pop(BuddyPageCacheList* list)
+{
+    PoolListNode* node = list->head;
+    list->head = node->next;
+    list->count--;
+    return node;
+}
+
+static void buddy_pcp_drain_list(BuddyPageCache* pcp, BuddyPageCacheList* list, size_t keep)
+{
+    if (list->count <= keep) {
+        return;
+    }
+
+    void* blocks[BUDDY_PCP_MAX_HIGH + 1];
+    size_t count = 0;
+    while (list->count > keep) {
+        blocks[count++] = buddy_pcp_pop(list);
+    }
+
+    std::lock_guard<std::mutex> guard(pcp->shared->lock);
+    buddy_free_batch(&pcp->shared->buddy, blocks, count);
+}
+
+void* buddy_pcp_alloc(BuddyPageCache* pcp, size_t size)
+{
+    size_t order = buddy_pcp_order(pcp, size);
+    if (order >= BUDDY_PCP_ORDERS) {
+        return buddy_shared_alloc(pcp->shared, size);
+    }
+
+    const size_t block_size = pcp->shared->buddy.alignment << order;
+    BuddyPageCacheList* list = &pcp->lists[order];
+    if (list->count == 0) {
+        void* blocks[BUDDY_PCP_MAX_HIGH];
+        size_t count = 0;
+        {
+            std::lock_guard<std::mutex> guard(pcp->shared->lock);
+            count = buddy_alloc_batch(&pcp->shared->buddy, block_size, blocks, pcp->low);
+        }
+        if (count == 0) {
+            fprintf(stderr, "[ERROR] buddy_pcp_alloc failed. Shared allocator doesn't have suitable buddy for size=%zu.\n", size);
+            return NULL;
+        }
+        // push in reverse so blocks come out in address order
+        for (size_t i = count; i > 0; i--) {
+            buddy_pcp_push(list, blocks[i - 1]);
+        }
+    }
+
+    void* ptr = buddy_pcp_pop(list);
+    return memset(ptr, 0, block_size);
+}
+
+void buddy_pcp_free(BuddyPageCache* pcp, void* ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    size_t order = buddy_pcp_order(pcp, size);
+    if (order >= BUDDY_PCP_ORDERS) {
+        buddy_shared_free(pcp->shared, ptr);
+        return;
+    }
+
+    BuddyPageCacheList* list = &pcp->lists[order];
+    buddy_pcp_push(list, ptr);
+    if (list->count > pcp->high) {
+        buddy_pcp_drain_list(pcp, list, pcp->low);
+    }
+}
+
+void buddy_pcp_drain(BuddyPageCache* pcp)
+{
+    for (int i = 0; i < BUDDY_PCP_ORDERS; i++) {
+        buddy_pcp_drain_list(pcp, &pcp->lists[i], 0);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef BUDDY_PCP_H
+#define BUDDY_PCP_H
+
+#include "allocator.h"
+
+#include <mutex>
+
+////////////////////////////////
+// shared buddy allocator with per-thread page caches
+//
+// Modeled after the Linux per-cpu pagesets. Each thread keeps a list of free
+// blocks for the lowest BUDDY_PCP_ORDERS orders (order 0 is one `alignment`
+// leaf). Blocks in a cache stay allocated in the shared tree; they only move
+// between the cache and the tree in batches, under one lock per batch.
+
+#define BUDDY_PCP_ORDERS 4
+#define BUDDY_PCP_MAX_HIGH 256
+
+struct BuddySharedAllocator
+{
+    BuddyAllocator buddy;
+    std::mutex lock;
+};
+
+void buddy_shared_init(BuddySharedAllocator* shared, void* buffer, size_t size, size_t align = DEFAULT_ALIGNMENT);
+void* buddy_shared_alloc(BuddySharedAllocator* shared, size_t size);
+void buddy_shared_free(BuddySharedAllocator* shared, void* ptr);
+void buddy_shared_destory(BuddySharedAllocator* shared);
+
+struct BuddyPageCacheList
+{
+    PoolListNode* head;
+    size_t count;
+};
+
+// One per thread, not thread-safe itself.
+struct BuddyPageCache
+{
+    BuddySharedAllocator* shared;
+    // an empty list is refilled up to `low` blocks, a list that grows past
+    // `high` is drained back down to `low`
+    size_t low;
+    size_t high;
+    BuddyPageCacheList lists[BUDDY_PCP_ORDERS];
+};
+
+void buddy_pcp_init(BuddyPageCache* pcp, BuddySharedAllocator* shared, size_t low, size_t high);
+void* buddy_pcp_alloc(BuddyPageCache* pcp, size_t size);
+// size must be the size the block was allocated with
+void buddy_pcp_free(BuddyPageCache* pcp, void* ptr, size_t size);
+// return every cached block to the shared tree, e.g. on thread exit
+void buddy_pcp_drain(BuddyPageCache* pcp);
+
+#endif
@@ -0,0 +1,339 @@
+#ifndef COMPOSABLE_H
+#define COMPOSABLE_H
+
+#include "allocator.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+
+////////////////////////////////
+// composable allocators
+//
+// Policy templates that layer the allocators above into one. Every block has
+//
+//     void* allocate(size_t size, size_t align);   // NULL on failure, zeroed
+//     void deallocate(void* ptr, size_t size);     // size as passed to allocate
+//     bool owns(void* ptr);
+//
+// and the composites route on size and owns(), so the whole layering is known
+// at compile time and inlines into one decision tree. For example "stack for
+// <= 256 B, otherwise 1 KiB pool chunks, otherwise buddy, malloc when full":
+//
+//     Segregator<256, Fallback<StackBlock, MallocBlock>,
+//         Segregator<1024, Fallback<PoolBlock, MallocBlock>, Fallback<BuddyBlock, MallocBlock>>>
+//
+// The adapters only point at an allocator, set the pointer after init.
+
+////////////////////////////////
+// adapters
+
+struct MallocBlock
+{
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        if (align < sizeof(void*)) {
+            align = sizeof(void*);
+        }
+        void* ptr = NULL;
+        if (posix_memalign(&ptr, align, size != 0 ? size : 1) != 0) {
+            return NULL;
+        }
+        return memset(ptr, 0, size);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        ::free(ptr);
+    }
+
+    // last resort, anything that reached it is its own
+    bool owns(void* ptr)
+    {
+        return true;
+    }
+};
+
+struct ArenaBlock
+{
+    ArenaAllocator* arena;
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        // a full arena falls back without an error message
+        return try_arena_alloc(arena, size, align);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        arena_free(arena, ptr);
+    }
+
+    bool owns(void* ptr)
+    {
+        return (unsigned char*)ptr >= arena->buffer && (unsigned char*)ptr < arena->buffer + arena->buffer_size;
+    }
+};
+
+// frees must come in FILO order
+struct StackBlock
+{
+    StackAllocator* stack;
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        if (align > stack_max_align()) {
+            return NULL;
+        }
+        return try_stack_alloc(stack, size, align);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        stack_free(stack, ptr);
+    }
+
+    bool owns(void* ptr)
+    {
+        return (unsigned char*)ptr >= stack->buffer && (unsigned char*)ptr < stack->buffer + stack->buffer_size;
+    }
+};
+
+// only requests that fit one chunk at the chunks' alignment
+struct PoolBlock
+{
+    PoolAllocator* pool;
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        if (size > pool->chunk_size || pool->chunk_size % align != 0 || (uintptr_t)pool->buffer % align != 0) {
+            return NULL;
+        }
+        return try_pool_alloc(pool);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        pool_free(pool, ptr);
+    }
+
+    bool owns(void* ptr)
+    {
+        return (unsigned char*)ptr >= pool->buffer && (unsigned char*)ptr < pool->buffer + pool->buffer_size;
+    }
+};
+
+struct FreeListBlock
+{
+    FreeListAllocator* free_list;
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        return try_free_list_alloc(free_list, size, align);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        free_list_free(free_list, ptr);
+    }
+
+    bool owns(void* ptr)
+    {
+        return (unsigned char*)ptr >= free_list->buffer && (unsigned char*)ptr < free_list->buffer + free_list->buffer_size;
+    }
+};
+
+// blocks are aligned to their size, up to the alignment of the buffer
+struct BuddyBlock
+{
+    BuddyAllocator* buddy;
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        if ((uintptr_t)buddy->buffer % align != 0 || size > buddy->usable_size) {
+            return NULL;
+        }
+        return try_buddy_alloc(buddy, size > align ? size : align);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        buddy_free(buddy, ptr);
+    }
+
+    bool owns(void* ptr)
+    {
+        return (unsigned char*)ptr >= buddy->buffer && (unsigned char*)ptr < buddy->buffer + buddy->usable_size;
+    }
+};
+
+////////////////////////////////
+// composites
+
+// Secondary serves whatever Primary can't, frees go back by Primary::owns
+template <class Primary, class Secondary>
+struct Fallback
+{
+    Primary primary;
+    Secondary secondary;
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        void* ptr = primary.allocate(size, align);
+        return ptr != NULL ? ptr : secondary.allocate(size, align);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        if (primary.owns(ptr)) {
+            primary.deallocate(ptr, size);
+        }
+        else {
+            secondary.deallocate(ptr, size);
+        }
+    }
+
+    bool owns(void* ptr)
+    {
+        return primary.owns(ptr) || secondary.owns(ptr);
+    }
+};
+
+// size <= Threshold goes to Small, everything else to Large
+template <size_t Threshold, class Small, class Large>
+struct Segregator
+{
+    Small small;
+    Large large;
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        return size <= Threshold ? small.allocate(size, align) : large.allocate(size, align);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        if (size <= Threshold) {
+            small.deallocate(ptr, size);
+        }
+        else {
+            large.deallocate(ptr, size);
+        }
+    }
+
+    bool owns(void* ptr)
+    {
+        return small.owns(ptr) || large.owns(ptr);
+    }
+};
+
+// One Alloc per Step-sized bucket, bucket i serves sizes in
+// (Min + i * Step, Min + (i + 1) * Step]. Sizes outside (Min, Max] fail.
+template <class Alloc, size_t Min, size_t Max, size_t Step>
+struct Bucketizer
+{
+    static_assert(Step > 0 && Max > Min && (Max - Min) % Step == 0, "(Max - Min) must be a multiple of Step");
+    static constexpr size_t Count = (Max - Min) / Step;
+
+    Alloc buckets[Count];
+
+    static constexpr size_t bucket_for(size_t size)
+    {
+        return (size - Min - 1) / Step;
+    }
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        if (size <= Min || size > Max) {
+            return NULL;
+        }
+        return buckets[bucket_for(size)].allocate(size, align);
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        assert(size > Min && size <= Max);
+        buckets[bucket_for(size)].deallocate(ptr, size);
+    }
+
+    bool owns(void* ptr)
+    {
+        for (size_t i = 0; i < Count; i++) {
+            if (buckets[i].owns(ptr)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct AffixNone
+{
+};
+
+// Puts a Prefix in front of and a Suffix behind every block, e.g. a size
+// header or a guard word. Prefix and Suffix are value-initialized on allocate.
+// Blocks are aligned to alignof(max_align_t), larger alignments fail.
+template <class Alloc, class Prefix, class Suffix = AffixNone>
+struct AffixAllocator
+{
+    static constexpr size_t PrefixSize = (sizeof(Prefix) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+    static constexpr bool HasSuffix = !std::is_same<Suffix, AffixNone>::value;
+
+    Alloc parent;
+
+    static size_t suffix_offset(size_t size)
+    {
+        return (size + alignof(Suffix) - 1) / alignof(Suffix) * alignof(Suffix);
+    }
+
+    static size_t total_size(size_t size)
+    {
+        return PrefixSize + (HasSuffix ? suffix_offset(size) + sizeof(Suffix) : size);
+    }
+
+    static Prefix* prefix(void* ptr)
+    {
+        return (Prefix*)((unsigned char*)ptr - sizeof(Prefix));
+    }
+
+    static Suffix* suffix(void* ptr, size_t size)
+    {
+        return (Suffix*)((unsigned char*)ptr + suffix_offset(size));
+    }
+
+    void* allocate(size_t size, size_t align = DEFAULT_ALIGNMENT)
+    {
+        if (align > alignof(max_align_t)) {
+            return NULL;
+        }
+        unsigned char* raw = (unsigned char*)parent.allocate(total_size(size), alignof(max_align_t));
+        if (raw == NULL) {
+            return NULL;
+        }
+        unsigned char* ptr = raw + PrefixSize;
+        new (prefix(ptr)) Prefix();
+        if (HasSuffix) {
+            new (suffix(ptr, size)) Suffix();
+        }
+        return ptr;
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        prefix(ptr)->~Prefix();
+        if (HasSuffix) {
+            suffix(ptr, size)->~Suffix();
+        }
+        parent.deallocate((unsigned char*)ptr - PrefixSize, total_size(size));
+    }
+
+    bool owns(void* ptr)
+    {
+        return parent.owns((unsigned char*)ptr - PrefixSize);
+    }
+};
+
+#endif
@@ -0,0 +1,314 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <exception>
+#include <new>
+#include <utility>
+
+////////////////////////////////
+// coroutine frames from a stack or arena
+//
+// C++20 only, the header is empty for older standards. A request sets up a
+// CoroFrameAllocator over a StackAllocator or an ArenaAllocator and passes it
+// by reference as the first parameter of every coroutine in its await chain
+// (the second one for member coroutines, after the object). The promise's
+// operator new picks it up from there:
+//
+//     CoroTask<int> handle(CoroFrameAllocator& frames, Request* request)
+//     {
+//         int row = co_await lookup(frames, request->key);
+//         co_return row + 1;
+//     }
+//
+//     CoroFrameAllocator frames;
+//     coro_frames_begin_stack(&frames, &request_stack);
+//     int result = coro_run(handle(frames, &request));
+//     coro_frames_end(&frames);
+//
+// coro_frames_end releases every frame of the request in one rewind. Frames
+// destroyed on top of the stack are popped right away, so loops that await
+// one child after another don't grow it. Frames are not zeroed, the compiler
+// initializes them. A coroutine without the argument, or one whose frame
+// doesn't fit, takes its frame from global operator new.
+//
+// CoroTask is a lazy task that resumes its awaiter by symmetric transfer, so
+// deep chains don't grow the thread's stack. Other task types get the same
+// frame placement by deriving their promise from CoroFramePromise.
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#define MEMORY_ALLOCATOR_COROUTINES 1
+#else
+#define MEMORY_ALLOCATOR_COROUTINES 0
+#endif
+
+#if MEMORY_ALLOCATOR_COROUTINES
+
+#include <coroutine>
+
+struct CoroFrameAllocator
+{
+    // one of the two is set
+    StackAllocator* stack;
+    ArenaAllocator* arena;
+    TempStackAllocator stack_start;
+    TempArenaAllocator arena_start;
+    // frames placed since the begin, global fallbacks not included
+    size_t frames;
+};
+
+inline void coro_frames_begin_stack(CoroFrameAllocator* frames, StackAllocator* stack)
+{
+    frames->stack = stack;
+    frames->arena = NULL;
+    frames->stack_start = temp_stack_start(stack);
+    frames->frames = 0;
+}
+
+inline void coro_frames_begin_arena(CoroFrameAllocator* frames, ArenaAllocator* arena)
+{
+    frames->stack = NULL;
+    frames->arena = arena;
+    frames->arena_start = temp_arena_start(arena);
+    frames->frames = 0;
+}
+
+// every coroutine of the request must have been destroyed
+inline void coro_frames_end(CoroFrameAllocator* frames)
+{
+    if (frames->stack != NULL) {
+        temp_stack_end(&frames->stack_start);
+    } else if (frames->arena != NULL) {
+        temp_arena_end(&frames->arena_start);
+    }
+    frames->frames = 0;
+}
+
+// in front of every frame, says where it came from
+struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) CoroFrameHeader
+{
+    // NULL for global operator new
+    CoroFrameAllocator* frames;
+};
+
+struct CoroFramePromise
+{
+    static void* coro_frame_alloc(size_t size, CoroFrameAllocator* frames)
+    {
+        size_t block_size = sizeof(CoroFrameHeader) + size;
+        void* block = NULL;
+        if (frames != NULL && frames->stack != NULL) {
+            // large objects would outlive the rewind
+            StackAllocator* stack = frames->stack;
+            if (stack->large_threshold == 0 || block_size < stack->large_threshold) {
+                // the compiler initializes the frame, no need to zero it
+                block = stack_push_fast(stack, block_size, alignof(CoroFrameHeader));
+                if (block == NULL) {
+                    block = try_stack_alloc(stack, block_size, alignof(CoroFrameHeader));
+                }
+            }
+        } else if (frames != NULL && frames->arena != NULL) {
+            block = arena_bump_fast(frames->arena, block_size, alignof(CoroFrameHeader));
+            if (block == NULL) {
+                block = try_arena_alloc(frames->arena, block_size, alignof(CoroFrameHeader));
+            }
+        }
+        if (block != NULL) {
+            frames->frames++;
+        } else {
+            block = ::operator new(block_size);
+            frames = NULL;
+        }
+        CoroFrameHeader* header = (CoroFrameHeader*)block;
+        header->frames = frames;
+        return header + 1;
+    }
+
+    template <class... Args>
+    static void* operator new(size_t size, CoroFrameAllocator& frames, Args&...)
+    {
+        return coro_frame_alloc(size, &frames);
+    }
+
+    // member coroutines, the object comes first
+    template <class Self, class... Args>
+    static void* operator new(size_t size, Self&, CoroFrameAllocator& frames, Args&...)
+    {
+        return coro_frame_alloc(size, &frames);
+    }
+
+    static void* operator new(size_t size)
+    {
+        return coro_frame_alloc(size, NULL);
+    }
+
+    static void operator delete(void* ptr, size_t size)
+    {
+        CoroFrameHeader* header = (CoroFrameHeader*)ptr - 1;
+        CoroFrameAllocator* frames = header->frames;
+        if (frames == NULL) {
+            ::operator delete(header);
+            return;
+        }
+        if (frames->stack != NULL) {
+            // pop it if nothing was placed above it, the rewind takes the rest
+            StackAllocator* stack = frames->stack;
+            if ((unsigned char*)ptr + size == stack->buffer + stack->offset) {
+                stack_free(stack, header);
+            }
+        } else {
+            // nothing for blocks in the arena, large objects go back
+            arena_free(frames->arena, header);
+        }
+    }
+};
+
+template <class T>
+class CoroTask;
+
+template <class Promise>
+struct CoroTaskFinalAwaiter
+{
+    bool await_ready() noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+    {
+        std::coroutine_handle<> continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+};
+
+template <class Derived>
+struct CoroTaskPromiseBase : CoroFramePromise
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    CoroTaskFinalAwaiter<Derived> final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    void rethrow()
+    {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+template <class T>
+struct CoroTaskPromise : CoroTaskPromiseBase<CoroTaskPromise<T>>
+{
+    // a plain union so T needn't be default constructible
+    union { T value; };
+    bool has_value = false;
+
+    CoroTaskPromise() {}
+    ~CoroTaskPromise()
+    {
+        if (has_value) {
+            value.~T();
+        }
+    }
+
+    CoroTask<T> get_return_object();
+
+    template <class U>
+    void return_value(U&& result)
+    {
+        new (&value) T(std::forward<U>(result));
+        has_value = true;
+    }
+
+    T take()
+    {
+        this->rethrow();
+        return std::move(value);
+    }
+};
+
+template <>
+struct CoroTaskPromise<void> : CoroTaskPromiseBase<CoroTaskPromise<void>>
+{
+    CoroTask<void> get_return_object();
+    void return_void() {}
+    void take() { rethrow(); }
+};
+
+template <class T = void>
+class CoroTask
+{
+public:
+    typedef CoroTaskPromise<T> promise_type;
+
+    CoroTask() : handle(nullptr) {}
+    explicit CoroTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    CoroTask(CoroTask&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    CoroTask& operator=(CoroTask&& other) noexcept
+    {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = other.handle;
+            other.handle = nullptr;
+        }
+        return *this;
+    }
+    CoroTask(const CoroTask&) = delete;
+    CoroTask& operator=(const CoroTask&) = delete;
+    ~CoroTask()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool done() const { return !handle || handle.done(); }
+    // starts or continues a task nobody awaits, e.g. from an event loop
+    void resume() { handle.resume(); }
+    // once done
+    T result() { return handle.promise().take(); }
+
+    bool await_ready() const noexcept { return done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    T await_resume() { return handle.promise().take(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <class T>
+inline CoroTask<T> CoroTaskPromise<T>::get_return_object()
+{
+    return CoroTask<T>(std::coroutine_handle<CoroTaskPromise<T>>::from_promise(*this));
+}
+
+inline CoroTask<void> CoroTaskPromise<void>::get_return_object()
+{
+    return CoroTask<void>(std::coroutine_handle<CoroTaskPromise<void>>::from_promise(*this));
+}
+
+// Runs a task whose chain never waits on anything outside it and destroys
+// it, so its frames are gone before coro_frames_end.
+template <class T>
+inline T coro_run(CoroTask<T>&& task)
+{
+    CoroTask<T> owned(std::move(task));
+    owned.resume();
+    return owned.result();
+}
+
+#endif
+
+#endif
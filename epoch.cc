@@ -0,0 +1,214 @@
+#include "epoch.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <thread>
+
+void epoch_pool_init(EpochPool* domain, void* buffer, size_t buffer_size, size_t chunk_size, size_t align)
+{
+    pool_init(&domain->pool, buffer, buffer_size, chunk_size, align);
+    domain->epoch.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        domain->threads[i].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+bool epoch_thread_register(EpochThread* thread, EpochPool* domain, size_t low, size_t high)
+{
+    assert(low > 0);
+    assert(low < high);
+    assert(high <= EPOCH_CACHE_MAX_HIGH);
+
+    thread->local_epoch.store(0, std::memory_order_relaxed);
+    thread->domain = domain;
+    thread->since_advance = 0;
+    thread->low = low;
+    thread->high = high;
+    thread->cache = NULL;
+    thread->cache_count = 0;
+    for (int i = 0; i < 3; i++) {
+        thread->limbo[i].epoch = 0;
+        thread->limbo[i].count = 0;
+    }
+
+    std::lock_guard<std::mutex> guard(domain->lock);
+    for (size_t i = 0; i < EPOCH_MAX_THREADS; i++) {
+        if (domain->threads[i].load(std::memory_order_relaxed) == NULL) {
+            thread->slot = i;
+            domain->threads[i].store(thread, std::memory_order_seq_cst);
+            return true;
+        }
+    }
+    fprintf(stderr, "[ERROR] epoch_thread_register failed. All %d thread slots are in use.\n", EPOCH_MAX_THREADS);
+    return false;
+}
+
+static void epoch_cache_push(EpochThread* thread, void* ptr)
+{
+    PoolListNode* node = (PoolListNode*)ptr;
+    node->next = thread->cache;
+    thread->cache = node;
+    thread->cache_count++;
+}
+
+static void epoch_cache_drain(EpochThread* thread, size_t keep)
+{
+    if (thread->cache_count <= keep) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(thread->domain->lock);
+    while (thread->cache_count > keep) {
+        PoolListNode* node = thread->cache;
+        thread->cache = node->next;
+        thread->cache_count--;
+        pool_free(&thread->domain->pool, node);
+    }
+}
+
+// the chunks are past every reader
+static void epoch_limbo_release(EpochThread* thread, EpochLimbo* limbo)
+{
+    for (size_t i = 0; i < limbo->count; i++) {
+        epoch_cache_push(thread, limbo->chunks[i]);
+    }
+    limbo->count = 0;
+}
+
+void epoch_thread_unregister(EpochThread* thread)
+{
+    EpochPool* domain = thread->domain;
+    assert((thread->local_epoch.load(std::memory_order_relaxed) & 1) == 0);
+
+    for (;;) {
+        epoch_try_advance(domain);
+        epoch_collect(thread);
+        if (thread->limbo[0].count == 0 && thread->limbo[1].count == 0 && thread->limbo[2].count == 0) {
+            break;
+        }
+        std::this_thread::yield();
+    }
+    epoch_cache_drain(thread, 0);
+
+    std::lock_guard<std::mutex> guard(domain->lock);
+    domain->threads[thread->slot].store(NULL, std::memory_order_seq_cst);
+}
+
+void* epoch_alloc(EpochThread* thread)
+{
+    if (thread->cache_count == 0) {
+        epoch_collect(thread);
+    }
+    if (thread->cache_count == 0) {
+        EpochPool* domain = thread->domain;
+        std::lock_guard<std::mutex> guard(domain->lock);
+        while (thread->cache_count < thread->low) {
+            void* ptr = try_pool_alloc(&domain->pool);
+            if (ptr == NULL) {
+                break;
+            }
+            epoch_cache_push(thread, ptr);
+        }
+    }
+    if (thread->cache_count == 0 && epoch_try_advance(thread->domain)) {
+        // the pool is empty, chunks this thread retired may be free by now
+        epoch_collect(thread);
+    }
+    if (thread->cache_count == 0) {
+        fprintf(stderr, "[ERROR] epoch_alloc failed. Pool is empty and no retired chunk is free yet.\n");
+        return NULL;
+    }
+
+    PoolListNode* node = thread->cache;
+    thread->cache = node->next;
+    thread->cache_count--;
+    return memset(node, 0, thread->domain->pool.chunk_size);
+}
+
+void epoch_free(EpochThread* thread, void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    epoch_cache_push(thread, ptr);
+    if (thread->cache_count > thread->high) {
+        epoch_cache_drain(thread, thread->low);
+    }
+}
+
+bool epoch_retire(EpochThread* thread, void* ptr)
+{
+    if (ptr == NULL) {
+        return true;
+    }
+
+    EpochPool* domain = thread->domain;
+    for (;;) {
+        uint64_t epoch = domain->epoch.load(std::memory_order_seq_cst);
+        EpochLimbo* limbo = &thread->limbo[epoch % 3];
+        if (limbo->epoch != epoch) {
+            // three or more epochs old
+            epoch_limbo_release(thread, limbo);
+            limbo->epoch = epoch;
+        }
+        if (limbo->count < EPOCH_LIMBO_SIZE) {
+            limbo->chunks[limbo->count++] = ptr;
+            break;
+        }
+        // full, wait for the readers to move on, unless this thread is the one
+        // holding the epoch back
+        uint64_t local = thread->local_epoch.load(std::memory_order_relaxed);
+        if ((local & 1) && (local >> 1) != epoch) {
+            fprintf(stderr, "[ERROR] epoch_retire failed. More than %d chunks retired in one critical section.\n",
+                EPOCH_LIMBO_SIZE);
+            return false;
+        }
+        if (!epoch_try_advance(domain)) {
+            std::this_thread::yield();
+        }
+    }
+
+    if (++thread->since_advance >= EPOCH_RETIRE_BATCH) {
+        thread->since_advance = 0;
+        epoch_try_advance(domain);
+        epoch_collect(thread);
+    }
+    return true;
+}
+
+bool epoch_try_advance(EpochPool* domain)
+{
+    uint64_t epoch = domain->epoch.load(std::memory_order_seq_cst);
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        EpochThread* thread = domain->threads[i].load(std::memory_order_acquire);
+        if (thread == NULL) {
+            continue;
+        }
+        uint64_t local = thread->local_epoch.load(std::memory_order_seq_cst);
+        if ((local & 1) && (local >> 1) != epoch) {
+            return false;
+        }
+    }
+    // losing the race is fine, someone else moved it on
+    domain->epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+    return true;
+}
+
+size_t epoch_collect(EpochThread* thread)
+{
+    uint64_t epoch = thread->domain->epoch.load(std::memory_order_seq_cst);
+    size_t freed = 0;
+    for (int i = 0; i < 3; i++) {
+        EpochLimbo* limbo = &thread->limbo[i];
+        if (limbo->count != 0 && limbo->epoch + 2 <= epoch) {
+            freed += limbo->count;
+            epoch_limbo_release(thread, limbo);
+        }
+    }
+    if (thread->cache_count > thread->high) {
+        epoch_cache_drain(thread, thread->low);
+    }
+    return freed;
+}
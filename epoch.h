@@ -0,0 +1,118 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include "allocator.h"
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+
+////////////////////////////////
+// epoch-based reclamation for pool chunks
+//
+// For lock-free structures whose nodes are pool chunks. Readers bracket every
+// access with epoch_enter/epoch_exit. A writer that unlinks a node retires it
+// instead of freeing it: the chunk sits in the thread's limbo list, tagged with
+// the global epoch, until the epoch has moved on twice. The epoch only moves
+// once every thread inside a critical section has seen the current one, so by
+// then no reader can still hold the chunk.
+//
+// Each thread also keeps a cache of free chunks, refilled from and drained to
+// the shared pool in batches under one lock, like BuddyPageCache. Reclaimed
+// chunks go to that cache first. Readers never take the lock and never write
+// to shared memory apart from their own epoch word.
+
+#define EPOCH_MAX_THREADS 64
+// retired chunks per limbo list, a full list blocks the retiring thread until
+// the readers move on
+#define EPOCH_LIMBO_SIZE 256
+// retires between attempts to advance the epoch
+#define EPOCH_RETIRE_BATCH 32
+#define EPOCH_CACHE_MAX_HIGH 256
+
+struct EpochThread;
+
+struct EpochPool
+{
+    PoolAllocator pool;
+    // guards the pool and thread registration
+    std::mutex lock;
+    alignas(64) std::atomic<uint64_t> epoch;
+    std::atomic<EpochThread*> threads[EPOCH_MAX_THREADS];
+};
+
+struct EpochLimbo
+{
+    // global epoch the chunks were retired in
+    uint64_t epoch;
+    size_t count;
+    void* chunks[EPOCH_LIMBO_SIZE];
+};
+
+// One per thread, not thread-safe itself.
+struct EpochThread
+{
+    // epoch << 1 | 1 inside a critical section, 0 outside
+    alignas(64) std::atomic<uint64_t> local_epoch;
+    alignas(64) EpochPool* domain;
+    size_t slot;
+    size_t since_advance;
+    // an empty cache is refilled up to `low` chunks, a cache that grows past
+    // `high` is drained back down to `low`
+    size_t low;
+    size_t high;
+    PoolListNode* cache;
+    size_t cache_count;
+    // indexed by epoch % 3, the third list is the one being filled
+    EpochLimbo limbo[3];
+};
+
+void epoch_pool_init(EpochPool* domain, void* buffer, size_t buffer_size,
+    size_t chunk_size, size_t align = DEFAULT_ALIGNMENT);
+// false if EPOCH_MAX_THREADS threads are already registered
+bool epoch_thread_register(EpochThread* thread, EpochPool* domain, size_t low, size_t high);
+// Waits for its retired chunks to become free and hands every chunk back to
+// the pool. Must be called outside a critical section.
+void epoch_thread_unregister(EpochThread* thread);
+
+inline void epoch_enter(EpochThread* thread)
+{
+    uint64_t epoch = thread->domain->epoch.load(std::memory_order_relaxed);
+    // the announcement must be visible before any load of the structure
+#if defined(__x86_64__) || defined(__i386__)
+    // a locked exchange is a full barrier and cheaper than mfence
+    thread->local_epoch.exchange((epoch << 1) | 1, std::memory_order_seq_cst);
+#else
+    thread->local_epoch.store((epoch << 1) | 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+}
+
+inline void epoch_exit(EpochThread* thread)
+{
+    thread->local_epoch.store(0, std::memory_order_release);
+}
+
+struct EpochGuard
+{
+    EpochThread* thread;
+    explicit EpochGuard(EpochThread* thread) : thread(thread) { epoch_enter(thread); }
+    ~EpochGuard() { epoch_exit(thread); }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+void* epoch_alloc(EpochThread* thread);
+// for a chunk no other thread can reach, e.g. one that was never published
+void epoch_free(EpochThread* thread, void* ptr);
+// For a chunk that was just unlinked, freed once no reader can hold it. One
+// critical section may retire about EPOCH_LIMBO_SIZE chunks, past that it
+// returns false and the chunk stays with the caller, to be retired again
+// after epoch_exit.
+bool epoch_retire(EpochThread* thread, void* ptr);
+// moves the global epoch on if every active thread has seen it
+bool epoch_try_advance(EpochPool* domain);
+// frees this thread's retired chunks that are safe, returns how many
+size_t epoch_collect(EpochThread* thread);
+
+#endif
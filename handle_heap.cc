@@ -0,0 +1,215 @@
+#include "handle_heap.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Every block is [FreeListAllocationHeader][HandleHeapBlockHeader][data]. With
+// 16-byte aligned nodes and sizes the free list's padding is exactly its
+// header, so the header sits at the block start and the compactor can step
+// from block to block.
+struct HandleHeapBlockHeader
+{
+    // entry index, to find the handle of a block being moved
+    uint64_t index;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(FreeListAllocationHeader) == HANDLE_HEAP_ALIGNMENT, "block layout needs a 16-byte allocation header");
+static_assert(sizeof(HandleHeapBlockHeader) == HANDLE_HEAP_ALIGNMENT, "block layout needs a 16-byte handle header");
+
+#define HANDLE_HEAP_DATA_OFFSET (sizeof(FreeListAllocationHeader) + sizeof(HandleHeapBlockHeader))
+
+static uint64_t handle_heap_now_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static HandleHeapEntry* handle_heap_entry(HandleHeap* heap, HeapHandle handle)
+{
+    uint32_t index = (uint32_t)handle - 1;
+    if (handle == HEAP_HANDLE_NULL || index >= heap->entry_count) {
+        return NULL;
+    }
+    HandleHeapEntry* entry = &heap->entries[index];
+    if (entry->block == NULL || entry->generation != (uint32_t)(handle >> 32)) {
+        return NULL;
+    }
+    return entry;
+}
+
+// compaction is the only way to serve a request the free bytes could hold
+static OomAction handle_heap_oom(void* allocator, size_t size, size_t align, void* user_data, void** fallback)
+{
+    HandleHeap* heap = (HandleHeap*)user_data;
+    if (heap->free_list.buffer_size - heap->free_list.buffer_used < size) {
+        return Oom_Action_Fail;
+    }
+    uint64_t moved = heap->moved_bytes;
+    handle_heap_compact(heap, 0);
+    return heap->moved_bytes != moved ? Oom_Action_Retry : Oom_Action_Fail;
+}
+
+bool handle_heap_init(HandleHeap* heap, void* buffer, size_t buffer_size, uint32_t max_handles)
+{
+    memset(heap, 0, sizeof(*heap));
+    uintptr_t start = align_forward((uintptr_t)buffer, HANDLE_HEAP_ALIGNMENT);
+    uintptr_t blocks = align_forward(start + (size_t)max_handles * sizeof(HandleHeapEntry), HANDLE_HEAP_ALIGNMENT);
+    uintptr_t end = ((uintptr_t)buffer + buffer_size) & ~(uintptr_t)(HANDLE_HEAP_ALIGNMENT - 1);
+    if (max_handles == 0 || blocks + HANDLE_HEAP_DATA_OFFSET + HANDLE_HEAP_ALIGNMENT > end) {
+        fprintf(stderr, "[ERROR] handle_heap_init failed. Buffer size=%zu can't hold %u handles and a block.\n",
+            buffer_size, max_handles);
+        return false;
+    }
+
+    heap->entries = (HandleHeapEntry*)start;
+    heap->entry_count = max_handles;
+    for (uint32_t i = 0; i < max_handles; i++) {
+        heap->entries[i].block = NULL;
+        heap->entries[i].size = 0;
+        heap->entries[i].pins = 0;
+        heap->entries[i].generation = 1;
+        heap->entries[i].next_free = i + 1 < max_handles ? i + 2 : 0;
+    }
+    heap->free_entry = 1;
+
+    free_list_init(&heap->free_list, (void*)blocks, end - blocks, Allocation_Policy_First_Fit);
+    free_list_set_oom_handler(&heap->free_list, handle_heap_oom, heap);
+    return true;
+}
+
+HeapHandle handle_heap_alloc(HandleHeap* heap, size_t size)
+{
+    if (heap->free_entry == 0) {
+        fprintf(stderr, "[ERROR] handle_heap_alloc failed. All %u handles are in use.\n", heap->entry_count);
+        return HEAP_HANDLE_NULL;
+    }
+
+    size_t block_size = sizeof(HandleHeapBlockHeader) + align_forward(size, HANDLE_HEAP_ALIGNMENT);
+    unsigned char* ptr = (unsigned char*)try_free_list_alloc(&heap->free_list, block_size, HANDLE_HEAP_ALIGNMENT);
+    if (ptr == NULL) {
+        fprintf(stderr, "[ERROR] handle_heap_alloc failed. No room for size=%zu even after compaction.\n", size);
+        return HEAP_HANDLE_NULL;
+    }
+
+    uint32_t index = heap->free_entry - 1;
+    HandleHeapEntry* entry = &heap->entries[index];
+    heap->free_entry = entry->next_free;
+    entry->block = ptr - sizeof(FreeListAllocationHeader);
+    entry->size = size;
+    entry->pins = 0;
+    entry->next_free = 0;
+    ((HandleHeapBlockHeader*)ptr)->index = index;
+    heap->live++;
+    return ((HeapHandle)entry->generation << 32) | (index + 1);
+}
+
+void handle_heap_free(HandleHeap* heap, HeapHandle handle)
+{
+    HandleHeapEntry* entry = handle_heap_entry(heap, handle);
+    if (entry == NULL) {
+        fprintf(stderr, "[ERROR] handle_heap_free failed. Handle %llx is stale.\n", (unsigned long long)handle);
+        return;
+    }
+    if (entry->pins != 0) {
+        fprintf(stderr, "[ERROR] handle_heap_free failed. Handle %llx is pinned.\n", (unsigned long long)handle);
+        return;
+    }
+
+    free_list_free(&heap->free_list, entry->block + sizeof(FreeListAllocationHeader));
+    entry->block = NULL;
+    entry->size = 0;
+    entry->generation++;
+    entry->next_free = heap->free_entry;
+    heap->free_entry = (uint32_t)(entry - heap->entries) + 1;
+    heap->live--;
+}
+
+void* handle_heap_pin(HandleHeap* heap, HeapHandle handle)
+{
+    HandleHeapEntry* entry = handle_heap_entry(heap, handle);
+    if (entry == NULL) {
+        fprintf(stderr, "[ERROR] handle_heap_pin failed. Handle %llx is stale.\n", (unsigned long long)handle);
+        return NULL;
+    }
+    entry->pins++;
+    return entry->block + HANDLE_HEAP_DATA_OFFSET;
+}
+
+void handle_heap_unpin(HandleHeap* heap, HeapHandle handle)
+{
+    HandleHeapEntry* entry = handle_heap_entry(heap, handle);
+    if (entry == NULL || entry->pins == 0) {
+        fprintf(stderr, "[ERROR] handle_heap_unpin failed. Handle %llx is stale or not pinned.\n", (unsigned long long)handle);
+        return;
+    }
+    entry->pins--;
+}
+
+size_t handle_heap_size(HandleHeap* heap, HeapHandle handle)
+{
+    HandleHeapEntry* entry = handle_heap_entry(heap, handle);
+    return entry != NULL ? entry->size : 0;
+}
+
+bool handle_heap_compact(HandleHeap* heap, uint64_t budget_ns)
+{
+    FreeListAllocator* free_list = &heap->free_list;
+    unsigned char* end = free_list->buffer + free_list->buffer_size;
+    uint64_t deadline = budget_ns != 0 ? handle_heap_now_ns() + budget_ns : 0;
+
+    FreeListNode* prev_node = NULL;
+    FreeListNode* node = free_list->head;
+    while (node != NULL) {
+        unsigned char* block = (unsigned char*)node + node->block_size;
+        if (block >= end) {
+            // the tail
+            return true;
+        }
+        // free blocks are always merged, so whatever follows one is allocated
+        size_t block_size = ((FreeListAllocationHeader*)block)->block_size;
+        HandleHeapBlockHeader* header = (HandleHeapBlockHeader*)(block + sizeof(FreeListAllocationHeader));
+        HandleHeapEntry* entry = &heap->entries[header->index];
+        if (entry->pins != 0) {
+            prev_node = node;
+            node = node->next;
+            continue;
+        }
+
+        // slide the block down, the free space it leaves behind moves up with it
+        size_t free_size = node->block_size;
+        FreeListNode* next = node->next;
+        memmove(node, block, block_size);
+        entry->block = (unsigned char*)node;
+        FreeListNode* moved = (FreeListNode*)((unsigned char*)node + block_size);
+        moved->block_size = free_size;
+        moved->next = next;
+        if (prev_node == NULL) {
+            free_list->head = moved;
+        }
+        else {
+            prev_node->next = moved;
+        }
+        free_list_coalescence_node(NULL, moved);
+        heap->moved_bytes += block_size;
+        node = moved;
+
+        if (deadline != 0 && handle_heap_now_ns() >= deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t handle_heap_largest_free(HandleHeap* heap)
+{
+    size_t largest = 0;
+    for (FreeListNode* node = heap->free_list.head; node != NULL; node = node->next) {
+        if (node->block_size > largest) {
+            largest = node->block_size;
+        }
+    }
+    return largest;
+}
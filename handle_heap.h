@@ -0,0 +1,68 @@
+#ifndef HANDLE_HEAP_H
+#define HANDLE_HEAP_H
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// compacting handle heap
+//
+// A FreeListAllocator whose blocks are reached through handles, so they can
+// move. Pin a handle to get a pointer that stays valid until the matching
+// unpin. handle_heap_compact slides every unpinned block that has free space
+// in front of it down into that space and updates the handle table, so the
+// free space gathers in one tail block (pinned blocks stay put and split it).
+// It stops once `budget_ns` has passed, so it can run a bit at a time between
+// requests. An allocation that fails while there are enough free bytes in
+// total compacts fully and tries again, through the free list's OOM handler.
+//
+// The handle table sits at the start of the buffer. Blocks are 16-byte aligned.
+// Handles carry a generation, a handle that was freed is refused.
+
+#define HANDLE_HEAP_ALIGNMENT 16
+
+typedef uint64_t HeapHandle;
+#define HEAP_HANDLE_NULL ((HeapHandle)0)
+
+struct HandleHeapEntry
+{
+    // free list block holding the data, NULL for an unused entry
+    unsigned char* block;
+    size_t size;
+    uint32_t pins;
+    // bumped on free so old handles to this entry are refused
+    uint32_t generation;
+    // next unused entry, index + 1
+    uint32_t next_free;
+};
+
+struct HandleHeap
+{
+    FreeListAllocator free_list;
+    HandleHeapEntry* entries;
+    uint32_t entry_count;
+    // first unused entry, index + 1, 0 when the table is full
+    uint32_t free_entry;
+    uint32_t live;
+    // bytes copied by compaction so far
+    uint64_t moved_bytes;
+};
+
+// false if the buffer can't hold the table and a block
+bool handle_heap_init(HandleHeap* heap, void* buffer, size_t buffer_size, uint32_t max_handles);
+HeapHandle handle_heap_alloc(HandleHeap* heap, size_t size);
+// the handle must not be pinned
+void handle_heap_free(HandleHeap* heap, HeapHandle handle);
+// pointer to the block until the matching unpin, NULL for a stale handle
+void* handle_heap_pin(HandleHeap* heap, HeapHandle handle);
+void handle_heap_unpin(HandleHeap* heap, HeapHandle handle);
+size_t handle_heap_size(HandleHeap* heap, HeapHandle handle);
+// Move blocks for at most budget_ns (0: no limit). True when nothing is left
+// to move, i.e. every free block is the tail or sits in front of a pinned block.
+bool handle_heap_compact(HandleHeap* heap, uint64_t budget_ns);
+// largest free block, headers included
+size_t handle_heap_largest_free(HandleHeap* heap);
+
+#endif
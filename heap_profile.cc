@@ -0,0 +1,466 @@
+#include "heap_profile.h"
+
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+
+#include "region.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+struct HeapProfileBucket
+{
+    uint64_t hash;
+    // 0 marks an empty slot
+    uint32_t depth;
+    uint64_t inuse_objects;
+    uint64_t inuse_bytes;
+    uint64_t alloc_objects;
+    uint64_t alloc_bytes;
+    void* frames[HEAP_PROFILE_MAX_DEPTH];
+};
+
+struct HeapProfileSample
+{
+    // 0 marks an empty slot
+    uintptr_t ptr;
+    uint64_t size;
+    uint32_t bucket;
+};
+
+struct HeapProfileState
+{
+    std::atomic_flag lock;
+    size_t rate;
+    Region bucket_region;
+    Region sample_region;
+    HeapProfileBucket* buckets;
+    HeapProfileSample* samples;
+    size_t bucket_count;
+    uint64_t dropped;
+};
+
+int heap_profile_active;
+uint32_t heap_profile_live_samples;
+uint16_t heap_profile_filter[HEAP_PROFILE_FILTER_SIZE];
+__thread int64_t heap_profile_bytes_left __attribute__((tls_model("initial-exec")));
+
+static HeapProfileState heap_profile_state = { ATOMIC_FLAG_INIT };
+static __thread uint64_t heap_profile_random __attribute__((tls_model("initial-exec")));
+// the first sample of a thread waits for a drawn interval too
+static __thread int heap_profile_armed __attribute__((tls_model("initial-exec")));
+// backtrace() may allocate the first time it runs
+static __thread int heap_profile_busy __attribute__((tls_model("initial-exec")));
+
+static void heap_profile_lock(HeapProfileState* state)
+{
+    int spins = 0;
+    while (state->lock.test_and_set(std::memory_order_acquire)) {
+        if (++spins > 64) {
+            sched_yield();
+            spins = 0;
+        }
+    }
+}
+
+static void heap_profile_unlock(HeapProfileState* state)
+{
+    state->lock.clear(std::memory_order_release);
+}
+
+static size_t heap_profile_sample_slot(uintptr_t ptr)
+{
+    return (size_t)((((uint64_t)ptr >> 4) * 0x9E3779B97F4A7C15ull) >> 32) & (HEAP_PROFILE_MAX_SAMPLES - 1);
+}
+
+// exponential with mean rate, so the samples form a Poisson process over bytes
+static int64_t heap_profile_next_interval(size_t rate)
+{
+    if (heap_profile_random == 0) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        heap_profile_random = ((uint64_t)now.tv_nsec << 20) ^ (uintptr_t)&heap_profile_random ^ 0x2545F4914F6CDD1Dull;
+    }
+    // xorshift64*
+    heap_profile_random ^= heap_profile_random >> 12;
+    heap_profile_random ^= heap_profile_random << 25;
+    heap_profile_random ^= heap_profile_random >> 27;
+    uint64_t bits = heap_profile_random * 0x2545F4914F6CDD1Dull;
+    // uniform in (0, 1]
+    double uniform = (double)((bits >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double interval = -log(uniform) * (double)rate;
+    return interval < 1.0 ? 1 : (int64_t)interval;
+}
+
+static uint32_t heap_profile_find_bucket(HeapProfileState* state, void** frames, uint32_t depth)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (uint32_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001B3ull;
+    }
+
+    size_t mask = HEAP_PROFILE_MAX_BUCKETS - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        HeapProfileBucket* bucket = &state->buckets[slot];
+        if (bucket->depth == 0) {
+            // keep probes short, a full table drops new stacks
+            if (state->bucket_count >= HEAP_PROFILE_MAX_BUCKETS / 4 * 3) {
+                return UINT32_MAX;
+            }
+            bucket->hash = hash;
+            bucket->depth = depth;
+            memcpy(bucket->frames, frames, depth * sizeof(void*));
+            state->bucket_count++;
+            return (uint32_t)slot;
+        }
+        if (bucket->hash == hash && bucket->depth == depth &&
+            memcmp(bucket->frames, frames, depth * sizeof(void*)) == 0) {
+            return (uint32_t)slot;
+        }
+    }
+}
+
+void heap_profile_sample(void* ptr, size_t size)
+{
+    HeapProfileState* state = &heap_profile_state;
+    if (heap_profile_busy) {
+        return;
+    }
+    heap_profile_busy = 1;
+
+    size_t rate = state->rate;
+    if (!heap_profile_armed) {
+        heap_profile_armed = 1;
+        heap_profile_bytes_left += heap_profile_next_interval(rate);
+        if (heap_profile_bytes_left >= 0) {
+            heap_profile_busy = 0;
+            return;
+        }
+    }
+    heap_profile_bytes_left = heap_profile_next_interval(rate);
+
+    void* frames[HEAP_PROFILE_MAX_DEPTH + 1];
+    int depth = backtrace(frames, HEAP_PROFILE_MAX_DEPTH + 1);
+    // drop this function's own frame
+    uint32_t stack_depth = depth > 1 ? (uint32_t)depth - 1 : 0;
+
+    heap_profile_lock(state);
+    if (!__atomic_load_n(&heap_profile_active, __ATOMIC_RELAXED) || stack_depth == 0) {
+        heap_profile_unlock(state);
+        heap_profile_busy = 0;
+        return;
+    }
+
+    uint32_t bucket_index = UINT32_MAX;
+    if (heap_profile_live_samples < HEAP_PROFILE_MAX_SAMPLES / 4 * 3) {
+        bucket_index = heap_profile_find_bucket(state, frames + 1, stack_depth);
+    }
+    if (bucket_index == UINT32_MAX) {
+        state->dropped++;
+        heap_profile_unlock(state);
+        heap_profile_busy = 0;
+        return;
+    }
+
+    HeapProfileBucket* bucket = &state->buckets[bucket_index];
+    bucket->inuse_objects++;
+    bucket->inuse_bytes += size;
+    bucket->alloc_objects++;
+    bucket->alloc_bytes += size;
+
+    size_t mask = HEAP_PROFILE_MAX_SAMPLES - 1;
+    size_t slot = heap_profile_sample_slot((uintptr_t)ptr);
+    while (state->samples[slot].ptr != 0 && state->samples[slot].ptr != (uintptr_t)ptr) {
+        slot = (slot + 1) & mask;
+    }
+    if (state->samples[slot].ptr == (uintptr_t)ptr) {
+        // the block went away in a free_all, which frees nothing one by one
+        HeapProfileBucket* stale = &state->buckets[state->samples[slot].bucket];
+        stale->inuse_objects--;
+        stale->inuse_bytes -= state->samples[slot].size;
+    }
+    else {
+        __atomic_add_fetch(&heap_profile_filter[heap_profile_filter_slot(ptr)], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&heap_profile_live_samples, 1, __ATOMIC_RELAXED);
+    }
+    state->samples[slot].ptr = (uintptr_t)ptr;
+    state->samples[slot].size = size;
+    state->samples[slot].bucket = bucket_index;
+    heap_profile_unlock(state);
+    heap_profile_busy = 0;
+}
+
+void heap_profile_unsample(void* ptr)
+{
+    HeapProfileState* state = &heap_profile_state;
+    heap_profile_lock(state);
+    if (state->samples == NULL) {
+        heap_profile_unlock(state);
+        return;
+    }
+
+    size_t mask = HEAP_PROFILE_MAX_SAMPLES - 1;
+    size_t slot = heap_profile_sample_slot((uintptr_t)ptr);
+    while (state->samples[slot].ptr != (uintptr_t)ptr) {
+        if (state->samples[slot].ptr == 0) {
+            // a filter collision, ptr was never sampled
+            heap_profile_unlock(state);
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    HeapProfileBucket* bucket = &state->buckets[state->samples[slot].bucket];
+    bucket->inuse_objects--;
+    bucket->inuse_bytes -= state->samples[slot].size;
+
+    // backward shift delete, later entries of the probe run move up
+    size_t hole = slot;
+    state->samples[hole].ptr = 0;
+    for (size_t next = (hole + 1) & mask; state->samples[next].ptr != 0; next = (next + 1) & mask) {
+        size_t home = heap_profile_sample_slot(state->samples[next].ptr);
+        bool movable = hole <= next ? (home <= hole || home > next) : (home <= hole && home > next);
+        if (movable) {
+            state->samples[hole] = state->samples[next];
+            state->samples[next].ptr = 0;
+            hole = next;
+        }
+    }
+
+    __atomic_sub_fetch(&heap_profile_filter[heap_profile_filter_slot(ptr)], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&heap_profile_live_samples, 1, __ATOMIC_RELAXED);
+    heap_profile_unlock(state);
+}
+
+bool heap_profile_start(size_t rate)
+{
+    HeapProfileState* state = &heap_profile_state;
+    if (rate == 0) {
+        rate = 1;
+    }
+
+    // load the unwinder now, it allocates on first use
+    void* frames[2];
+    heap_profile_busy = 1;
+    backtrace(frames, 2);
+    heap_profile_busy = 0;
+
+    heap_profile_lock(state);
+    if (__atomic_load_n(&heap_profile_active, __ATOMIC_RELAXED)) {
+        heap_profile_unlock(state);
+        return false;
+    }
+    if (!region_map(&state->bucket_region, HEAP_PROFILE_MAX_BUCKETS * sizeof(HeapProfileBucket))) {
+        heap_profile_unlock(state);
+        return false;
+    }
+    if (!region_map(&state->sample_region, HEAP_PROFILE_MAX_SAMPLES * sizeof(HeapProfileSample))) {
+        region_unmap(&state->bucket_region);
+        heap_profile_unlock(state);
+        return false;
+    }
+    state->buckets = (HeapProfileBucket*)state->bucket_region.base;
+    state->samples = (HeapProfileSample*)state->sample_region.base;
+    state->bucket_count = 0;
+    state->dropped = 0;
+    state->rate = rate;
+    __atomic_store_n(&heap_profile_active, 1, __ATOMIC_RELAXED);
+    heap_profile_unlock(state);
+    return true;
+}
+
+void heap_profile_stop()
+{
+    HeapProfileState* state = &heap_profile_state;
+    heap_profile_lock(state);
+    if (!__atomic_load_n(&heap_profile_active, __ATOMIC_RELAXED)) {
+        heap_profile_unlock(state);
+        return;
+    }
+    __atomic_store_n(&heap_profile_active, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&heap_profile_live_samples, 0, __ATOMIC_RELAXED);
+    memset(heap_profile_filter, 0, sizeof(heap_profile_filter));
+    region_unmap(&state->bucket_region);
+    region_unmap(&state->sample_region);
+    state->buckets = NULL;
+    state->samples = NULL;
+    state->bucket_count = 0;
+    heap_profile_unlock(state);
+}
+
+bool heap_profile_running()
+{
+    return __atomic_load_n(&heap_profile_active, __ATOMIC_RELAXED) != 0;
+}
+
+void heap_profile_fork_prepare()
+{
+    heap_profile_lock(&heap_profile_state);
+}
+
+void heap_profile_fork_release()
+{
+    heap_profile_unlock(&heap_profile_state);
+}
+
+// caller holds the lock
+static void heap_profile_sum(HeapProfileState* state, HeapProfileTotals* totals)
+{
+    memset(totals, 0, sizeof(*totals));
+    totals->dropped = state->dropped;
+    if (state->buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < HEAP_PROFILE_MAX_BUCKETS; i++) {
+        const HeapProfileBucket* bucket = &state->buckets[i];
+        if (bucket->depth == 0) {
+            continue;
+        }
+        totals->inuse_objects += bucket->inuse_objects;
+        totals->inuse_bytes += bucket->inuse_bytes;
+        totals->alloc_objects += bucket->alloc_objects;
+        totals->alloc_bytes += bucket->alloc_bytes;
+        totals->buckets++;
+    }
+}
+
+void heap_profile_totals(HeapProfileTotals* totals)
+{
+    HeapProfileState* state = &heap_profile_state;
+    heap_profile_lock(state);
+    heap_profile_sum(state, totals);
+    heap_profile_unlock(state);
+}
+
+////////////////////////////////
+// dump, formatted by hand because stdio may allocate
+
+struct HeapProfileWriter
+{
+    int fd;
+    bool ok;
+    size_t used;
+    char buffer[4096];
+};
+
+static void heap_profile_flush(HeapProfileWriter* writer)
+{
+    const char* bytes = writer->buffer;
+    size_t size = writer->used;
+    while (writer->ok && size > 0) {
+        ssize_t written = write(writer->fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            writer->ok = false;
+            break;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+    writer->used = 0;
+}
+
+static void heap_profile_put(HeapProfileWriter* writer, const char* text, size_t length)
+{
+    while (length > 0) {
+        if (writer->used == sizeof(writer->buffer)) {
+            heap_profile_flush(writer);
+        }
+        size_t room = sizeof(writer->buffer) - writer->used;
+        size_t chunk = length < room ? length : room;
+        memcpy(writer->buffer + writer->used, text, chunk);
+        writer->used += chunk;
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+static void heap_profile_put_string(HeapProfileWriter* writer, const char* text)
+{
+    heap_profile_put(writer, text, strlen(text));
+}
+
+static void heap_profile_put_number(HeapProfileWriter* writer, uint64_t value, unsigned base)
+{
+    char digits[24];
+    size_t count = 0;
+    do {
+        digits[sizeof(digits) - 1 - count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    heap_profile_put(writer, digits + sizeof(digits) - count, count);
+}
+
+static void heap_profile_put_counts(HeapProfileWriter* writer, uint64_t inuse_objects, uint64_t inuse_bytes,
+    uint64_t alloc_objects, uint64_t alloc_bytes)
+{
+    heap_profile_put_number(writer, inuse_objects, 10);
+    heap_profile_put_string(writer, ": ");
+    heap_profile_put_number(writer, inuse_bytes, 10);
+    heap_profile_put_string(writer, " [");
+    heap_profile_put_number(writer, alloc_objects, 10);
+    heap_profile_put_string(writer, ": ");
+    heap_profile_put_number(writer, alloc_bytes, 10);
+    heap_profile_put_string(writer, "] @");
+}
+
+bool heap_profile_dump(const char* path)
+{
+    HeapProfileState* state = &heap_profile_state;
+    HeapProfileWriter writer;
+    writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    writer.ok = writer.fd >= 0;
+    writer.used = 0;
+    if (!writer.ok) {
+        return false;
+    }
+
+    heap_profile_lock(state);
+    HeapProfileTotals totals;
+    heap_profile_sum(state, &totals);
+    heap_profile_put_string(&writer, "heap profile: ");
+    heap_profile_put_counts(&writer, totals.inuse_objects, totals.inuse_bytes, totals.alloc_objects, totals.alloc_bytes);
+    heap_profile_put_string(&writer, " heap_v2/");
+    heap_profile_put_number(&writer, state->rate, 10);
+    heap_profile_put_string(&writer, "\n");
+
+    for (size_t i = 0; state->buckets != NULL && i < HEAP_PROFILE_MAX_BUCKETS; i++) {
+        const HeapProfileBucket* bucket = &state->buckets[i];
+        if (bucket->depth == 0) {
+            continue;
+        }
+        heap_profile_put_counts(&writer, bucket->inuse_objects, bucket->inuse_bytes,
+            bucket->alloc_objects, bucket->alloc_bytes);
+        for (uint32_t f = 0; f < bucket->depth; f++) {
+            heap_profile_put_string(&writer, " 0x");
+            heap_profile_put_number(&writer, (uintptr_t)bucket->frames[f], 16);
+        }
+        heap_profile_put_string(&writer, "\n");
+    }
+    heap_profile_unlock(state);
+
+    // pprof maps the addresses back to binaries with this
+    heap_profile_put_string(&writer, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        char chunk[4096];
+        ssize_t count;
+        while ((count = read(maps, chunk, sizeof(chunk))) > 0) {
+            heap_profile_put(&writer, chunk, (size_t)count);
+        }
+        close(maps);
+    }
+    heap_profile_flush(&writer);
+    close(writer.fd);
+    return writer.ok;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// sampling heap profiler
+//
+// Build with -DMEMORY_ALLOCATOR_HEAP_PROFILE=1 (cmake -DMEMORY_ALLOCATOR_HEAP_PROFILE=ON)
+// and the pool, free list and buddy allocators report to it. Nothing is
+// recorded until heap_profile_start. Without the toggle every hook expands to
+// nothing.
+//
+// Allocations are sampled by bytes as in tcmalloc: each thread draws the
+// distance to its next sample from an exponential distribution with mean
+// `rate`, so a block of s bytes is picked with probability 1 - exp(-s / rate).
+// A sample keeps its call stack. Samples with the same stack share a bucket
+// counting what is still live (in use) and everything ever sampled (alloc).
+//
+// heap_profile_dump writes both in gperftools' heap_v2 text format, and pprof
+// scales the samples back up:
+//     pprof -sample_index=inuse_space program file.heap
+//     pprof -sample_index=alloc_space program file.heap
+//
+// The tables are mmap'd and the dump goes through write(), so the profiler
+// also runs inside the malloc replacement. Linux only.
+
+#ifndef MEMORY_ALLOCATOR_HEAP_PROFILE
+#define MEMORY_ALLOCATOR_HEAP_PROFILE 0
+#endif
+
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+
+#if !defined(__linux__)
+#error "MEMORY_ALLOCATOR_HEAP_PROFILE needs backtrace() and /proc, it is Linux only"
+#endif
+
+// mean bytes between samples, tcmalloc's default
+#define HEAP_PROFILE_DEFAULT_RATE ((size_t)512 * 1024)
+#define HEAP_PROFILE_MAX_DEPTH 32
+// distinct call stacks
+#define HEAP_PROFILE_MAX_BUCKETS 16384
+// live samples, power of two
+#define HEAP_PROFILE_MAX_SAMPLES 65536
+// counters in front of the sample table that let frees of unsampled blocks
+// skip the lock, power of two
+#define HEAP_PROFILE_FILTER_SIZE 65536
+
+struct HeapProfileTotals
+{
+    uint64_t inuse_objects;
+    uint64_t inuse_bytes;
+    uint64_t alloc_objects;
+    uint64_t alloc_bytes;
+    size_t buckets;
+    // samples lost because a table was full
+    uint64_t dropped;
+};
+
+// false if the profiler is already running or its tables can't be mapped
+bool heap_profile_start(size_t rate = HEAP_PROFILE_DEFAULT_RATE);
+// drops every sample
+void heap_profile_stop();
+bool heap_profile_running();
+// in-use and cumulative profile, see above
+bool heap_profile_dump(const char* path);
+void heap_profile_totals(HeapProfileTotals* totals);
+// hold the profiler lock across fork() so the child doesn't inherit it taken
+void heap_profile_fork_prepare();
+void heap_profile_fork_release();
+
+// slow paths of the hooks
+void heap_profile_sample(void* ptr, size_t size);
+void heap_profile_unsample(void* ptr);
+
+extern int heap_profile_active;
+extern uint32_t heap_profile_live_samples;
+extern uint16_t heap_profile_filter[HEAP_PROFILE_FILTER_SIZE];
+extern __thread int64_t heap_profile_bytes_left __attribute__((tls_model("initial-exec")));
+
+inline size_t heap_profile_filter_slot(void* ptr)
+{
+    return (size_t)((((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull) >> 48) & (HEAP_PROFILE_FILTER_SIZE - 1);
+}
+
+inline void heap_profile_alloc(void* ptr, size_t size)
+{
+    if (!__atomic_load_n(&heap_profile_active, __ATOMIC_RELAXED)) {
+        return;
+    }
+    heap_profile_bytes_left -= (int64_t)size;
+    if (heap_profile_bytes_left < 0) {
+        heap_profile_sample(ptr, size);
+    }
+}
+
+// call before the block can be handed out again
+inline void heap_profile_free(void* ptr)
+{
+    if (__atomic_load_n(&heap_profile_live_samples, __ATOMIC_RELAXED) == 0 ||
+        __atomic_load_n(&heap_profile_filter[heap_profile_filter_slot(ptr)], __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    heap_profile_unsample(ptr);
+}
+
+#define HEAP_PROFILE_ALLOC(ptr, size) heap_profile_alloc(ptr, size)
+#define HEAP_PROFILE_FREE(ptr) heap_profile_free(ptr)
+
+#else
+
+#define HEAP_PROFILE_ALLOC(ptr, size) ((void)0)
+#define HEAP_PROFILE_FREE(ptr) ((void)0)
+
+#endif
+
+#endif
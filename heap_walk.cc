@@ -0,0 +1,304 @@
+#include "heap_walk.h"
+#include "region.h"
+
+#include <string.h>
+
+static bool heap_walk_visit(HeapWalkFunc func, void* user_data, size_t offset, size_t size, size_t padding,
+    HeapBlockState state, void* data)
+{
+    HeapBlock block;
+    block.offset = offset;
+    block.size = size;
+    block.padding = padding;
+    block.state = state;
+    block.data = data;
+    block.large = false;
+    return func(&block, user_data);
+}
+
+// large objects keep their header in the page in front of the data
+static bool heap_walk_large_objects(LargeObjectList* list, HeapWalkFunc func, void* user_data)
+{
+    for (LargeObject* object = list->head; object != NULL; object = object->next) {
+        HeapBlock block;
+        block.offset = 0;
+        block.size = object->map_size;
+        block.padding = REGION_SMALL_PAGE_SIZE;
+        block.state = Heap_Block_Used;
+        block.data = (unsigned char*)object + REGION_SMALL_PAGE_SIZE;
+        block.large = true;
+        if (!func(&block, user_data)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool arena_walk(ArenaAllocator* arena, HeapWalkFunc func, void* user_data)
+{
+    size_t limit = arena->buffer_size;
+    if (arena->region != NULL && arena->region->committed < limit) {
+        limit = arena->region->committed;
+    }
+    if (arena->offset != 0 &&
+        !heap_walk_visit(func, user_data, 0, arena->offset, 0, Heap_Block_Used, arena->buffer)) {
+        return false;
+    }
+    if (limit > arena->offset &&
+        !heap_walk_visit(func, user_data, arena->offset, limit - arena->offset, 0, Heap_Block_Free, NULL)) {
+        return false;
+    }
+    if (arena->buffer_size > limit &&
+        !heap_walk_visit(func, user_data, limit, arena->buffer_size - limit, 0, Heap_Block_Reserved, NULL)) {
+        return false;
+    }
+    return heap_walk_large_objects(&arena->large_objects, func, user_data);
+}
+
+bool stack_walk(StackAllocator* stack, HeapWalkFunc func, void* user_data)
+{
+    if (stack->buffer_size > stack->offset &&
+        !heap_walk_visit(func, user_data, stack->offset, stack->buffer_size - stack->offset, 0, Heap_Block_Free, NULL)) {
+        return false;
+    }
+
+    // each block's first byte is its padding, its header links to the block below
+    size_t end = stack->offset;
+    size_t start = stack->prev_offset;
+    while (end != 0) {
+        size_t padding = stack->buffer[start];
+        if (start >= end || padding < sizeof(StackAllocationHeader) || start + padding > end) {
+            fprintf(stderr, "[ERROR] stack_walk failed. Block at offset %zu is damaged.\n", start);
+            return false;
+        }
+        StackAllocationHeader* header =
+            (StackAllocationHeader*)(stack->buffer + start + padding - sizeof(StackAllocationHeader));
+        if (header->padding != padding || (start != 0 && header->prev_offset >= start)) {
+            fprintf(stderr, "[ERROR] stack_walk failed. Header of the block at offset %zu is damaged.\n", start);
+            return false;
+        }
+        if (!heap_walk_visit(func, user_data, start, end - start, padding, Heap_Block_Used,
+            stack->buffer + start + padding)) {
+            return false;
+        }
+        end = start;
+        start = header->prev_offset;
+    }
+    return heap_walk_large_objects(&stack->large_objects, func, user_data);
+}
+
+#define POOL_WALK_WINDOW 4096
+
+bool pool_walk(PoolAllocator* pool, HeapWalkFunc func, void* user_data)
+{
+    size_t chunk_count = pool->buffer_size / pool->chunk_size;
+    // free chunks of one window of the pool, found with one pass over the free list
+    uint64_t free_bits[POOL_WALK_WINDOW / 64];
+    for (size_t first = 0; first < chunk_count; first += POOL_WALK_WINDOW) {
+        memset(free_bits, 0, sizeof(free_bits));
+        size_t visited = 0;
+        for (PoolListNode* node = pool->head; node != NULL; node = node->next) {
+            size_t offset = (unsigned char*)node - pool->buffer;
+            if (++visited > chunk_count || (unsigned char*)node < pool->buffer || offset % pool->chunk_size != 0 ||
+                offset / pool->chunk_size >= chunk_count) {
+                fprintf(stderr, "[ERROR] pool_walk failed. The free list is damaged.\n");
+                return false;
+            }
+            size_t index = offset / pool->chunk_size;
+            if (index >= first && index < first + POOL_WALK_WINDOW) {
+                free_bits[(index - first) / 64] |= (uint64_t)1 << ((index - first) % 64);
+            }
+        }
+
+        size_t last = first + POOL_WALK_WINDOW < chunk_count ? first + POOL_WALK_WINDOW : chunk_count;
+        for (size_t index = first; index < last; index++) {
+            bool free = (free_bits[(index - first) / 64] >> ((index - first) % 64)) & 1;
+            size_t offset = index * pool->chunk_size;
+            if (!heap_walk_visit(func, user_data, offset, pool->chunk_size, 0,
+                free ? Heap_Block_Free : Heap_Block_Used, free ? NULL : pool->buffer + offset)) {
+                return false;
+            }
+        }
+    }
+
+    size_t tail = pool->buffer_size - chunk_count * pool->chunk_size;
+    return tail == 0 ||
+        heap_walk_visit(func, user_data, chunk_count * pool->chunk_size, tail, 0, Heap_Block_Reserved, NULL);
+}
+
+bool free_list_walk(FreeListAllocator* free_list, HeapWalkFunc func, void* user_data)
+{
+    // the free list is sorted, whatever lies between two free nodes is allocated
+    size_t offset = 0;
+    FreeListNode* node = free_list->head;
+    while (offset < free_list->buffer_size) {
+        unsigned char* block = free_list->buffer + offset;
+        if ((unsigned char*)node == block) {
+            if (node->block_size == 0 || offset + node->block_size > free_list->buffer_size) {
+                fprintf(stderr, "[ERROR] free_list_walk failed. Free block at offset %zu is damaged.\n", offset);
+                return false;
+            }
+            if (!heap_walk_visit(func, user_data, offset, node->block_size, 0, Heap_Block_Free, NULL)) {
+                return false;
+            }
+            offset += node->block_size;
+            node = node->next;
+            continue;
+        }
+
+        size_t limit = node != NULL ? (size_t)((unsigned char*)node - free_list->buffer) : free_list->buffer_size;
+        size_t padding = *(size_t*)block;
+        if (limit <= offset || padding < sizeof(FreeListAllocationHeader) || offset + padding > limit) {
+            fprintf(stderr, "[ERROR] free_list_walk failed. Block at offset %zu is damaged.\n", offset);
+            return false;
+        }
+        FreeListAllocationHeader* header =
+            (FreeListAllocationHeader*)(block + padding - sizeof(FreeListAllocationHeader));
+        if (header->padding != padding || header->block_size < padding || offset + header->block_size > limit) {
+            fprintf(stderr, "[ERROR] free_list_walk failed. Header of the block at offset %zu is damaged.\n", offset);
+            return false;
+        }
+        if (!heap_walk_visit(func, user_data, offset, header->block_size, padding, Heap_Block_Used, block + padding)) {
+            return false;
+        }
+        offset += header->block_size;
+    }
+    return true;
+}
+
+void heap_snapshot_init(HeapSnapshot* snapshot, const char* kind, size_t buffer_size)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->kind = kind;
+    snapshot->buffer_size = buffer_size;
+    snapshot->cell_size = (buffer_size + HEAP_SNAPSHOT_CELLS - 1) / HEAP_SNAPSHOT_CELLS;
+    if (snapshot->cell_size == 0) {
+        snapshot->cell_size = 1;
+    }
+    snapshot->cell_count = (buffer_size + snapshot->cell_size - 1) / snapshot->cell_size;
+}
+
+static void heap_snapshot_fill(HeapSnapshot* snapshot, size_t offset, size_t size)
+{
+    size_t end = offset + size;
+    if (end > snapshot->buffer_size) {
+        end = snapshot->buffer_size;
+    }
+    while (offset < end) {
+        size_t cell = offset / snapshot->cell_size;
+        size_t cell_end = (cell + 1) * snapshot->cell_size;
+        size_t chunk_end = cell_end < end ? cell_end : end;
+        snapshot->cells[cell] += chunk_end - offset;
+        offset = chunk_end;
+    }
+}
+
+bool heap_snapshot_add(const HeapBlock* block, void* user_data)
+{
+    HeapSnapshot* snapshot = (HeapSnapshot*)user_data;
+    if (block->large) {
+        snapshot->large_blocks++;
+        snapshot->large_bytes += block->size;
+        return true;
+    }
+
+    switch (block->state) {
+    case Heap_Block_Used:
+        snapshot->used_blocks++;
+        snapshot->used_bytes += block->size;
+        snapshot->padding_bytes += block->padding;
+        heap_snapshot_fill(snapshot, block->offset, block->size);
+        break;
+    case Heap_Block_Free:
+    {
+        snapshot->free_blocks++;
+        snapshot->free_bytes += block->size;
+        if (block->size > snapshot->largest_free) {
+            snapshot->largest_free = block->size;
+        }
+        size_t bucket = 0;
+        while (bucket + 1 < HEAP_SNAPSHOT_BUCKETS && (block->size >> (bucket + 1)) != 0) {
+            bucket++;
+        }
+        snapshot->free_histogram[bucket]++;
+        break;
+    }
+    case Heap_Block_Reserved:
+        snapshot->reserved_bytes += block->size;
+        heap_snapshot_fill(snapshot, block->offset, block->size);
+        break;
+    }
+    return true;
+}
+
+double heap_snapshot_fragmentation(const HeapSnapshot* snapshot)
+{
+    if (snapshot->free_bytes == 0) {
+        return 0.0;
+    }
+    return 1.0 - (double)snapshot->largest_free / (double)snapshot->free_bytes;
+}
+
+bool heap_snapshot_write_json(const HeapSnapshot* snapshot, FILE* file)
+{
+    fprintf(file, "{\"kind\": \"%s\", \"buffer_size\": %zu, \"cell_size\": %zu,\n",
+        snapshot->kind != NULL ? snapshot->kind : "", snapshot->buffer_size, snapshot->cell_size);
+    fprintf(file, " \"used_blocks\": %zu, \"used_bytes\": %zu, \"padding_bytes\": %zu,\n",
+        snapshot->used_blocks, snapshot->used_bytes, snapshot->padding_bytes);
+    fprintf(file, " \"free_blocks\": %zu, \"free_bytes\": %zu, \"largest_free\": %zu, \"fragmentation\": %.4f,\n",
+        snapshot->free_blocks, snapshot->free_bytes, snapshot->largest_free, heap_snapshot_fragmentation(snapshot));
+    fprintf(file, " \"reserved_bytes\": %zu, \"large_blocks\": %zu, \"large_bytes\": %zu,\n",
+        snapshot->reserved_bytes, snapshot->large_blocks, snapshot->large_bytes);
+
+    size_t buckets = HEAP_SNAPSHOT_BUCKETS;
+    while (buckets > 0 && snapshot->free_histogram[buckets - 1] == 0) {
+        buckets--;
+    }
+    fprintf(file, " \"free_histogram\": [");
+    for (size_t i = 0; i < buckets; i++) {
+        fprintf(file, i == 0 ? "%zu" : ", %zu", snapshot->free_histogram[i]);
+    }
+    fprintf(file, "],\n");
+
+    fprintf(file, " \"occupancy\": \"");
+    for (size_t i = 0; i < snapshot->cell_count; i++) {
+        size_t cell_start = i * snapshot->cell_size;
+        size_t cell_size = snapshot->buffer_size - cell_start < snapshot->cell_size ?
+            snapshot->buffer_size - cell_start : snapshot->cell_size;
+        // rounded up, a cell with anything in it is never 00
+        uint64_t level = (snapshot->cells[i] * 255 + cell_size - 1) / cell_size;
+        fprintf(file, "%02x", (unsigned)(level > 255 ? 255 : level));
+    }
+    fprintf(file, "\"}\n");
+    return ferror(file) == 0;
+}
+
+bool arena_snapshot(ArenaAllocator* arena, HeapSnapshot* snapshot)
+{
+    heap_snapshot_init(snapshot, "arena", arena->buffer_size);
+    return arena_walk(arena, heap_snapshot_add, snapshot);
+}
+
+bool stack_snapshot(StackAllocator* stack, HeapSnapshot* snapshot)
+{
+    heap_snapshot_init(snapshot, "stack", stack->buffer_size);
+    return stack_walk(stack, heap_snapshot_add, snapshot);
+}
+
+bool pool_snapshot(PoolAllocator* pool, HeapSnapshot* snapshot)
+{
+    heap_snapshot_init(snapshot, "pool", pool->buffer_size);
+    return pool_walk(pool, heap_snapshot_add, snapshot);
+}
+
+bool free_list_snapshot(FreeListAllocator* free_list, HeapSnapshot* snapshot)
+{
+    heap_snapshot_init(snapshot, "free_list", free_list->buffer_size);
+    return free_list_walk(free_list, heap_snapshot_add, snapshot);
+}
+
+bool buddy_snapshot(BuddyAllocator* buddy, HeapSnapshot* snapshot)
+{
+    heap_snapshot_init(snapshot, "buddy", POW_OF_2(buddy->tree_height) * buddy->alignment);
+    return buddy_walk(buddy, heap_snapshot_add, snapshot);
+}
@@ -0,0 +1,108 @@
+#ifndef HEAP_WALK_H
+#define HEAP_WALK_H
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+////////////////////////////////
+// heap walk and snapshots
+//
+// xxx_walk calls a visitor for every block of an allocator, live and free,
+// with its offset from the buffer start, its whole size (headers and padding
+// included) and the padding in front of the data. Blocks come in address
+// order, except that stacks go from the top down and large objects come last.
+// The walk reads the allocator's own headers and free lists and allocates
+// nothing, the visitor must not change the allocator.
+//
+// An arena doesn't remember its blocks, it shows up as one used block and the
+// free tail. A buddy allocation made with buddy_alloc_exact is one block that
+// covers its tail blocks too.
+//
+// HeapSnapshot is a visitor that sums the blocks up into a fixed-size
+// occupancy map and a histogram of free block sizes, and writes them as JSON
+// for offline fragmentation plots:
+//
+//     HeapSnapshot snapshot;
+//     buddy_snapshot(&buddy, &snapshot);
+//     heap_snapshot_write_json(&snapshot, file);
+
+enum HeapBlockState
+{
+    Heap_Block_Free,
+    Heap_Block_Used,
+    // not usable: uncommitted arena pages, the buddy's tree and virtual tail
+    Heap_Block_Reserved,
+};
+
+struct HeapBlock
+{
+    // from the allocator's buffer, 0 for large objects
+    size_t offset;
+    size_t size;
+    // bytes in front of the data, headers included
+    size_t padding;
+    HeapBlockState state;
+    // NULL for free and reserved blocks
+    void* data;
+    // has a mapping of its own, outside the buffer
+    bool large;
+};
+
+// return false to stop the walk
+typedef bool (*HeapWalkFunc)(const HeapBlock* block, void* user_data);
+
+// All return false if the visitor stopped the walk or the allocator's
+// headers don't add up, in which case an error is printed.
+bool arena_walk(ArenaAllocator* arena, HeapWalkFunc func, void* user_data);
+bool stack_walk(StackAllocator* stack, HeapWalkFunc func, void* user_data);
+bool pool_walk(PoolAllocator* pool, HeapWalkFunc func, void* user_data);
+bool free_list_walk(FreeListAllocator* free_list, HeapWalkFunc func, void* user_data);
+bool buddy_walk(BuddyAllocator* buddy, HeapWalkFunc func, void* user_data);
+
+#define HEAP_SNAPSHOT_CELLS 512
+// free blocks by size, bucket i holds sizes in [2^i, 2^(i+1))
+#define HEAP_SNAPSHOT_BUCKETS 48
+
+struct HeapSnapshot
+{
+    const char* kind;
+    size_t buffer_size;
+    // bytes per occupancy cell, the last cell may be shorter
+    size_t cell_size;
+    size_t cell_count;
+
+    size_t used_blocks;
+    size_t used_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t reserved_bytes;
+    size_t padding_bytes;
+    size_t largest_free;
+    size_t large_blocks;
+    size_t large_bytes;
+
+    // used and reserved bytes in each cell
+    uint64_t cells[HEAP_SNAPSHOT_CELLS];
+    size_t free_histogram[HEAP_SNAPSHOT_BUCKETS];
+};
+
+void heap_snapshot_init(HeapSnapshot* snapshot, const char* kind, size_t buffer_size);
+// a HeapWalkFunc, user_data is the HeapSnapshot
+bool heap_snapshot_add(const HeapBlock* block, void* user_data);
+// 1 - largest free block / free bytes, 0 when all free space is one block
+double heap_snapshot_fragmentation(const HeapSnapshot* snapshot);
+// One object: the totals, the free size histogram and the occupancy map as a
+// hex string with one byte per cell (00 empty, ff full).
+bool heap_snapshot_write_json(const HeapSnapshot* snapshot, FILE* file);
+
+// init and walk in one go
+bool arena_snapshot(ArenaAllocator* arena, HeapSnapshot* snapshot);
+bool stack_snapshot(StackAllocator* stack, HeapSnapshot* snapshot);
+bool pool_snapshot(PoolAllocator* pool, HeapSnapshot* snapshot);
+bool free_list_snapshot(FreeListAllocator* free_list, HeapSnapshot* snapshot);
+bool buddy_snapshot(BuddyAllocator* buddy, HeapSnapshot* snapshot);
+
+#endif
@@ -0,0 +1,232 @@
+#include "large_object.h"
+#include "allocator.h"
+#include "region.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#define LARGE_OBJECT_HEADER_SIZE REGION_SMALL_PAGE_SIZE
+
+static LargeObject* large_object_header(void* ptr)
+{
+    return (LargeObject*)((unsigned char*)ptr - LARGE_OBJECT_HEADER_SIZE);
+}
+
+static void* large_object_data(LargeObject* object)
+{
+    return (unsigned char*)object + LARGE_OBJECT_HEADER_SIZE;
+}
+
+static void large_object_link(LargeObjectList* list, LargeObject* object)
+{
+    object->prev = NULL;
+    object->next = NULL;
+    if (list == NULL) {
+        return;
+    }
+    object->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = object;
+    }
+    list->head = object;
+    list->count++;
+}
+
+static void large_object_unlink(LargeObjectList* list, LargeObject* object)
+{
+    if (list == NULL) {
+        return;
+    }
+    if (object->prev != NULL) {
+        object->prev->next = object->next;
+    }
+    else {
+        list->head = object->next;
+    }
+    if (object->next != NULL) {
+        object->next->prev = object->prev;
+    }
+    list->count--;
+}
+
+#if defined(__linux__)
+
+static unsigned char* large_object_map(size_t size)
+{
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : (unsigned char*)ptr;
+}
+
+static void large_object_unmap(unsigned char* base, size_t size)
+{
+    munmap(base, size);
+}
+
+static unsigned char* large_object_remap(unsigned char* base, size_t old_size, size_t new_size)
+{
+    void* ptr = mremap(base, old_size, new_size, MREMAP_MAYMOVE);
+    return ptr == MAP_FAILED ? NULL : (unsigned char*)ptr;
+}
+
+#else
+
+// No mremap, the block is moved with a copy.
+static unsigned char* large_object_map(size_t size)
+{
+    unsigned char* raw = (unsigned char*)malloc(size + REGION_SMALL_PAGE_SIZE + sizeof(void*));
+    if (raw == NULL) {
+        return NULL;
+    }
+    unsigned char* base = (unsigned char*)align_forward((uintptr_t)raw + sizeof(void*), REGION_SMALL_PAGE_SIZE);
+    ((void**)base)[-1] = raw;
+    return (unsigned char*)memset(base, 0, size);
+}
+
+static void large_object_unmap(unsigned char* base, size_t size)
+{
+    free(((void**)base)[-1]);
+}
+
+static unsigned char* large_object_remap(unsigned char* base, size_t old_size, size_t new_size)
+{
+    unsigned char* new_base = large_object_map(new_size);
+    if (new_base == NULL) {
+        return NULL;
+    }
+    memcpy(new_base, base, old_size < new_size ? old_size : new_size);
+    large_object_unmap(base, old_size);
+    return new_base;
+}
+
+#endif
+
+static size_t large_object_map_size(size_t size, size_t align)
+{
+    size_t slack = align > REGION_SMALL_PAGE_SIZE ? align - REGION_SMALL_PAGE_SIZE : 0;
+    return align_forward(LARGE_OBJECT_HEADER_SIZE + slack + size, REGION_SMALL_PAGE_SIZE);
+}
+
+void* large_object_alloc(LargeObjectList* list, size_t size, size_t align)
+{
+    void* ptr = try_large_object_alloc(list, size, align);
+    if (ptr != NULL) {
+        return ptr;
+    }
+    size_t map_size = large_object_map_size(size, align);
+    if (map_size < size) {
+        fprintf(stderr, "[ERROR] large_object_alloc failed. size=%zu is too large.\n", size);
+    }
+    else {
+        fprintf(stderr, "[ERROR] large_object_alloc failed. mmap of %zu bytes failed.\n", map_size);
+    }
+    return NULL;
+}
+
+void* try_large_object_alloc(LargeObjectList* list, size_t size, size_t align)
+{
+    size_t slack = align > REGION_SMALL_PAGE_SIZE ? align - REGION_SMALL_PAGE_SIZE : 0;
+    size_t map_size = large_object_map_size(size, align);
+    if (map_size < size) {
+        return NULL;
+    }
+
+    unsigned char* base = large_object_map(map_size);
+    if (base == NULL) {
+        return NULL;
+    }
+
+    unsigned char* data = base + LARGE_OBJECT_HEADER_SIZE;
+    if (slack != 0) {
+        data = (unsigned char*)align_forward((uintptr_t)data, align);
+    }
+    LargeObject* object = large_object_header(data);
+    object->map_base = base;
+    object->map_size = map_size;
+    object->size = size;
+    large_object_link(list, object);
+    return data;
+}
+
+void* large_object_resize(LargeObjectList* list, void* ptr, size_t new_size)
+{
+    if (ptr == NULL) {
+        return large_object_alloc(list, new_size);
+    }
+
+    LargeObject* object = large_object_header(ptr);
+    size_t offset = (unsigned char*)ptr - object->map_base;
+    size_t map_size = align_forward(offset + new_size, REGION_SMALL_PAGE_SIZE);
+    if (map_size < new_size) {
+        fprintf(stderr, "[ERROR] large_object_resize failed. size=%zu is too large.\n", new_size);
+        return NULL;
+    }
+
+    size_t old_size = object->size;
+    if (new_size > old_size) {
+        // the tail of the last page may hold bytes from before a shrink
+        size_t page_end = object->map_size - offset;
+        size_t clear_end = new_size < page_end ? new_size : page_end;
+        if (clear_end > old_size) {
+            memset((unsigned char*)ptr + old_size, 0, clear_end - old_size);
+        }
+    }
+
+    if (map_size != object->map_size) {
+        large_object_unlink(list, object);
+        unsigned char* base = large_object_remap(object->map_base, object->map_size, map_size);
+        if (base == NULL) {
+            large_object_link(list, object);
+            fprintf(stderr, "[ERROR] large_object_resize failed. mremap to %zu bytes failed.\n", map_size);
+            return NULL;
+        }
+        ptr = base + offset;
+        object = large_object_header(ptr);
+        object->map_base = base;
+        object->map_size = map_size;
+        large_object_link(list, object);
+    }
+    object->size = new_size;
+    return ptr;
+}
+
+void large_object_free(LargeObjectList* list, void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    LargeObject* object = large_object_header(ptr);
+    large_object_unlink(list, object);
+    large_object_unmap(object->map_base, object->map_size);
+}
+
+void large_object_free_all(LargeObjectList* list)
+{
+    LargeObject* object = list->head;
+    while (object != NULL) {
+        LargeObject* next = object->next;
+        large_object_unmap(object->map_base, object->map_size);
+        object = next;
+    }
+    list->head = NULL;
+    list->count = 0;
+}
+
+bool large_object_owns(LargeObjectList* list, void* ptr)
+{
+    for (LargeObject* object = list->head; object != NULL; object = object->next) {
+        if (large_object_data(object) == ptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t large_object_size(void* ptr)
+{
+    return large_object_header(ptr)->size;
+}
@@ -0,0 +1,48 @@
+#ifndef LARGE_OBJECT_H
+#define LARGE_OBJECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// large objects
+//
+// Blocks above a threshold get a mapping of their own: one header page followed
+// by the data, so the pointer is page aligned and a resize is an
+// mremap(MREMAP_MAYMOVE). The kernel moves the page tables, no bytes are copied.
+// Alignment above a page is only kept until the first resize.
+
+// size from which arenas and stacks with large objects enabled use them
+#define LARGE_OBJECT_THRESHOLD (1024 * 1024)
+
+struct LargeObject
+{
+    LargeObject* next;
+    LargeObject* prev;
+    // whole mapping, the header is the page right before the data
+    unsigned char* map_base;
+    size_t map_size;
+    // bytes requested by the last alloc/resize
+    size_t size;
+};
+
+// Objects owned by one allocator, so they can all be released together. Every
+// function also accepts a NULL list for objects nobody tracks.
+struct LargeObjectList
+{
+    LargeObject* head;
+    size_t count;
+};
+
+void* large_object_alloc(LargeObjectList* list, size_t size, size_t align = 0);
+// same without the error message
+void* try_large_object_alloc(LargeObjectList* list, size_t size, size_t align = 0);
+// zero-copy move to new_size, the bytes past the old size are zero
+void* large_object_resize(LargeObjectList* list, void* ptr, size_t new_size);
+void large_object_free(LargeObjectList* list, void* ptr);
+void large_object_free_all(LargeObjectList* list);
+// true if ptr was handed out from this list, walks the list
+bool large_object_owns(LargeObjectList* list, void* ptr);
+size_t large_object_size(void* ptr);
+
+#endif
@@ -1,6 +1,39 @@
 #include "allocator.h"
+#include "static_buddy.h"
+#include "buddy_pcp.h"
+#include "region.h"
+#include "warmup.h"
+#include "large_object.h"
+#include "pmr_allocator.h"
+#include "composable.h"
+#include "thread_heap.h"
+#include "trace.h"
+#include "allocator_stats.h"
+#include "heap_profile.h"
+#include "persistent_arena.h"
+#include "shm_allocator.h"
+#include "numa_heap.h"
+#include "handle_heap.h"
+#include "epoch.h"
+#include "coroutine.h"
+#include "heap_walk.h"
 #include <malloc.h>
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <list>
+#include <mutex>
+#include <map>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 void arena_test()
 {
@@ -466,6 +499,2272 @@ void buddy_test()
     free(buf_128B);
 }
 
+void buddy_region_test()
+{
+    // odd size and misaligned start, neither is allowed by buddy_init
+    size_t buf_size = 1000;
+    unsigned char* buf = (unsigned char*)malloc(buf_size + 1);
+    unsigned char* region = buf + 1;
+
+    const size_t align = 8;
+    BuddyAllocator buddy = { 0 };
+    buddy_init_region(&buddy, region, buf_size, align);
+    assert((uintptr_t)buddy.buffer % align == 0);
+    assert(buddy.tree_in_buffer);
+    assert(buddy.tree >= buddy.buffer + buddy.usable_size);
+    assert(buddy.tree < region + buf_size);
+    assert(POW_OF_2(buddy.tree_height) * align >= buddy.usable_size);
+
+    size_t leaf_count = buddy.usable_size / align;
+    char** blocks = (char**)malloc(leaf_count * sizeof(char*));
+    for (size_t i = 0; i < leaf_count; i++) {
+        blocks[i] = (char*)buddy_alloc(&buddy, align);
+        assert(blocks[i] != NULL);
+        assert((unsigned char*)blocks[i] >= buddy.buffer);
+        assert((unsigned char*)blocks[i] + align <= buddy.buffer + buddy.usable_size);
+        for (size_t j = 0; j < align; j++) {
+            blocks[i][j] = (char)i;
+        }
+    }
+    // the reserved tail is never handed out
+    void* tail = buddy_alloc(&buddy, align);
+    assert(tail == NULL);
+
+    for (size_t i = 0; i < leaf_count; i++) {
+        for (size_t j = 0; j < align; j++) {
+            assert(blocks[i][j] == (char)i);
+        }
+        buddy_free(&buddy, blocks[i]);
+    }
+
+    // everything merged back into the largest block below the reserved tail
+    size_t largest = POW_OF_2(buddy.tree_height - 1) * align;
+    char* big = (char*)buddy_alloc(&buddy, largest);
+    assert((unsigned char*)big == buddy.buffer);
+    buddy_free(&buddy, big);
+
+    buddy_alloc(&buddy, align);
+    buddy_free_all(&buddy);
+    big = (char*)buddy_alloc(&buddy, largest);
+    assert((unsigned char*)big == buddy.buffer);
+
+    buddy_destory(&buddy);
+    free(blocks);
+    free(buf);
+}
+
+void buddy_resize_test()
+{
+    const size_t align = 8;
+    const size_t buf_size = align * POW_OF_2(4);
+    void* buf = malloc(buf_size);
+
+    BuddyAllocator buddy = { 0 };
+    buddy_init(&buddy, buf, buf_size, align);
+
+    // grow in place by merging with the free right-hand buddies
+    char* a = (char*)buddy_alloc(&buddy, 8);
+    assert((uintptr_t)a == (uintptr_t)buf);
+    for (int i = 0; i < 8; i++) {
+        a[i] = 65 + i;
+    }
+    char* a_grown = (char*)buddy_resize(&buddy, a, 32);
+    assert(a_grown == a);
+    for (int i = 0; i < 8; i++) {
+        assert(a_grown[i] == 65 + i);
+    }
+    for (int i = 8; i < 32; i++) {
+        assert(a_grown[i] == 0);
+    }
+
+    // the 16..32 range is taken by the grown block
+    char* b = (char*)buddy_alloc(&buddy, 16);
+    assert((uintptr_t)b == (uintptr_t)buf + 32);
+    buddy_free(&buddy, b);
+
+    // shrink hands the upper halves back
+    char* a_shrunk = (char*)buddy_resize(&buddy, a_grown, 5);
+    assert(a_shrunk == a);
+    char* c = (char*)buddy_alloc(&buddy, 8);
+    assert((uintptr_t)c == (uintptr_t)a + 8);
+    char* d = (char*)buddy_alloc(&buddy, 16);
+    assert((uintptr_t)d == (uintptr_t)a + 16);
+
+    // buddy is taken, grow has to copy
+    char* a_moved = (char*)buddy_resize(&buddy, a_shrunk, 16);
+    assert(a_moved != a);
+    assert(((uintptr_t)a_moved - (uintptr_t)buf) % 16 == 0);
+    for (int i = 0; i < 8; i++) {
+        assert(a_moved[i] == 65 + i);
+    }
+    for (int i = 8; i < 16; i++) {
+        assert(a_moved[i] == 0);
+    }
+
+    // right children can't grow in place either
+    for (int i = 0; i < 8; i++) {
+        c[i] = 97 + i;
+    }
+    char* c_moved = (char*)buddy_resize(&buddy, c, 16);
+    assert(c_moved != c);
+    for (int i = 0; i < 8; i++) {
+        assert(c_moved[i] == 97 + i);
+    }
+
+    // resizing to 0 frees the block
+    char* d_resized = (char*)buddy_resize(&buddy, d, 0);
+    assert(d_resized == NULL);
+    char* e = (char*)buddy_resize(&buddy, NULL, 8);
+    assert(e != NULL);
+
+    buddy_free(&buddy, e);
+    buddy_free(&buddy, c_moved);
+    buddy_free(&buddy, a_moved);
+    char* whole = (char*)buddy_alloc(&buddy, buf_size);
+    assert((uintptr_t)whole == (uintptr_t)buf);
+
+    buddy_destory(&buddy);
+    free(buf);
+}
+
+// the 2-bit node states of allocator.cc: 0 free, 1 split, 2 allocated, 3 tail
+static int buddy_test_node_state(BuddyAllocator* buddy, size_t index)
+{
+    return (buddy->tree[index / 4] >> ((index % 4) * 2)) & 3;
+}
+
+void buddy_exact_test()
+{
+    const size_t align = 8;
+    const size_t buf_size = align * POW_OF_2(4);
+    void* buf = malloc(buf_size);
+
+    BuddyAllocator buddy = { 0 };
+    buddy_init(&buddy, buf, buf_size, align);
+
+    // 33 bytes needs 40 and takes the 64 byte buddy, only [0, 40) stays allocated
+    char* a = (char*)buddy_alloc_exact(&buddy, 33);
+    assert((uintptr_t)a == (uintptr_t)buf);
+    for (int i = 0; i < 33; i++) {
+        a[i] = 65 + i;
+    }
+    // [0, 32) is the head, [32, 40) its tail and [40, 64) is split off free
+    assert(buddy_test_node_state(&buddy, 1) == 1);
+    assert(buddy_test_node_state(&buddy, 3) == 2);
+    assert(buddy_test_node_state(&buddy, 4) == 1);
+    assert(buddy_test_node_state(&buddy, 9) == 1);
+    assert(buddy_test_node_state(&buddy, 10) == 0);
+    assert(buddy_test_node_state(&buddy, 19) == 3);
+    assert(buddy_test_node_state(&buddy, 20) == 0);
+
+    char* b = (char*)buddy_alloc(&buddy, 8);
+    assert((uintptr_t)b == (uintptr_t)buf + 40);
+    char* c = (char*)buddy_alloc(&buddy, 16);
+    assert((uintptr_t)c == (uintptr_t)buf + 48);
+    char* d = (char*)buddy_alloc(&buddy, 64);
+    assert((uintptr_t)d == (uintptr_t)buf + 64);
+    char* full = (char*)buddy_alloc(&buddy, 8);
+    assert(full == NULL);
+
+    // resizing a span always moves it
+    buddy_free(&buddy, d);
+    char* a_moved = (char*)buddy_resize(&buddy, a, 48);
+    assert((uintptr_t)a_moved == (uintptr_t)buf + 64);
+    for (int i = 0; i < 33; i++) {
+        assert(a_moved[i] == 65 + i);
+    }
+
+    // the whole span of a was released, its head and tail are reusable
+    char* e = (char*)buddy_alloc(&buddy, 32);
+    assert((uintptr_t)e == (uintptr_t)buf);
+    char* f = (char*)buddy_alloc(&buddy, 8);
+    assert((uintptr_t)f == (uintptr_t)buf + 32);
+
+    buddy_free(&buddy, a_moved);
+    buddy_free(&buddy, b);
+    buddy_free(&buddy, c);
+    buddy_free(&buddy, e);
+    buddy_free(&buddy, f);
+    char* whole = (char*)buddy_alloc(&buddy, buf_size);
+    assert((uintptr_t)whole == (uintptr_t)buf);
+
+    buddy_destory(&buddy);
+    free(buf);
+}
+
+void buddy_pcp_test()
+{
+    const size_t align = 64;
+    const size_t buf_size = 64 * 1024;
+    void* raw = malloc(buf_size + align);
+    void* buf = (void*)align_forward((uintptr_t)raw, align);
+
+    BuddySharedAllocator* shared = new BuddySharedAllocator();
+    buddy_shared_init(shared, buf, buf_size, align);
+
+    {
+        BuddyPageCache pcp;
+        buddy_pcp_init(&pcp, shared, 4, 8);
+
+        // first alloc refills `low` blocks in one batch
+        char* a = (char*)buddy_pcp_alloc(&pcp, 10);
+        assert(a != NULL);
+        assert(pcp.lists[0].count == 3);
+        char* b = (char*)buddy_pcp_alloc(&pcp, 100);
+        assert(b != NULL);
+        assert(pcp.lists[1].count == 3);
+        assert(((uintptr_t)b - (uintptr_t)buf) % 128 == 0);
+
+        // past the high watermark the list drains back to low
+        char* blocks[8];
+        for (int i = 0; i < 8; i++) {
+            blocks[i] = (char*)buddy_pcp_alloc(&pcp, align);
+        }
+        for (int i = 0; i < 8; i++) {
+            buddy_pcp_free(&pcp, blocks[i], align);
+        }
+        assert(pcp.lists[0].count <= pcp.high);
+        buddy_pcp_free(&pcp, a, 10);
+        assert(pcp.lists[0].count >= pcp.low && pcp.lists[0].count <= pcp.high);
+
+        // large orders bypass the cache
+        char* big = (char*)buddy_pcp_alloc(&pcp, 4096);
+        assert(big != NULL);
+        buddy_pcp_free(&pcp, big, 4096);
+
+        buddy_pcp_free(&pcp, b, 100);
+        buddy_pcp_drain(&pcp);
+        for (int i = 0; i < BUDDY_PCP_ORDERS; i++) {
+            assert(pcp.lists[i].count == 0);
+        }
+
+        // every block went back and merged
+        void* whole = buddy_shared_alloc(shared, buf_size);
+        assert(whole == buf);
+        buddy_shared_free(shared, whole);
+    }
+
+    // concurrent churn, each thread checks its blocks weren't handed to anyone else
+    {
+        const int thread_count = 4;
+        std::thread threads[thread_count];
+        for (int t = 0; t < thread_count; t++) {
+            threads[t] = std::thread([shared, t]() {
+                BuddyPageCache pcp;
+                buddy_pcp_init(&pcp, shared, 4, 16);
+                unsigned char* live[16] = { 0 };
+                for (int i = 0; i < 2000; i++) {
+                    int slot = i % 16;
+                    if (live[slot] != NULL) {
+                        for (size_t j = 0; j < 64; j++) {
+                            assert(live[slot][j] == (unsigned char)(t + 1));
+                        }
+                        buddy_pcp_free(&pcp, live[slot], 64);
+                    }
+                    live[slot] = (unsigned char*)buddy_pcp_alloc(&pcp, 64);
+                    assert(live[slot] != NULL);
+                    memset(live[slot], t + 1, 64);
+                }
+                for (int slot = 0; slot < 16; slot++) {
+                    buddy_pcp_free(&pcp, live[slot], 64);
+                }
+                buddy_pcp_drain(&pcp);
+            });
+        }
+        for (int t = 0; t < thread_count; t++) {
+            threads[t].join();
+        }
+
+        void* whole = buddy_shared_alloc(shared, buf_size);
+        assert(whole == buf);
+    }
+
+    buddy_shared_destory(shared);
+    delete shared;
+    free(raw);
+}
+
+void region_test()
+{
+    {
+        Region region;
+        bool mapped = region_map(&region, 10000);
+        assert(mapped);
+        assert(region.size == 3 * REGION_SMALL_PAGE_SIZE);
+        assert(region.committed == region.size);
+        assert((uintptr_t)region.base % REGION_SMALL_PAGE_SIZE == 0);
+        memset(region.base, 0xAB, region.size);
+        region_unmap(&region);
+        assert(region.base == NULL);
+    }
+
+    // reserved huge page region backing an arena, committed as the arena grows
+    {
+        Region region;
+        bool mapped = region_map(&region, 3 * REGION_HUGE_PAGE_SIZE + 1, Region_Flag_Huge_Pages | Region_Flag_Reserve);
+        assert(mapped);
+        assert(region.page_size == REGION_HUGE_PAGE_SIZE);
+        assert(region.size == 4 * REGION_HUGE_PAGE_SIZE);
+        assert((uintptr_t)region.base % REGION_HUGE_PAGE_SIZE == 0);
+        assert(region.committed == 0);
+
+        ArenaAllocator arena = { 0 };
+        arena_init_region(&arena, &region);
+        char* a = (char*)arena_alloc(&arena, 100);
+        assert(a != NULL);
+        assert(region.committed == REGION_HUGE_PAGE_SIZE);
+        a[99] = 1;
+
+        char* b = (char*)arena_alloc(&arena, 2 * REGION_HUGE_PAGE_SIZE);
+        assert(b != NULL);
+        assert(region.committed == 3 * REGION_HUGE_PAGE_SIZE);
+        b[2 * REGION_HUGE_PAGE_SIZE - 1] = 1;
+
+        char* c = (char*)arena_resize(&arena, b, 2 * REGION_HUGE_PAGE_SIZE, 3 * REGION_HUGE_PAGE_SIZE);
+        assert(c == b);
+        assert(region.committed == region.size);
+
+        char* d = (char*)arena_alloc(&arena, REGION_HUGE_PAGE_SIZE);
+        assert(d == NULL);
+        region_unmap(&region);
+    }
+
+    // buddy whose minimum block is one huge page
+    {
+        Region region;
+        bool mapped = region_map(&region, 8 * REGION_HUGE_PAGE_SIZE, Region_Flag_Huge_Pages);
+        assert(mapped);
+        BuddyAllocator buddy = { 0 };
+        buddy_init(&buddy, region.base, region.size, region.page_size);
+        char* a = (char*)buddy_alloc(&buddy, 1);
+        assert((unsigned char*)a == region.base);
+        char* b = (char*)buddy_alloc(&buddy, 1);
+        assert((unsigned char*)b == region.base + REGION_HUGE_PAGE_SIZE);
+        buddy_free(&buddy, a);
+        buddy_free(&buddy, b);
+        buddy_destory(&buddy);
+        region_unmap(&region);
+    }
+}
+
+void warmup_test()
+{
+    size_t buf_size = 1024 * 1024 + 100;
+    char* buf = (char*)malloc(buf_size);
+
+    PoolAllocator pool = { 0 };
+    pool_init(&pool, buf, buf_size, 64);
+    size_t chunk_count = pool.buffer_size / pool.chunk_size;
+
+    WarmupResult result;
+    bool warmed = pool_warmup(&pool, NULL, &result);
+    assert(warmed);
+    assert(result.bytes >= pool.buffer_size);
+    assert(result.pages >= pool.buffer_size / REGION_SMALL_PAGE_SIZE);
+    assert(result.thread_count == 1);
+
+    // the free list written by pool_init survives the touch loop
+    size_t node_count = 0;
+    for (PoolListNode* node = pool.head; node != NULL; node = node->next) {
+        node_count++;
+    }
+    assert(node_count == chunk_count);
+
+    // forced parallel warm-up of a fresh region, with mlock
+    Region region;
+    bool mapped = region_map(&region, 8 * 1024 * 1024);
+    assert(mapped);
+    BuddyAllocator buddy = { 0 };
+    buddy_init(&buddy, region.base, region.size, 4096);
+    WarmupOptions options = { 0 };
+    options.thread_count = 4;
+    options.parallel_threshold = 1024 * 1024;
+    options.lock = true;
+    bool ok = buddy_warmup(&buddy, &options, &result);
+    assert(ok == result.locked);
+    assert(result.thread_count == 4);
+    assert(result.bytes == region.size);
+    buddy_destory(&buddy);
+    region_unmap(&region);
+
+    Region populated;
+    mapped = region_map(&populated, 1024 * 1024, Region_Flag_Populate);
+    assert(mapped);
+    assert(populated.base[0] == 0);
+    region_unmap(&populated);
+
+    free(buf);
+}
+
+void static_buddy_test()
+{
+    typedef Buddy<1024, 64> Buddy1K;
+    static_assert(Buddy1K::Leaves == 16, "");
+    static_assert(Buddy1K::Height == 4, "");
+    static_assert(Buddy1K::block_offset(Buddy1K::levels.first_index[4] + 3, 4) == 3 * 64, "");
+    static_assert(Buddy1K::block_offset(2, 1) == 512, "");
+
+    void* buf = malloc(2048);
+    unsigned char* aligned = (unsigned char*)align_forward((uintptr_t)buf, 64);
+
+    Buddy1K* buddy = (Buddy1K*)malloc(sizeof(Buddy1K));
+    buddy->init(aligned);
+    assert(buddy->longest[0] == Buddy1K::Height + 1);
+
+    char* a = (char*)buddy->alloc(10);
+    assert((unsigned char*)a == aligned);
+    assert(buddy->block_size(a) == 64);
+    for (int i = 0; i < 10; i++) {
+        a[i] = 65 + i;
+    }
+
+    char* b = (char*)buddy->alloc(65);
+    assert(buddy->block_size(b) == 128);
+    assert(((uintptr_t)b - (uintptr_t)aligned) % 128 == 0);
+
+    char* c = (char*)buddy->alloc(64);
+    // the free 64 byte buddy next to a is the tightest fit
+    assert((unsigned char*)c == aligned + 64);
+
+    char* d = (char*)buddy->alloc(512);
+    assert((unsigned char*)d == aligned + 512);
+    char* full = (char*)buddy->alloc(512);
+    assert(full == NULL);
+
+    for (int i = 0; i < 10; i++) {
+        assert(a[i] == 65 + i);
+    }
+
+    buddy->free(b);
+    buddy->free(a);
+
+    // a's old bytes are cleared, nothing past the requested size is touched
+    char* zeroed = (char*)buddy->alloc_zeroed(5);
+    assert(zeroed == a);
+    for (int i = 0; i < 5; i++) {
+        assert(zeroed[i] == 0);
+    }
+    assert(zeroed[5] == 65 + 5);
+    buddy->free(zeroed);
+
+    buddy->free(c);
+    buddy->free(d);
+    assert(buddy->longest[0] == Buddy1K::Height + 1);
+
+    char* whole = (char*)buddy->alloc(1024);
+    assert((unsigned char*)whole == aligned);
+    full = (char*)buddy->alloc(1);
+    assert(full == NULL);
+    buddy->free(whole);
+
+    buddy->alloc(64);
+    buddy->free_all();
+    assert(buddy->longest[0] == Buddy1K::Height + 1);
+
+    free(buddy);
+    free(buf);
+}
+
+void numa_test()
+{
+    int node_count = region_numa_node_count();
+    assert(node_count >= 1 && node_count <= REGION_MAX_NUMA_NODES);
+    int node = region_numa_current_node();
+    assert(node >= 0 && node < node_count);
+
+    Region region;
+    bool ok = region_map_node(&region, 3 * REGION_SMALL_PAGE_SIZE, node_count - 1, Region_Flag_Populate);
+    assert(ok);
+    assert(region.committed == region.size && region.base[region.size - 1] == 0);
+    region_unmap(&region);
+    // a node that doesn't exist maps unbound
+    ok = region_map_node(&region, REGION_SMALL_PAGE_SIZE, REGION_MAX_NUMA_NODES + 1);
+    assert(ok);
+    region_unmap(&region);
+
+    NumaArenas arenas;
+    ok = numa_arenas_init(&arenas, 1024 * 1024, Region_Flag_Reserve);
+    assert(ok);
+    assert(arenas.node_count == node_count);
+    ArenaAllocator* arena = numa_arenas_local(&arenas);
+    if (node_count == 1) {
+        assert(arena == &arenas.arenas[0]);
+    }
+    char* text = (char*)arena_alloc(arena, 64 * 1024);
+    assert(text != NULL && (unsigned char*)text >= arena->buffer && (unsigned char*)text < arena->buffer + arena->buffer_size);
+    memset(text, 'n', 64 * 1024);
+    assert(numa_arenas_node(&arenas, -1) == &arenas.arenas[0]);
+    assert(numa_arenas_node(&arenas, node_count) == &arenas.arenas[0]);
+    numa_arenas_destroy(&arenas);
+
+    NumaPools pools;
+    ok = numa_pools_init(&pools, 64 * 1024, 100, 64);
+    assert(ok);
+    assert(pools.node_count == node_count);
+    for (int i = 0; i < node_count; i++) {
+        PoolAllocator* pool = numa_pools_node(&pools, i);
+        assert(pool->chunk_size == 128);
+        void* chunk = pool_alloc(pool);
+        assert(chunk != NULL && ((uintptr_t)chunk & 63) == 0);
+        pool_free(pool, chunk);
+    }
+    PoolAllocator* pool = numa_pools_local(&pools);
+    assert(pool >= &pools.pools[0] && pool < &pools.pools[node_count]);
+    numa_pools_destroy(&pools);
+}
+
+void large_object_test()
+{
+    const size_t page = REGION_SMALL_PAGE_SIZE;
+
+    LargeObjectList list = { 0 };
+    size_t size_1 = 3 * 1024 * 1024 + 5;
+    unsigned char* a = (unsigned char*)large_object_alloc(&list, size_1);
+    assert(a != NULL);
+    assert((uintptr_t)a % page == 0);
+    assert(large_object_size(a) == size_1);
+    assert(large_object_owns(&list, a));
+    for (size_t i = 0; i < size_1; i += 4096) {
+        a[i] = (unsigned char)(i / 4096);
+    }
+    a[size_1 - 1] = 0xAB;
+
+    unsigned char* b = (unsigned char*)large_object_alloc(&list, 64 * 1024, 64 * 1024);
+    assert((uintptr_t)b % (64 * 1024) == 0);
+    assert(list.count == 2);
+
+    // grow: contents move with the pages, the new bytes are zero
+    size_t size_2 = 256 * 1024 * 1024;
+    a = (unsigned char*)large_object_resize(&list, a, size_2);
+    assert(a != NULL);
+    assert((uintptr_t)a % page == 0);
+    assert(large_object_owns(&list, a));
+    assert(list.count == 2);
+    for (size_t i = 0; i < size_1 - 1; i += 4096) {
+        assert(a[i] == (unsigned char)(i / 4096));
+    }
+    assert(a[size_1 - 1] == 0xAB);
+    assert(a[size_1] == 0);
+    assert(a[size_2 - 1] == 0);
+
+    // shrink inside a page then grow again, the dropped bytes come back zero
+    a = (unsigned char*)large_object_resize(&list, a, size_1 - 1);
+    a = (unsigned char*)large_object_resize(&list, a, size_1 + 100);
+    assert(a[size_1 - 1] == 0);
+
+    large_object_free(&list, b);
+    assert(!large_object_owns(&list, b));
+    assert(list.count == 1);
+    large_object_free_all(&list);
+    assert(list.head == NULL && list.count == 0);
+
+    // untracked
+    void* c = large_object_alloc(NULL, 2 * page);
+    c = large_object_resize(NULL, c, 8 * page);
+    assert(large_object_size(c) == 8 * page);
+    large_object_free(NULL, c);
+
+    // arena: small requests stay in the buffer, large ones get a mapping
+    size_t buf_size = 64 * 1024;
+    char* buf = (char*)malloc(buf_size);
+    ArenaAllocator arena;
+    arena_init(&arena, buf, buf_size);
+    arena_use_large_objects(&arena, 32 * 1024);
+
+    char* small = (char*)arena_alloc(&arena, 100);
+    assert((unsigned char*)small == arena.buffer);
+    char* grow = (char*)arena_alloc(&arena, 1000);
+    memset(grow, 7, 1000);
+    size_t offset = arena.offset;
+
+    // the last allocation moves out and gives its arena space back
+    char* big = (char*)arena_resize(&arena, grow, 1000, 40 * 1024);
+    assert(big != grow);
+    assert(arena.large_objects.count == 1);
+    assert(arena.offset == offset - 1000);
+    assert(big[999] == 7 && big[1000] == 0);
+
+    big = (char*)arena_resize(&arena, big, 40 * 1024, 100 * 1024 * 1024);
+    assert(big != NULL && big[0] == 7);
+    assert(arena.large_objects.count == 1);
+
+    void* direct = arena_alloc(&arena, 1024 * 1024);
+    assert(direct != NULL && arena.large_objects.count == 2);
+    arena_free(&arena, direct);
+    assert(arena.large_objects.count == 1);
+
+    arena_free_all(&arena);
+    assert(arena.offset == 0 && arena.large_objects.count == 0);
+
+    // stack: large blocks can be freed out of order
+    StackAllocator stack;
+    stack_init(&stack, buf, buf_size);
+    stack_use_large_objects(&stack, 32 * 1024);
+
+    char* s1 = (char*)stack_alloc(&stack, 128);
+    char* s2 = (char*)stack_alloc(&stack, 1024 * 1024);
+    char* s3 = (char*)stack_alloc(&stack, 256);
+    assert(stack.large_objects.count == 1);
+    assert((unsigned char*)s1 >= stack.buffer && (unsigned char*)s3 < stack.buffer + stack.buffer_size);
+    s2 = (char*)stack_resize(&stack, s2, 1024 * 1024, 8 * 1024 * 1024);
+    assert(s2 != NULL && large_object_size(s2) == 8 * 1024 * 1024);
+    stack_free(&stack, s2);
+    assert(stack.large_objects.count == 0);
+
+    memset(s3, 3, 256);
+    char* s4 = (char*)stack_resize(&stack, s3, 256, 64 * 1024);
+    assert(s4 != s3 && s4[255] == 3 && s4[256] == 0);
+    assert(stack.large_objects.count == 1);
+    stack_free(&stack, s1);
+    stack_free_all(&stack);
+    assert(stack.offset == 0 && stack.large_objects.count == 0);
+
+    free(buf);
+}
+
+void pmr_test()
+{
+    size_t buf_size = 64 * 1024;
+    unsigned char* buf = (unsigned char*)malloc(buf_size + 4096);
+    unsigned char* aligned = (unsigned char*)align_forward((uintptr_t)buf, 4096);
+
+    // request-scoped arena behind vector and unordered_map
+    ArenaAllocator arena;
+    arena_init(&arena, aligned, buf_size);
+    ArenaResource arena_resource(&arena);
+    {
+        std::pmr::vector<int> vec(&arena_resource);
+        for (int i = 0; i < 1000; i++) {
+            vec.push_back(i);
+        }
+        assert((unsigned char*)vec.data() >= arena.buffer && (unsigned char*)vec.data() < arena.buffer + arena.buffer_size);
+
+        std::pmr::unordered_map<int, int> map(&arena_resource);
+        for (int i = 0; i < 100; i++) {
+            map[i] = i * i;
+        }
+        assert(map[7] == 49);
+        assert(arena.offset > 1000 * sizeof(int));
+    }
+    ArenaResource same_arena(&arena);
+    assert(arena_resource == same_arena);
+    assert(arena_resource != *std::pmr::new_delete_resource());
+
+    void* over_aligned = arena_resource.allocate(100, 256);
+    assert((uintptr_t)over_aligned % 256 == 0);
+
+    bool thrown = false;
+    try {
+        (void)arena_resource.allocate(buf_size);
+    }
+    catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    assert(thrown);
+    arena_free_all(&arena);
+
+    // stack, alignment above what its header can record
+    StackAllocator stack;
+    stack_init(&stack, aligned, buf_size);
+    StackResource stack_resource(&stack);
+    void* stack_ptr = stack_resource.allocate(64, 1024);
+    assert((uintptr_t)stack_ptr % 1024 == 0);
+    stack_resource.deallocate(stack_ptr, 64, 1024);
+    assert(stack.offset != 0);
+    {
+        std::pmr::vector<double> vec(100, 1.0, &stack_resource);
+        assert(vec[99] == 1.0);
+    }
+    stack_free_all(&stack);
+
+    // pool, one node per chunk
+    PoolAllocator pool;
+    pool_init(&pool, aligned, buf_size, 32);
+    PoolResource pool_resource(&pool);
+    {
+        std::pmr::list<int> list(&pool_resource);
+        for (int i = 0; i < 100; i++) {
+            list.push_back(i);
+        }
+        assert(list.back() == 99);
+    }
+    size_t free_chunks = 0;
+    for (PoolListNode* node = pool.head; node != NULL; node = node->next) {
+        free_chunks++;
+    }
+    assert(free_chunks == pool.buffer_size / pool.chunk_size);
+    thrown = false;
+    try {
+        (void)pool_resource.allocate(64);
+    }
+    catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // free list
+    FreeListAllocator free_list;
+    free_list_init(&free_list, aligned, buf_size, Allocation_Policy_Best_Fit);
+    FreeListResource free_list_resource(&free_list);
+    {
+        std::pmr::map<int, int> map(&free_list_resource);
+        for (int i = 0; i < 200; i++) {
+            map[i] = -i;
+        }
+        assert(map[150] == -150);
+        void* aligned_ptr = free_list_resource.allocate(10, 128);
+        assert((uintptr_t)aligned_ptr % 128 == 0);
+        free_list_resource.deallocate(aligned_ptr, 10, 128);
+    }
+    assert(free_list.buffer_used == 0);
+
+    // buddy
+    BuddyAllocator buddy = { 0 };
+    buddy_init(&buddy, aligned, buf_size, 64);
+    BuddyResource buddy_resource(&buddy);
+    {
+        std::pmr::vector<int> vec(&buddy_resource);
+        for (int i = 0; i < 2000; i++) {
+            vec.push_back(i);
+        }
+        assert(vec[1999] == 1999);
+        void* page = buddy_resource.allocate(100, 4096);
+        assert((uintptr_t)page % 4096 == 0);
+        buddy_resource.deallocate(page, 100, 4096);
+    }
+    void* whole = buddy_alloc(&buddy, buf_size);
+    assert(whole == aligned);
+    buddy_free(&buddy, whole);
+    buddy_destory(&buddy);
+
+    free(buf);
+}
+
+void composable_test()
+{
+    size_t buf_size = 16 * 1024;
+    unsigned char* buf = (unsigned char*)malloc(4 * buf_size + 4096);
+    unsigned char* aligned = (unsigned char*)align_forward((uintptr_t)buf, 4096);
+
+    StackAllocator stack;
+    stack_init(&stack, aligned, buf_size);
+    PoolAllocator pool;
+    pool_init(&pool, aligned + buf_size, 256, 64);
+    BuddyAllocator buddy = { 0 };
+    buddy_init(&buddy, aligned + 2 * buf_size, buf_size, 64);
+
+    // stack for <= 256 B, 64 B pool chunks up to 1 KiB, then buddy, malloc when any of them is full
+    typedef Segregator<256, Fallback<StackBlock, MallocBlock>,
+        Segregator<1024, Fallback<PoolBlock, MallocBlock>, Fallback<BuddyBlock, MallocBlock>>> Policy;
+    Policy policy;
+    policy.small.primary.stack = &stack;
+    policy.large.small.primary.pool = &pool;
+    policy.large.large.primary.buddy = &buddy;
+
+    void* s1 = policy.allocate(100);
+    assert(policy.small.primary.owns(s1));
+    void* p1 = policy.allocate(300);
+    // a 300 byte request doesn't fit a 64 B chunk, the pool falls back to malloc
+    assert(!policy.large.small.primary.owns(p1));
+    assert(policy.owns(p1));
+    void* b1 = policy.allocate(4000);
+    assert(policy.large.large.primary.owns(b1));
+    void* whole = buddy_alloc(&buddy, buf_size);
+    assert(whole == NULL);
+    void* b2 = policy.allocate(2 * buf_size);
+    assert(!policy.large.large.primary.owns(b2));
+    memset(b2, 1, 2 * buf_size);
+
+    policy.deallocate(b2, 2 * buf_size);
+    policy.deallocate(b1, 4000);
+    policy.deallocate(p1, 300);
+    policy.deallocate(s1, 100);
+    assert(stack.offset == 0);
+    whole = buddy_alloc(&buddy, buf_size);
+    assert(whole != NULL);
+    buddy_free_all(&buddy);
+
+    // small chunks of the pool, then malloc when the four chunks are gone
+    typedef Fallback<PoolBlock, MallocBlock> PoolOrMalloc;
+    PoolOrMalloc pool_or_malloc;
+    pool_or_malloc.primary.pool = &pool;
+    void* chunks[5];
+    for (int i = 0; i < 5; i++) {
+        chunks[i] = pool_or_malloc.allocate(48);
+        assert(chunks[i] != NULL);
+    }
+    assert(pool.head == NULL);
+    assert(!pool_or_malloc.primary.owns(chunks[4]));
+    for (int i = 0; i < 5; i++) {
+        pool_or_malloc.deallocate(chunks[i], 48);
+    }
+    assert(pool.head != NULL);
+
+    // one free list per 128 B bucket
+    FreeListAllocator free_lists[4];
+    typedef Bucketizer<FreeListBlock, 0, 512, 128> Buckets;
+    static_assert(Buckets::Count == 4, "");
+    static_assert(Buckets::bucket_for(128) == 0 && Buckets::bucket_for(129) == 1, "");
+    Buckets buckets;
+    for (int i = 0; i < 4; i++) {
+        free_list_init(&free_lists[i], aligned + 3 * buf_size + i * 1024, 1024, Allocation_Policy_First_Fit);
+        buckets.buckets[i].free_list = &free_lists[i];
+    }
+    void* x = buckets.allocate(200);
+    assert(buckets.buckets[1].owns(x));
+    assert(buckets.owns(x));
+    void* too_big = buckets.allocate(513);
+    assert(too_big == NULL);
+    buckets.deallocate(x, 200);
+    assert(free_lists[1].buffer_used == 0);
+
+    // size header in front, guard word behind
+    struct Guard
+    {
+        uint32_t magic = 0xFEEDFACE;
+    };
+    AffixAllocator<MallocBlock, size_t, Guard> affix;
+    char* a = (char*)affix.allocate(13);
+    assert((uintptr_t)a % alignof(max_align_t) == 0);
+    *affix.prefix(a) = 13;
+    memset(a, 0x11, 13);
+    assert(affix.suffix(a, 13)->magic == 0xFEEDFACE);
+    assert(*affix.prefix(a) == 13);
+    void* over_aligned = affix.allocate(8, 64);
+    assert(over_aligned == NULL);
+    affix.deallocate(a, 13);
+
+    buddy_destory(&buddy);
+    free(buf);
+}
+
+struct OomTestState
+{
+    int calls;
+    BuddyAllocator* buddy;
+    void* evictable;
+};
+
+static OomAction oom_test_evict(void* allocator, size_t size, size_t align, void* user_data, void** fallback)
+{
+    OomTestState* state = (OomTestState*)user_data;
+    state->calls++;
+    assert(allocator == state->buddy);
+    if (state->evictable == NULL) {
+        return Oom_Action_Fail;
+    }
+    buddy_free(state->buddy, state->evictable);
+    state->evictable = NULL;
+    return Oom_Action_Retry;
+}
+
+static OomAction oom_test_fallback(void* allocator, size_t size, size_t align, void* user_data, void** fallback)
+{
+    OomTestState* state = (OomTestState*)user_data;
+    state->calls++;
+    *fallback = calloc(1, size);
+    return Oom_Action_Fallback;
+}
+
+static OomAction oom_test_stubborn(void* allocator, size_t size, size_t align, void* user_data, void** fallback)
+{
+    OomTestState* state = (OomTestState*)user_data;
+    state->calls++;
+    return Oom_Action_Retry;
+}
+
+void oom_test()
+{
+#if defined(__linux__)
+    // the try_ variants stay quiet, catch anything they print
+    fflush(stderr);
+    char path[] = "/tmp/memory_allocator_oom_XXXXXX";
+    int capture = mkstemp(path);
+    assert(capture >= 0);
+    int saved_stderr = dup(2);
+    dup2(capture, 2);
+#endif
+
+    unsigned char buffer[1024];
+    {
+        ArenaAllocator arena = { 0 };
+        arena_init(&arena, buffer, 64);
+        void* fits = try_arena_alloc(&arena, 48);
+        assert(fits != NULL);
+        void* full = try_arena_alloc(&arena, 48);
+        assert(full == NULL);
+
+        StackAllocator stack = { 0 };
+        stack_init(&stack, buffer, 64);
+        full = try_stack_alloc(&stack, 100);
+        assert(full == NULL);
+
+        PoolAllocator pool = { 0 };
+        pool_init(&pool, buffer, 64, 32);
+        void* first = try_pool_alloc(&pool);
+        void* second = try_pool_alloc(&pool);
+        assert(first != NULL && second != NULL);
+        full = try_pool_alloc(&pool);
+        assert(full == NULL);
+
+        FreeListAllocator free_list = { 0 };
+        free_list_init(&free_list, buffer, 128, Allocation_Policy_First_Fit);
+        full = try_free_list_alloc(&free_list, 256);
+        assert(full == NULL);
+    }
+
+#if defined(__linux__)
+    fflush(stderr);
+    dup2(saved_stderr, 2);
+    close(saved_stderr);
+    off_t captured = lseek(capture, 0, SEEK_END);
+    assert(captured == 0);
+    close(capture);
+    unlink(path);
+#endif
+
+    size_t size = 4096;
+    void* heap = aligned_alloc(64, size);
+    BuddyAllocator buddy = { 0 };
+    buddy_init(&buddy, heap, size, 64);
+    OomTestState state = { 0 };
+    state.buddy = &buddy;
+
+    // evict and retry
+    state.evictable = buddy_alloc(&buddy, 2048);
+    void* held = buddy_alloc(&buddy, 2048);
+    buddy_set_oom_handler(&buddy, oom_test_evict, &state);
+    void* block = try_buddy_alloc(&buddy, 2048);
+    assert(block == state.evictable || (block != NULL && state.evictable == NULL));
+    assert(state.calls == 1);
+    // nothing left to evict
+    void* full = try_buddy_alloc(&buddy, 64);
+    assert(full == NULL && state.calls == 2);
+
+    // a fallback block comes from elsewhere
+    state.calls = 0;
+    buddy_set_oom_handler(&buddy, oom_test_fallback, &state);
+    unsigned char* fallback = (unsigned char*)buddy_alloc(&buddy, 100);
+    assert(fallback != NULL && state.calls == 1);
+    assert(fallback < buddy.buffer || fallback >= buddy.buffer + size);
+    free(fallback);
+
+    // a handler that never makes room gives up after OOM_MAX_RETRIES
+    state.calls = 0;
+    buddy_set_oom_handler(&buddy, oom_test_stubborn, &state);
+    full = try_buddy_alloc(&buddy, 64);
+    assert(full == NULL);
+    assert(state.calls == OOM_MAX_RETRIES);
+
+    buddy_free(&buddy, block);
+    buddy_free(&buddy, held);
+    buddy_destory(&buddy);
+    free(heap);
+}
+
+void thread_heap_test()
+{
+    ThreadHeap* heap = thread_heap_create();
+
+    char* a = (char*)thread_heap_alloc(heap, 10);
+    char* b = (char*)thread_heap_alloc(heap, 10);
+    assert(a != NULL && b == a + 16);
+    assert(thread_heap_block_size(a) == 16);
+    assert(thread_heap_owner(a) == heap);
+    assert((uintptr_t)thread_heap_segment(a) % THREAD_HEAP_SEGMENT_SIZE == 0);
+    memset(a, 1, 16);
+
+    char* c = (char*)thread_heap_alloc(heap, 100);
+    assert(thread_heap_block_size(c) == 128);
+    assert(thread_heap_segment(c) != thread_heap_segment(a));
+
+    // freed locally, handed out again
+    thread_heap_free(heap, a);
+    char* d = (char*)thread_heap_alloc(heap, 16);
+    assert(d == a && d[0] == 0);
+
+    // huge blocks get a segment of their own
+    size_t huge_size = 5 * 1024 * 1024;
+    char* huge = (char*)thread_heap_alloc(heap, huge_size);
+    assert(huge != NULL && thread_heap_block_size(huge) >= huge_size);
+    huge[huge_size - 1] = 1;
+    thread_heap_free(heap, huge);
+
+    // frees from other threads queue up until the owner runs dry
+    const size_t count = 1000;
+    void* blocks[count];
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = thread_heap_alloc(heap, 64);
+    }
+    ThreadHeapSegment* segment = thread_heap_segment(blocks[0]);
+    // keeps the segment alive through thread_heap_collect
+    void* pin = thread_heap_alloc(heap, 64);
+    size_t used = segment->used;
+    std::thread consumer([&blocks, count]() {
+        ThreadHeap* local = thread_heap_local();
+        for (size_t i = 0; i < count; i++) {
+            thread_heap_free(local, blocks[i]);
+        }
+        // blocks of this thread survive its exit
+        void* kept = thread_heap_alloc(local, 32);
+        blocks[0] = kept;
+    });
+    consumer.join();
+    assert(segment->used == used);
+    assert(segment->remote_free.load() != NULL);
+
+    // the next slow path reuses them before carving another slab
+    std::vector<void*> fill;
+    while (segment->pool.head != NULL) {
+        fill.push_back(thread_heap_alloc(heap, 64));
+    }
+    size_t grown = segment->grown;
+    void* recycled = thread_heap_alloc(heap, 64);
+    assert(thread_heap_segment(recycled) == segment);
+    assert(segment->remote_free.load() == NULL && segment->grown == grown);
+    thread_heap_free(heap, recycled);
+    for (void* block : fill) {
+        thread_heap_free(heap, block);
+    }
+    thread_heap_collect(heap);
+    assert(segment->used == used - count);
+    assert(segment->remote_free.load() == NULL);
+    void* again = thread_heap_alloc(heap, 64);
+    assert(thread_heap_segment(again) == segment);
+    thread_heap_free(heap, again);
+    thread_heap_free(heap, pin);
+
+    // the consumer's segment was abandoned with one live block, the next heap adopts it
+    void* kept = blocks[0];
+    assert(thread_heap_owner(kept) == NULL);
+    ThreadHeap* adopter = thread_heap_create();
+    assert(thread_heap_owner(kept) == adopter);
+    thread_heap_free(adopter, kept);
+    thread_heap_collect(adopter);
+    // 32 bytes is class 1, the segment was empty and got released
+    assert(adopter->segments[1] == NULL);
+    thread_heap_destroy(adopter);
+
+    thread_heap_free(heap, b);
+    thread_heap_free(heap, c);
+    thread_heap_free(heap, d);
+    thread_heap_destroy(heap);
+}
+
+void trace_test()
+{
+#if defined(__linux__)
+    char path[] = "/tmp/memory_allocator_trace_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    // enough records to flush the writer's buffer a few times
+    const size_t count = 100000;
+    TraceWriter writer;
+    bool opened = trace_writer_open(&writer, path);
+    assert(opened);
+    for (size_t i = 0; i < count; i++) {
+        TraceOp op = i % 3 == 0 ? Trace_Op_Alloc : (i % 3 == 1 ? Trace_Op_Realloc : Trace_Op_Free);
+        trace_writer_append(&writer, op, 0x1000 + i * 16, i, i * 7, (size_t)1 << (i % 13), (uint32_t)(i % 5));
+    }
+    trace_writer_close(&writer);
+    assert(writer.written == count);
+
+    TraceReader reader;
+    opened = trace_reader_open(&reader, path);
+    assert(opened);
+    assert(reader.count == count);
+    uint64_t last_time = 0;
+    for (size_t i = 0; i < reader.count; i++) {
+        const TraceRecord* record = &reader.records[i];
+        assert(record->op == (i % 3 == 0 ? Trace_Op_Alloc : (i % 3 == 1 ? Trace_Op_Realloc : Trace_Op_Free)));
+        assert(record->id == 0x1000 + i * 16);
+        assert(record->prev_id == i);
+        assert(record->size == i * 7);
+        assert(record->align_log2 == i % 13);
+        assert(record->thread == i % 5);
+        assert(record->time_ns >= last_time);
+        last_time = record->time_ns;
+        trace_reader_release(&reader, i);
+    }
+    trace_reader_close(&reader);
+
+    // a torn last record is dropped, the rest still reads
+    int truncated = truncate(path, sizeof(TraceHeader) + 10 * sizeof(TraceRecord) + 3);
+    assert(truncated == 0);
+    opened = trace_reader_open(&reader, path);
+    assert(opened);
+    assert(reader.count == 10);
+    assert(reader.records[9].id == 0x1000 + 9 * 16);
+    trace_reader_close(&reader);
+
+    unlink(path);
+#endif
+}
+
+void allocator_stats_test()
+{
+#if MEMORY_ALLOCATOR_STATS
+    AllocatorStatsSnapshot snapshot;
+
+    {
+        unsigned char buffer[1024];
+        ArenaAllocator arena = { 0 };
+        arena_init(&arena, buffer, sizeof(buffer));
+        arena_alloc(&arena, 10, 1);
+        // 6 bytes of padding to reach the next 16 byte boundary
+        arena_alloc(&arena, 16, 16);
+        void* too_big = arena_alloc(&arena, 2048, 1);
+        assert(too_big == NULL);
+        allocator_stats_read(&arena.stats, &snapshot);
+        assert(snapshot.alloc_count == 2 && snapshot.failed_count == 1);
+        assert(snapshot.requested_bytes == 26 && snapshot.overhead_bytes == 6);
+        assert(snapshot.live_bytes == 32 && snapshot.peak_bytes == 32);
+
+        TempArenaAllocator temp = temp_arena_start(&arena);
+        arena_alloc(&arena, 100, 1);
+        temp_arena_end(&temp);
+        arena_free_all(&arena);
+        allocator_stats_read(&arena.stats, &snapshot);
+        assert(snapshot.live_bytes == 0 && snapshot.peak_bytes >= 132);
+    }
+
+    {
+        unsigned char buffer[1024];
+        StackAllocator stack = { 0 };
+        stack_init(&stack, buffer, sizeof(buffer));
+        void* a = stack_alloc(&stack, 24, 8);
+        void* b = stack_alloc(&stack, 40, 8);
+        b = stack_resize(&stack, b, 40, 80, 8);
+        allocator_stats_read(&stack.stats, &snapshot);
+        assert(snapshot.alloc_count == 2 && snapshot.overhead_bytes > 0);
+        assert(snapshot.live_bytes == (int64_t)stack.offset);
+        stack_free(&stack, b);
+        stack_free(&stack, a);
+        allocator_stats_read(&stack.stats, &snapshot);
+        assert(snapshot.free_count == 2 && snapshot.live_bytes == 0);
+    }
+
+    {
+        unsigned char buffer[1024];
+        PoolAllocator pool = { 0 };
+        pool_init(&pool, buffer, sizeof(buffer), 64, 8);
+        void* blocks[16];
+        for (size_t i = 0; i < 16; i++) {
+            blocks[i] = pool_alloc(&pool);
+        }
+        pool_free(&pool, blocks[3]);
+        allocator_stats_read(&pool.stats, &snapshot);
+        assert(snapshot.alloc_count == 16 && snapshot.free_count == 1);
+        assert(snapshot.live_bytes == 15 * 64 && snapshot.peak_bytes == 16 * 64);
+    }
+
+    {
+        unsigned char buffer[4096];
+        FreeListAllocator free_list = { 0 };
+        free_list_init(&free_list, buffer, sizeof(buffer), Allocation_Policy_First_Fit);
+        void* a = free_list_alloc(&free_list, 100, 8);
+        void* b = free_list_alloc(&free_list, 200, 8);
+        allocator_stats_read(&free_list.stats, &snapshot);
+        assert(snapshot.requested_bytes == 300);
+        // the header and padding count as overhead
+        assert(snapshot.live_bytes == (int64_t)free_list.buffer_used);
+        assert(snapshot.overhead_bytes == free_list.buffer_used - 300);
+        free_list_free(&free_list, a);
+        free_list_free(&free_list, b);
+        allocator_stats_read(&free_list.stats, &snapshot);
+        assert(snapshot.live_bytes == 0 && snapshot.free_count == 2);
+    }
+
+    {
+        size_t size = 64 * 1024;
+        void* buffer = aligned_alloc(64, size);
+        BuddyAllocator buddy = { 0 };
+        buddy_init(&buddy, buffer, size, 64);
+        void* a = buddy_alloc(&buddy, 100);
+        void* b = buddy_alloc_exact(&buddy, 3 * 64);
+        allocator_stats_read(&buddy.stats, &snapshot);
+        assert(snapshot.live_bytes == 128 + 192);
+        assert(snapshot.overhead_bytes == 28);
+        // grows in place into its free buddy
+        a = buddy_resize(&buddy, a, 256);
+        allocator_stats_read(&buddy.stats, &snapshot);
+        assert(snapshot.live_bytes == 256 + 192);
+        buddy_free(&buddy, a);
+        buddy_free(&buddy, b);
+        allocator_stats_read(&buddy.stats, &snapshot);
+        assert(snapshot.live_bytes == 0 && snapshot.peak_bytes == 256 + 192);
+
+        // threads land in different shards, the sums still add up
+        std::mutex lock;
+        std::vector<std::thread> threads;
+        const size_t per_thread = 1000;
+        for (size_t t = 0; t < 4; t++) {
+            threads.emplace_back([&buddy, &lock, per_thread]() {
+                for (size_t i = 0; i < per_thread; i++) {
+                    std::lock_guard<std::mutex> guard(lock);
+                    void* ptr = buddy_alloc(&buddy, 64);
+                    buddy_free(&buddy, ptr);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        allocator_stats_read(&buddy.stats, &snapshot);
+        assert(snapshot.alloc_count == 2 + 4 * per_thread);
+        assert(snapshot.free_count == 2 + 4 * per_thread);
+        assert(snapshot.live_bytes == 0);
+#if MEMORY_ALLOCATOR_STATS_LATENCY
+        assert(allocator_stats_percentile(snapshot.alloc_latency, 0.99) > 0);
+#endif
+        buddy_destory(&buddy);
+        free(buffer);
+    }
+
+    {
+        typedef Buddy<4096, 64> SmallBuddy;
+        SmallBuddy* buddy = new SmallBuddy();
+        void* buffer = aligned_alloc(64, 4096);
+        buddy->init(buffer);
+        void* a = buddy->alloc(100);
+        void* too_big = buddy->alloc(8192);
+        assert(too_big == NULL);
+        allocator_stats_read(&buddy->stats, &snapshot);
+        assert(snapshot.live_bytes == 128 && snapshot.failed_count == 1);
+        buddy->free(a);
+        allocator_stats_read(&buddy->stats, &snapshot);
+        assert(snapshot.live_bytes == 0);
+        free(buffer);
+        delete buddy;
+    }
+#endif
+}
+
+void heap_profile_test()
+{
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+    HeapProfileTotals totals;
+
+    // a rate of one byte samples every allocation
+    bool started = heap_profile_start(1);
+    assert(started);
+    // only one profile at a time
+    started = heap_profile_start(1);
+    assert(!started);
+    {
+        size_t size = 64 * 1024;
+        void* buffer = aligned_alloc(64, size);
+        BuddyAllocator buddy = { 0 };
+        buddy_init(&buddy, buffer, size, 64);
+        void* blocks[10];
+        for (size_t i = 0; i < 10; i++) {
+            blocks[i] = buddy_alloc(&buddy, 100);
+        }
+        for (size_t i = 0; i < 4; i++) {
+            buddy_free(&buddy, blocks[i]);
+        }
+        heap_profile_totals(&totals);
+        assert(totals.alloc_objects == 10 && totals.alloc_bytes == 1000);
+        assert(totals.inuse_objects == 6 && totals.inuse_bytes == 600);
+        // every block came from the same line
+        assert(totals.buckets == 1);
+
+        char path[] = "/tmp/memory_allocator_heap_XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+        bool dumped = heap_profile_dump(path);
+        assert(dumped);
+        FILE* file = fopen(path, "r");
+        assert(file != NULL);
+        char line[512];
+        char* read = fgets(line, sizeof(line), file);
+        assert(read != NULL);
+        assert(strcmp(line, "heap profile: 6: 600 [10: 1000] @ heap_v2/1\n") == 0);
+        read = fgets(line, sizeof(line), file);
+        assert(read != NULL);
+        assert(strncmp(line, "6: 600 [10: 1000] @ 0x", 22) == 0);
+        bool has_maps = false;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            has_maps = has_maps || strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+        }
+        assert(has_maps);
+        fclose(file);
+        unlink(path);
+
+        for (size_t i = 4; i < 10; i++) {
+            buddy_free(&buddy, blocks[i]);
+        }
+        heap_profile_totals(&totals);
+        assert(totals.inuse_objects == 0 && totals.alloc_objects == 10);
+        buddy_destory(&buddy);
+        free(buffer);
+    }
+    heap_profile_stop();
+    heap_profile_totals(&totals);
+    assert(totals.alloc_objects == 0);
+
+    // one sample per `rate` bytes on average
+    const size_t rate = 4096;
+    started = heap_profile_start(rate);
+    assert(started);
+    {
+        const size_t chunk = 64;
+        const size_t count = 16 * 1024;
+        void* buffer = malloc(chunk * count);
+        PoolAllocator pool = { 0 };
+        pool_init(&pool, buffer, chunk * count, chunk, 8);
+        for (size_t i = 0; i < count; i++) {
+            pool_alloc(&pool);
+        }
+        heap_profile_totals(&totals);
+        // expected 256, the standard deviation is 16
+        assert(totals.alloc_objects > 256 - 96 && totals.alloc_objects < 256 + 96);
+        assert(totals.inuse_objects == totals.alloc_objects);
+        pool_free_all(&pool);
+        free(buffer);
+    }
+    heap_profile_stop();
+#endif
+}
+
+struct PersistentTestNode
+{
+    uint64_t key;
+    rel_ptr<char> name;
+    rel_ptr<PersistentTestNode> next;
+};
+
+struct PersistentTestRoot
+{
+    uint64_t count;
+    rel_ptr<PersistentTestNode> head;
+    rel_ptr<uint32_t> values;
+};
+
+static void persistent_arena_check(PersistentArena* persistent, uint64_t count)
+{
+    PersistentTestRoot* root = (PersistentTestRoot*)persistent_arena_root(persistent);
+    assert(root != NULL && root->count == count);
+    uint64_t key = count;
+    for (PersistentTestNode* node = root->head.get(); node != NULL; node = node->next.get()) {
+        key--;
+        char name[32];
+        snprintf(name, sizeof(name), "node %llu", (unsigned long long)key);
+        assert(node->key == key);
+        assert(strcmp(node->name.get(), name) == 0);
+        assert(root->values[key] == (uint32_t)(key * key));
+    }
+    assert(key == 0);
+}
+
+void persistent_arena_test()
+{
+#if defined(__linux__)
+    char path[] = "/tmp/memory_allocator_persistent_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    const uint64_t count = 1000;
+    const uint64_t user_version = 3;
+    PersistentArena persistent;
+    bool ok = persistent_arena_create(&persistent, path, 64 * 1024 * 1024, user_version);
+    assert(ok);
+    ArenaAllocator* arena = &persistent.arena;
+    PersistentTestRoot* root = (PersistentTestRoot*)arena_alloc(arena, sizeof(PersistentTestRoot));
+    root->count = count;
+    root->values = (uint32_t*)arena_alloc(arena, count * sizeof(uint32_t));
+    for (uint64_t i = 0; i < count; i++) {
+        root->values[i] = (uint32_t)(i * i);
+        PersistentTestNode* node = (PersistentTestNode*)arena_alloc(arena, sizeof(PersistentTestNode));
+        char name[32];
+        int length = snprintf(name, sizeof(name), "node %llu", (unsigned long long)i);
+        node->name = (char*)arena_alloc(arena, length + 1, 1);
+        memcpy(node->name.get(), name, length + 1);
+        node->key = i;
+        node->next = root->head;
+        root->head = node;
+    }
+    // a copy points at the same node from its own address
+    rel_ptr<PersistentTestNode> copy = root->head;
+    assert(copy.get() == root->head.get() && copy.offset != root->head.offset);
+    persistent_arena_set_root(&persistent, root);
+    size_t used = arena->offset;
+    ok = persistent_arena_seal(&persistent);
+    assert(ok);
+
+    // two mappings of the same file at different addresses both read it in place
+    PersistentArena first;
+    PersistentArena second;
+    ok = persistent_arena_open(&first, path, user_version, Persistent_Arena_Verify);
+    assert(ok);
+    ok = persistent_arena_open(&second, path, user_version);
+    assert(ok);
+    assert(first.arena.buffer != second.arena.buffer);
+    assert(first.arena.offset == used);
+    persistent_arena_check(&first, count);
+    persistent_arena_check(&second, count);
+    // full and read only
+    void* full = try_arena_alloc(&second.arena, 8);
+    assert(full == NULL);
+    persistent_arena_close(&second);
+
+    // another layout version is refused
+    ok = persistent_arena_open(&second, path, user_version + 1);
+    assert(!ok);
+
+    // an unsealed build leaves the sealed file alone
+    PersistentArena builder;
+    ok = persistent_arena_create(&builder, path, 1024 * 1024, user_version);
+    assert(ok);
+    arena_alloc(&builder.arena, 4096);
+    char temp_path[sizeof(path) + 4];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    assert(access(temp_path, F_OK) == 0);
+    persistent_arena_close(&builder);
+    assert(access(temp_path, F_OK) != 0);
+    persistent_arena_close(&first);
+    ok = persistent_arena_open(&first, path, user_version, Persistent_Arena_Verify);
+    assert(ok);
+    persistent_arena_check(&first, count);
+    persistent_arena_close(&first);
+
+    // damaged data is only found when verifying, a truncated file or damaged header always
+    fd = open(path, O_RDWR);
+    assert(fd >= 0);
+    unsigned char byte = 0xAB;
+    ssize_t written = pwrite(fd, &byte, 1, PERSISTENT_ARENA_HEADER_SIZE + used / 2);
+    assert(written == 1);
+    ok = persistent_arena_open(&first, path, user_version);
+    assert(ok);
+    assert(!persistent_arena_verify(&first));
+    persistent_arena_close(&first);
+    ok = persistent_arena_open(&first, path, user_version, Persistent_Arena_Verify);
+    assert(!ok);
+    int truncated = ftruncate(fd, PERSISTENT_ARENA_HEADER_SIZE + used - 1);
+    assert(truncated == 0);
+    ok = persistent_arena_open(&first, path, user_version);
+    assert(!ok);
+    written = pwrite(fd, &byte, 1, offsetof(PersistentArenaHeader, root));
+    assert(written == 1);
+    ok = persistent_arena_open(&first, path, user_version);
+    assert(!ok);
+    close(fd);
+
+    unlink(path);
+#endif
+}
+
+void shm_allocator_test()
+{
+#if defined(__linux__)
+    char name[64];
+    snprintf(name, sizeof(name), "/memory_allocator_test_%d", (int)getpid());
+
+    // pool: chunks handed to another process come back through its frees
+    const uint32_t chunk_count = 64;
+    ShmPoolAllocator pool;
+    bool ok = shm_pool_create(&pool, name, chunk_count * 256, 200, 64);
+    assert(ok);
+    assert(pool.chunk_size == 256 && pool.chunk_count == chunk_count);
+    ShmPoolAllocator duplicate;
+    ok = shm_pool_create(&duplicate, name, 4096, 64);
+    assert(!ok);
+    ShmFreeListAllocator wrong_kind;
+    ok = shm_free_list_attach(&wrong_kind, name);
+    assert(!ok);
+
+    void* chunks[chunk_count];
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        chunks[i] = shm_pool_alloc(&pool);
+        assert(chunks[i] != NULL && ((uintptr_t)chunks[i] & 63) == 0);
+        ((uint64_t*)chunks[i])[0] = i;
+    }
+    void* full = try_shm_pool_alloc(&pool);
+    assert(full == NULL);
+
+    int pipe_fds[2];
+    int piped = pipe(pipe_fds);
+    assert(piped == 0);
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        close(pipe_fds[1]);
+        ShmPoolAllocator attached;
+        if (!shm_pool_attach(&attached, name) || attached.chunks == pool.chunks) {
+            _exit(1);
+        }
+        uint64_t offset;
+        uint32_t count = 0;
+        while (read(pipe_fds[0], &offset, sizeof(offset)) == sizeof(offset)) {
+            uint64_t* chunk = (uint64_t*)shm_pointer(&attached.segment, offset);
+            if (chunk[0] != count) {
+                _exit(2);
+            }
+            shm_pool_free(&attached, chunk);
+            count++;
+        }
+        shm_pool_detach(&attached);
+        _exit(count == chunk_count ? 0 : 3);
+    }
+    close(pipe_fds[0]);
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        uint64_t offset = shm_offset(&pool.segment, chunks[i]);
+        ssize_t written = write(pipe_fds[1], &offset, sizeof(offset));
+        assert(written == sizeof(offset));
+    }
+    close(pipe_fds[1]);
+    int status;
+    pid_t exited = waitpid(child, &status, 0);
+    assert(exited == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        chunks[i] = try_shm_pool_alloc(&pool);
+        assert(chunks[i] != NULL && ((uint64_t*)chunks[i])[0] == 0);
+    }
+    full = try_shm_pool_alloc(&pool);
+    assert(full == NULL);
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        shm_pool_free(&pool, chunks[i]);
+    }
+
+    // lock-free churn: a chunk is never handed to two threads at once
+    std::vector<std::thread> threads;
+    for (uint64_t t = 1; t <= 4; t++) {
+        threads.emplace_back([&pool, t]() {
+            for (size_t i = 0; i < 20000; i++) {
+                uint64_t* chunk = (uint64_t*)try_shm_pool_alloc(&pool);
+                assert(chunk != NULL);
+                chunk[0] = t;
+                chunk[31] = t;
+                if (i % 64 == 0) {
+                    std::this_thread::yield();
+                }
+                assert(chunk[0] == t && chunk[31] == t);
+                shm_pool_free(&pool, chunk);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    shm_pool_detach(&pool);
+    // the creator's detach removed the name
+    ok = shm_pool_attach(&pool, name);
+    assert(!ok);
+
+    // alignments below the free link's are raised to it
+    ok = shm_pool_create(&pool, name, 4096, 6, 1);
+    assert(ok);
+    assert(pool.chunk_size == 8);
+    void* first = shm_pool_alloc(&pool);
+    void* second = shm_pool_alloc(&pool);
+    assert(((uintptr_t)first & 3) == 0 && ((uintptr_t)second & 3) == 0);
+    shm_pool_free(&pool, first);
+    shm_pool_free(&pool, second);
+    shm_pool_detach(&pool);
+
+    // free list: another process allocates messages, this one frees them
+    const size_t buffer_size = 64 * 1024;
+    ShmFreeListAllocator free_list;
+    ok = shm_free_list_create(&free_list, name, buffer_size, Allocation_Policy_Best_Fit);
+    assert(ok);
+    piped = pipe(pipe_fds);
+    assert(piped == 0);
+    child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        close(pipe_fds[0]);
+        ShmFreeListAllocator attached;
+        if (!shm_free_list_attach(&attached, name)) {
+            _exit(1);
+        }
+        for (uint64_t i = 0; i < 32; i++) {
+            uint64_t message[2];
+            message[1] = 16 + i * 37;
+            unsigned char* ptr = (unsigned char*)shm_free_list_alloc(&attached, message[1], 16);
+            if (ptr == NULL || ((uintptr_t)ptr & 15) != 0) {
+                _exit(2);
+            }
+            memset(ptr, (int)i + 1, message[1]);
+            message[0] = shm_offset(&attached.segment, ptr);
+            if (write(pipe_fds[1], message, sizeof(message)) != sizeof(message)) {
+                _exit(3);
+            }
+        }
+        shm_free_list_detach(&attached);
+        _exit(0);
+    }
+    close(pipe_fds[1]);
+    uint64_t message[2];
+    uint64_t received = 0;
+    std::vector<void*> messages;
+    while (read(pipe_fds[0], message, sizeof(message)) == sizeof(message)) {
+        unsigned char* ptr = (unsigned char*)shm_pointer(&free_list.segment, message[0]);
+        for (size_t i = 0; i < message[1]; i++) {
+            assert(ptr[i] == received + 1);
+        }
+        messages.push_back(ptr);
+        received++;
+    }
+    close(pipe_fds[0]);
+    exited = waitpid(child, &status, 0);
+    assert(exited == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(received == 32);
+    // out of order, so frees merge on both sides
+    for (size_t i = 0; i < messages.size(); i += 2) {
+        shm_free_list_free(&free_list, messages[i]);
+    }
+    for (size_t i = 1; i < messages.size(); i += 2) {
+        shm_free_list_free(&free_list, messages[i]);
+    }
+    ShmFreeListHeader* header = free_list.header;
+    assert(header->buffer_used == 0);
+    assert(header->head == header->buffer);
+    ShmFreeListNode* node = (ShmFreeListNode*)shm_pointer(&free_list.segment, header->head);
+    assert(node->block_size == buffer_size && node->next == 0);
+
+    // a process that dies holding the lock doesn't wedge the others
+    child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        pthread_mutex_lock(&header->lock);
+        _exit(0);
+    }
+    exited = waitpid(child, &status, 0);
+    assert(exited == child);
+    void* ptr = shm_free_list_alloc(&free_list, 128);
+    assert(ptr != NULL);
+    shm_free_list_free(&free_list, ptr);
+    assert(header->buffer_used == 0);
+
+    // a takeover that never marks the mutex consistent leaves it unrecoverable,
+    // later calls fail instead of touching the list
+    ptr = shm_free_list_alloc(&free_list, 128);
+    assert(ptr != NULL);
+    child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        pthread_mutex_lock(&header->lock);
+        _exit(0);
+    }
+    exited = waitpid(child, &status, 0);
+    assert(exited == child);
+    int locked = pthread_mutex_lock(&header->lock);
+    assert(locked == EOWNERDEAD);
+    pthread_mutex_unlock(&header->lock);
+    void* refused = shm_free_list_alloc(&free_list, 128);
+    assert(refused == NULL);
+    size_t used = header->buffer_used;
+    shm_free_list_free(&free_list, ptr);
+    assert(header->buffer_used == used);
+    shm_free_list_detach(&free_list);
+#endif
+}
+
+static void handle_heap_check(HandleHeap* heap, HeapHandle* handles, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (handles[i] == HEAP_HANDLE_NULL) {
+            continue;
+        }
+        unsigned char* data = (unsigned char*)handle_heap_pin(heap, handles[i]);
+        assert(data != NULL && ((uintptr_t)data & (HANDLE_HEAP_ALIGNMENT - 1)) == 0);
+        size_t size = handle_heap_size(heap, handles[i]);
+        for (size_t j = 0; j < size; j++) {
+            assert(data[j] == (unsigned char)(i + j));
+        }
+        handle_heap_unpin(heap, handles[i]);
+    }
+}
+
+void handle_heap_test()
+{
+    const size_t buffer_size = 64 * 1024;
+    const size_t max_handles = 256;
+    void* buffer = malloc(buffer_size);
+    HandleHeap heap;
+    bool ok = handle_heap_init(&heap, buffer, buffer_size, max_handles);
+    assert(ok);
+
+    // fill the heap
+    HeapHandle handles[max_handles];
+    size_t count = 0;
+    for (size_t i = 0; i < max_handles && heap.free_list.buffer_size - heap.free_list.buffer_used >= 1024; i++) {
+        size_t size = 200 + i % 7 * 16;
+        count++;
+        handles[i] = handle_heap_alloc(&heap, size);
+        assert(handles[i] != HEAP_HANDLE_NULL);
+        unsigned char* data = (unsigned char*)handle_heap_pin(&heap, handles[i]);
+        for (size_t j = 0; j < size; j++) {
+            data[j] = (unsigned char)(i + j);
+        }
+        handle_heap_unpin(&heap, handles[i]);
+    }
+    // every other block free: lots of free bytes, all in small holes
+    for (size_t i = 0; i < count; i += 2) {
+        handle_heap_free(&heap, handles[i]);
+        handles[i] = HEAP_HANDLE_NULL;
+    }
+    assert(count > 100 && heap.live == count / 2);
+    size_t free_bytes = heap.free_list.buffer_size - heap.free_list.buffer_used;
+    assert(handle_heap_largest_free(&heap) < free_bytes / 2);
+
+    // a pinned block stays where it is, the rest slide a few at a time
+    size_t pinned = (count / 2) | 1;
+    void* pinned_data = handle_heap_pin(&heap, handles[pinned]);
+    size_t steps = 0;
+    while (!handle_heap_compact(&heap, 1)) {
+        steps++;
+        handle_heap_check(&heap, handles, count);
+        assert(steps < count);
+    }
+    void* pinned_again = handle_heap_pin(&heap, handles[pinned]);
+    assert(pinned_again == pinned_data);
+    handle_heap_unpin(&heap, handles[pinned]);
+    handle_heap_check(&heap, handles, count);
+    // free space in front of the pinned block and the tail
+    assert(heap.free_list.head != NULL && heap.free_list.head->next != NULL);
+    assert(heap.free_list.head->next->next == NULL);
+    // pinned blocks can't be freed, freed handles are refused
+    handle_heap_free(&heap, handles[pinned]);
+    handle_heap_unpin(&heap, handles[pinned]);
+    handle_heap_free(&heap, handles[pinned]);
+    pinned_again = handle_heap_pin(&heap, handles[pinned]);
+    assert(pinned_again == NULL);
+    handles[pinned] = HEAP_HANDLE_NULL;
+
+    // unpinned, everything ends up in one tail block
+    uint64_t moved = heap.moved_bytes;
+    ok = handle_heap_compact(&heap, 0);
+    assert(ok);
+    assert(heap.moved_bytes > moved);
+    assert(heap.free_list.head != NULL && heap.free_list.head->next == NULL);
+    assert(handle_heap_largest_free(&heap) == heap.free_list.buffer_size - heap.free_list.buffer_used);
+    handle_heap_check(&heap, handles, count);
+
+    // fragment again, a large request compacts on its own
+    for (size_t i = 1; i < count; i += 4) {
+        if (handles[i] != HEAP_HANDLE_NULL) {
+            handle_heap_free(&heap, handles[i]);
+            handles[i] = HEAP_HANDLE_NULL;
+        }
+    }
+    free_bytes = heap.free_list.buffer_size - heap.free_list.buffer_used;
+    size_t large = free_bytes - 1024;
+    assert(handle_heap_largest_free(&heap) < large);
+    moved = heap.moved_bytes;
+    HeapHandle big = handle_heap_alloc(&heap, large);
+    assert(big != HEAP_HANDLE_NULL && heap.moved_bytes > moved);
+    assert(handle_heap_size(&heap, big) == large);
+    handle_heap_check(&heap, handles, count);
+    // and one that can't fit anyway fails without moving anything
+    moved = heap.moved_bytes;
+    HeapHandle too_big = handle_heap_alloc(&heap, buffer_size);
+    assert(too_big == HEAP_HANDLE_NULL);
+    assert(heap.moved_bytes == moved);
+
+    free(buffer);
+}
+
+void epoch_test()
+{
+    const size_t chunk_size = 32;
+    // room for every thread's limbo lists to fill up
+    const size_t chunk_count = 8192;
+    void* buffer = malloc(chunk_size * chunk_count);
+    EpochPool* domain = new EpochPool();
+    epoch_pool_init(domain, buffer, chunk_size * chunk_count, chunk_size);
+
+    // a reader that stays inside holds back everything retired since it entered
+    {
+        EpochThread* reader = new EpochThread();
+        EpochThread* writer = new EpochThread();
+        bool registered = epoch_thread_register(reader, domain, 4, 8);
+        assert(registered);
+        registered = epoch_thread_register(writer, domain, 4, 8);
+        assert(registered);
+
+        unsigned char* chunk = (unsigned char*)epoch_alloc(writer);
+        assert(chunk != NULL && chunk[0] == 0);
+        assert(writer->cache_count == 3);
+        memset(chunk, 0xAB, chunk_size);
+
+        epoch_enter(reader);
+        epoch_retire(writer, chunk);
+        for (int i = 0; i < 8; i++) {
+            epoch_try_advance(domain);
+        }
+        // one step at most, the reader hasn't seen it
+        assert(domain->epoch.load() == 1);
+        size_t collected = epoch_collect(writer);
+        assert(collected == 0);
+        assert(chunk[0] == 0xAB);
+        epoch_exit(reader);
+
+        // two steps later it is free again
+        bool advanced = epoch_try_advance(domain);
+        assert(advanced);
+        collected = epoch_collect(writer);
+        assert(collected == 1);
+        assert(writer->cache == (PoolListNode*)chunk);
+
+        // a guard announces the current epoch
+        {
+            EpochGuard guard(reader);
+            assert(reader->local_epoch.load() == ((domain->epoch.load() << 1) | 1));
+        }
+        assert(reader->local_epoch.load() == 0);
+
+        // a chunk nobody else saw goes straight back
+        void* scratch = epoch_alloc(writer);
+        size_t cached = writer->cache_count;
+        epoch_free(writer, scratch);
+        assert(writer->cache_count == cached + 1);
+
+        epoch_thread_unregister(reader);
+        epoch_thread_unregister(writer);
+        assert(writer->cache_count == 0);
+        delete reader;
+        delete writer;
+    }
+
+    // a critical section that retires too much gets its chunk back instead of
+    // waiting on itself
+    {
+        EpochThread* writer = new EpochThread();
+        bool registered = epoch_thread_register(writer, domain, 4, 8);
+        assert(registered);
+        epoch_enter(writer);
+        void* refused = NULL;
+        size_t retired = 0;
+        while (retired <= 3 * EPOCH_LIMBO_SIZE) {
+            void* chunk = epoch_alloc(writer);
+            assert(chunk != NULL);
+            if (!epoch_retire(writer, chunk)) {
+                refused = chunk;
+                break;
+            }
+            retired++;
+        }
+        assert(refused != NULL && retired >= EPOCH_LIMBO_SIZE);
+        epoch_exit(writer);
+        bool accepted = epoch_retire(writer, refused);
+        assert(accepted);
+        epoch_thread_unregister(writer);
+        delete writer;
+    }
+
+    // readers check every node they reach against its key while writers replace
+    // nodes, a chunk reused too early shows up as a mismatch
+    {
+        struct Node
+        {
+            uint64_t key;
+            uint64_t check;
+            uint64_t version;
+        };
+        const size_t slot_count = 64;
+        std::atomic<Node*> slots[slot_count];
+        EpochThread* setup = new EpochThread();
+        bool registered = epoch_thread_register(setup, domain, 8, 32);
+        assert(registered);
+        for (size_t i = 0; i < slot_count; i++) {
+            Node* node = (Node*)epoch_alloc(setup);
+            node->key = i;
+            node->check = i * 0x9E3779B97F4A7C15ull;
+            slots[i].store(node);
+        }
+
+        const int thread_count = 4;
+        std::thread threads[thread_count];
+        for (int t = 0; t < thread_count; t++) {
+            threads[t] = std::thread([domain, &slots, t]() {
+                EpochThread* thread = new EpochThread();
+                bool registered = epoch_thread_register(thread, domain, 8, 32);
+                assert(registered);
+                for (int i = 0; i < 20000; i++) {
+                    size_t key = (size_t)(i * 7 + t * 13) % slot_count;
+                    if (t == 0 || i % 8 == 0) {
+                        Node* node = (Node*)epoch_alloc(thread);
+                        assert(node != NULL);
+                        node->key = key;
+                        node->check = key * 0x9E3779B97F4A7C15ull;
+                        node->version = (uint64_t)i;
+                        epoch_enter(thread);
+                        Node* old = slots[key].exchange(node);
+                        epoch_retire(thread, old);
+                        epoch_exit(thread);
+                    } else {
+                        EpochGuard guard(thread);
+                        Node* node = slots[key].load(std::memory_order_acquire);
+                        for (int spin = 0; spin < 16; spin++) {
+                            assert(node->key == key);
+                            assert(node->check == key * 0x9E3779B97F4A7C15ull);
+                        }
+                    }
+                }
+                epoch_thread_unregister(thread);
+                delete thread;
+            });
+        }
+        for (int t = 0; t < thread_count; t++) {
+            threads[t].join();
+        }
+
+        for (size_t i = 0; i < slot_count; i++) {
+            epoch_free(setup, slots[i].load());
+        }
+        epoch_thread_unregister(setup);
+        delete setup;
+
+        // every chunk made it back to the pool
+        size_t free_chunks = 0;
+        while (try_pool_alloc(&domain->pool) != NULL) {
+            free_chunks++;
+        }
+        assert(free_chunks == chunk_count);
+    }
+
+    delete domain;
+    free(buffer);
+}
+
+#if MEMORY_ALLOCATOR_COROUTINES
+static CoroTask<size_t> coroutine_test_chain(CoroFrameAllocator& frames, int depth)
+{
+    if (depth == 0) {
+        co_return 0;
+    }
+    size_t below = co_await coroutine_test_chain(frames, depth - 1);
+    co_return below + (size_t)depth;
+}
+
+static CoroTask<size_t> coroutine_test_offset(CoroFrameAllocator& frames)
+{
+    co_return frames.stack->offset;
+}
+
+static CoroTask<size_t> coroutine_test_loop(CoroFrameAllocator& frames, int count)
+{
+    // children one after another reuse the same stack space
+    size_t first = co_await coroutine_test_offset(frames);
+    for (int i = 0; i < count; i++) {
+        size_t offset = co_await coroutine_test_offset(frames);
+        assert(offset == first);
+    }
+    co_return first;
+}
+
+static CoroTask<int> coroutine_test_global(int value)
+{
+    co_return value * 2;
+}
+
+struct CoroutineTestHandler
+{
+    int base;
+
+    CoroTask<int> handle(CoroFrameAllocator& frames, int value)
+    {
+        size_t chain = co_await coroutine_test_chain(frames, 3);
+        co_return base + value + (int)chain;
+    }
+};
+#endif
+
+void coroutine_test()
+{
+    const size_t buf_size = 64 * 1024;
+    void* buf = malloc(buf_size);
+
+    // a rewind point frees everything above it at once
+    StackAllocator stack;
+    stack_init(&stack, buf, buf_size);
+    void* below = stack_alloc(&stack, 100);
+    size_t offset = stack.offset;
+    TempStackAllocator temp_stack = temp_stack_start(&stack);
+    void* above = stack_alloc(&stack, 200);
+    assert(above != NULL);
+    above = stack_alloc(&stack, 300);
+    assert(above != NULL);
+    temp_stack_end(&temp_stack);
+    assert(stack.offset == offset);
+    stack_free(&stack, below);
+    assert(stack.offset == 0);
+
+#if MEMORY_ALLOCATOR_COROUTINES
+    // the whole chain lives on the stack and is gone after the rewind
+    {
+        CoroFrameAllocator frames;
+        coro_frames_begin_stack(&frames, &stack);
+        CoroTask<size_t> task = coroutine_test_chain(frames, 50);
+        assert(frames.frames == 1 && stack.offset != 0);
+        size_t sum = coro_run(std::move(task));
+        assert(sum == 50 * 51 / 2);
+        assert(frames.frames == 51);
+        // every frame was on top when it finished
+        assert(stack.offset == 0);
+        coro_frames_end(&frames);
+        assert(stack.offset == 0);
+
+        coro_frames_begin_stack(&frames, &stack);
+        size_t first = coro_run(coroutine_test_loop(frames, 100));
+        assert(first != 0 && frames.frames == 102);
+        coro_frames_end(&frames);
+        assert(stack.offset == 0);
+
+        // member coroutines take it after the object
+        CoroutineTestHandler handler = { 1000 };
+        coro_frames_begin_stack(&frames, &stack);
+        int handled = coro_run(handler.handle(frames, 7));
+        assert(handled == 1000 + 7 + 6);
+        assert(frames.frames == 5);
+        coro_frames_end(&frames);
+
+        // no allocator argument, global operator new
+        coro_frames_begin_stack(&frames, &stack);
+        int doubled = coro_run(coroutine_test_global(21));
+        assert(doubled == 42);
+        assert(frames.frames == 0);
+        coro_frames_end(&frames);
+    }
+
+    // frames that don't fit fall back to operator new
+    {
+        StackAllocator small;
+        char small_buf[256];
+        stack_init(&small, small_buf, sizeof(small_buf));
+        CoroFrameAllocator frames;
+        coro_frames_begin_stack(&frames, &small);
+        size_t sum = coro_run(coroutine_test_chain(frames, 20));
+        assert(sum == 20 * 21 / 2);
+        assert(frames.frames < 21);
+        coro_frames_end(&frames);
+        assert(small.offset == 0);
+    }
+
+    // in an arena scope frames pile up until the rewind
+    {
+        ArenaAllocator arena;
+        arena_init(&arena, buf, buf_size);
+        arena_alloc(&arena, 64);
+        size_t arena_offset = arena.offset;
+        CoroFrameAllocator frames;
+        coro_frames_begin_arena(&frames, &arena);
+        size_t sum = coro_run(coroutine_test_chain(frames, 30));
+        assert(sum == 30 * 31 / 2);
+        assert(frames.frames == 31 && arena.offset > arena_offset);
+        coro_frames_end(&frames);
+        assert(arena.offset == arena_offset);
+    }
+#endif
+
+    free(buf);
+}
+
+struct HeapWalkTestLog
+{
+    HeapBlock blocks[64];
+    size_t count;
+    // stop after this many blocks, 0 for never
+    size_t stop_after;
+};
+
+static bool heap_walk_test_visit(const HeapBlock* block, void* user_data)
+{
+    HeapWalkTestLog* log = (HeapWalkTestLog*)user_data;
+    assert(log->count < 64);
+    log->blocks[log->count++] = *block;
+    return log->stop_after == 0 || log->count < log->stop_after;
+}
+
+// the blocks inside the buffer tile it without gaps
+static size_t heap_walk_test_total(HeapWalkTestLog* log)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < log->count; i++) {
+        if (!log->blocks[i].large) {
+            total += log->blocks[i].size;
+        }
+    }
+    return total;
+}
+
+void heap_walk_test()
+{
+    // the pool expects whole chunks, so the offsets below need an aligned start
+    const size_t buf_size = 4096;
+    void* raw = malloc(buf_size + 64);
+    unsigned char* buf = (unsigned char*)align_forward((uintptr_t)raw, 64);
+    HeapWalkTestLog log;
+
+    // arena: one used span and the free tail
+    {
+        ArenaAllocator arena;
+        arena_init(&arena, buf, buf_size);
+        arena_alloc(&arena, 100);
+        arena_alloc(&arena, 30);
+        log.count = 0;
+        log.stop_after = 0;
+        bool walked = arena_walk(&arena, heap_walk_test_visit, &log);
+        assert(walked);
+        assert(log.count == 2);
+        assert(log.blocks[0].state == Heap_Block_Used && log.blocks[0].offset == 0);
+        assert(log.blocks[0].size == arena.offset && log.blocks[0].data == buf);
+        assert(log.blocks[1].state == Heap_Block_Free && log.blocks[1].offset == arena.offset);
+        assert(heap_walk_test_total(&log) == buf_size);
+    }
+
+    // stack: free tail first, then the blocks from the top down
+    {
+        StackAllocator stack;
+        stack_init(&stack, buf, buf_size);
+        unsigned char* a = (unsigned char*)stack_alloc(&stack, 100);
+        unsigned char* b = (unsigned char*)stack_alloc(&stack, 200, 64);
+        log.count = 0;
+        log.stop_after = 0;
+        bool walked = stack_walk(&stack, heap_walk_test_visit, &log);
+        assert(walked);
+        assert(log.count == 3);
+        assert(log.blocks[0].state == Heap_Block_Free && log.blocks[0].offset == stack.offset);
+        assert(log.blocks[1].state == Heap_Block_Used && log.blocks[1].data == b);
+        assert(buf + log.blocks[1].offset + log.blocks[1].padding == b);
+        assert(log.blocks[2].state == Heap_Block_Used && log.blocks[2].data == a);
+        assert(log.blocks[2].offset == 0 && log.blocks[2].offset + log.blocks[2].size == log.blocks[1].offset);
+        assert(heap_walk_test_total(&log) == buf_size);
+
+        // a damaged padding byte is caught
+        unsigned char saved = buf[log.blocks[1].offset];
+        buf[log.blocks[1].offset] = 1;
+        log.count = 0;
+        walked = stack_walk(&stack, heap_walk_test_visit, &log);
+        assert(!walked);
+        buf[log.blocks[1].offset] = saved;
+    }
+
+    // pool: one block per chunk
+    {
+        PoolAllocator pool;
+        pool_init(&pool, buf, 1024, 64, 64);
+        void* chunks[3];
+        for (int i = 0; i < 3; i++) {
+            chunks[i] = pool_alloc(&pool);
+        }
+        pool_free(&pool, chunks[1]);
+        log.count = 0;
+        log.stop_after = 0;
+        bool walked = pool_walk(&pool, heap_walk_test_visit, &log);
+        assert(walked);
+        assert(log.count == 16);
+        for (size_t i = 0; i < log.count; i++) {
+            bool used = log.blocks[i].data == chunks[0] || log.blocks[i].data == chunks[2];
+            assert(log.blocks[i].offset == i * 64 && log.blocks[i].size == 64);
+            assert(log.blocks[i].state == (used ? Heap_Block_Used : Heap_Block_Free));
+        }
+    }
+
+    // free list: headers and free nodes alternate in address order
+    {
+        FreeListAllocator free_list;
+        free_list_init(&free_list, buf, buf_size, Allocation_Policy_First_Fit);
+        void* a = free_list_alloc(&free_list, 100);
+        void* b = free_list_alloc(&free_list, 200);
+        void* c = free_list_alloc(&free_list, 50, 64);
+        free_list_free(&free_list, b);
+        log.count = 0;
+        log.stop_after = 0;
+        bool walked = free_list_walk(&free_list, heap_walk_test_visit, &log);
+        assert(walked);
+        assert(log.count == 4);
+        assert(log.blocks[0].state == Heap_Block_Used && log.blocks[0].data == a);
+        assert(log.blocks[1].state == Heap_Block_Free);
+        assert(log.blocks[2].state == Heap_Block_Used && log.blocks[2].data == c);
+        assert(free_list.buffer + log.blocks[2].offset + log.blocks[2].padding == c);
+        assert(log.blocks[3].state == Heap_Block_Free);
+        assert(heap_walk_test_total(&log) == free_list.buffer_size);
+
+        // the visitor can stop the walk
+        log.count = 0;
+        log.stop_after = 2;
+        walked = free_list_walk(&free_list, heap_walk_test_visit, &log);
+        assert(!walked);
+        assert(log.count == 2);
+
+        HeapSnapshot snapshot;
+        walked = free_list_snapshot(&free_list, &snapshot);
+        assert(walked);
+        assert(snapshot.used_blocks == 2 && snapshot.free_blocks == 2);
+        assert(snapshot.used_bytes + snapshot.free_bytes == free_list.buffer_size);
+        assert(snapshot.largest_free < snapshot.free_bytes);
+        double fragmentation = heap_snapshot_fragmentation(&snapshot);
+        assert(fragmentation > 0.0 && fragmentation < 1.0);
+        uint64_t used_in_cells = 0;
+        for (size_t i = 0; i < snapshot.cell_count; i++) {
+            used_in_cells += snapshot.cells[i];
+        }
+        assert(used_in_cells == snapshot.used_bytes);
+
+        FILE* file = tmpfile();
+        assert(file != NULL);
+        bool written = heap_snapshot_write_json(&snapshot, file);
+        assert(written);
+        char json[4096];
+        rewind(file);
+        size_t read = fread(json, 1, sizeof(json) - 1, file);
+        json[read] = '\0';
+        fclose(file);
+        assert(strstr(json, "\"kind\": \"free_list\"") != NULL);
+        const char* occupancy = strstr(json, "\"occupancy\": \"");
+        assert(occupancy != NULL);
+        occupancy += strlen("\"occupancy\": \"");
+        assert(strchr(occupancy, '"') - occupancy == (ptrdiff_t)(2 * snapshot.cell_count));
+        // the first block is in use, the last cell is free
+        assert(strncmp(occupancy, "00", 2) != 0);
+        assert(strncmp(occupancy + 2 * snapshot.cell_count - 2, "00", 2) == 0);
+    }
+
+    // buddy: exact spans are one block, the tree and the tail are reserved
+    {
+        BuddyAllocator buddy;
+        buddy_init_region(&buddy, buf, buf_size, 64);
+        void* a = buddy_alloc(&buddy, 100);
+        void* b = buddy_alloc_exact(&buddy, 192);
+        log.count = 0;
+        log.stop_after = 0;
+        bool walked = buddy_walk(&buddy, heap_walk_test_visit, &log);
+        assert(walked);
+        size_t used = 0, reserved = 0;
+        for (size_t i = 0; i < log.count; i++) {
+            if (log.blocks[i].state == Heap_Block_Used) {
+                used++;
+                assert(log.blocks[i].data == a || log.blocks[i].data == b);
+                assert(log.blocks[i].size == (log.blocks[i].data == a ? 128u : 192u));
+            } else if (log.blocks[i].state == Heap_Block_Reserved) {
+                reserved += log.blocks[i].size;
+                assert(log.blocks[i].offset >= buddy.usable_size);
+            }
+            assert(i == 0 || log.blocks[i].offset == log.blocks[i - 1].offset + log.blocks[i - 1].size);
+        }
+        assert(used == 2);
+        assert(buddy.usable_size + reserved == POW_OF_2(buddy.tree_height) * buddy.alignment);
+
+        HeapSnapshot snapshot;
+        walked = buddy_snapshot(&buddy, &snapshot);
+        assert(walked);
+        assert(snapshot.used_bytes == 128 + 192 && snapshot.reserved_bytes == reserved);
+        buddy_free(&buddy, a);
+        buddy_free(&buddy, b);
+    }
+
+    free(raw);
+}
+
 void memory_test()
 {
     arena_test();
@@ -475,8 +2774,52 @@ void memory_test()
     pool_test();
 
     free_list_test();
-    
+
     buddy_test();
+
+    buddy_region_test();
+
+    static_buddy_test();
+
+    buddy_resize_test();
+
+    buddy_exact_test();
+
+    buddy_pcp_test();
+
+    region_test();
+
+    warmup_test();
+
+    large_object_test();
+
+    pmr_test();
+
+    composable_test();
+
+    thread_heap_test();
+
+    trace_test();
+
+    allocator_stats_test();
+
+    heap_profile_test();
+
+    oom_test();
+
+    persistent_arena_test();
+
+    shm_allocator_test();
+
+    numa_test();
+
+    handle_heap_test();
+
+    epoch_test();
+
+    coroutine_test();
+
+    heap_walk_test();
 }
 
 int main(void)
@@ -0,0 +1,631 @@
+// malloc replacement built from the allocators in this repo, load it with
+// LD_PRELOAD=libmemory_allocator_preload.so
+//
+// small  (<= 2 KiB)        size-classed PoolAllocators, one address range per class
+// medium (<= 1 MiB)        Buddy<1 GiB, 4 KiB>
+// huge / overflow          a large object (own mapping, realloc is an mremap)
+//
+// Small chunks, bootstrap memory and large objects come zeroed; medium blocks
+// are only cleared for calloc, and only up to the requested size. Nothing in
+// here may call into libc's malloc: locks are spinlocks and there are no
+// thread_local objects with destructors. Calls made while the heap is being set
+// up are served from a static bootstrap arena.
+//
+// With MEMORY_ALLOCATOR_TRACE=path every call is recorded to path.<pid> (see
+// trace.h), for memory_allocator_replay. Forked children stop recording, a
+// child that execs starts its own file.
+//
+// Built with MEMORY_ALLOCATOR_HEAP_PROFILE, MEMORY_ALLOCATOR_HEAP_PROFILE=path
+// samples the small and medium heaps (see heap_profile.h, the mean interval
+// can be set with MEMORY_ALLOCATOR_HEAP_PROFILE_RATE=bytes) and writes
+// path.<pid>.heap at exit. memory_allocator_heap_profile_dump(path) writes one
+// on demand.
+
+#include "allocator.h"
+#include "static_buddy.h"
+#include "region.h"
+#include "large_object.h"
+#include "trace.h"
+#include "heap_profile.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+
+#define PRELOAD_API extern "C" __attribute__((visibility("default")))
+
+#define PRELOAD_MIN_ALIGN 16
+#define PRELOAD_SMALL_MAX 2048
+#define PRELOAD_CLASS_SPAN ((size_t)512 * 1024 * 1024)
+#define PRELOAD_SLAB_SIZE ((size_t)256 * 1024)
+#define PRELOAD_MEDIUM_HEAP ((size_t)1024 * 1024 * 1024)
+#define PRELOAD_MEDIUM_BLOCK ((size_t)4096)
+#define PRELOAD_MEDIUM_MAX ((size_t)1024 * 1024)
+#define PRELOAD_BOOTSTRAP_SIZE (256 * 1024)
+
+static const size_t preload_class_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+#define PRELOAD_CLASS_COUNT (sizeof(preload_class_sizes) / sizeof(preload_class_sizes[0]))
+
+struct PreloadSpinLock
+{
+    std::atomic_flag flag;
+};
+
+static void preload_lock(PreloadSpinLock* lock)
+{
+    int spins = 0;
+    while (lock->flag.test_and_set(std::memory_order_acquire)) {
+        if (++spins > 64) {
+            sched_yield();
+            spins = 0;
+        }
+    }
+}
+
+static void preload_unlock(PreloadSpinLock* lock)
+{
+    lock->flag.clear(std::memory_order_release);
+}
+
+struct PreloadSizeClass
+{
+    PoolAllocator pool;
+    // bytes of the class range already carved into chunks
+    size_t grown;
+    PreloadSpinLock lock;
+};
+
+typedef Buddy<PRELOAD_MEDIUM_HEAP, PRELOAD_MEDIUM_BLOCK> PreloadBuddy;
+
+struct PreloadHeap
+{
+    Region small_region;
+    PreloadSizeClass classes[PRELOAD_CLASS_COUNT];
+    // class index for (size + 15) / 16
+    uint8_t class_of[PRELOAD_SMALL_MAX / 16 + 1];
+
+    Region medium_region;
+    PreloadBuddy medium;
+    PreloadSpinLock medium_lock;
+
+    ArenaAllocator bootstrap;
+    PreloadSpinLock bootstrap_lock;
+};
+
+static PreloadHeap preload_heap;
+static unsigned char preload_bootstrap_buffer[PRELOAD_BOOTSTRAP_SIZE] __attribute__((aligned(64)));
+
+// 0 not initialized, 1 initializing, 2 ready
+static std::atomic<int> preload_state(0);
+static __thread int preload_initializing __attribute__((tls_model("initial-exec")));
+
+// Records are appended under the trace lock. A free is recorded before the
+// block is released and an alloc after it is handed out, so an address is never
+// reused out of order. Realloc holds the lock across the call.
+static TraceWriter preload_trace;
+static PreloadSpinLock preload_trace_lock;
+static std::atomic<bool> preload_tracing(false);
+static std::atomic<uint32_t> preload_trace_threads(0);
+static __thread uint32_t preload_trace_thread __attribute__((tls_model("initial-exec")));
+
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+// dump target at exit, empty in forked children
+static char preload_profile_path[4096];
+#endif
+
+static void preload_fork_prepare()
+{
+    preload_lock(&preload_trace_lock);
+    for (size_t i = 0; i < PRELOAD_CLASS_COUNT; i++) {
+        preload_lock(&preload_heap.classes[i].lock);
+    }
+    preload_lock(&preload_heap.medium_lock);
+    preload_lock(&preload_heap.bootstrap_lock);
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+    // sampled under the heap locks, so it comes last
+    heap_profile_fork_prepare();
+#endif
+}
+
+static void preload_fork_release()
+{
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+    heap_profile_fork_release();
+#endif
+    preload_unlock(&preload_heap.bootstrap_lock);
+    preload_unlock(&preload_heap.medium_lock);
+    for (size_t i = PRELOAD_CLASS_COUNT; i > 0; i--) {
+        preload_unlock(&preload_heap.classes[i - 1].lock);
+    }
+    preload_unlock(&preload_trace_lock);
+}
+
+static void preload_fork_child()
+{
+    // the buffered records belong to the parent
+    if (preload_tracing.load(std::memory_order_relaxed)) {
+        preload_tracing.store(false, std::memory_order_relaxed);
+        trace_writer_abandon(&preload_trace);
+    }
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+    // the samples so far are the parent's, its file too
+    preload_profile_path[0] = '\0';
+#endif
+    preload_fork_release();
+}
+
+// path.<pid><suffix>, built by hand because snprintf may allocate
+static bool preload_pid_path(char* out, size_t out_size, const char* path, const char* suffix)
+{
+    size_t length = strlen(path);
+    size_t suffix_length = strlen(suffix);
+    char digits[16];
+    size_t digit_count = 0;
+    for (unsigned pid = (unsigned)getpid(); pid != 0 || digit_count == 0; pid /= 10) {
+        digits[digit_count++] = (char)('0' + pid % 10);
+    }
+    if (length + 1 + digit_count + suffix_length + 1 > out_size) {
+        return false;
+    }
+    memcpy(out, path, length);
+    out[length++] = '.';
+    while (digit_count > 0) {
+        out[length++] = digits[--digit_count];
+    }
+    memcpy(out + length, suffix, suffix_length + 1);
+    return true;
+}
+
+static void preload_trace_open()
+{
+    const char* path = getenv("MEMORY_ALLOCATOR_TRACE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+
+    static char trace_path[4096];
+    if (!preload_pid_path(trace_path, sizeof(trace_path), path, "")) {
+        return;
+    }
+
+    if (trace_writer_open(&preload_trace, trace_path)) {
+        preload_tracing.store(true, std::memory_order_release);
+    }
+}
+
+__attribute__((destructor)) static void preload_trace_close()
+{
+    if (!preload_tracing.load(std::memory_order_acquire)) {
+        return;
+    }
+    preload_lock(&preload_trace_lock);
+    preload_tracing.store(false, std::memory_order_relaxed);
+    trace_writer_close(&preload_trace);
+    preload_unlock(&preload_trace_lock);
+}
+
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+static void preload_profile_start()
+{
+    const char* path = getenv("MEMORY_ALLOCATOR_HEAP_PROFILE");
+    if (path == NULL || path[0] == '\0' ||
+        !preload_pid_path(preload_profile_path, sizeof(preload_profile_path), path, ".heap")) {
+        return;
+    }
+    size_t rate = HEAP_PROFILE_DEFAULT_RATE;
+    const char* rate_text = getenv("MEMORY_ALLOCATOR_HEAP_PROFILE_RATE");
+    if (rate_text != NULL && rate_text[0] != '\0') {
+        rate = (size_t)strtoull(rate_text, NULL, 10);
+    }
+    heap_profile_start(rate);
+}
+
+__attribute__((destructor)) static void preload_profile_dump()
+{
+    if (heap_profile_running() && preload_profile_path[0] != '\0') {
+        heap_profile_dump(preload_profile_path);
+    }
+}
+
+PRELOAD_API int memory_allocator_heap_profile_dump(const char* path)
+{
+    return heap_profile_dump(path) ? 0 : -1;
+}
+#endif
+
+// caller holds the trace lock
+static void preload_trace_append(TraceOp op, void* ptr, void* prev, size_t size, size_t align)
+{
+    if (!preload_tracing.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (preload_trace_thread == 0) {
+        preload_trace_thread = preload_trace_threads.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    trace_writer_append(&preload_trace, op, (uintptr_t)ptr, (uintptr_t)prev, size, align, preload_trace_thread);
+}
+
+static void preload_trace_record(TraceOp op, void* ptr, size_t size, size_t align)
+{
+    preload_lock(&preload_trace_lock);
+    preload_trace_append(op, ptr, NULL, size, align);
+    preload_unlock(&preload_trace_lock);
+}
+
+static void preload_init_heap()
+{
+    PreloadHeap* heap = &preload_heap;
+
+    size_t class_index = 0;
+    for (size_t i = 0; i <= PRELOAD_SMALL_MAX / 16; i++) {
+        while (preload_class_sizes[class_index] < i * 16) {
+            class_index++;
+        }
+        heap->class_of[i] = (uint8_t)class_index;
+    }
+
+    // one range per class so free can find the class from the address
+    size_t span = PRELOAD_CLASS_SPAN;
+    while (!region_map(&heap->small_region, span * PRELOAD_CLASS_COUNT) && span > PRELOAD_SLAB_SIZE) {
+        span >>= 1;
+    }
+    for (size_t i = 0; i < PRELOAD_CLASS_COUNT; i++) {
+        PreloadSizeClass* size_class = &heap->classes[i];
+        size_class->pool.buffer = heap->small_region.base + i * span;
+        size_class->pool.buffer_size = heap->small_region.base != NULL ? span : 0;
+        size_class->pool.chunk_size = preload_class_sizes[i];
+        size_class->pool.head = NULL;
+        size_class->grown = 0;
+    }
+
+    if (region_map(&heap->medium_region, PRELOAD_MEDIUM_HEAP)) {
+        heap->medium.init(heap->medium_region.base);
+    }
+
+    pthread_atfork(preload_fork_prepare, preload_fork_release, preload_fork_child);
+
+    preload_trace_open();
+#if MEMORY_ALLOCATOR_HEAP_PROFILE
+    preload_profile_start();
+#endif
+}
+
+static void preload_ensure_init()
+{
+    if (preload_state.load(std::memory_order_acquire) == 2) {
+        return;
+    }
+
+    int expected = 0;
+    if (preload_state.compare_exchange_strong(expected, 1, std::memory_order_acq_rel)) {
+        arena_init(&preload_heap.bootstrap, preload_bootstrap_buffer, PRELOAD_BOOTSTRAP_SIZE);
+        preload_initializing = 1;
+        preload_init_heap();
+        preload_initializing = 0;
+        preload_state.store(2, std::memory_order_release);
+        return;
+    }
+
+    // someone else is setting up, wait unless it's us recursing
+    while (!preload_initializing && preload_state.load(std::memory_order_acquire) != 2) {
+        sched_yield();
+    }
+}
+
+static bool preload_in_range(void* ptr, unsigned char* base, size_t size)
+{
+    return base != NULL && (unsigned char*)ptr >= base && (unsigned char*)ptr < base + size;
+}
+
+////////////////////////////////
+// bootstrap
+
+static void* preload_bootstrap_alloc(size_t size, size_t align)
+{
+    if (align < PRELOAD_MIN_ALIGN) {
+        align = PRELOAD_MIN_ALIGN;
+    }
+    preload_lock(&preload_heap.bootstrap_lock);
+    // size is stored in front so realloc can copy out of the bootstrap arena
+    unsigned char* base = (unsigned char*)arena_alloc(&preload_heap.bootstrap, size + align, align);
+    preload_unlock(&preload_heap.bootstrap_lock);
+    if (base == NULL) {
+        return NULL;
+    }
+    ((size_t*)(base + align))[-1] = size;
+    return base + align;
+}
+
+////////////////////////////////
+// small
+
+static void* preload_small_alloc(size_t class_index)
+{
+    PreloadSizeClass* size_class = &preload_heap.classes[class_index];
+    preload_lock(&size_class->lock);
+
+    PoolAllocator* pool = &size_class->pool;
+    if (pool->head == NULL) {
+        size_t slab = PRELOAD_SLAB_SIZE - PRELOAD_SLAB_SIZE % pool->chunk_size;
+        if (size_class->grown + slab > pool->buffer_size) {
+            preload_unlock(&size_class->lock);
+            return NULL;
+        }
+        // push back to front so the slab is handed out in address order
+        unsigned char* begin = pool->buffer + size_class->grown;
+        for (size_t offset = slab; offset > 0; offset -= pool->chunk_size) {
+            pool_free(pool, begin + offset - pool->chunk_size);
+        }
+        size_class->grown += slab;
+    }
+    void* ptr = pool_alloc(pool);
+
+    preload_unlock(&size_class->lock);
+    return ptr;
+}
+
+static void preload_small_free(size_t class_index, void* ptr)
+{
+    PreloadSizeClass* size_class = &preload_heap.classes[class_index];
+    preload_lock(&size_class->lock);
+    pool_free(&size_class->pool, ptr);
+    preload_unlock(&size_class->lock);
+}
+
+////////////////////////////////
+// medium
+
+static void* preload_medium_alloc(size_t size, bool zero)
+{
+    if (preload_heap.medium_region.base == NULL) {
+        return NULL;
+    }
+    preload_lock(&preload_heap.medium_lock);
+    void* ptr = zero ? preload_heap.medium.alloc_zeroed(size) : preload_heap.medium.alloc(size);
+    preload_unlock(&preload_heap.medium_lock);
+    return ptr;
+}
+
+////////////////////////////////
+// dispatch
+
+static void* preload_alloc(size_t size, size_t align, bool zero)
+{
+    preload_ensure_init();
+    if (preload_initializing) {
+        return preload_bootstrap_alloc(size, align);
+    }
+
+    if (size == 0) {
+        size = 1;
+    }
+    if (align < PRELOAD_MIN_ALIGN) {
+        align = PRELOAD_MIN_ALIGN;
+    }
+
+    void* ptr = NULL;
+    if (align == PRELOAD_MIN_ALIGN && size <= PRELOAD_SMALL_MAX) {
+        ptr = preload_small_alloc(preload_heap.class_of[(size + 15) >> 4]);
+    }
+    else if (align <= PRELOAD_SMALL_MAX && size <= PRELOAD_SMALL_MAX) {
+        // power of two classes are aligned to their size
+        size_t class_size = align > size ? align : size;
+        size_t rounded = PRELOAD_MIN_ALIGN;
+        while (rounded < class_size) {
+            rounded <<= 1;
+        }
+        ptr = preload_small_alloc(preload_heap.class_of[rounded >> 4]);
+    }
+
+    if (ptr == NULL && size <= PRELOAD_MEDIUM_MAX && align <= PRELOAD_MEDIUM_BLOCK) {
+        // buddy blocks are aligned to their own size, the heap only to a page
+        ptr = preload_medium_alloc(align > size ? align : size, zero);
+    }
+
+    if (ptr == NULL) {
+        ptr = large_object_alloc(NULL, size, align);
+    }
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+static void preload_free(void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    PreloadHeap* heap = &preload_heap;
+
+    if (preload_in_range(ptr, preload_bootstrap_buffer, PRELOAD_BOOTSTRAP_SIZE)) {
+        return;
+    }
+    if (preload_in_range(ptr, heap->small_region.base, heap->small_region.size)) {
+        size_t class_index = ((unsigned char*)ptr - heap->small_region.base) / (heap->small_region.size / PRELOAD_CLASS_COUNT);
+        preload_small_free(class_index, ptr);
+        return;
+    }
+    if (preload_in_range(ptr, heap->medium_region.base, PRELOAD_MEDIUM_HEAP)) {
+        preload_lock(&heap->medium_lock);
+        heap->medium.free(ptr);
+        preload_unlock(&heap->medium_lock);
+        return;
+    }
+
+    large_object_free(NULL, ptr);
+}
+
+static size_t preload_usable_size(void* ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+    PreloadHeap* heap = &preload_heap;
+
+    if (preload_in_range(ptr, preload_bootstrap_buffer, PRELOAD_BOOTSTRAP_SIZE)) {
+        return ((size_t*)ptr)[-1];
+    }
+    if (preload_in_range(ptr, heap->small_region.base, heap->small_region.size)) {
+        size_t class_index = ((unsigned char*)ptr - heap->small_region.base) / (heap->small_region.size / PRELOAD_CLASS_COUNT);
+        return preload_class_sizes[class_index];
+    }
+    if (preload_in_range(ptr, heap->medium_region.base, PRELOAD_MEDIUM_HEAP)) {
+        preload_lock(&heap->medium_lock);
+        size_t size = heap->medium.block_size(ptr);
+        preload_unlock(&heap->medium_lock);
+        return size;
+    }
+    return large_object_size(ptr);
+}
+
+static bool preload_is_large(void* ptr)
+{
+    PreloadHeap* heap = &preload_heap;
+    return !preload_in_range(ptr, preload_bootstrap_buffer, PRELOAD_BOOTSTRAP_SIZE) &&
+        !preload_in_range(ptr, heap->small_region.base, heap->small_region.size) &&
+        !preload_in_range(ptr, heap->medium_region.base, PRELOAD_MEDIUM_HEAP);
+}
+
+static void* preload_realloc(void* ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return preload_alloc(size, PRELOAD_MIN_ALIGN, false);
+    }
+    if (size == 0) {
+        preload_free(ptr);
+        return NULL;
+    }
+
+    if (size > PRELOAD_MEDIUM_MAX && preload_is_large(ptr)) {
+        void* new_ptr = large_object_resize(NULL, ptr, size);
+        if (new_ptr == NULL) {
+            errno = ENOMEM;
+        }
+        return new_ptr;
+    }
+
+    // stay put unless the block is more than twice the new size
+    size_t usable = preload_usable_size(ptr);
+    if (size <= usable && (size > usable / 2 || usable <= PRELOAD_MIN_ALIGN)) {
+        return ptr;
+    }
+
+    void* new_ptr = preload_alloc(size, PRELOAD_MIN_ALIGN, false);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, usable < size ? usable : size);
+    preload_free(ptr);
+    return new_ptr;
+}
+
+////////////////////////////////
+// libc interface
+
+static void* preload_api_alloc(size_t size, size_t align, bool zero)
+{
+    void* ptr = preload_alloc(size, align, zero);
+    if (ptr != NULL && preload_tracing.load(std::memory_order_relaxed)) {
+        preload_trace_record(Trace_Op_Alloc, ptr, size, align);
+    }
+    return ptr;
+}
+
+PRELOAD_API void* malloc(size_t size)
+{
+    return preload_api_alloc(size, PRELOAD_MIN_ALIGN, false);
+}
+
+PRELOAD_API void free(void* ptr)
+{
+    if (ptr != NULL && preload_tracing.load(std::memory_order_relaxed)) {
+        preload_trace_record(Trace_Op_Free, ptr, 0, 0);
+    }
+    preload_free(ptr);
+}
+
+PRELOAD_API void* calloc(size_t count, size_t size)
+{
+    size_t total = 0;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return preload_api_alloc(total, PRELOAD_MIN_ALIGN, true);
+}
+
+PRELOAD_API void* realloc(void* ptr, size_t size)
+{
+    if (!preload_tracing.load(std::memory_order_relaxed)) {
+        return preload_realloc(ptr, size);
+    }
+
+    preload_lock(&preload_trace_lock);
+    void* new_ptr = preload_realloc(ptr, size);
+    if (ptr == NULL) {
+        if (new_ptr != NULL) {
+            preload_trace_append(Trace_Op_Alloc, new_ptr, NULL, size, PRELOAD_MIN_ALIGN);
+        }
+    }
+    else if (size == 0) {
+        preload_trace_append(Trace_Op_Free, ptr, NULL, 0, 0);
+    }
+    else if (new_ptr != NULL) {
+        preload_trace_append(Trace_Op_Realloc, new_ptr, ptr, size, PRELOAD_MIN_ALIGN);
+    }
+    preload_unlock(&preload_trace_lock);
+    return new_ptr;
+}
+
+PRELOAD_API int posix_memalign(void** memptr, size_t align, size_t size)
+{
+    if (align < sizeof(void*) || !is_power_of_two(align)) {
+        return EINVAL;
+    }
+    void* ptr = preload_api_alloc(size, align, false);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+PRELOAD_API void* aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || !is_power_of_two(align)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return preload_api_alloc(size, align, false);
+}
+
+PRELOAD_API void* memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+PRELOAD_API void* valloc(size_t size)
+{
+    return preload_api_alloc(size, REGION_SMALL_PAGE_SIZE, false);
+}
+
+PRELOAD_API void* pvalloc(size_t size)
+{
+    return preload_api_alloc(align_forward(size, REGION_SMALL_PAGE_SIZE), REGION_SMALL_PAGE_SIZE, false);
+}
+
+PRELOAD_API size_t malloc_usable_size(void* ptr)
+{
+    return preload_usable_size(ptr);
+}
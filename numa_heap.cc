@@ -0,0 +1,74 @@
+#include "numa_heap.h"
+
+#include <stdio.h>
+#include <string.h>
+
+bool numa_arenas_init(NumaArenas* numa, size_t size_per_node, unsigned flags)
+{
+    memset(numa, 0, sizeof(*numa));
+    int node_count = region_numa_node_count();
+    for (int node = 0; node < node_count; node++) {
+        if (!region_map_node(&numa->regions[node], size_per_node, node, flags)) {
+            fprintf(stderr, "[ERROR] numa_arenas_init failed. Can't map %zu bytes for node %d.\n", size_per_node, node);
+            numa_arenas_destroy(numa);
+            return false;
+        }
+        arena_init_region(&numa->arenas[node], &numa->regions[node]);
+        numa->node_count = node + 1;
+    }
+    return true;
+}
+
+ArenaAllocator* numa_arenas_node(NumaArenas* numa, int node)
+{
+    // a node that came online after init shares node 0's instance
+    return &numa->arenas[node >= 0 && node < numa->node_count ? node : 0];
+}
+
+ArenaAllocator* numa_arenas_local(NumaArenas* numa)
+{
+    return numa_arenas_node(numa, region_numa_current_node());
+}
+
+void numa_arenas_destroy(NumaArenas* numa)
+{
+    for (int node = 0; node < numa->node_count; node++) {
+        arena_free_all(&numa->arenas[node]);
+        region_unmap(&numa->regions[node]);
+    }
+    memset(numa, 0, sizeof(*numa));
+}
+
+bool numa_pools_init(NumaPools* numa, size_t size_per_node, size_t chunk_size, size_t align, unsigned flags)
+{
+    memset(numa, 0, sizeof(*numa));
+    int node_count = region_numa_node_count();
+    for (int node = 0; node < node_count; node++) {
+        if (!region_map_node(&numa->regions[node], size_per_node, node, flags & ~Region_Flag_Reserve)) {
+            fprintf(stderr, "[ERROR] numa_pools_init failed. Can't map %zu bytes for node %d.\n", size_per_node, node);
+            numa_pools_destroy(numa);
+            return false;
+        }
+        pool_init(&numa->pools[node], numa->regions[node].base, numa->regions[node].size, chunk_size, align);
+        numa->node_count = node + 1;
+    }
+    return true;
+}
+
+PoolAllocator* numa_pools_node(NumaPools* numa, int node)
+{
+    return &numa->pools[node >= 0 && node < numa->node_count ? node : 0];
+}
+
+PoolAllocator* numa_pools_local(NumaPools* numa)
+{
+    return numa_pools_node(numa, region_numa_current_node());
+}
+
+void numa_pools_destroy(NumaPools* numa)
+{
+    for (int node = 0; node < numa->node_count; node++) {
+        region_unmap(&numa->regions[node]);
+    }
+    memset(numa, 0, sizeof(*numa));
+}
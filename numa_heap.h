@@ -0,0 +1,47 @@
+#ifndef NUMA_HEAP_H
+#define NUMA_HEAP_H
+
+#include "allocator.h"
+#include "region.h"
+
+////////////////////////////////
+// per-node arenas and pools
+//
+// One ArenaAllocator or PoolAllocator per NUMA node, each over a region bound
+// to its node with region_map_node, so pages land on that node no matter which
+// thread touches them first. The _local functions pick the instance of the
+// node the calling thread runs on. The instances are no more thread safe than
+// the allocators they wrap, and a thread can migrate between the pick and the
+// use; pin threads to a node when locality has to be strict.
+//
+// On a single node machine there is one instance and _local always returns it.
+// The arenas keep pointers to the regions inside the struct, don't move it.
+
+struct NumaArenas
+{
+    int node_count;
+    Region regions[REGION_MAX_NUMA_NODES];
+    ArenaAllocator arenas[REGION_MAX_NUMA_NODES];
+};
+
+// size_per_node of address space per node, with Region_Flag_Reserve it is committed as the arena grows
+bool numa_arenas_init(NumaArenas* numa, size_t size_per_node, unsigned flags = Region_Flag_None);
+ArenaAllocator* numa_arenas_node(NumaArenas* numa, int node);
+ArenaAllocator* numa_arenas_local(NumaArenas* numa);
+void numa_arenas_destroy(NumaArenas* numa);
+
+struct NumaPools
+{
+    int node_count;
+    Region regions[REGION_MAX_NUMA_NODES];
+    PoolAllocator pools[REGION_MAX_NUMA_NODES];
+};
+
+// the pools thread their free lists through every chunk at init, Region_Flag_Reserve is ignored
+bool numa_pools_init(NumaPools* numa, size_t size_per_node, size_t chunk_size,
+    size_t align = DEFAULT_ALIGNMENT, unsigned flags = Region_Flag_None);
+PoolAllocator* numa_pools_node(NumaPools* numa, int node);
+PoolAllocator* numa_pools_local(NumaPools* numa);
+void numa_pools_destroy(NumaPools* numa);
+
+#endif
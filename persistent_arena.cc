@@ -0,0 +1,315 @@
+#include "persistent_arena.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define PERSISTENT_ARENA_NO_ROOT UINT64_MAX
+
+static inline uint64_t checksum_rotl(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Not cryptographic, it catches torn writes and bit rot. Four independent
+// lanes of 8-byte words keep it near memory bandwidth on large files.
+uint64_t persistent_arena_checksum(const void* data, size_t size)
+{
+    const uint64_t prime1 = 0x9E3779B185EBCA87ull;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, (uint64_t)0 - prime1};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, bytes + i + lane * 8, sizeof(word));
+            lanes[lane] = checksum_rotl(lanes[lane] + word * prime2, 31) * prime1;
+        }
+    }
+
+    uint64_t hash = (uint64_t)size * prime1;
+    for (int lane = 0; lane < 4; ++lane) {
+        hash = checksum_rotl(hash ^ lanes[lane], 27) * prime1 + prime2;
+    }
+    for (; i < size; ++i) {
+        hash = checksum_rotl(hash ^ (bytes[i] * prime2), 11) * prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime1;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static uint64_t persistent_arena_header_checksum(const PersistentArenaHeader* header)
+{
+    return persistent_arena_checksum(header, offsetof(PersistentArenaHeader, header_checksum));
+}
+
+void persistent_arena_set_root(PersistentArena* persistent, void* root)
+{
+    if (root == NULL) {
+        persistent->root = PERSISTENT_ARENA_NO_ROOT;
+        return;
+    }
+    unsigned char* ptr = (unsigned char*)root;
+    if (ptr < persistent->arena.buffer || ptr >= persistent->arena.buffer + persistent->arena.offset) {
+        fprintf(stderr, "[ERROR] persistent_arena_set_root failed. %p is not in the arena.\n", root);
+        return;
+    }
+    persistent->root = (uint64_t)(ptr - persistent->arena.buffer);
+}
+
+void* persistent_arena_root(PersistentArena* persistent)
+{
+    if (persistent->root == PERSISTENT_ARENA_NO_ROOT) {
+        return NULL;
+    }
+    return persistent->arena.buffer + persistent->root;
+}
+
+bool persistent_arena_verify(PersistentArena* persistent)
+{
+    const PersistentArenaHeader* header = (const PersistentArenaHeader*)persistent->map;
+    return persistent_arena_checksum(persistent->arena.buffer, persistent->arena.offset) == header->data_checksum;
+}
+
+#if defined(__linux__)
+
+// a rename is only durable once the directory holding the entry is synced
+static bool persistent_arena_sync_dir(const char* path)
+{
+    char dir[sizeof(((PersistentArena*)NULL)->path)];
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    }
+    else {
+        size_t length = slash == path ? 1 : (size_t)(slash - path);
+        memcpy(dir, path, length);
+        dir[length] = '\0';
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+bool persistent_arena_create(PersistentArena* persistent, const char* path, size_t capacity, uint64_t user_version)
+{
+    memset(persistent, 0, sizeof(*persistent));
+    persistent->fd = -1;
+    persistent->root = PERSISTENT_ARENA_NO_ROOT;
+
+    size_t path_length = strlen(path);
+    if (path_length + sizeof(".tmp") > sizeof(persistent->temp_path)) {
+        fprintf(stderr, "[ERROR] persistent_arena_create failed. Path %s is too long.\n", path);
+        return false;
+    }
+    memcpy(persistent->path, path, path_length + 1);
+    memcpy(persistent->temp_path, path, path_length);
+    memcpy(persistent->temp_path + path_length, ".tmp", sizeof(".tmp"));
+
+    int fd = open(persistent->temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] persistent_arena_create failed. Can't create %s.\n", persistent->temp_path);
+        return false;
+    }
+    // sparse, the header stays zero until seal so a crashed build is never valid
+    size_t map_size = PERSISTENT_ARENA_HEADER_SIZE + capacity;
+    if (ftruncate(fd, (off_t)map_size) != 0) {
+        fprintf(stderr, "[ERROR] persistent_arena_create failed. Can't size %s to %zu bytes.\n",
+            persistent->temp_path, map_size);
+        close(fd);
+        unlink(persistent->temp_path);
+        return false;
+    }
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] persistent_arena_create failed. Can't map %s.\n", persistent->temp_path);
+        close(fd);
+        unlink(persistent->temp_path);
+        return false;
+    }
+
+    persistent->map = (unsigned char*)map;
+    persistent->map_size = map_size;
+    persistent->fd = fd;
+    persistent->writable = true;
+    persistent->user_version = user_version;
+    arena_init(&persistent->arena, persistent->map + PERSISTENT_ARENA_HEADER_SIZE, capacity);
+    return true;
+}
+
+bool persistent_arena_seal(PersistentArena* persistent)
+{
+    if (!persistent->writable) {
+        fprintf(stderr, "[ERROR] persistent_arena_seal failed. The arena was opened read only.\n");
+        return false;
+    }
+
+    size_t used = persistent->arena.offset;
+    PersistentArenaHeader* header = (PersistentArenaHeader*)persistent->map;
+    memcpy(header->magic, PERSISTENT_ARENA_MAGIC, sizeof(header->magic));
+    header->version = PERSISTENT_ARENA_VERSION;
+    header->header_size = PERSISTENT_ARENA_HEADER_SIZE;
+    header->user_version = persistent->user_version;
+    header->used = used;
+    header->root = persistent->root;
+    header->data_checksum = persistent_arena_checksum(persistent->arena.buffer, used);
+    header->header_checksum = persistent_arena_header_checksum(header);
+
+    munmap(persistent->map, persistent->map_size);
+    persistent->map = NULL;
+    // the data must be on disk before the rename makes the file visible
+    bool sealed = ftruncate(persistent->fd, (off_t)(PERSISTENT_ARENA_HEADER_SIZE + used)) == 0 &&
+        fsync(persistent->fd) == 0;
+    close(persistent->fd);
+    persistent->fd = -1;
+    if (!sealed) {
+        fprintf(stderr, "[ERROR] persistent_arena_seal failed. Can't write %s.\n", persistent->temp_path);
+        unlink(persistent->temp_path);
+        memset(persistent, 0, sizeof(*persistent));
+        persistent->fd = -1;
+        return false;
+    }
+    if (rename(persistent->temp_path, persistent->path) != 0) {
+        fprintf(stderr, "[ERROR] persistent_arena_seal failed. Can't move %s to %s.\n",
+            persistent->temp_path, persistent->path);
+        unlink(persistent->temp_path);
+        memset(persistent, 0, sizeof(*persistent));
+        persistent->fd = -1;
+        return false;
+    }
+    // the file is in place either way, but without this a crash can bring back the old one
+    bool synced = persistent_arena_sync_dir(persistent->path);
+    if (!synced) {
+        fprintf(stderr, "[ERROR] persistent_arena_seal failed. Can't sync the directory of %s.\n", persistent->path);
+    }
+
+    memset(persistent, 0, sizeof(*persistent));
+    persistent->fd = -1;
+    return synced;
+}
+
+bool persistent_arena_open(PersistentArena* persistent, const char* path, uint64_t user_version, unsigned flags)
+{
+    memset(persistent, 0, sizeof(*persistent));
+    persistent->fd = -1;
+    persistent->root = PERSISTENT_ARENA_NO_ROOT;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] persistent_arena_open failed. Can't open %s.\n", path);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < PERSISTENT_ARENA_HEADER_SIZE) {
+        fprintf(stderr, "[ERROR] persistent_arena_open failed. %s is too small to be an arena.\n", path);
+        close(fd);
+        return false;
+    }
+    // shared, every process that opens the file reads the same page cache pages
+    size_t map_size = (size_t)info.st_size;
+    void* map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] persistent_arena_open failed. Can't map %s.\n", path);
+        return false;
+    }
+
+    const PersistentArenaHeader* header = (const PersistentArenaHeader*)map;
+    const char* problem = NULL;
+    if (memcmp(header->magic, PERSISTENT_ARENA_MAGIC, sizeof(header->magic)) != 0) {
+        problem = "is not a sealed arena";
+    } else if (header->header_checksum != persistent_arena_header_checksum(header)) {
+        problem = "has a damaged header";
+    } else if (header->version != PERSISTENT_ARENA_VERSION || header->header_size != PERSISTENT_ARENA_HEADER_SIZE) {
+        problem = "has an unsupported format version";
+    } else if (header->used != map_size - PERSISTENT_ARENA_HEADER_SIZE) {
+        problem = "is truncated";
+    } else if (header->root != PERSISTENT_ARENA_NO_ROOT && header->root >= header->used) {
+        problem = "has a root outside the data";
+    } else if (header->user_version != user_version) {
+        problem = "was built for another user version";
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "[ERROR] persistent_arena_open failed. %s %s.\n", path, problem);
+        munmap(map, map_size);
+        return false;
+    }
+
+    persistent->map = (unsigned char*)map;
+    persistent->map_size = map_size;
+    persistent->user_version = user_version;
+    persistent->root = header->root;
+    // full, arena_alloc fails instead of writing to the read-only mapping
+    arena_init(&persistent->arena, persistent->map + PERSISTENT_ARENA_HEADER_SIZE, header->used);
+    persistent->arena.offset = header->used;
+
+    if ((flags & Persistent_Arena_Verify) && !persistent_arena_verify(persistent)) {
+        fprintf(stderr, "[ERROR] persistent_arena_open failed. %s has damaged data.\n", path);
+        persistent_arena_close(persistent);
+        return false;
+    }
+    return true;
+}
+
+void persistent_arena_close(PersistentArena* persistent)
+{
+    if (persistent->map != NULL) {
+        munmap(persistent->map, persistent->map_size);
+    }
+    if (persistent->fd >= 0) {
+        close(persistent->fd);
+    }
+    if (persistent->writable) {
+        unlink(persistent->temp_path);
+    }
+    memset(persistent, 0, sizeof(*persistent));
+    persistent->fd = -1;
+}
+
+#else
+
+bool persistent_arena_create(PersistentArena* persistent, const char* path, size_t capacity, uint64_t user_version)
+{
+    memset(persistent, 0, sizeof(*persistent));
+    persistent->fd = -1;
+    fprintf(stderr, "[ERROR] persistent_arena_create failed. Persistent arenas are only supported on Linux.\n");
+    return false;
+}
+
+bool persistent_arena_seal(PersistentArena* persistent)
+{
+    return false;
+}
+
+bool persistent_arena_open(PersistentArena* persistent, const char* path, uint64_t user_version, unsigned flags)
+{
+    memset(persistent, 0, sizeof(*persistent));
+    persistent->fd = -1;
+    fprintf(stderr, "[ERROR] persistent_arena_open failed. Persistent arenas are only supported on Linux.\n");
+    return false;
+}
+
+void persistent_arena_close(PersistentArena* persistent)
+{
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef PERSISTENT_ARENA_H
+#define PERSISTENT_ARENA_H
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// persistent arena
+//
+// An ArenaAllocator over an mmap'd file. Build a structure with arena_alloc on
+// `arena`, link it with rel_ptr instead of raw pointers, point the root at it
+// and seal. A later process maps the sealed file and reads the structure in
+// place: there is no parsing, and pages fault in as they are touched.
+//
+// The builder writes to path.tmp, which seal renames over path, so readers
+// never see a half-built file. The file is a PersistentArenaHeader followed by
+// the arena bytes. The header holds the format version, the caller's own
+// version for the layout of what is stored, and checksums of the header and
+// the data. The header is always checked on open. The data checksum reads
+// every page, so it is only checked with Persistent_Arena_Verify or
+// persistent_arena_verify.
+
+#define PERSISTENT_ARENA_MAGIC "MAPARENA"
+#define PERSISTENT_ARENA_VERSION 1
+// the data starts one page into the file, so arena blocks keep page alignment
+#define PERSISTENT_ARENA_HEADER_SIZE 4096
+
+struct PersistentArenaHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // layout version of the stored structures, chosen by the caller
+    uint64_t user_version;
+    // arena bytes in use
+    uint64_t used;
+    // offset of the root object from the start of the data, UINT64_MAX for none
+    uint64_t root;
+    uint64_t data_checksum;
+    // over the fields above
+    uint64_t header_checksum;
+};
+
+enum PersistentArenaFlags
+{
+    Persistent_Arena_Flag_None = 0,
+    // check the data checksum on open, touching every page
+    Persistent_Arena_Verify = 1 << 0,
+};
+
+struct PersistentArena
+{
+    // allocate with this while building, read only after open
+    ArenaAllocator arena;
+    unsigned char* map;
+    size_t map_size;
+    int fd;
+    bool writable;
+    uint64_t user_version;
+    // offset of the root from arena.buffer, UINT64_MAX for none
+    uint64_t root;
+    // builder only, the file being written and where it goes on seal
+    char temp_path[4096];
+    char path[4096];
+};
+
+// Start a new file with room for `capacity` bytes. The file is sparse, only
+// what is allocated takes disk space.
+bool persistent_arena_create(PersistentArena* persistent, const char* path, size_t capacity, uint64_t user_version);
+void persistent_arena_set_root(PersistentArena* persistent, void* root);
+// Write the header, trim the file to what was used and move it into place,
+// syncing the file and then its directory. The arena is closed afterwards.
+bool persistent_arena_seal(PersistentArena* persistent);
+// map a sealed file read only, false if it is missing, damaged or of another version
+bool persistent_arena_open(PersistentArena* persistent, const char* path, uint64_t user_version,
+    unsigned flags = Persistent_Arena_Flag_None);
+bool persistent_arena_verify(PersistentArena* persistent);
+void* persistent_arena_root(PersistentArena* persistent);
+// a builder that wasn't sealed removes its temp file
+void persistent_arena_close(PersistentArena* persistent);
+
+uint64_t persistent_arena_checksum(const void* data, size_t size);
+
+// Pointer stored as the distance from itself to the target, so a structure
+// linked with it can be mapped at any address. Null is stored as 0, a rel_ptr
+// can't point at itself. Copies recompute the distance from their own address.
+template <class T>
+struct rel_ptr
+{
+    int64_t offset;
+
+    rel_ptr() : offset(0) {}
+    rel_ptr(T* ptr) { set(ptr); }
+    rel_ptr(const rel_ptr& other) { set(other.get()); }
+
+    rel_ptr& operator=(const rel_ptr& other)
+    {
+        set(other.get());
+        return *this;
+    }
+
+    rel_ptr& operator=(T* ptr)
+    {
+        set(ptr);
+        return *this;
+    }
+
+    T* get() const
+    {
+        return offset == 0 ? NULL : (T*)((const unsigned char*)this + offset);
+    }
+
+    void set(T* ptr)
+    {
+        offset = ptr == NULL ? 0 : (int64_t)((uintptr_t)ptr - (uintptr_t)this);
+    }
+
+    T* operator->() const { return get(); }
+    T& operator*() const { return *get(); }
+    T& operator[](size_t index) const { return get()[index]; }
+    explicit operator bool() const { return offset != 0; }
+};
+
+#endif
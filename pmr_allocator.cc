@@ -0,0 +1,116 @@
+#include "pmr_allocator.h"
+
+#include <new>
+
+// lowest set bit, the largest power of two that divides the address
+static size_t pmr_address_alignment(const void* ptr)
+{
+    uintptr_t address = (uintptr_t)ptr;
+    return (size_t)(address & (~address + 1));
+}
+
+// the try_ variants, exhaustion is reported to the caller as bad_alloc only
+static void* pmr_check(void* ptr)
+{
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+// arena
+void* ArenaResource::do_allocate(size_t bytes, size_t align)
+{
+    return pmr_check(try_arena_alloc(arena, bytes, align));
+}
+
+void ArenaResource::do_deallocate(void*, size_t, size_t)
+{
+    // DO NOTHING
+}
+
+bool ArenaResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    const ArenaResource* resource = dynamic_cast<const ArenaResource*>(&other);
+    return resource != NULL && resource->arena == arena;
+}
+
+// stack
+void* StackResource::do_allocate(size_t bytes, size_t align)
+{
+    // stack_alloc caps the alignment at what its header can record
+    const size_t max_align = stack_max_align();
+    if (align <= max_align) {
+        return pmr_check(try_stack_alloc(stack, bytes, align));
+    }
+    unsigned char* ptr = (unsigned char*)pmr_check(try_stack_alloc(stack, bytes + align, max_align));
+    return (void*)align_forward((uintptr_t)ptr, align);
+}
+
+void StackResource::do_deallocate(void*, size_t, size_t)
+{
+    // DO NOTHING
+}
+
+bool StackResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    const StackResource* resource = dynamic_cast<const StackResource*>(&other);
+    return resource != NULL && resource->stack == stack;
+}
+
+// pool
+void* PoolResource::do_allocate(size_t bytes, size_t align)
+{
+    if (bytes > pool->chunk_size || pool->chunk_size % align != 0 || pmr_address_alignment(pool->buffer) < align) {
+        throw std::bad_alloc();
+    }
+    return pmr_check(try_pool_alloc(pool));
+}
+
+void PoolResource::do_deallocate(void* ptr, size_t, size_t)
+{
+    pool_free(pool, ptr);
+}
+
+bool PoolResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    const PoolResource* resource = dynamic_cast<const PoolResource*>(&other);
+    return resource != NULL && resource->pool == pool;
+}
+
+// free list
+void* FreeListResource::do_allocate(size_t bytes, size_t align)
+{
+    return pmr_check(try_free_list_alloc(free_list, bytes, align));
+}
+
+void FreeListResource::do_deallocate(void* ptr, size_t, size_t)
+{
+    free_list_free(free_list, ptr);
+}
+
+bool FreeListResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    const FreeListResource* resource = dynamic_cast<const FreeListResource*>(&other);
+    return resource != NULL && resource->free_list == free_list;
+}
+
+// buddy
+void* BuddyResource::do_allocate(size_t bytes, size_t align)
+{
+    if (pmr_address_alignment(buddy->buffer) < align) {
+        throw std::bad_alloc();
+    }
+    return pmr_check(try_buddy_alloc(buddy, bytes > align ? bytes : align));
+}
+
+void BuddyResource::do_deallocate(void* ptr, size_t, size_t)
+{
+    buddy_free(buddy, ptr);
+}
+
+bool BuddyResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    const BuddyResource* resource = dynamic_cast<const BuddyResource*>(&other);
+    return resource != NULL && resource->buddy == buddy;
+}
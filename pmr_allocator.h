@@ -0,0 +1,80 @@
+#ifndef PMR_ALLOCATOR_H
+#define PMR_ALLOCATOR_H
+
+#include "allocator.h"
+
+#include <memory_resource>
+
+////////////////////////////////
+// std::pmr::memory_resource adapters
+//
+// Let std::pmr containers draw from an existing allocator. The resource only
+// keeps a pointer, the allocator must outlive it. Allocation failure throws
+// std::bad_alloc, as the standard requires. Two resources compare equal when
+// they share the same allocator.
+
+// deallocate does nothing, memory comes back with arena_free_all
+class ArenaResource : public std::pmr::memory_resource
+{
+public:
+    explicit ArenaResource(ArenaAllocator* arena) : arena(arena) {}
+    ArenaAllocator* arena;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// deallocate does nothing, containers don't free in FILO order
+class StackResource : public std::pmr::memory_resource
+{
+public:
+    explicit StackResource(StackAllocator* stack) : stack(stack) {}
+    StackAllocator* stack;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// only requests that fit one chunk at the chunks' alignment, e.g. list or map nodes
+class PoolResource : public std::pmr::memory_resource
+{
+public:
+    explicit PoolResource(PoolAllocator* pool) : pool(pool) {}
+    PoolAllocator* pool;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+class FreeListResource : public std::pmr::memory_resource
+{
+public:
+    explicit FreeListResource(FreeListAllocator* free_list) : free_list(free_list) {}
+    FreeListAllocator* free_list;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// blocks are aligned to their size, up to the alignment of the buffer
+class BuddyResource : public std::pmr::memory_resource
+{
+public:
+    explicit BuddyResource(BuddyAllocator* buddy) : buddy(buddy) {}
+    BuddyAllocator* buddy;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "region.h"
+#include "allocator.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+static void* region_map_hugetlb(size_t size, int prot, int populate)
+{
+    void* ptr = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB | populate, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// over-map and trim so the base lands on a huge page boundary, then ask for THP
+static void* region_map_trimmed(size_t size, size_t align, int prot, int populate)
+{
+    size_t map_size = size + align;
+    unsigned char* ptr = (unsigned char*)mmap(NULL, map_size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    unsigned char* base = (unsigned char*)align_forward((uintptr_t)ptr, align);
+    size_t head = base - ptr;
+    size_t tail = map_size - head - size;
+    if (head != 0) {
+        munmap(ptr, head);
+    }
+    if (tail != 0) {
+        munmap(base + size, tail);
+    }
+#if defined(MADV_HUGEPAGE)
+    if (align >= REGION_HUGE_PAGE_SIZE) {
+        madvise(base, size, MADV_HUGEPAGE);
+    }
+#endif
+    if (populate) {
+        // MAP_POPULATE on the over-sized mapping would fault the trimmed parts too
+        for (volatile unsigned char* p = base; p < base + size; p += REGION_SMALL_PAGE_SIZE) {
+            *p = 0;
+        }
+    }
+    return base;
+}
+
+bool region_map(Region* region, size_t size, unsigned flags)
+{
+    memset(region, 0, sizeof(*region));
+    int prot = (flags & Region_Flag_Reserve) ? PROT_NONE : PROT_READ | PROT_WRITE;
+    int populate = (flags & Region_Flag_Populate) && !(flags & Region_Flag_Reserve) ? MAP_POPULATE : 0;
+
+    if (flags & Region_Flag_Huge_Pages) {
+        size = align_forward(size, REGION_HUGE_PAGE_SIZE);
+        region->page_size = REGION_HUGE_PAGE_SIZE;
+
+        void* ptr = region_map_hugetlb(size, prot, populate);
+        if (ptr != NULL) {
+            region->backing = Region_Backing_Hugetlb;
+        }
+        else {
+            ptr = region_map_trimmed(size, REGION_HUGE_PAGE_SIZE, prot, populate);
+            if (ptr == NULL) {
+                fprintf(stderr, "[ERROR] region_map failed. mmap of %zu bytes failed.\n", size);
+                return false;
+            }
+            region->backing = Region_Backing_Transparent_Huge_Pages;
+        }
+        region->base = (unsigned char*)ptr;
+    }
+    else {
+        size = align_forward(size, REGION_SMALL_PAGE_SIZE);
+        region->page_size = REGION_SMALL_PAGE_SIZE;
+        void* ptr = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | populate, -1, 0);
+        if (ptr == MAP_FAILED) {
+            fprintf(stderr, "[ERROR] region_map failed. mmap of %zu bytes failed.\n", size);
+            return false;
+        }
+        region->base = (unsigned char*)ptr;
+        region->backing = Region_Backing_Small_Pages;
+    }
+
+    region->size = size;
+    region->committed = (flags & Region_Flag_Reserve) ? 0 : size;
+    return true;
+}
+
+bool region_map_aligned(Region* region, size_t size, size_t align)
+{
+    assert(is_power_of_two(align) && align >= REGION_SMALL_PAGE_SIZE);
+    memset(region, 0, sizeof(*region));
+    size = align_forward(size, REGION_SMALL_PAGE_SIZE);
+    void* ptr = region_map_trimmed(size, align, PROT_READ | PROT_WRITE, 0);
+    if (ptr == NULL) {
+        fprintf(stderr, "[ERROR] region_map_aligned failed. mmap of %zu bytes failed.\n", size + align);
+        return false;
+    }
+    region->base = (unsigned char*)ptr;
+    region->size = size;
+    region->committed = size;
+    region->page_size = REGION_SMALL_PAGE_SIZE;
+    region->backing = align >= REGION_HUGE_PAGE_SIZE ? Region_Backing_Transparent_Huge_Pages : Region_Backing_Small_Pages;
+    return true;
+}
+
+bool region_commit(Region* region, size_t size)
+{
+    if (size <= region->committed) {
+        return true;
+    }
+    if (size > region->size) {
+        return false;
+    }
+
+    size_t end = align_forward(size, region->page_size);
+    if (end > region->size) {
+        end = region->size;
+    }
+    if (mprotect(region->base + region->committed, end - region->committed, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    region->committed = end;
+    return true;
+}
+
+void region_unmap(Region* region)
+{
+    if (region->base != NULL) {
+        munmap(region->base, region->size);
+    }
+    memset(region, 0, sizeof(*region));
+}
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+static int region_numa_nodes = 0;
+
+// "0-1,3" and the like, open/read so it works inside the malloc replacement
+static int region_numa_read_node_count()
+{
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    char text[256];
+    ssize_t length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 1;
+    }
+    text[length] = 0;
+
+    int highest = 0;
+    int value = -1;
+    for (const char* c = text; ; c++) {
+        if (*c >= '0' && *c <= '9') {
+            value = (value < 0 ? 0 : value * 10) + (*c - '0');
+            continue;
+        }
+        if (value > highest) {
+            highest = value;
+        }
+        value = -1;
+        if (*c == 0) {
+            break;
+        }
+    }
+    return highest + 1 > REGION_MAX_NUMA_NODES ? REGION_MAX_NUMA_NODES : highest + 1;
+}
+
+int region_numa_node_count()
+{
+    int count = __atomic_load_n(&region_numa_nodes, __ATOMIC_RELAXED);
+    if (count == 0) {
+        count = region_numa_read_node_count();
+        __atomic_store_n(&region_numa_nodes, count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+int region_numa_current_node()
+{
+    if (region_numa_node_count() == 1) {
+        return 0;
+    }
+    unsigned cpu = 0;
+    unsigned node = 0;
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 29)
+    // vDSO, no system call
+    if (getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+#else
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+#endif
+    return (int)node < REGION_MAX_NUMA_NODES ? (int)node : 0;
+}
+
+bool region_map_node(Region* region, size_t size, int node, unsigned flags)
+{
+    // populate after the policy is set, or the pages land wherever this thread runs
+    if (!region_map(region, size, flags & ~Region_Flag_Populate)) {
+        return false;
+    }
+
+    if (region_numa_node_count() > 1 && node >= 0 && node < REGION_MAX_NUMA_NODES) {
+        unsigned long mask[REGION_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+        mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+        // the kernel drops the last bit of maxnode, as libnuma does pass one more
+        syscall(SYS_mbind, region->base, region->size, MPOL_BIND, mask, REGION_MAX_NUMA_NODES + 1, 0);
+    }
+
+    if ((flags & Region_Flag_Populate) && !(flags & Region_Flag_Reserve)) {
+        for (volatile unsigned char* p = region->base; p < region->base + region->size; p += region->page_size) {
+            *p = 0;
+        }
+    }
+    return true;
+}
+
+#else
+
+// No virtual memory API, fall back to an aligned heap block that is fully committed.
+static bool region_map_heap(Region* region, size_t size, size_t align, size_t page_size)
+{
+    memset(region, 0, sizeof(*region));
+    size = align_forward(size, page_size);
+
+    unsigned char* raw = (unsigned char*)malloc(size + align + sizeof(void*));
+    if (raw == NULL) {
+        fprintf(stderr, "[ERROR] region_map failed. malloc of %zu bytes failed.\n", size);
+        return false;
+    }
+    unsigned char* base = (unsigned char*)align_forward((uintptr_t)raw + sizeof(void*), align);
+    ((void**)base)[-1] = raw;
+
+    region->base = base;
+    region->size = size;
+    region->committed = size;
+    region->page_size = page_size;
+    region->backing = Region_Backing_Small_Pages;
+    return true;
+}
+
+bool region_map(Region* region, size_t size, unsigned flags)
+{
+    size_t page_size = (flags & Region_Flag_Huge_Pages) ? REGION_HUGE_PAGE_SIZE : REGION_SMALL_PAGE_SIZE;
+    return region_map_heap(region, size, page_size, page_size);
+}
+
+bool region_map_aligned(Region* region, size_t size, size_t align)
+{
+    assert(is_power_of_two(align) && align >= REGION_SMALL_PAGE_SIZE);
+    return region_map_heap(region, size, align, REGION_SMALL_PAGE_SIZE);
+}
+
+bool region_commit(Region* region, size_t size)
+{
+    return size <= region->size;
+}
+
+void region_unmap(Region* region)
+{
+    if (region->base != NULL) {
+        free(((void**)region->base)[-1]);
+    }
+    memset(region, 0, sizeof(*region));
+}
+
+int region_numa_node_count()
+{
+    return 1;
+}
+
+int region_numa_current_node()
+{
+    return 0;
+}
+
+bool region_map_node(Region* region, size_t size, int node, unsigned flags)
+{
+    return region_map(region, size, flags);
+}
+
+#endif
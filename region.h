@@ -0,0 +1,70 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// region provider
+//
+// Page-aligned memory straight from the OS, to back the allocators instead of
+// a malloc'd buffer. With Region_Flag_Huge_Pages the region is 2 MiB aligned
+// and uses MAP_HUGETLB when the kernel has huge pages reserved, otherwise
+// madvise(MADV_HUGEPAGE) so transparent huge pages can back it.
+
+#define REGION_SMALL_PAGE_SIZE (4 * 1024)
+#define REGION_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+enum RegionFlags
+{
+    Region_Flag_None = 0,
+    Region_Flag_Huge_Pages = 1 << 0,
+    // only reserve address space, memory is committed with region_commit
+    Region_Flag_Reserve = 1 << 1,
+    // fault every page in at map time (MAP_POPULATE), ignored with Region_Flag_Reserve
+    Region_Flag_Populate = 1 << 2,
+};
+
+enum RegionBacking
+{
+    Region_Backing_Small_Pages,
+    Region_Backing_Hugetlb,
+    Region_Backing_Transparent_Huge_Pages,
+};
+
+struct Region
+{
+    unsigned char* base;
+    size_t size;
+    // bytes from base that are readable and writable
+    size_t committed;
+    // granularity of the backing pages, also the commit granularity
+    size_t page_size;
+    RegionBacking backing;
+};
+
+bool region_map(Region* region, size_t size, unsigned flags = Region_Flag_None);
+// committed small-page region whose base is a multiple of align, a power of two >= a page
+bool region_map_aligned(Region* region, size_t size, size_t align);
+// make sure the first `size` bytes are committed, rounded up to page_size
+bool region_commit(Region* region, size_t size);
+void region_unmap(Region* region);
+
+////////////////////////////////
+// NUMA
+//
+// Talks to the kernel directly (mbind, getcpu), libnuma isn't needed. On a
+// machine with one node, or off Linux, everything is node 0 and regions are
+// mapped as usual.
+
+#define REGION_MAX_NUMA_NODES 64
+
+// highest online node + 1, read once from sysfs
+int region_numa_node_count();
+// node of the CPU the calling thread is running on right now
+int region_numa_current_node();
+// region_map with the pages bound to `node` (MPOL_BIND) before any of them is
+// faulted in. If the kernel refuses the policy the region stays unbound.
+bool region_map_node(Region* region, size_t size, int node, unsigned flags = Region_Flag_None);
+
+#endif
@@ -0,0 +1,619 @@
+// Replays an allocation trace (trace.h) against each allocator in this repo and
+// glibc malloc:
+//
+//     memory_allocator_replay TRACE [--heap MiB] [allocator...]
+//
+// Record traces from any program with
+//
+//     LD_PRELOAD=libmemory_allocator_preload.so MEMORY_ALLOCATOR_TRACE=/tmp/app.trace app
+//
+// Every allocator runs in a forked child, so peak RSS is its own and a crash
+// only loses its row. Records replay in file order on one thread. Blocks are
+// touched once so their pages count as resident, like the recorded program's
+// would. Fragmentation is 1 - live bytes / heap RSS, sampled over the trace.
+
+#include "allocator.h"
+#include "static_buddy.h"
+#include "region.h"
+#include "thread_heap.h"
+#include "trace.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define REPLAY_DEFAULT_HEAP ((size_t)1024 * 1024 * 1024)
+#define REPLAY_SAMPLES 20
+// most records between RSS reads for the peak, it is also read whenever the
+// live bytes grow by a sixteenth
+#define REPLAY_RSS_INTERVAL 65536
+
+////////////////////////////////
+// live blocks by trace id, linear probing without tombstones
+
+struct ReplayBlock
+{
+    uint64_t id;
+    void* ptr;
+    size_t size;
+};
+
+struct ReplayTable
+{
+    Region region;
+    ReplayBlock* blocks;
+    size_t capacity;
+    size_t count;
+};
+
+static bool replay_table_init(ReplayTable* table, size_t capacity)
+{
+    size_t rounded = 1024;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    memset(table, 0, sizeof(*table));
+    if (!region_map(&table->region, rounded * sizeof(ReplayBlock))) {
+        return false;
+    }
+    table->blocks = (ReplayBlock*)table->region.base;
+    table->capacity = rounded;
+    return true;
+}
+
+static void replay_table_destroy(ReplayTable* table)
+{
+    region_unmap(&table->region);
+}
+
+static size_t replay_table_slot(ReplayTable* table, uint64_t id)
+{
+    uint64_t hash = id * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash >> 20) & (table->capacity - 1);
+}
+
+static ReplayBlock* replay_table_find(ReplayTable* table, uint64_t id)
+{
+    for (size_t slot = replay_table_slot(table, id);; slot = (slot + 1) & (table->capacity - 1)) {
+        ReplayBlock* block = &table->blocks[slot];
+        if (block->id == id) {
+            return block;
+        }
+        if (block->id == 0) {
+            return NULL;
+        }
+    }
+}
+
+static bool replay_table_grow(ReplayTable* table);
+
+static ReplayBlock* replay_table_insert(ReplayTable* table, uint64_t id)
+{
+    if (2 * (table->count + 1) > table->capacity && !replay_table_grow(table)) {
+        return NULL;
+    }
+    size_t slot = replay_table_slot(table, id);
+    while (table->blocks[slot].id != 0 && table->blocks[slot].id != id) {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    ReplayBlock* block = &table->blocks[slot];
+    if (block->id == 0) {
+        block->id = id;
+        block->ptr = NULL;
+        block->size = 0;
+        table->count++;
+    }
+    return block;
+}
+
+static void replay_table_remove(ReplayTable* table, ReplayBlock* block)
+{
+    // shift the rest of the cluster back so lookups never stop early
+    size_t hole = block - table->blocks;
+    size_t slot = hole;
+    for (;;) {
+        slot = (slot + 1) & (table->capacity - 1);
+        if (table->blocks[slot].id == 0) {
+            break;
+        }
+        size_t home = replay_table_slot(table, table->blocks[slot].id);
+        bool movable = hole <= slot ? (home <= hole || home > slot) : (home <= hole && home > slot);
+        if (movable) {
+            table->blocks[hole] = table->blocks[slot];
+            hole = slot;
+        }
+    }
+    table->blocks[hole].id = 0;
+    table->count--;
+}
+
+static bool replay_table_grow(ReplayTable* table)
+{
+    ReplayTable grown;
+    if (!replay_table_init(&grown, table->capacity * 2)) {
+        fprintf(stderr, "[ERROR] replay_table_grow failed. Can't map %zu slots.\n", table->capacity * 2);
+        return false;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->blocks[i].id != 0) {
+            *replay_table_insert(&grown, table->blocks[i].id) = table->blocks[i];
+        }
+    }
+    replay_table_destroy(table);
+    *table = grown;
+    return true;
+}
+
+////////////////////////////////
+// allocators
+//
+// Heaps are mapped lazily, RSS only grows with the pages an allocator touches.
+
+struct ReplayAllocator
+{
+    const char* name;
+    bool (*init)(size_t heap_size);
+    void* (*alloc)(size_t size, size_t align);
+    // NULL on failure, ptr stays valid then
+    void* (*resize)(void* ptr, size_t old_size, size_t new_size);
+    void (*free)(void* ptr);
+};
+
+static Region replay_region;
+
+static bool replay_map_heap(size_t heap_size)
+{
+    return region_map(&replay_region, heap_size);
+}
+
+static void* replay_copy_resize(void* (*alloc)(size_t, size_t), void (*release)(void*), void* ptr,
+    size_t old_size, size_t new_size)
+{
+    void* new_ptr = alloc(new_size, DEFAULT_ALIGNMENT);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    release(ptr);
+    return new_ptr;
+}
+
+// glibc
+static bool replay_malloc_init(size_t heap_size) { return true; }
+static void* replay_malloc_alloc(size_t size, size_t align)
+{
+    if (align <= DEFAULT_ALIGNMENT) {
+        return malloc(size);
+    }
+    void* ptr = NULL;
+    return posix_memalign(&ptr, align, size) == 0 ? ptr : NULL;
+}
+static void* replay_malloc_resize(void* ptr, size_t old_size, size_t new_size) { return realloc(ptr, new_size); }
+static void replay_malloc_free(void* ptr) { free(ptr); }
+
+// free list, first and best fit
+static FreeListAllocator replay_free_list;
+static bool replay_free_list_init(size_t heap_size, FreeListAllocationPolicy policy)
+{
+    if (!replay_map_heap(heap_size)) {
+        return false;
+    }
+    free_list_init(&replay_free_list, replay_region.base, replay_region.size, policy);
+    return true;
+}
+static bool replay_first_fit_init(size_t heap_size) { return replay_free_list_init(heap_size, Allocation_Policy_First_Fit); }
+static bool replay_best_fit_init(size_t heap_size) { return replay_free_list_init(heap_size, Allocation_Policy_Best_Fit); }
+static void* replay_free_list_alloc(size_t size, size_t align) { return free_list_alloc(&replay_free_list, size, align); }
+static void replay_free_list_free(void* ptr) { free_list_free(&replay_free_list, ptr); }
+static void* replay_free_list_resize(void* ptr, size_t old_size, size_t new_size)
+{
+    return replay_copy_resize(replay_free_list_alloc, replay_free_list_free, ptr, old_size, new_size);
+}
+
+// buddy, blocks are aligned to their size
+static BuddyAllocator replay_buddy;
+static bool replay_buddy_init(size_t heap_size)
+{
+    size_t size = 1;
+    while (size * 2 <= heap_size) {
+        size <<= 1;
+    }
+    if (!replay_map_heap(size)) {
+        return false;
+    }
+    buddy_init(&replay_buddy, replay_region.base, replay_region.size, 64);
+    return true;
+}
+static void* replay_buddy_alloc(size_t size, size_t align) { return buddy_alloc(&replay_buddy, size > align ? size : align); }
+static void* replay_buddy_resize(void* ptr, size_t old_size, size_t new_size) { return buddy_resize(&replay_buddy, ptr, new_size); }
+static void replay_buddy_free(void* ptr) { buddy_free(&replay_buddy, ptr); }
+
+// compile-time buddy, the heap size is fixed
+typedef Buddy<REPLAY_DEFAULT_HEAP, 64> ReplayStaticBuddy;
+static ReplayStaticBuddy* replay_static_buddy;
+static bool replay_static_buddy_init(size_t heap_size)
+{
+    if (!replay_map_heap(REPLAY_DEFAULT_HEAP)) {
+        return false;
+    }
+    replay_static_buddy = (ReplayStaticBuddy*)malloc(sizeof(ReplayStaticBuddy));
+    if (replay_static_buddy == NULL) {
+        return false;
+    }
+    replay_static_buddy->init(replay_region.base);
+    return true;
+}
+static void* replay_static_buddy_alloc(size_t size, size_t align) { return replay_static_buddy->alloc(size > align ? size : align); }
+static void replay_static_buddy_free(void* ptr) { replay_static_buddy->free(ptr); }
+static void* replay_static_buddy_resize(void* ptr, size_t old_size, size_t new_size)
+{
+    if (new_size <= replay_static_buddy->block_size(ptr)) {
+        return ptr;
+    }
+    return replay_copy_resize(replay_static_buddy_alloc, replay_static_buddy_free, ptr, old_size, new_size);
+}
+
+// thread heap, power of two classes are aligned to their size within a segment
+static bool replay_thread_heap_init(size_t heap_size) { return thread_heap_local() != NULL; }
+static void* replay_thread_heap_alloc(size_t size, size_t align)
+{
+    if (align > DEFAULT_ALIGNMENT) {
+        size_t rounded = align;
+        while (rounded < size) {
+            rounded <<= 1;
+        }
+        size = rounded;
+    }
+    void* ptr = thread_heap_alloc(thread_heap_local(), size);
+    if (ptr != NULL && (uintptr_t)ptr % align != 0) {
+        thread_heap_free(thread_heap_local(), ptr);
+        return NULL;
+    }
+    return ptr;
+}
+static void replay_thread_heap_free(void* ptr) { thread_heap_free(thread_heap_local(), ptr); }
+static void* replay_thread_heap_resize(void* ptr, size_t old_size, size_t new_size)
+{
+    if (new_size <= thread_heap_block_size(ptr)) {
+        return ptr;
+    }
+    return replay_copy_resize(replay_thread_heap_alloc, replay_thread_heap_free, ptr, old_size, new_size);
+}
+
+static const ReplayAllocator replay_allocators[] = {
+    { "malloc", replay_malloc_init, replay_malloc_alloc, replay_malloc_resize, replay_malloc_free },
+    { "first_fit", replay_first_fit_init, replay_free_list_alloc, replay_free_list_resize, replay_free_list_free },
+    { "best_fit", replay_best_fit_init, replay_free_list_alloc, replay_free_list_resize, replay_free_list_free },
+    { "buddy", replay_buddy_init, replay_buddy_alloc, replay_buddy_resize, replay_buddy_free },
+    { "static_buddy", replay_static_buddy_init, replay_static_buddy_alloc, replay_static_buddy_resize, replay_static_buddy_free },
+    { "thread_heap", replay_thread_heap_init, replay_thread_heap_alloc, replay_thread_heap_resize, replay_thread_heap_free },
+};
+
+////////////////////////////////
+// replay
+
+struct ReplaySample
+{
+    // percent of the trace replayed
+    double progress;
+    size_t live_bytes;
+    size_t rss_bytes;
+};
+
+struct ReplayResult
+{
+    bool completed;
+    size_t ops;
+    double elapsed_ns;
+    size_t failures;
+    // frees and reallocs of blocks allocated before recording started
+    size_t unmatched;
+    size_t peak_rss;
+    size_t peak_live;
+    ReplaySample samples[REPLAY_SAMPLES];
+    size_t sample_count;
+};
+
+// anonymous resident bytes, the trace's file pages don't count
+static size_t replay_rss()
+{
+#if defined(__linux__)
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return 0;
+    }
+    unsigned long size = 0, resident = 0, shared = 0;
+    int fields = fscanf(statm, "%lu %lu %lu", &size, &resident, &shared);
+    fclose(statm);
+    if (fields != 3) {
+        return 0;
+    }
+    return (size_t)(resident - shared) * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+static void replay_touch(void* ptr, size_t size)
+{
+    volatile unsigned char* bytes = (volatile unsigned char*)ptr;
+    for (size_t offset = 0; offset < size; offset += REGION_SMALL_PAGE_SIZE) {
+        bytes[offset] = 1;
+    }
+}
+
+static void replay_run(const ReplayAllocator* allocator, TraceReader* reader, size_t max_live, size_t heap_size,
+    ReplayResult* result)
+{
+    memset(result, 0, sizeof(*result));
+
+    ReplayTable table;
+    if (!replay_table_init(&table, 2 * max_live)) {
+        fprintf(stderr, "[ERROR] %s: can't map the block table.\n", allocator->name);
+        return;
+    }
+    // fault the table in so it doesn't show up as heap growth
+    memset(table.blocks, 0, table.capacity * sizeof(ReplayBlock));
+    if (!allocator->init(heap_size)) {
+        fprintf(stderr, "[ERROR] %s: can't set up the heap.\n", allocator->name);
+        replay_table_destroy(&table);
+        return;
+    }
+    size_t baseline = replay_rss();
+
+    size_t live_bytes = 0;
+    size_t next_sample = 1;
+    size_t rss_interval = reader->count / 1000;
+    if (rss_interval > REPLAY_RSS_INTERVAL) {
+        rss_interval = REPLAY_RSS_INTERVAL;
+    }
+    if (rss_interval == 0) {
+        rss_interval = 1;
+    }
+    size_t next_rss_live = 0;
+    double elapsed = 0;
+    uint64_t start = trace_now_ns();
+    for (size_t i = 0; i < reader->count; i++) {
+        const TraceRecord* record = &reader->records[i];
+        size_t align = (size_t)1 << record->align_log2;
+
+        if (record->op == Trace_Op_Alloc || (record->op == Trace_Op_Realloc && replay_table_find(&table, record->prev_id) == NULL)) {
+            if (record->op == Trace_Op_Realloc) {
+                result->unmatched++;
+            }
+            void* ptr = allocator->alloc(record->size, align);
+            if (ptr == NULL) {
+                result->failures++;
+                continue;
+            }
+            replay_touch(ptr, record->size);
+            ReplayBlock* block = replay_table_insert(&table, record->id);
+            if (block == NULL) {
+                break;
+            }
+            if (block->ptr != NULL) {
+                // the recorder never reuses a live id, only a torn trace gets here
+                live_bytes -= block->size;
+                allocator->free(block->ptr);
+            }
+            block->ptr = ptr;
+            block->size = record->size;
+            live_bytes += record->size;
+        }
+        else if (record->op == Trace_Op_Free) {
+            ReplayBlock* block = replay_table_find(&table, record->id);
+            if (block == NULL) {
+                result->unmatched++;
+                continue;
+            }
+            allocator->free(block->ptr);
+            live_bytes -= block->size;
+            replay_table_remove(&table, block);
+        }
+        else if (record->op == Trace_Op_Realloc) {
+            ReplayBlock* block = replay_table_find(&table, record->prev_id);
+            void* ptr = allocator->resize(block->ptr, block->size, record->size);
+            if (ptr == NULL) {
+                // like realloc, the old block is still live
+                result->failures++;
+                continue;
+            }
+            if (record->size > block->size) {
+                replay_touch((unsigned char*)ptr + block->size, record->size - block->size);
+            }
+            live_bytes += record->size - block->size;
+            replay_table_remove(&table, block);
+            block = replay_table_insert(&table, record->id);
+            if (block == NULL) {
+                break;
+            }
+            block->ptr = ptr;
+            block->size = record->size;
+        }
+        result->ops++;
+        if (live_bytes > result->peak_live) {
+            result->peak_live = live_bytes;
+        }
+
+        bool sample = i + 1 >= next_sample * reader->count / REPLAY_SAMPLES;
+        if (sample || i % rss_interval == 0 || live_bytes > next_rss_live) {
+            // the bookkeeping isn't part of the allocator's time
+            elapsed += (double)(trace_now_ns() - start);
+            size_t rss = replay_rss();
+            rss = rss > baseline ? rss - baseline : 0;
+            if (rss > result->peak_rss) {
+                result->peak_rss = rss;
+            }
+            next_rss_live = live_bytes + live_bytes / 16;
+            if (sample && result->sample_count < REPLAY_SAMPLES) {
+                ReplaySample* point = &result->samples[result->sample_count++];
+                point->progress = 100.0 * (double)(i + 1) / (double)reader->count;
+                point->live_bytes = live_bytes;
+                point->rss_bytes = rss;
+                next_sample++;
+            }
+            trace_reader_release(reader, i);
+            start = trace_now_ns();
+        }
+    }
+    elapsed += (double)(trace_now_ns() - start);
+
+    result->elapsed_ns = elapsed;
+    result->completed = true;
+}
+
+////////////////////////////////
+// driver
+
+// max blocks live at once, sizes the table of every run
+static size_t replay_scan(TraceReader* reader, size_t* unmatched)
+{
+    ReplayTable table;
+    if (!replay_table_init(&table, 1024)) {
+        return 0;
+    }
+    size_t max_live = 0;
+    *unmatched = 0;
+    for (size_t i = 0; i < reader->count; i++) {
+        const TraceRecord* record = &reader->records[i];
+        if (record->op == Trace_Op_Free || record->op == Trace_Op_Realloc) {
+            uint64_t id = record->op == Trace_Op_Free ? record->id : record->prev_id;
+            ReplayBlock* block = replay_table_find(&table, id);
+            if (block != NULL) {
+                replay_table_remove(&table, block);
+            }
+            else {
+                (*unmatched)++;
+            }
+        }
+        if (record->op == Trace_Op_Alloc || record->op == Trace_Op_Realloc) {
+            if (replay_table_insert(&table, record->id) == NULL) {
+                break;
+            }
+        }
+        if (table.count > max_live) {
+            max_live = table.count;
+        }
+        trace_reader_release(reader, i);
+    }
+    replay_table_destroy(&table);
+    return max_live;
+}
+
+static void replay_print(const char* name, const ReplayResult* result)
+{
+    if (!result->completed) {
+        fprintf(stdout, "%-14s did not complete\n", name);
+        return;
+    }
+    double ns_per_op = result->ops != 0 ? result->elapsed_ns / (double)result->ops : 0;
+    fprintf(stdout, "%-14s %10zu ops %9.2f ns/op %10.0f ops/s  failures %zu  peak rss %zu KiB  peak live %zu KiB\n",
+        name, result->ops, ns_per_op, result->elapsed_ns > 0 ? 1e9 * (double)result->ops / result->elapsed_ns : 0,
+        result->failures, result->peak_rss / 1024, result->peak_live / 1024);
+    for (size_t i = 0; i < result->sample_count; i++) {
+        const ReplaySample* point = &result->samples[i];
+        double fragmentation = point->rss_bytes > point->live_bytes ? 100.0 * (1.0 - (double)point->live_bytes / (double)point->rss_bytes) : 0;
+        fprintf(stdout, "    %5.1f%%  live %10zu KiB  rss %10zu KiB  fragmentation %5.1f%%\n",
+            point->progress, point->live_bytes / 1024, point->rss_bytes / 1024, fragmentation);
+    }
+}
+
+static bool replay_selected(const char* name, int argc, char** argv, int first)
+{
+    bool any = false;
+    for (int i = first; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            i++;
+            continue;
+        }
+        any = true;
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return !any;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s TRACE [--heap MiB] [allocator...]\nallocators:", argv[0]);
+        for (const ReplayAllocator& allocator : replay_allocators) {
+            fprintf(stderr, " %s", allocator.name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    size_t heap_size = REPLAY_DEFAULT_HEAP;
+    for (int i = 2; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--heap") == 0) {
+            heap_size = (size_t)strtoull(argv[i + 1], NULL, 10) * 1024 * 1024;
+        }
+    }
+
+    TraceReader reader;
+    if (!trace_reader_open(&reader, argv[1])) {
+        return 1;
+    }
+    size_t unmatched = 0;
+    size_t max_live = replay_scan(&reader, &unmatched);
+    fprintf(stdout, "%s: %zu records, at most %zu live blocks, %zu frees of blocks from before recording\n",
+        argv[1], reader.count, max_live, unmatched);
+
+#if defined(__linux__)
+    for (const ReplayAllocator& allocator : replay_allocators) {
+        if (!replay_selected(allocator.name, argc, argv, 2)) {
+            continue;
+        }
+        fflush(stdout);
+
+        int pipe_fds[2];
+        if (pipe(pipe_fds) != 0) {
+            fprintf(stderr, "[ERROR] replay: pipe failed.\n");
+            return 1;
+        }
+        pid_t child = fork();
+        if (child == 0) {
+            close(pipe_fds[0]);
+            TraceReader child_reader = reader;
+            child_reader.released = 0;
+            ReplayResult result;
+            replay_run(&allocator, &child_reader, max_live, heap_size, &result);
+            ssize_t written = write(pipe_fds[1], &result, sizeof(result));
+            _exit(written == (ssize_t)sizeof(result) ? 0 : 1);
+        }
+        close(pipe_fds[1]);
+
+        ReplayResult result;
+        memset(&result, 0, sizeof(result));
+        size_t received = 0;
+        while (child > 0 && received < sizeof(result)) {
+            ssize_t n = read(pipe_fds[0], (unsigned char*)&result + received, sizeof(result) - received);
+            if (n <= 0) {
+                break;
+            }
+            received += (size_t)n;
+        }
+        close(pipe_fds[0]);
+        if (child > 0) {
+            waitpid(child, NULL, 0);
+        }
+        if (received != sizeof(result)) {
+            result.completed = false;
+        }
+        replay_print(allocator.name, &result);
+    }
+#else
+    fprintf(stderr, "[ERROR] replay needs fork, only supported on Linux.\n");
+#endif
+
+    trace_reader_close(&reader);
+    return 0;
+}
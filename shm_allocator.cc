@@ -0,0 +1,581 @@
+#include "shm_allocator.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+
+static bool shm_segment_create(ShmSegment* segment, const char* name, size_t size, ShmAllocatorKind kind)
+{
+    memset(segment, 0, sizeof(*segment));
+    size_t name_length = strlen(name);
+    if (name_length >= sizeof(segment->name)) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. Name is too long.\n", name);
+        return false;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. Can't create it (%s).\n", name, strerror(errno));
+        return false;
+    }
+    // a new segment reads as zeros, pages are only allocated when touched
+    if (ftruncate(fd, (off_t)size) != 0) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. Can't size it to %zu bytes.\n", name, size);
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. Can't map %zu bytes.\n", name, size);
+        shm_unlink(name);
+        return false;
+    }
+
+    segment->base = (unsigned char*)base;
+    segment->size = size;
+    segment->owner = true;
+    memcpy(segment->name, name, name_length + 1);
+
+    ShmSegmentHeader* header = (ShmSegmentHeader*)base;
+    memcpy(header->magic, SHM_SEGMENT_MAGIC, sizeof(header->magic));
+    header->version = SHM_SEGMENT_VERSION;
+    header->kind = kind;
+    header->size = size;
+    return true;
+}
+
+// the allocator state is set up, attachers may use it
+static void shm_segment_publish(ShmSegment* segment)
+{
+    __atomic_store_n(&((ShmSegmentHeader*)segment->base)->ready, 1, __ATOMIC_RELEASE);
+}
+
+static bool shm_segment_attach(ShmSegment* segment, const char* name, ShmAllocatorKind kind)
+{
+    memset(segment, 0, sizeof(*segment));
+    size_t name_length = strlen(name);
+    if (name_length >= sizeof(segment->name)) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. Name is too long.\n", name);
+        return false;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. Can't open it (%s).\n", name, strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < SHM_SEGMENT_HEADER_SIZE) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. It is too small to hold an allocator.\n", name);
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. Can't map %zu bytes.\n", name, size);
+        return false;
+    }
+
+    const ShmSegmentHeader* header = (const ShmSegmentHeader*)base;
+    const char* problem = NULL;
+    if (memcmp(header->magic, SHM_SEGMENT_MAGIC, sizeof(header->magic)) != 0 ||
+        __atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) == 0) {
+        problem = "is not a ready allocator segment";
+    } else if (header->version != SHM_SEGMENT_VERSION) {
+        problem = "has an unsupported version";
+    } else if (header->kind != (uint32_t)kind) {
+        problem = "holds another kind of allocator";
+    } else if (header->size != size) {
+        problem = "has the wrong size";
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "[ERROR] shm segment %s failed. It %s.\n", name, problem);
+        munmap(base, size);
+        return false;
+    }
+
+    segment->base = (unsigned char*)base;
+    segment->size = size;
+    segment->owner = false;
+    memcpy(segment->name, name, name_length + 1);
+    return true;
+}
+
+static void shm_segment_detach(ShmSegment* segment)
+{
+    if (segment->base != NULL) {
+        munmap(segment->base, segment->size);
+    }
+    if (segment->owner) {
+        shm_unlink(segment->name);
+    }
+    memset(segment, 0, sizeof(*segment));
+}
+
+// shared pool
+bool shm_pool_create(ShmPoolAllocator* pool, const char* name, size_t buffer_size, size_t chunk_size, size_t align)
+{
+    memset(pool, 0, sizeof(*pool));
+    assert(is_power_of_two(align));
+    // every free chunk holds an atomic uint32_t link
+    if (align < alignof(uint32_t)) {
+        align = alignof(uint32_t);
+    }
+    size_t chunk_size_align = align_forward(chunk_size, align);
+    if (chunk_size_align < sizeof(uint32_t)) {
+        fprintf(stderr, "[ERROR] shm_pool_create failed. Chunk size=%zu can't hold a free list link.\n", chunk_size);
+        return false;
+    }
+    size_t chunks = align_forward(SHM_SEGMENT_HEADER_SIZE, align);
+    size_t chunk_count = buffer_size / chunk_size_align;
+    // indexes are stored + 1 in 32 bits
+    if (chunk_count == 0 || chunk_count >= UINT32_MAX) {
+        fprintf(stderr, "[ERROR] shm_pool_create failed. Buffer size=%zu holds %zu chunks of %zu bytes.\n",
+            buffer_size, chunk_count, chunk_size_align);
+        return false;
+    }
+
+    if (!shm_segment_create(&pool->segment, name, chunks + chunk_count * chunk_size_align, Shm_Allocator_Pool)) {
+        return false;
+    }
+    ShmPoolHeader* header = (ShmPoolHeader*)pool->segment.base;
+    header->chunk_size = chunk_size_align;
+    header->chunk_count = chunk_count;
+    header->chunks = chunks;
+    header->head = 0;
+    header->fresh = 0;
+    shm_segment_publish(&pool->segment);
+
+    pool->header = header;
+    pool->chunks = pool->segment.base + chunks;
+    pool->chunk_size = chunk_size_align;
+    pool->chunk_count = (uint32_t)chunk_count;
+    return true;
+}
+
+bool shm_pool_attach(ShmPoolAllocator* pool, const char* name)
+{
+    memset(pool, 0, sizeof(*pool));
+    if (!shm_segment_attach(&pool->segment, name, Shm_Allocator_Pool)) {
+        return false;
+    }
+    ShmPoolHeader* header = (ShmPoolHeader*)pool->segment.base;
+    if (header->chunks + header->chunk_count * header->chunk_size > pool->segment.size) {
+        fprintf(stderr, "[ERROR] shm_pool_attach failed. Chunks of %s run past the segment.\n", name);
+        shm_segment_detach(&pool->segment);
+        return false;
+    }
+    pool->header = header;
+    pool->chunks = pool->segment.base + header->chunks;
+    pool->chunk_size = header->chunk_size;
+    pool->chunk_count = (uint32_t)header->chunk_count;
+    return true;
+}
+
+void shm_pool_detach(ShmPoolAllocator* pool)
+{
+    shm_segment_detach(&pool->segment);
+    memset(pool, 0, sizeof(*pool));
+}
+
+void* try_shm_pool_alloc(ShmPoolAllocator* pool)
+{
+    ShmPoolHeader* header = pool->header;
+    unsigned char* chunk = NULL;
+
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    while ((uint32_t)head != 0) {
+        unsigned char* top = pool->chunks + (size_t)((uint32_t)head - 1) * pool->chunk_size;
+        // may already be handed out and overwritten by another process, the
+        // tag makes the exchange fail in that case
+        uint32_t next = __atomic_load_n((uint32_t*)top, __ATOMIC_RELAXED);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&header->head, &head, new_head, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            chunk = top;
+            break;
+        }
+    }
+
+    if (chunk == NULL) {
+        uint64_t fresh = __atomic_load_n(&header->fresh, __ATOMIC_RELAXED);
+        while (fresh < pool->chunk_count) {
+            if (__atomic_compare_exchange_n(&header->fresh, &fresh, fresh + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                chunk = pool->chunks + (size_t)fresh * pool->chunk_size;
+                break;
+            }
+        }
+    }
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return memset(chunk, 0, pool->chunk_size);
+}
+
+void* shm_pool_alloc(ShmPoolAllocator* pool)
+{
+    void* ptr = try_shm_pool_alloc(pool);
+    if (ptr == NULL) {
+        fprintf(stderr, "[ERROR] shm pool %s doesn't have enough space for new allocation.\n", pool->segment.name);
+    }
+    return ptr;
+}
+
+void shm_pool_free(ShmPoolAllocator* pool, void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    unsigned char* chunk = (unsigned char*)ptr;
+    if (chunk < pool->chunks || chunk >= pool->chunks + (size_t)pool->chunk_count * pool->chunk_size ||
+        (size_t)(chunk - pool->chunks) % pool->chunk_size != 0) {
+        fprintf(stderr, "[ERROR] shm_pool_free failed. %p is not a chunk of %s.\n", ptr, pool->segment.name);
+        return;
+    }
+
+    ShmPoolHeader* header = pool->header;
+    uint64_t index = (uint64_t)(chunk - pool->chunks) / pool->chunk_size + 1;
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+    do {
+        __atomic_store_n((uint32_t*)chunk, (uint32_t)head, __ATOMIC_RELAXED);
+        new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!__atomic_compare_exchange_n(&header->head, &head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// shared free list
+static inline ShmFreeListNode* shm_free_list_node(ShmFreeListAllocator* free_list, uint64_t offset)
+{
+    return (ShmFreeListNode*)(free_list->segment.base + offset);
+}
+
+// false if the mutex can't be taken, e.g. ENOTRECOVERABLE after a dead owner's
+// takeover failed
+static bool shm_free_list_lock(ShmFreeListAllocator* free_list)
+{
+    int result = pthread_mutex_lock(&free_list->header->lock);
+    if (result == EOWNERDEAD) {
+        fprintf(stderr, "[ERROR] shm free list %s was left locked by a dead process, taking it over.\n",
+            free_list->segment.name);
+        result = pthread_mutex_consistent(&free_list->header->lock);
+        if (result != 0) {
+            pthread_mutex_unlock(&free_list->header->lock);
+        }
+    }
+    if (result != 0) {
+        fprintf(stderr, "[ERROR] shm free list %s failed. Can't lock it (%s).\n", free_list->segment.name,
+            strerror(result));
+        return false;
+    }
+    return true;
+}
+
+static void shm_free_list_unlock(ShmFreeListAllocator* free_list)
+{
+    pthread_mutex_unlock(&free_list->header->lock);
+}
+
+static void shm_free_list_insert_node(ShmFreeListAllocator* free_list, uint64_t prev_node, uint64_t node)
+{
+    if (prev_node == 0) {
+        shm_free_list_node(free_list, node)->next = free_list->header->head;
+        free_list->header->head = node;
+    } else {
+        shm_free_list_node(free_list, node)->next = shm_free_list_node(free_list, prev_node)->next;
+        shm_free_list_node(free_list, prev_node)->next = node;
+    }
+}
+
+static void shm_free_list_remove_node(ShmFreeListAllocator* free_list, uint64_t prev_node, uint64_t node)
+{
+    if (prev_node == 0) {
+        free_list->header->head = shm_free_list_node(free_list, node)->next;
+    } else {
+        shm_free_list_node(free_list, prev_node)->next = shm_free_list_node(free_list, node)->next;
+    }
+}
+
+static void shm_free_list_coalescence_node(ShmFreeListAllocator* free_list, uint64_t prev_node, uint64_t node)
+{
+    ShmFreeListNode* current = shm_free_list_node(free_list, node);
+    if (current->next != 0 && node + current->block_size == current->next) {
+        ShmFreeListNode* next = shm_free_list_node(free_list, current->next);
+        current->block_size += next->block_size;
+        current->next = next->next;
+    }
+
+    if (prev_node != 0) {
+        ShmFreeListNode* prev = shm_free_list_node(free_list, prev_node);
+        if (prev_node + prev->block_size == node) {
+            prev->block_size += current->block_size;
+            prev->next = current->next;
+        }
+    }
+}
+
+bool shm_free_list_create(ShmFreeListAllocator* free_list, const char* name, size_t buffer_size,
+    FreeListAllocationPolicy allocation_policy)
+{
+    memset(free_list, 0, sizeof(*free_list));
+    if (buffer_size < sizeof(ShmFreeListNode)) {
+        fprintf(stderr, "[ERROR] shm_free_list_create failed. Buffer size=%zu is smaller then sizeof(ShmFreeListNode)=%zu.\n",
+            buffer_size, sizeof(ShmFreeListNode));
+        return false;
+    }
+    if (!shm_segment_create(&free_list->segment, name, SHM_SEGMENT_HEADER_SIZE + buffer_size, Shm_Allocator_Free_List)) {
+        return false;
+    }
+
+    ShmFreeListHeader* header = (ShmFreeListHeader*)free_list->segment.base;
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    int result = pthread_mutex_init(&header->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    if (result != 0) {
+        fprintf(stderr, "[ERROR] shm_free_list_create failed. Can't set up a process-shared mutex.\n");
+        shm_segment_detach(&free_list->segment);
+        return false;
+    }
+
+    // like free_list_init, every block starts FREE_LIST_BLOCK_ALIGNMENT aligned
+    header->buffer = SHM_SEGMENT_HEADER_SIZE;
+    header->buffer_size = buffer_size & ~(FREE_LIST_BLOCK_ALIGNMENT - 1);
+    header->buffer_used = 0;
+    header->head = header->buffer;
+    header->allocation_policy = allocation_policy;
+    ShmFreeListNode* node = (ShmFreeListNode*)(free_list->segment.base + header->buffer);
+    node->block_size = header->buffer_size;
+    node->next = 0;
+    shm_segment_publish(&free_list->segment);
+
+    free_list->header = header;
+    return true;
+}
+
+bool shm_free_list_attach(ShmFreeListAllocator* free_list, const char* name)
+{
+    memset(free_list, 0, sizeof(*free_list));
+    if (!shm_segment_attach(&free_list->segment, name, Shm_Allocator_Free_List)) {
+        return false;
+    }
+    ShmFreeListHeader* header = (ShmFreeListHeader*)free_list->segment.base;
+    if (header->buffer + header->buffer_size > free_list->segment.size) {
+        fprintf(stderr, "[ERROR] shm_free_list_attach failed. Buffer of %s runs past the segment.\n", name);
+        shm_segment_detach(&free_list->segment);
+        return false;
+    }
+    free_list->header = header;
+    return true;
+}
+
+void shm_free_list_detach(ShmFreeListAllocator* free_list)
+{
+    shm_segment_detach(&free_list->segment);
+    memset(free_list, 0, sizeof(*free_list));
+}
+
+void* try_shm_free_list_alloc(ShmFreeListAllocator* free_list, size_t size, size_t align)
+{
+    if (size < sizeof(ShmFreeListNode)) {
+        size = sizeof(ShmFreeListNode);
+    }
+    // keeps the node split off behind the block aligned
+    size = align_forward(size, FREE_LIST_BLOCK_ALIGNMENT);
+
+    if (!shm_free_list_lock(free_list)) {
+        return NULL;
+    }
+    ShmFreeListHeader* header = free_list->header;
+    if (header->buffer_size - header->buffer_used < size || header->head == 0) {
+        shm_free_list_unlock(free_list);
+        return NULL;
+    }
+
+    uint64_t prev_node = 0;
+    uint64_t found_node = 0;
+    size_t require_size = 0;
+    size_t padding = 0;
+
+    // same search as free_list_alloc, on offsets
+    if (header->allocation_policy == Allocation_Policy_First_Fit) {
+        uint64_t node_prev = 0;
+        for (uint64_t node = header->head; node != 0; node = shm_free_list_node(free_list, node)->next) {
+            size_t padd = get_padding_with_header((uintptr_t)free_list->segment.base + node,
+                sizeof(FreeListAllocationHeader), align);
+            if (shm_free_list_node(free_list, node)->block_size >= padd + size) {
+                require_size = padd + size;
+                padding = padd;
+                found_node = node;
+                prev_node = node_prev;
+                break;
+            }
+            node_prev = node;
+        }
+    } else {
+        uint64_t node_prev = 0;
+        size_t minimum_diff_size = ~(size_t)0;
+        for (uint64_t node = header->head; node != 0; node = shm_free_list_node(free_list, node)->next) {
+            size_t padd = get_padding_with_header((uintptr_t)free_list->segment.base + node,
+                sizeof(FreeListAllocationHeader), align);
+            size_t block_size = shm_free_list_node(free_list, node)->block_size;
+            if (block_size >= padd + size && block_size - (padd + size) < minimum_diff_size) {
+                require_size = padd + size;
+                padding = padd;
+                minimum_diff_size = block_size - require_size;
+                found_node = node;
+                prev_node = node_prev;
+            }
+            node_prev = node;
+        }
+    }
+
+    if (found_node == 0) {
+        shm_free_list_unlock(free_list);
+        return NULL;
+    }
+
+    ShmFreeListNode* found = shm_free_list_node(free_list, found_node);
+    if (found->block_size - require_size > sizeof(ShmFreeListNode)) {
+        uint64_t new_node = found_node + require_size;
+        shm_free_list_node(free_list, new_node)->block_size = found->block_size - require_size;
+        found->block_size = require_size;
+        shm_free_list_insert_node(free_list, found_node, new_node);
+    }
+    shm_free_list_remove_node(free_list, prev_node, found_node);
+    header->buffer_used += found->block_size;
+
+    unsigned char* ptr = free_list->segment.base + found_node + padding;
+    FreeListAllocationHeader* allocation = (FreeListAllocationHeader*)(ptr - sizeof(FreeListAllocationHeader));
+    allocation->block_size = found->block_size;
+    allocation->padding = padding;
+    shm_free_list_unlock(free_list);
+
+    // the block is ours, large messages are cleared outside the lock
+    return memset(ptr, 0, size);
+}
+
+void* shm_free_list_alloc(ShmFreeListAllocator* free_list, size_t size, size_t align)
+{
+    void* ptr = try_shm_free_list_alloc(free_list, size, align);
+    if (ptr == NULL) {
+        fprintf(stderr, "[ERROR] shm_free_list_alloc failed. %s doesn't have suitable block for size=%zu.\n",
+            free_list->segment.name, size);
+    }
+    return ptr;
+}
+
+void shm_free_list_free(ShmFreeListAllocator* free_list, void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    ShmFreeListHeader* header = free_list->header;
+    uint64_t offset = shm_offset(&free_list->segment, ptr);
+    if (offset < header->buffer + sizeof(FreeListAllocationHeader) || offset >= header->buffer + header->buffer_size) {
+        fprintf(stderr, "[ERROR] shm_free_list_free failed. %p is not in %s.\n", ptr, free_list->segment.name);
+        return;
+    }
+
+    FreeListAllocationHeader* allocation = (FreeListAllocationHeader*)((unsigned char*)ptr - sizeof(FreeListAllocationHeader));
+    uint64_t new_node = offset - allocation->padding;
+    size_t block_size = allocation->block_size;
+
+    if (!shm_free_list_lock(free_list)) {
+        fprintf(stderr, "[ERROR] shm_free_list_free failed. %p is not returned to %s.\n", ptr, free_list->segment.name);
+        return;
+    }
+    shm_free_list_node(free_list, new_node)->block_size = block_size;
+    uint64_t prev_node = 0;
+    for (uint64_t node = header->head; node != 0 && node < new_node; node = shm_free_list_node(free_list, node)->next) {
+        prev_node = node;
+    }
+    shm_free_list_insert_node(free_list, prev_node, new_node);
+    header->buffer_used -= block_size;
+    shm_free_list_coalescence_node(free_list, prev_node, new_node);
+    shm_free_list_unlock(free_list);
+}
+
+#else
+
+bool shm_pool_create(ShmPoolAllocator* pool, const char* name, size_t buffer_size, size_t chunk_size, size_t align)
+{
+    memset(pool, 0, sizeof(*pool));
+    fprintf(stderr, "[ERROR] shm_pool_create failed. Shared memory allocators are only supported on Linux.\n");
+    return false;
+}
+
+bool shm_pool_attach(ShmPoolAllocator* pool, const char* name)
+{
+    memset(pool, 0, sizeof(*pool));
+    fprintf(stderr, "[ERROR] shm_pool_attach failed. Shared memory allocators are only supported on Linux.\n");
+    return false;
+}
+
+void shm_pool_detach(ShmPoolAllocator* pool)
+{
+}
+
+void* shm_pool_alloc(ShmPoolAllocator* pool)
+{
+    return NULL;
+}
+
+void* try_shm_pool_alloc(ShmPoolAllocator* pool)
+{
+    return NULL;
+}
+
+void shm_pool_free(ShmPoolAllocator* pool, void* ptr)
+{
+}
+
+bool shm_free_list_create(ShmFreeListAllocator* free_list, const char* name, size_t buffer_size,
+    FreeListAllocationPolicy allocation_policy)
+{
+    memset(free_list, 0, sizeof(*free_list));
+    fprintf(stderr, "[ERROR] shm_free_list_create failed. Shared memory allocators are only supported on Linux.\n");
+    return false;
+}
+
+bool shm_free_list_attach(ShmFreeListAllocator* free_list, const char* name)
+{
+    memset(free_list, 0, sizeof(*free_list));
+    fprintf(stderr, "[ERROR] shm_free_list_attach failed. Shared memory allocators are only supported on Linux.\n");
+    return false;
+}
+
+void shm_free_list_detach(ShmFreeListAllocator* free_list)
+{
+}
+
+void* shm_free_list_alloc(ShmFreeListAllocator* free_list, size_t size, size_t align)
+{
+    return NULL;
+}
+
+void* try_shm_free_list_alloc(ShmFreeListAllocator* free_list, size_t size, size_t align)
+{
+    return NULL;
+}
+
+void shm_free_list_free(ShmFreeListAllocator* free_list, void* ptr)
+{
+}
+
+#endif
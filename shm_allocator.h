@@ -0,0 +1,148 @@
+#ifndef SHM_ALLOCATOR_H
+#define SHM_ALLOCATOR_H
+
+#include "allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
+////////////////////////////////
+// shared memory allocators
+//
+// PoolAllocator and FreeListAllocator laid out in a POSIX shared memory
+// segment, for handing messages between processes without copying them. One
+// process creates the segment under a name, others attach to it. Every link
+// inside the segment is an offset from its start, so each process can map it
+// at a different address. A producer allocates a message in place and sends
+// shm_offset() of it; the consumer turns it back with shm_pointer() and frees
+// it. Any attached process can free any block.
+//
+// The pool is lock free: a stack of chunk indexes whose head carries an ABA
+// tag in the same 64-bit word. Chunks that were never handed out are taken
+// from a watermark, so creating a large pool touches no chunk pages.
+//
+// The free list takes a robust process-shared mutex. If a process dies holding
+// it the next one to lock takes over, but a list the dead process was in the
+// middle of changing may have lost blocks. If the mutex can't be locked at all,
+// alloc returns NULL and free leaves the block out of the list.
+//
+// The creator's detach removes the name, processes that are still attached
+// keep their mapping. Linux only.
+
+#define SHM_SEGMENT_MAGIC "MASHMSEG"
+#define SHM_SEGMENT_VERSION 1
+// allocator state sits in the first page, blocks start after it
+#define SHM_SEGMENT_HEADER_SIZE 4096
+#define SHM_SEGMENT_MAX_NAME 256
+
+enum ShmAllocatorKind
+{
+    Shm_Allocator_Pool = 1,
+    Shm_Allocator_Free_List = 2,
+};
+
+struct ShmSegmentHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    uint64_t size;
+    // set last by the creator, attach refuses a segment that isn't ready
+    uint32_t ready;
+};
+
+struct ShmSegment
+{
+    unsigned char* base;
+    size_t size;
+    bool owner;
+    char name[SHM_SEGMENT_MAX_NAME];
+};
+
+// 0 for NULL, the segment header is never a block
+inline uint64_t shm_offset(const ShmSegment* segment, const void* ptr)
+{
+    return ptr == NULL ? 0 : (uint64_t)((const unsigned char*)ptr - segment->base);
+}
+
+inline void* shm_pointer(const ShmSegment* segment, uint64_t offset)
+{
+    return offset == 0 ? NULL : segment->base + offset;
+}
+
+////////////////////////////////
+// shared pool
+struct ShmPoolHeader
+{
+    ShmSegmentHeader segment;
+    uint64_t chunk_size;
+    uint64_t chunk_count;
+    // offset of chunk 0
+    uint64_t chunks;
+    // low half: index + 1 of the first free chunk, 0 when empty. high half: ABA tag
+    alignas(64) uint64_t head;
+    // chunks below it have been handed out at least once
+    alignas(64) uint64_t fresh;
+};
+
+struct ShmPoolAllocator
+{
+    ShmSegment segment;
+    ShmPoolHeader* header;
+    unsigned char* chunks;
+    size_t chunk_size;
+    uint32_t chunk_count;
+};
+
+// `name` follows shm_open, e.g. "/my_pool". buffer_size is the room for
+// chunks, the segment is one header page larger.
+bool shm_pool_create(ShmPoolAllocator* pool, const char* name, size_t buffer_size,
+    size_t chunk_size, size_t align = DEFAULT_ALIGNMENT);
+bool shm_pool_attach(ShmPoolAllocator* pool, const char* name);
+void shm_pool_detach(ShmPoolAllocator* pool);
+void* shm_pool_alloc(ShmPoolAllocator* pool);
+void* try_shm_pool_alloc(ShmPoolAllocator* pool);
+void shm_pool_free(ShmPoolAllocator* pool, void* ptr);
+
+////////////////////////////////
+// shared free list
+struct ShmFreeListNode
+{
+    // offset of the next free node, 0 for none
+    uint64_t next;
+    uint64_t block_size;
+};
+
+struct ShmFreeListHeader
+{
+    ShmSegmentHeader segment;
+#if defined(__linux__)
+    pthread_mutex_t lock;
+#endif
+    // offset and size of the managed bytes
+    uint64_t buffer;
+    uint64_t buffer_size;
+    uint64_t buffer_used;
+    uint64_t head;
+    uint32_t allocation_policy;
+};
+
+struct ShmFreeListAllocator
+{
+    ShmSegment segment;
+    ShmFreeListHeader* header;
+};
+
+bool shm_free_list_create(ShmFreeListAllocator* free_list, const char* name, size_t buffer_size,
+    FreeListAllocationPolicy allocation_policy);
+bool shm_free_list_attach(ShmFreeListAllocator* free_list, const char* name);
+void shm_free_list_detach(ShmFreeListAllocator* free_list);
+void* shm_free_list_alloc(ShmFreeListAllocator* free_list, size_t size, size_t align = DEFAULT_ALIGNMENT);
+void* try_shm_free_list_alloc(ShmFreeListAllocator* free_list, size_t size, size_t align = DEFAULT_ALIGNMENT);
+void shm_free_list_free(ShmFreeListAllocator* free_list, void* ptr);
+
+#endif
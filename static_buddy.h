@@ -0,0 +1,223 @@
+#ifndef STATIC_BUDDY_H
+#define STATIC_BUDDY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+
+#include "allocator_stats.h"
+#include "heap_profile.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+////////////////////////////////
+// compile-time specialized buddy allocator
+//
+// Same idea as BuddyAllocator but the heap size and the minimum block are
+// template parameters, so the tree geometry is constexpr and every index and
+// offset computation is a shift or a mask. Each node stores the order of the
+// largest free block in its subtree (plus one, 0 means nothing free), which
+// makes alloc and free walk a single root-to-leaf path.
+
+constexpr size_t static_buddy_log2(size_t x)
+{
+    size_t n = 0;
+    while (x > 1) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
+
+// number of bits needed to represent x, 0 for x == 0
+inline size_t static_buddy_bit_width(size_t x)
+{
+    if (x == 0) {
+        return 0;
+    }
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, (unsigned long long)x);
+    return (size_t)index + 1;
+#else
+    return (size_t)(64 - __builtin_clzll((unsigned long long)x));
+#endif
+}
+
+template <size_t HeapSize, size_t MinBlock>
+struct Buddy
+{
+    static_assert(MinBlock > 0 && (MinBlock & (MinBlock - 1)) == 0, "MinBlock must be a power of two");
+    static_assert(HeapSize > MinBlock && (HeapSize & (HeapSize - 1)) == 0, "HeapSize must be a power of two larger than MinBlock");
+
+    static constexpr size_t Leaves = HeapSize / MinBlock;
+    static constexpr size_t Height = static_buddy_log2(Leaves);
+    static constexpr size_t MinShift = static_buddy_log2(MinBlock);
+    static constexpr size_t NodeCount = 2 * Leaves - 1;
+
+    static_assert(Height + 1 < 256, "tree is too tall for 8-bit orders");
+
+    // per level lookup tables, level 0 is the root
+    struct LevelTable
+    {
+        size_t first_index[Height + 1];
+        size_t shift[Height + 1];
+        uint8_t full[Height + 1];
+    };
+
+    static constexpr LevelTable make_levels()
+    {
+        LevelTable table = {};
+        for (size_t level = 0; level <= Height; level++) {
+            table.first_index[level] = ((size_t)1 << level) - 1;
+            table.shift[level] = MinShift + Height - level;
+            table.full[level] = (uint8_t)(Height - level + 1);
+        }
+        return table;
+    }
+
+    static constexpr LevelTable levels = make_levels();
+
+    unsigned char* buffer;
+    uint8_t longest[NodeCount];
+    ALLOCATOR_STATS_FIELD
+
+    // order of the smallest block that fits size, 0 is a MinBlock block
+    static size_t order_for(size_t size)
+    {
+        size_t leaves = (size + MinBlock - 1) >> MinShift;
+        return leaves <= 1 ? 0 : static_buddy_bit_width(leaves - 1);
+    }
+
+    static constexpr size_t block_offset(size_t index, size_t level)
+    {
+        return (index - levels.first_index[level]) << levels.shift[level];
+    }
+
+    void init(void* buf)
+    {
+        assert(buf != NULL);
+        assert(((uintptr_t)buf & (MinBlock - 1)) == 0);
+        buffer = (unsigned char*)buf;
+        ALLOCATOR_STATS_INIT(&stats);
+        free_all();
+    }
+
+    // not zeroed, alloc_zeroed clears the requested bytes
+    void* alloc(size_t size)
+    {
+        ALLOCATOR_STATS_START(stats_start);
+        if (size > HeapSize) {
+            ALLOCATOR_STATS_FAIL(&stats, stats_start);
+            return NULL;
+        }
+        const size_t order = order_for(size);
+        const uint8_t need = (uint8_t)(order + 1);
+        if (longest[0] < need) {
+            ALLOCATOR_STATS_FAIL(&stats, stats_start);
+            return NULL;
+        }
+
+        // descend to the target level, picking the tighter child that still fits
+        size_t index = 0;
+        const size_t level = Height - order;
+        for (size_t l = 0; l < level; l++) {
+            size_t left = index * 2 + 1;
+            uint8_t l_free = longest[left];
+            uint8_t r_free = longest[left + 1];
+            if (l_free >= need && (r_free < need || l_free <= r_free)) {
+                index = left;
+            }
+            else {
+                index = left + 1;
+            }
+        }
+
+        longest[index] = 0;
+        const size_t offset = block_offset(index, level);
+        update_parents(index, level);
+        ALLOCATOR_STATS_ALLOC(&stats, stats_start, size, (size_t)MinBlock << order);
+        HEAP_PROFILE_ALLOC(&buffer[offset], size);
+
+        return &buffer[offset];
+    }
+
+    void* alloc_zeroed(size_t size)
+    {
+        void* ptr = alloc(size);
+        return ptr != NULL ? memset(ptr, 0, size) : NULL;
+    }
+
+    void free(void* ptr)
+    {
+        if (ptr == NULL) {
+            return;
+        }
+        ALLOCATOR_STATS_START(stats_start);
+        HEAP_PROFILE_FREE(ptr);
+        size_t offset = (uintptr_t)ptr - (uintptr_t)buffer;
+        assert(offset < HeapSize);
+
+        // the allocated block is the first node with no free space on the leaf's path
+        size_t index = levels.first_index[Height] + (offset >> MinShift);
+        size_t level = Height;
+        while (longest[index] != 0) {
+            assert(index != 0 && "double free or pointer not from this buddy");
+            index = (index - 1) >> 1;
+            level--;
+        }
+        longest[index] = levels.full[level];
+        update_parents(index, level);
+        ALLOCATOR_STATS_FREE(&stats, stats_start, (size_t)1 << levels.shift[level]);
+    }
+
+    // size of the block backing ptr
+    size_t block_size(void* ptr) const
+    {
+        size_t offset = (uintptr_t)ptr - (uintptr_t)buffer;
+        size_t index = levels.first_index[Height] + (offset >> MinShift);
+        size_t level = Height;
+        while (longest[index] != 0 && index != 0) {
+            index = (index - 1) >> 1;
+            level--;
+        }
+        return (size_t)1 << levels.shift[level];
+    }
+
+    bool owns(void* ptr) const
+    {
+        return (unsigned char*)ptr >= buffer && (unsigned char*)ptr < buffer + HeapSize;
+    }
+
+    void free_all()
+    {
+        ALLOCATOR_STATS_RELEASE_ALL(&stats);
+        for (size_t level = 0; level <= Height; level++) {
+            size_t first = levels.first_index[level];
+            memset(&longest[first], levels.full[level], first + 1);
+        }
+    }
+
+private:
+    void update_parents(size_t index, size_t level)
+    {
+        while (index != 0) {
+            index = (index - 1) >> 1;
+            level--;
+            uint8_t left = longest[index * 2 + 1];
+            uint8_t right = longest[index * 2 + 2];
+            uint8_t child_full = levels.full[level + 1];
+            if (left == child_full && right == child_full) {
+                longest[index] = levels.full[level];
+            }
+            else {
+                longest[index] = left > right ? left : right;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "thread_heap.h"
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+
+#define THREAD_HEAP_HEADER_SIZE align_forward(sizeof(ThreadHeapSegment), 64)
+// chunks carved from a segment at a time, so untouched pages stay untouched
+#define THREAD_HEAP_SLAB_SIZE (64 * 1024)
+
+static const size_t thread_heap_class_sizes[THREAD_HEAP_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+};
+
+struct ThreadHeapClassTable
+{
+    // class index for (size + 15) / 16
+    uint8_t class_of[THREAD_HEAP_SMALL_MAX / 16 + 1];
+};
+
+static constexpr ThreadHeapClassTable thread_heap_make_class_table()
+{
+    ThreadHeapClassTable table = {};
+    size_t class_index = 0;
+    for (size_t i = 0; i <= THREAD_HEAP_SMALL_MAX / 16; i++) {
+        while (thread_heap_class_sizes[class_index] < i * 16) {
+            class_index++;
+        }
+        table.class_of[i] = (uint8_t)class_index;
+    }
+    return table;
+}
+
+static constexpr ThreadHeapClassTable thread_heap_classes = thread_heap_make_class_table();
+
+// segments whose heap was destroyed while they still held live blocks
+static std::mutex thread_heap_abandoned_lock;
+static ThreadHeapSegment* thread_heap_abandoned;
+
+static ThreadHeapSegment* thread_heap_segment_create(ThreadHeap* heap, size_t class_index, size_t size)
+{
+    Region region;
+    if (!region_map_aligned(&region, size, THREAD_HEAP_SEGMENT_SIZE)) {
+        return NULL;
+    }
+
+    // fresh pages are zero, the atomics start out NULL
+    ThreadHeapSegment* segment = (ThreadHeapSegment*)region.base;
+    segment->owner.store(heap, std::memory_order_relaxed);
+    segment->next = NULL;
+    segment->region = region;
+    segment->class_index = class_index;
+    segment->used = 0;
+    segment->grown = 0;
+    segment->pool.buffer = region.base + THREAD_HEAP_HEADER_SIZE;
+    segment->pool.buffer_size = region.size - THREAD_HEAP_HEADER_SIZE;
+    segment->pool.chunk_size = class_index == THREAD_HEAP_HUGE_CLASS ? segment->pool.buffer_size : thread_heap_class_sizes[class_index];
+    segment->pool.head = NULL;
+    segment->remote_free.store(NULL, std::memory_order_relaxed);
+    return segment;
+}
+
+static void thread_heap_segment_destroy(ThreadHeapSegment* segment)
+{
+    // the region lives inside the mapping it describes
+    Region region = segment->region;
+    region_unmap(&region);
+}
+
+// move the remote frees into the pool, owner only
+static void thread_heap_segment_collect(ThreadHeapSegment* segment)
+{
+    if (segment->remote_free.load(std::memory_order_relaxed) == NULL) {
+        return;
+    }
+    PoolListNode* node = segment->remote_free.exchange(NULL, std::memory_order_acquire);
+    while (node != NULL) {
+        PoolListNode* next = node->next;
+        pool_free(&segment->pool, node);
+        segment->used--;
+        node = next;
+    }
+}
+
+static bool thread_heap_segment_carve(ThreadHeapSegment* segment)
+{
+    PoolAllocator* pool = &segment->pool;
+    size_t slab = THREAD_HEAP_SLAB_SIZE - THREAD_HEAP_SLAB_SIZE % pool->chunk_size;
+    if (slab == 0) {
+        slab = pool->chunk_size;
+    }
+    if (segment->grown + slab > pool->buffer_size) {
+        slab = (pool->buffer_size - segment->grown) / pool->chunk_size * pool->chunk_size;
+        if (slab == 0) {
+            return false;
+        }
+    }
+    // push back to front so the slab is handed out in address order
+    unsigned char* begin = pool->buffer + segment->grown;
+    for (size_t offset = slab; offset > 0; offset -= pool->chunk_size) {
+        pool_free(pool, begin + offset - pool->chunk_size);
+    }
+    segment->grown += slab;
+    return true;
+}
+
+static void thread_heap_adopt(ThreadHeap* heap, ThreadHeapSegment* segment)
+{
+    segment->owner.store(heap, std::memory_order_release);
+    thread_heap_segment_collect(segment);
+    if (segment->used == 0) {
+        thread_heap_segment_destroy(segment);
+        return;
+    }
+    segment->next = heap->segments[segment->class_index];
+    heap->segments[segment->class_index] = segment;
+}
+
+ThreadHeap* thread_heap_create()
+{
+    ThreadHeap* heap = (ThreadHeap*)malloc(sizeof(ThreadHeap));
+    if (heap == NULL) {
+        fprintf(stderr, "[ERROR] thread_heap_create failed. Out of memory.\n");
+        return NULL;
+    }
+    memset(heap, 0, sizeof(*heap));
+
+    ThreadHeapSegment* abandoned = NULL;
+    {
+        std::lock_guard<std::mutex> guard(thread_heap_abandoned_lock);
+        abandoned = thread_heap_abandoned;
+        thread_heap_abandoned = NULL;
+    }
+    while (abandoned != NULL) {
+        ThreadHeapSegment* next = abandoned->next;
+        thread_heap_adopt(heap, abandoned);
+        abandoned = next;
+    }
+    return heap;
+}
+
+void thread_heap_destroy(ThreadHeap* heap)
+{
+    if (heap == NULL) {
+        return;
+    }
+
+    ThreadHeapSegment* abandoned = NULL;
+    ThreadHeapSegment* abandoned_tail = NULL;
+    for (size_t c = 0; c < THREAD_HEAP_CLASS_COUNT; c++) {
+        ThreadHeapSegment* segment = heap->segments[c];
+        while (segment != NULL) {
+            ThreadHeapSegment* next = segment->next;
+            // frees that race with this land on the remote list and are counted in used
+            segment->owner.store(NULL, std::memory_order_release);
+            thread_heap_segment_collect(segment);
+            if (segment->used == 0) {
+                thread_heap_segment_destroy(segment);
+            }
+            else {
+                segment->next = abandoned;
+                abandoned = segment;
+                if (abandoned_tail == NULL) {
+                    abandoned_tail = segment;
+                }
+            }
+            segment = next;
+        }
+    }
+
+    if (abandoned != NULL) {
+        std::lock_guard<std::mutex> guard(thread_heap_abandoned_lock);
+        abandoned_tail->next = thread_heap_abandoned;
+        thread_heap_abandoned = abandoned;
+    }
+    free(heap);
+}
+
+struct ThreadHeapLocal
+{
+    ThreadHeap* heap;
+
+    ~ThreadHeapLocal()
+    {
+        thread_heap_destroy(heap);
+    }
+};
+
+static thread_local ThreadHeapLocal thread_heap_tls;
+
+ThreadHeap* thread_heap_local()
+{
+    if (thread_heap_tls.heap == NULL) {
+        thread_heap_tls.heap = thread_heap_create();
+    }
+    return thread_heap_tls.heap;
+}
+
+static void* thread_heap_alloc_huge(ThreadHeap* heap, size_t size)
+{
+    size_t total = THREAD_HEAP_HEADER_SIZE + size;
+    if (total < size) {
+        return NULL;
+    }
+    ThreadHeapSegment* segment = thread_heap_segment_create(heap, THREAD_HEAP_HUGE_CLASS, total);
+    if (segment == NULL) {
+        fprintf(stderr, "[ERROR] thread_heap_alloc failed. Can't map %zu bytes.\n", total);
+        return NULL;
+    }
+    segment->used = 1;
+    return segment->pool.buffer;
+}
+
+// current segment of the class is dry: drain the remote frees of every segment
+// in the class, reuse a freed chunk, else carve a slab, else map a new segment
+static void* thread_heap_alloc_slow(ThreadHeap* heap, size_t class_index)
+{
+    ThreadHeapSegment** found = NULL;
+    for (ThreadHeapSegment** link = &heap->segments[class_index]; *link != NULL; link = &(*link)->next) {
+        thread_heap_segment_collect(*link);
+        if (found == NULL && (*link)->pool.head != NULL) {
+            found = link;
+        }
+    }
+    for (ThreadHeapSegment** link = &heap->segments[class_index]; found == NULL && *link != NULL; link = &(*link)->next) {
+        if (thread_heap_segment_carve(*link)) {
+            found = link;
+        }
+    }
+    if (found != NULL) {
+        // move to the front so the fast path finds it
+        ThreadHeapSegment* segment = *found;
+        *found = segment->next;
+        segment->next = heap->segments[class_index];
+        heap->segments[class_index] = segment;
+        segment->used++;
+        return pool_alloc(&segment->pool);
+    }
+
+    ThreadHeapSegment* segment = thread_heap_segment_create(heap, class_index, THREAD_HEAP_SEGMENT_SIZE);
+    if (segment == NULL || !thread_heap_segment_carve(segment)) {
+        fprintf(stderr, "[ERROR] thread_heap_alloc failed. Can't map a new segment.\n");
+        return NULL;
+    }
+    segment->next = heap->segments[class_index];
+    heap->segments[class_index] = segment;
+    segment->used++;
+    return pool_alloc(&segment->pool);
+}
+
+void* thread_heap_alloc(ThreadHeap* heap, size_t size)
+{
+    if (size > THREAD_HEAP_SMALL_MAX) {
+        return thread_heap_alloc_huge(heap, size);
+    }
+
+    size_t class_index = thread_heap_classes.class_of[(size + 15) >> 4];
+    ThreadHeapSegment* segment = heap->segments[class_index];
+    if (segment != NULL && segment->pool.head != NULL) {
+        segment->used++;
+        return pool_alloc(&segment->pool);
+    }
+    return thread_heap_alloc_slow(heap, class_index);
+}
+
+void thread_heap_free(ThreadHeap* heap, void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    ThreadHeapSegment* segment = thread_heap_segment(ptr);
+    if (segment->class_index == THREAD_HEAP_HUGE_CLASS) {
+        // a single block, no owner state to update
+        thread_heap_segment_destroy(segment);
+        return;
+    }
+
+    if (heap != NULL && segment->owner.load(std::memory_order_relaxed) == heap) {
+        pool_free(&segment->pool, ptr);
+        segment->used--;
+        return;
+    }
+
+    // Treiber push, the owner only ever takes the whole list so there is no ABA
+    PoolListNode* node = (PoolListNode*)ptr;
+    PoolListNode* head = segment->remote_free.load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!segment->remote_free.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void thread_heap_collect(ThreadHeap* heap)
+{
+    for (size_t c = 0; c < THREAD_HEAP_CLASS_COUNT; c++) {
+        ThreadHeapSegment** link = &heap->segments[c];
+        while (*link != NULL) {
+            ThreadHeapSegment* segment = *link;
+            thread_heap_segment_collect(segment);
+            if (segment->used == 0) {
+                *link = segment->next;
+                thread_heap_segment_destroy(segment);
+            }
+            else {
+                link = &segment->next;
+            }
+        }
+    }
+}
+
+ThreadHeapSegment* thread_heap_segment(void* ptr)
+{
+    return (ThreadHeapSegment*)((uintptr_t)ptr & ~(uintptr_t)(THREAD_HEAP_SEGMENT_SIZE - 1));
+}
+
+ThreadHeap* thread_heap_owner(void* ptr)
+{
+    return thread_heap_segment(ptr)->owner.load(std::memory_order_acquire);
+}
+
+size_t thread_heap_block_size(void* ptr)
+{
+    return thread_heap_segment(ptr)->pool.chunk_size;
+}
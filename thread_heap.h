@@ -0,0 +1,72 @@
+#ifndef THREAD_HEAP_H
+#define THREAD_HEAP_H
+
+#include "allocator.h"
+#include "region.h"
+
+#include <atomic>
+
+////////////////////////////////
+// thread-local heaps
+//
+// Every thread owns a heap, and each heap owns segments: 4 MiB blocks aligned
+// to 4 MiB. A segment serves one size class as a PoolAllocator, or holds a
+// single block above THREAD_HEAP_SMALL_MAX. The segment header sits at its base,
+// so masking any pointer finds its segment and owner in O(1).
+//
+// Only the owner touches a segment's pool. A free from another thread pushes
+// the block on the segment's lock-free remote list. Whenever the front segment
+// of a class runs dry, the owner takes each list of that class in one exchange
+// before it carves or maps more, and thread_heap_collect takes all of them.
+// On heap destruction, segments that still hold live blocks are abandoned.
+// The next heap created adopts them.
+
+#define THREAD_HEAP_SEGMENT_SIZE ((size_t)4 * 1024 * 1024)
+#define THREAD_HEAP_SMALL_MAX 8192
+#define THREAD_HEAP_CLASS_COUNT 18
+// segment kind of a single-block segment
+#define THREAD_HEAP_HUGE_CLASS THREAD_HEAP_CLASS_COUNT
+
+struct ThreadHeap;
+
+struct ThreadHeapSegment
+{
+    // NULL while abandoned
+    std::atomic<ThreadHeap*> owner;
+    // next segment of the same class in the owner's list, or in the abandoned list
+    ThreadHeapSegment* next;
+    Region region;
+    size_t class_index;
+    // blocks handed out and not yet freed locally or collected
+    size_t used;
+    // bytes of the pool buffer already carved into chunks
+    size_t grown;
+    PoolAllocator pool;
+    std::atomic<PoolListNode*> remote_free;
+};
+
+struct ThreadHeap
+{
+    // segments per size class, the head is where allocation happens
+    ThreadHeapSegment* segments[THREAD_HEAP_CLASS_COUNT];
+};
+
+ThreadHeap* thread_heap_create();
+// Releases empty segments and abandons the rest, any thread may still free into them.
+void thread_heap_destroy(ThreadHeap* heap);
+// heap of the calling thread, created on first use and destroyed at thread exit
+ThreadHeap* thread_heap_local();
+
+// heap must be the calling thread's heap
+void* thread_heap_alloc(ThreadHeap* heap, size_t size);
+// any thread, heap is the calling thread's heap
+void thread_heap_free(ThreadHeap* heap, void* ptr);
+// pull in remote frees of every segment and release the empty ones
+void thread_heap_collect(ThreadHeap* heap);
+
+ThreadHeapSegment* thread_heap_segment(void* ptr);
+// NULL for blocks of abandoned segments
+ThreadHeap* thread_heap_owner(void* ptr);
+size_t thread_heap_block_size(void* ptr);
+
+#endif
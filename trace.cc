@@ -0,0 +1,247 @@
+#include "trace.h"
+#include "region.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define TRACE_WRITER_BUFFER_SIZE ((size_t)1024 * 1024)
+// drop consumed pages in steps, not on every record
+#define TRACE_READER_RELEASE_STEP ((size_t)64 * 1024 * 1024)
+
+uint64_t trace_now_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+#if defined(__linux__)
+
+static bool trace_write_all(int fd, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+bool trace_writer_open(TraceWriter* writer, const char* path)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] trace_writer_open failed. Can't create %s.\n", path);
+        return false;
+    }
+    void* buffer = mmap(NULL, TRACE_WRITER_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] trace_writer_open failed. Can't map the record buffer.\n");
+        close(fd);
+        return false;
+    }
+
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.start_ns = trace_now_ns();
+    if (!trace_write_all(fd, &header, sizeof(header))) {
+        fprintf(stderr, "[ERROR] trace_writer_open failed. Can't write to %s.\n", path);
+        munmap(buffer, TRACE_WRITER_BUFFER_SIZE);
+        close(fd);
+        return false;
+    }
+
+    writer->fd = fd;
+    writer->start_ns = header.start_ns;
+    writer->buffer = (TraceRecord*)buffer;
+    writer->capacity = TRACE_WRITER_BUFFER_SIZE / sizeof(TraceRecord);
+    return true;
+}
+
+bool trace_writer_flush(TraceWriter* writer)
+{
+    if (writer->count == 0) {
+        return true;
+    }
+    bool ok = trace_write_all(writer->fd, writer->buffer, writer->count * sizeof(TraceRecord));
+    if (ok) {
+        writer->written += writer->count;
+    }
+    writer->count = 0;
+    return ok;
+}
+
+void trace_writer_close(TraceWriter* writer)
+{
+    if (writer->fd < 0) {
+        return;
+    }
+    if (!trace_writer_flush(writer)) {
+        fprintf(stderr, "[ERROR] trace_writer_close failed. Records after %llu were lost.\n",
+            (unsigned long long)writer->written);
+    }
+    close(writer->fd);
+    trace_writer_abandon(writer);
+}
+
+void trace_writer_abandon(TraceWriter* writer)
+{
+    if (writer->buffer != NULL) {
+        munmap(writer->buffer, TRACE_WRITER_BUFFER_SIZE);
+    }
+    writer->fd = -1;
+    writer->buffer = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+}
+
+bool trace_reader_open(TraceReader* reader, const char* path)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] trace_reader_open failed. Can't open %s.\n", path);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(TraceHeader)) {
+        fprintf(stderr, "[ERROR] trace_reader_open failed. %s is not a trace.\n", path);
+        close(fd);
+        return false;
+    }
+    size_t map_size = (size_t)info.st_size;
+    void* map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] trace_reader_open failed. Can't map %s.\n", path);
+        return false;
+    }
+
+    const TraceHeader* header = (const TraceHeader*)map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header->version != TRACE_VERSION ||
+        header->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "[ERROR] trace_reader_open failed. %s has an unknown format.\n", path);
+        munmap(map, map_size);
+        return false;
+    }
+    madvise(map, map_size, MADV_SEQUENTIAL);
+
+    reader->map = (unsigned char*)map;
+    reader->map_size = map_size;
+    reader->header = header;
+    reader->records = (const TraceRecord*)(reader->map + sizeof(TraceHeader));
+    // a torn last record is ignored
+    reader->count = (map_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    return true;
+}
+
+void trace_reader_release(TraceReader* reader, size_t index)
+{
+    size_t end = (const unsigned char*)(reader->records + index) - reader->map;
+    end -= end % REGION_SMALL_PAGE_SIZE;
+    if (end < reader->released + TRACE_READER_RELEASE_STEP) {
+        return;
+    }
+    madvise(reader->map + reader->released, end - reader->released, MADV_DONTNEED);
+    reader->released = end;
+}
+
+void trace_reader_close(TraceReader* reader)
+{
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->map_size);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+#else
+
+bool trace_writer_open(TraceWriter* writer, const char* path)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    fprintf(stderr, "[ERROR] trace_writer_open failed. Traces are only supported on Linux.\n");
+    return false;
+}
+
+bool trace_writer_flush(TraceWriter* writer)
+{
+    return false;
+}
+
+void trace_writer_close(TraceWriter* writer)
+{
+}
+
+void trace_writer_abandon(TraceWriter* writer)
+{
+}
+
+bool trace_reader_open(TraceReader* reader, const char* path)
+{
+    memset(reader, 0, sizeof(*reader));
+    fprintf(stderr, "[ERROR] trace_reader_open failed. Traces are only supported on Linux.\n");
+    return false;
+}
+
+void trace_reader_release(TraceReader* reader, size_t index)
+{
+}
+
+void trace_reader_close(TraceReader* reader)
+{
+}
+
+#endif
+
+void trace_writer_append(TraceWriter* writer, TraceOp op, uint64_t id, uint64_t prev_id, uint64_t size,
+    size_t align, uint32_t thread)
+{
+    if (writer->buffer == NULL) {
+        return;
+    }
+    if (writer->count == writer->capacity && !trace_writer_flush(writer)) {
+        // stop at the last whole record instead of leaving a hole
+        fprintf(stderr, "[ERROR] trace_writer_append failed. The trace stops after %llu records.\n",
+            (unsigned long long)writer->written);
+        trace_writer_close(writer);
+        return;
+    }
+    TraceRecord* record = &writer->buffer[writer->count++];
+    record->time_ns = trace_now_ns() - writer->start_ns;
+    record->id = id;
+    record->prev_id = prev_id;
+    record->size = size;
+    record->thread = thread;
+    record->op = (uint8_t)op;
+    uint8_t align_log2 = 0;
+    while (align > 1) {
+        align >>= 1;
+        align_log2++;
+    }
+    record->align_log2 = align_log2;
+    record->reserved = 0;
+}
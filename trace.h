@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////
+// allocation traces
+//
+// A trace file is a TraceHeader followed by fixed-size TraceRecords in the
+// order the calls happened. Records are never written with holes, so a trace
+// cut short by a crash is still valid up to its last whole record.
+//
+// The writer never calls malloc: it buffers in an mmap'd page block and
+// flushes with write(), so the malloc replacement can record itself. The
+// reader maps the file and releases pages behind the cursor, so a multi-GB
+// trace streams through a bounded resident set.
+
+#define TRACE_MAGIC "MATRACE"
+#define TRACE_VERSION 1
+
+enum TraceOp
+{
+    Trace_Op_Alloc = 1,
+    Trace_Op_Free = 2,
+    Trace_Op_Realloc = 3,
+};
+
+struct TraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    // CLOCK_MONOTONIC when recording started
+    uint64_t start_ns;
+};
+
+struct TraceRecord
+{
+    // nanoseconds since start_ns
+    uint64_t time_ns;
+    // address of the block, unique among live blocks
+    uint64_t id;
+    // realloc: address of the block before the call, otherwise 0
+    uint64_t prev_id;
+    // bytes requested, 0 for free
+    uint64_t size;
+    // small per-process thread number, in order of the threads' first call
+    uint32_t thread;
+    uint8_t op;
+    uint8_t align_log2;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 40, "trace records are part of the file format");
+
+struct TraceWriter
+{
+    int fd;
+    uint64_t start_ns;
+    TraceRecord* buffer;
+    size_t count;
+    size_t capacity;
+    // records flushed so far
+    uint64_t written;
+};
+
+bool trace_writer_open(TraceWriter* writer, const char* path);
+// not thread safe, callers serialize so ids are never reused out of order
+void trace_writer_append(TraceWriter* writer, TraceOp op, uint64_t id, uint64_t prev_id, uint64_t size,
+    size_t align, uint32_t thread);
+bool trace_writer_flush(TraceWriter* writer);
+// flushes and closes the file
+void trace_writer_close(TraceWriter* writer);
+// drops the buffer without flushing, for a forked child that shares the file
+void trace_writer_abandon(TraceWriter* writer);
+
+struct TraceReader
+{
+    unsigned char* map;
+    size_t map_size;
+    const TraceHeader* header;
+    const TraceRecord* records;
+    size_t count;
+    // bytes at the front of the mapping already given back
+    size_t released;
+};
+
+bool trace_reader_open(TraceReader* reader, const char* path);
+// Give back the pages holding records before index. They are read again from
+// the page cache if touched later.
+void trace_reader_release(TraceReader* reader, size_t index);
+void trace_reader_close(TraceReader* reader);
+
+uint64_t trace_now_ns();
+
+#endif
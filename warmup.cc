@@ -0,0 +1,185 @@
+#include "warmup.h"
+#include "region.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define WARMUP_DEFAULT_PARALLEL_THRESHOLD (64 * 1024 * 1024)
+
+static size_t warmup_page_size()
+{
+#if defined(__linux__)
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size > 0) {
+        return (size_t)page_size;
+    }
+#endif
+    return REGION_SMALL_PAGE_SIZE;
+}
+
+// Fault in the pages of [begin, end), both page aligned. Returns true if the
+// kernel did it. The touch loop stays within [lo, hi) so bytes around the
+// buffer that share its first or last page are never written.
+static bool warmup_range(unsigned char* begin, unsigned char* end, unsigned char* lo, unsigned char* hi, size_t page_size)
+{
+#if defined(__linux__)
+    if (madvise(begin, end - begin, MADV_POPULATE_WRITE) == 0) {
+        return true;
+    }
+#endif
+    // write back what is there so live data survives
+    for (unsigned char* page = begin; page < end; page += page_size) {
+        volatile unsigned char* p = page < lo ? lo : page;
+        if ((unsigned char*)p >= hi) {
+            break;
+        }
+        *p = *p;
+    }
+    return false;
+}
+
+bool memory_warmup(void* buffer, size_t size, const WarmupOptions* options, WarmupResult* result)
+{
+    WarmupOptions defaults = {};
+    defaults.parallel_threshold = WARMUP_DEFAULT_PARALLEL_THRESHOLD;
+    if (options == NULL) {
+        options = &defaults;
+    }
+
+    WarmupResult local_result;
+    if (result == NULL) {
+        result = &local_result;
+    }
+    memset(result, 0, sizeof(*result));
+
+    if (buffer == NULL || size == 0) {
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    const size_t page_size = warmup_page_size();
+    unsigned char* begin = (unsigned char*)((uintptr_t)buffer & ~(uintptr_t)(page_size - 1));
+    unsigned char* end = (unsigned char*)align_forward((uintptr_t)buffer + size, page_size);
+    unsigned char* lo = (unsigned char*)buffer;
+    unsigned char* hi = lo + size;
+    const size_t bytes = end - begin;
+    const size_t pages = bytes / page_size;
+
+    size_t parallel_threshold = options->parallel_threshold != 0 ? options->parallel_threshold : WARMUP_DEFAULT_PARALLEL_THRESHOLD;
+    size_t thread_count = options->thread_count;
+    if (thread_count == 0) {
+        thread_count = bytes / parallel_threshold;
+        size_t hardware = std::thread::hardware_concurrency();
+        if (hardware != 0 && thread_count > hardware) {
+            thread_count = hardware;
+        }
+    }
+    if (thread_count > pages) {
+        thread_count = pages;
+    }
+    if (thread_count == 0 || bytes < parallel_threshold) {
+        thread_count = 1;
+    }
+
+    bool populated = true;
+    if (thread_count == 1) {
+        populated = warmup_range(begin, end, lo, hi, page_size);
+    }
+    else {
+        std::vector<std::thread> threads;
+        std::vector<char> thread_populated(thread_count, 0);
+        size_t pages_per_thread = (pages + thread_count - 1) / thread_count;
+        for (size_t t = 0; t < thread_count; t++) {
+            unsigned char* chunk_begin = begin + t * pages_per_thread * page_size;
+            unsigned char* chunk_end = chunk_begin + pages_per_thread * page_size;
+            if (chunk_end > end) {
+                chunk_end = end;
+            }
+            if (chunk_begin >= chunk_end) {
+                break;
+            }
+            char* out = &thread_populated[t];
+            threads.emplace_back([chunk_begin, chunk_end, lo, hi, page_size, out]() {
+                *out = warmup_range(chunk_begin, chunk_end, lo, hi, page_size);
+            });
+        }
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+            populated = populated && thread_populated[t];
+        }
+        thread_count = threads.size();
+    }
+
+    bool ok = true;
+    if (options->lock) {
+#if defined(__linux__)
+        result->locked = mlock(begin, bytes) == 0;
+#endif
+        if (!result->locked) {
+            fprintf(stderr, "[ERROR] memory_warmup failed to lock %zu bytes.\n", bytes);
+            ok = false;
+        }
+    }
+
+    result->elapsed_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    result->bytes = bytes;
+    result->pages = pages;
+    result->thread_count = thread_count;
+    result->populated = populated;
+    return ok;
+}
+
+bool arena_warmup(ArenaAllocator* arena, const WarmupOptions* options, WarmupResult* result)
+{
+    if (arena->region != NULL && !region_commit(arena->region, arena->buffer_size)) {
+        fprintf(stderr, "[ERROR] arena_warmup failed to commit the arena region.\n");
+        return false;
+    }
+    return memory_warmup(arena->buffer, arena->buffer_size, options, result);
+}
+
+bool stack_warmup(StackAllocator* stack, const WarmupOptions* options, WarmupResult* result)
+{
+    return memory_warmup(stack->buffer, stack->buffer_size, options, result);
+}
+
+bool pool_warmup(PoolAllocator* pool, const WarmupOptions* options, WarmupResult* result)
+{
+    return memory_warmup(pool->buffer, pool->buffer_size, options, result);
+}
+
+bool free_list_warmup(FreeListAllocator* free_list, const WarmupOptions* options, WarmupResult* result)
+{
+    return memory_warmup(free_list->buffer, free_list->buffer_size, options, result);
+}
+
+bool buddy_warmup(BuddyAllocator* allocator, const WarmupOptions* options, WarmupResult* result)
+{
+    size_t tree_size = buddy_tree_size(allocator);
+    if (allocator->tree_in_buffer) {
+        // the tree sits right after the usable bytes, warm both in one go
+        size_t size = (allocator->tree + tree_size) - allocator->buffer;
+        return memory_warmup(allocator->buffer, size, options, result);
+    }
+
+    WarmupOptions tree_options = {};
+    tree_options.lock = options != NULL && options->lock;
+    if (!memory_warmup(allocator->tree, tree_size, &tree_options, NULL)) {
+        return false;
+    }
+    return memory_warmup(allocator->buffer, allocator->usable_size, options, result);
+}
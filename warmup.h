@@ -0,0 +1,45 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "allocator.h"
+
+////////////////////////////////
+// pre-fault / pin
+//
+// Take the page faults of an allocator's backing memory up front instead of on
+// the first request that touches each page. Uses MADV_POPULATE_WRITE when the
+// kernel has it and a read/write touch loop otherwise, split across threads for
+// large buffers. Existing contents are preserved, but the buffer must not be in
+// use by other threads during warm-up.
+
+struct WarmupOptions
+{
+    // 0 picks one thread per parallel_threshold bytes, capped at the hardware concurrency
+    size_t thread_count;
+    // buffers smaller than this are warmed on the calling thread
+    size_t parallel_threshold;
+    // mlock the memory after faulting it in
+    bool lock;
+};
+
+struct WarmupResult
+{
+    uint64_t elapsed_ns;
+    size_t bytes;
+    size_t pages;
+    size_t thread_count;
+    // faulted in by the kernel (MADV_POPULATE_WRITE) rather than a touch loop
+    bool populated;
+    bool locked;
+};
+
+// options may be NULL for the defaults, result may be NULL
+bool memory_warmup(void* buffer, size_t size, const WarmupOptions* options, WarmupResult* result);
+
+bool arena_warmup(ArenaAllocator* arena, const WarmupOptions* options = NULL, WarmupResult* result = NULL);
+bool stack_warmup(StackAllocator* stack, const WarmupOptions* options = NULL, WarmupResult* result = NULL);
+bool pool_warmup(PoolAllocator* pool, const WarmupOptions* options = NULL, WarmupResult* result = NULL);
+bool free_list_warmup(FreeListAllocator* free_list, const WarmupOptions* options = NULL, WarmupResult* result = NULL);
+bool buddy_warmup(BuddyAllocator* allocator, const WarmupOptions* options = NULL, WarmupResult* result = NULL);
+
+#endif